@@ -16,14 +16,111 @@
  ***************************************************************************/
 
 #include "backup.h"
+#include "extfs.h"
+#include "journal.h"
+#include "remote.h"
+#include "stats.h"
 #include "color.h"
 #include <iostream>
 #include <thread>
 #include <cassert>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <utility>
 
 using namespace std;
 using namespace std::filesystem;
 
+/**
+ * \param tree directory tree
+ * \param dir a directory of the tree
+ * \return the size of the regular files in the directory and subdirectories
+ */
+static uint64_t regularFilesSize(const DirectoryTree& tree, const DirectoryNode& dir)
+{
+    uint64_t result=0;
+    for(auto& n : tree.getDirectoryContent(dir))
+    {
+        if(n.isDirectory()) result+=regularFilesSize(tree,n);
+        else if(n.type()==file_type::regular) result+=n.size();
+    }
+    return result;
+}
+
+/**
+ * Count the entries of a scanned tree and the size of its regular files in
+ * the current phase, for --stats
+ * \param tree directory tree
+ */
+static void countScanned(const DirectoryTree& tree)
+{
+    if(statsEnabled()) countEntries(tree.size(),regularFilesSize(tree,tree.getTreeRoot()));
+}
+
+/**
+ * \param metadataFile path of a metadata file
+ * \return the last time the metadata file or its log were written
+ */
+static time_t metadataMtime(const path& metadataFile)
+{
+    time_t result=ext_status(metadataFile).mtime();
+    auto logFile=DirectoryTree::logPath(metadataFile);
+    error_code ec;
+    if(exists(logFile,ec)) result=max(result,ext_status(logFile).mtime());
+    return result;
+}
+
+/**
+ * Run tasks, each in a separate thread
+ * \param tasks tasks to run
+ * \param threads if false, run the tasks one after the other instead,
+ * stopping at the first one that fails
+ * \throws runtime_error containing the error messages of all the tasks that
+ * failed, in the order of the tasks
+ */
+static void runTasks(const vector<function<void ()>>& tasks, bool threads)
+{
+    if(threads==false)
+    {
+        for(auto& task : tasks) task();
+        return;
+    }
+    vector<string> exceptions(tasks.size());
+    vector<thread> t;
+    for(size_t i=1;i<tasks.size();i++)
+    {
+        t.emplace_back([&,i](){
+            try {
+                tasks[i]();
+            } catch(exception& e) {
+                exceptions[i]=e.what();
+            }
+        });
+    }
+    //The first task runs in this thread
+    if(tasks.empty()==false)
+    {
+        try {
+            tasks[0]();
+        } catch(exception& e) {
+            exceptions[0]=e.what();
+        }
+    }
+    for(auto& x : t) x.join();
+    string errors;
+    for(auto& e : exceptions)
+    {
+        if(e.empty()) continue;
+        if(errors.empty()==false) errors+=' ';
+        errors+=e;
+    }
+    if(errors.empty()==false) throw runtime_error(errors);
+}
+
 /**
  * This helper class handles loading the directory trees in memory needed for
  * doing backups, and handles the logic behind saving metadata files.
@@ -40,16 +137,39 @@ public:
      * \param meta2 second copy of the metadata for the destination directory
      * \param opt scan options
      * \param threads if true, scan in parallel
+     * \param jobs number of threads used to scan directories
+     * \param rehashPeriod if not 0, reuse the hashes of unchanged files from
+     * the metadata files, see HashCache
+     * \param rehashRun number of this backup reusing hashes, see HashCache
+     * \param remote if not nullptr, the backup directory and the metadata files
+     * are on this remote target. Can't be used with rehashPeriod
      * \param warningCallback warning callback
      * \throws exception if scanning or loading fails
      */
     TreeManager(const path& src, const path& dst, const path& meta1,
-                const path& meta2, ScanOpt opt, bool threads,
+                const path& meta2, ScanOpt opt, bool threads, unsigned jobs,
+                unsigned rehashPeriod, unsigned rehashRun, RemoteTarget *remote,
                 function<void (const string&)> warningCallback)
-        : meta1(meta1), meta2(meta2), srcTreePresent(true)
+        : meta1(meta1), meta2(meta2), remote(remote), srcTreePresent(true)
     {
-        loadMetadataFiles(meta1Tree,meta2Tree,meta1,meta2,warningCallback);
-        scanSourceTargetDir(src,dst,threads,opt,srcTree,dstTree,warningCallback);
+        if(rehashPeriod==0)
+        {
+            loadAndScan(&src,&dst,opt,threads,jobs,warningCallback);
+            return;
+        }
+        assert(remote==nullptr);
+        //The hash cache is needed while scanning, so in this case the
+        //metadata files have to be loaded first
+        loadAndScan(nullptr,nullptr,opt,threads,jobs,warningCallback);
+        //Metadata files are written last during a backup, so files whose
+        //ctime is older than both metadata files did not change since then
+        time_t trustedBefore=min(metadataMtime(meta1),metadataMtime(meta2));
+        HashCache cache(meta1Tree,meta2Tree,trustedBefore,rehashPeriod,rehashRun);
+        srcTree.setHashCache(&cache);
+        dstTree.setHashCache(&cache);
+        scanSourceTargetDir(src,dst,threads,jobs,opt,srcTree,dstTree,warningCallback);
+        srcTree.setHashCache(nullptr);
+        dstTree.setHashCache(nullptr);
     }
 
     /**
@@ -59,18 +179,75 @@ public:
      * \param meta1 first copy of the metadata for the destination directory
      * \param meta2 second copy of the metadata for the destination directory
      * \param opt scan options
+     * \param jobs number of threads used to scan directories
+     * \param remote if not nullptr, the backup directory and the metadata files
+     * are on this remote target
      * \param warningCallback warning callback
      * \throws exception if scanning or loading fails
      */
     TreeManager(const path& dst, const path& meta1, const path& meta2,
-                ScanOpt opt, function<void (const string&)> warningCallback)
-        : meta1(meta1), meta2(meta2), srcTreePresent(false)
+                ScanOpt opt, unsigned jobs, RemoteTarget *remote,
+                function<void (const string&)> warningCallback)
+        : meta1(meta1), meta2(meta2), remote(remote), srcTreePresent(false)
     {
-        loadMetadataFiles(meta1Tree,meta2Tree,meta1,meta2,warningCallback);
-        cout<<"Scanning backup directory... "; cout.flush();
-        if(warningCallback) dstTree.setWarningCallback(warningCallback);
-        dstTree.scanDirectory(dst,opt);
-        cout<<"Done.\n";
+        loadAndScan(nullptr,&dst,opt,true,jobs,warningCallback);
+    }
+
+    /**
+     * Constructor without backup tree. Scan only the source directory, if
+     * given, and load metadata files. Call trustMetadata() or scanDstTree()
+     * before using the backup tree.
+     * \param src source directory path, or nullptr to not scan it, see
+     * rescanSourceTree()
+     * \param meta1 first copy of the metadata for the destination directory
+     * \param meta2 second copy of the metadata for the destination directory
+     * \param opt scan options
+     * \param jobs number of threads used to scan directories
+     * \param warningCallback warning callback
+     * \throws exception if scanning or loading fails
+     */
+    TreeManager(const path *src, const path& meta1, const path& meta2,
+                ScanOpt opt, unsigned jobs,
+                function<void (const string&)> warningCallback)
+        : meta1(meta1), meta2(meta2), srcTreePresent(src!=nullptr),
+          dstTreePresent(false)
+    {
+        loadAndScan(src,nullptr,opt,true,jobs,warningCallback);
+    }
+
+    /**
+     * Use the first metadata tree as the backup tree instead of scanning the
+     * backup directory, if the metadata trees are equal and a cheap check of
+     * the backup directory finds nothing changed in it since the metadata
+     * files were written. The check lists all directories, comparing the names
+     * of their entries and the type and modified time of subdirectories with
+     * the metadata, but does not read the metadata of files. Can only be
+     * called if the backup tree is not present
+     * \param dst destination (backup) directory path
+     * \param jobs number of threads used to compare the metadata trees
+     * \return true if the metadata is trusted, false if the backup directory
+     * needs to be scanned
+     */
+    bool trustMetadata(const path& dst, unsigned jobs);
+
+    /**
+     * Scan the backup directory. Can only be called if the backup tree is
+     * not present
+     * \param dst destination (backup) directory path
+     * \param opt scan options
+     * \throws exception if scanning fails
+     */
+    void scanDstTree(const path& dst, ScanOpt opt);
+
+    /**
+     * Bind a tree to the backup directory, on the remote target if any
+     * \param tree directory tree
+     * \param dst destination (backup) directory path
+     */
+    void bindToDstPath(DirectoryTree& tree, const path& dst)
+    {
+        if(remote) tree.bindToRemoteTarget(*remote,dst);
+        else tree.bindToTopPath(dst);
     }
 
     /**
@@ -78,6 +255,32 @@ public:
      */
     bool hasSourceTree() const { return srcTreePresent; }
 
+    /**
+     * Build the source tree from the first metadata tree, that describes the
+     * backup directory as it was after the last backup, scanning again only
+     * the given directories of the source directory. Can only be called if
+     * hasSourceTree()==false, and after scrubbing, as the first metadata tree
+     * must be consistent with the backup directory
+     * \param src source directory path (directory to be backed up)
+     * \param dirs directories that changed since the last backup, relative to
+     * the source directory, with parent directories before subdirectories
+     * \param opt scan options
+     * \throws exception if scanning fails
+     */
+    void rescanSourceTree(const path& src, const vector<path>& dirs, ScanOpt opt);
+
+    /**
+     * Compute again the hashes of some files of the source tree, can only be
+     * called if hasSourceTree()==true
+     * \param files relative paths of the files
+     * \throws exception if hashing fails
+     */
+    void hashSourceFiles(const vector<path>& files)
+    {
+        assert(srcTreePresent);
+        srcTree.computeHashes(files);
+    }
+
     /**
      * \return the source directory tree, can only be called if hasSourceTree()==true
      */
@@ -90,7 +293,11 @@ public:
     /**
      * \return the backup directory tree
      */
-    DirectoryTree& getDstTree() { return dstTree; }
+    DirectoryTree& getDstTree()
+    {
+        assert(dstTreePresent);
+        return dstTree;
+    }
 
     /**
      * \return the first metadata directory tree
@@ -113,6 +320,11 @@ public:
      */
     void discardMeta2Tree()
     {
+        //The changes to the first tree can be appended to the log of the second
+        //metadata file if it had the same content of the first one
+        meta2Log=meta2Tree.getLogState();
+        //The second metadata file is written back in the format it has
+        meta2Format=meta2Tree.metadataFormat();
         meta2Tree.clear();
         meta2TreePresent=false;
     }
@@ -123,6 +335,11 @@ public:
      */
     void saveMetadataOnExit() { save=true; }
 
+    /**
+     * \return true if saveMetadataOnExit() has been called
+     */
+    bool savingMetadataOnExit() const { return save; }
+
     /**
      * If called and saveMetadataOnExit() is called too, when this object is
      * destructed a backup copy of the first metadata file will be kept
@@ -143,66 +360,282 @@ public:
 
 private:
     /**
-     * \param meta1Tree first metadata file will be loaded here
-     * \param meta2Tree first metadata file will be loaded here
-     * \param meta1 path to first copy of the metadata path
-     * \param meta2 path to second copy of the metadata path
+     * Load the metadata files and scan the source and backup directories,
+     * all concurrently
+     * \param src source directory path, or nullptr to not scan it
+     * \param dst backup directory path, or nullptr to not scan it
+     * \param opt scan options
+     * \param threads if true, load and scan in parallel
+     * \param jobs number of threads used to scan directories
      * \param warningCallback warning callback
+     * \throws exception if scanning or loading fails
      */
-    void loadMetadataFiles(DirectoryTree& meta1Tree, DirectoryTree& meta2Tree,
-                       const path& meta1, const path& meta2,
-                       function<void (const string&)> warningCallback);
+    void loadAndScan(const path *src, const path *dst, ScanOpt opt,
+                     bool threads, unsigned jobs,
+                     function<void (const string&)> warningCallback);
+
+    /// When saving, metadata files are written in full instead of appending to
+    /// their log if the log would grow larger than this fraction of them
+    static constexpr double maxLogRatio=0.25;
 
     DirectoryTree srcTree, dstTree, meta1Tree, meta2Tree;
+    MetadataLogState meta2Log; ///< State of meta2 once meta2Tree is discarded
+    MetadataFormat meta2Format=MetadataFormat::Text; ///< Format of meta2, likewise
     const path meta1, meta2;
-    const bool srcTreePresent;
+    RemoteTarget *remote=nullptr;
+    bool srcTreePresent;
+    bool dstTreePresent=true;
     bool meta2TreePresent=true;
     bool save=false, meta1NeedsBackup=false, meta2NeedsBackup=false;
 };
 
-void TreeManager::loadMetadataFiles(DirectoryTree& meta1Tree,
-    DirectoryTree& meta2Tree, const path& meta1, const path& meta2,
-    function<void (const string&)> warningCallback) try
+void TreeManager::loadAndScan(const path *src, const path *dst, ScanOpt opt,
+    bool threads, unsigned jobs, function<void (const string&)> warningCallback)
+{
+    cout<<"Loading metadata files";
+    if(src) cout<<" and scanning source and backup directory";
+    else if(dst) cout<<" and scanning backup directory";
+    cout<<"... "; cout.flush();
+    for(auto tree : {&srcTree,&dstTree,&meta1Tree,&meta2Tree})
+    {
+        if(warningCallback) tree->setWarningCallback(warningCallback);
+        tree->setJobs(jobs);
+    }
+    //Directories are scanned with the same hash algorithm of the metadata
+    //files, so it is read in advance from the header of the first one. If it
+    //can't be read, loading the file reports the error
+    HashAlgorithm alg=HashAlgorithm::SHA1;
+    try {
+        if(remote) alg=remote->readHashAlgorithm(meta1);
+        else alg=DirectoryTree::readHashAlgorithm(meta1);
+    } catch(exception&) {}
+    srcTree.setHashAlgorithm(alg);
+    dstTree.setHashAlgorithm(alg);
+    //Remote metadata files are transferred whole, then parsed
+    auto readMetadata=[this](DirectoryTree& tree, const path& metadataFile){
+        PhaseTimer phase(Phase::MetadataLoad);
+        auto logFile=DirectoryTree::logPath(metadataFile);
+        if(remote==nullptr)
+        {
+            tree.readFrom(metadataFile);
+            if(statsEnabled()==false) return;
+            error_code ec;
+            auto logSize=file_size(logFile,ec);
+            countEntries(tree.size(),file_size(metadataFile)+(ec ? 0 : logSize));
+            return;
+        }
+        istringstream is(remote->readFile(metadataFile));
+        tree.readFrom(is,metadataFile.string());
+        string log;
+        if(remote->exists(logFile)) log=remote->readFile(logFile);
+        if(log.empty()==false) tree.replayLog(log,logFile.string());
+        countEntries(tree.size(),is.str().size()+log.size());
+    };
+    string metaErrors[2];
+    vector<function<void ()>> tasks;
+    tasks.push_back([&]{
+        try {
+            readMetadata(meta1Tree,meta1);
+        } catch(exception& e) {
+            metaErrors[0]=e.what();
+            throw;
+        }
+    });
+    tasks.push_back([&]{
+        try {
+            readMetadata(meta2Tree,meta2);
+        } catch(exception& e) {
+            metaErrors[1]=e.what();
+            throw;
+        }
+    });
+    if(dst) tasks.push_back([&]{
+        PhaseTimer phase(Phase::BackupScan);
+        if(remote) remote->scanDirectory(*dst,opt,jobs,dstTree);
+        else dstTree.scanDirectory(*dst,opt);
+        countScanned(dstTree);
+    });
+    if(src) tasks.push_back([&]{
+        PhaseTimer phase(Phase::SourceScan);
+        srcTree.scanDirectory(*src,opt);
+        countScanned(srcTree);
+    });
+    try {
+        runTasks(tasks,threads);
+        if(meta1Tree.hashAlgorithm()!=meta2Tree.hashAlgorithm())
+        {
+            metaErrors[0]="Metadata files use different hash algorithms";
+            throw runtime_error(metaErrors[0]);
+        }
+    } catch(exception& e) {
+        if(metaErrors[0].empty() && metaErrors[1].empty()) throw;
+        string what=metaErrors[0];
+        if(what.empty()==false && metaErrors[1].empty()==false) what+=' ';
+        what+=metaErrors[1];
+        cout<<what<<"\nIt looks like at least one of the metadata files is "
+            <<"corrupted to the point that it cannot be read. The cause may be "
+            <<"an unclean unmount of the filesystem (did you run an fsck?), "
+            <<"you tried to edit a metadata file with a text editor or "
+            <<"bit rot occurred in a metadata file.\n"
+            <<redb<<"Unrecoverable inconsistencies found."<<reset<<" You will "
+            <<"need to manually fix the backup directory, possibly by "
+            <<"recreating metadata files and replacing the corrupted one(s).\n"
+            <<"the 'ddm diff' command may help to troubleshoot bad metadata.\n";
+        throw;
+    }
+    if((src || dst) && meta1Tree.hashAlgorithm()!=alg)
+        throw runtime_error(meta1.string()+" changed while loading it");
+    //Directories scanned later use the same hash algorithm too
+    srcTree.setHashAlgorithm(meta1Tree.hashAlgorithm());
+    dstTree.setHashAlgorithm(meta1Tree.hashAlgorithm());
+    cout<<"Done.\n";
+}
+
+/**
+ * Check that the directories of a tree have the same entries in the filesystem
+ * \param tree directory tree
+ * \param dir directory node of the tree
+ * \param d the directory in the filesystem
+ * \return true if the entries names match, and subdirectories have the same
+ * type and modified time
+ */
+static bool sameDirectories(const DirectoryTree& tree, const DirectoryNode& dir,
+                            const ext_directory& d)
+{
+    auto content=tree.getDirectoryContent(dir);
+    auto names=d.entries();
+    if(names.size()!=content.size()) return false;
+    sort(names.begin(),names.end());
+    vector<string_view> treeNames;
+    for(auto& n : content) treeNames.push_back(n.name());
+    sort(treeNames.begin(),treeNames.end());
+    if(equal(names.begin(),names.end(),treeNames.begin())==false) return false;
+    for(auto& n : content)
+    {
+        if(n.isDirectory()==false) break; //Directories are sorted first
+        string name(n.name());
+        ext_file_status st(d.fd(),name.c_str());
+        if(st.type()!=file_type::directory || st.mtime()!=n.mtime()) return false;
+        ext_directory sub(d.fd(),name);
+        if(sameDirectories(tree,n,sub)==false) return false;
+    }
+    return true;
+}
+
+bool TreeManager::trustMetadata(const path& dst, unsigned jobs)
 {
-    cout<<"Loading metatata files... "; cout.flush();
-    if(warningCallback) meta1Tree.setWarningCallback(warningCallback);
-    if(warningCallback) meta2Tree.setWarningCallback(warningCallback);
-    meta1Tree.readFrom(meta1);
-    meta2Tree.readFrom(meta2);
+    assert(dstTreePresent==false);
+    PhaseTimer phase(Phase::BackupScan);
+    cout<<"Checking backup directory against metadata files... "; cout.flush();
+    bool same=diff2(meta1Tree,meta2Tree,CompareOpt(),jobs).empty();
+    try {
+        ext_directory top(AT_FDCWD,dst);
+        if(same) same=sameDirectories(meta1Tree,meta1Tree.getTreeRoot(),top);
+    } catch(exception&) {
+        same=false; //Also if something was removed while checking
+    }
+    if(same==false)
+    {
+        cout<<"Changed.\n";
+        return false;
+    }
+    dstTree.clear();
+    for(auto& n : meta1Tree.getDirectoryContent(meta1Tree.getTreeRoot()))
+        dstTree.copyFromTree(meta1Tree,n.name(),"");
+    dstTree.bindToTopPath(dst);
+    dstTreePresent=true;
+    cout<<"Done.\n";
+    return true;
+}
+
+void TreeManager::scanDstTree(const path& dst, ScanOpt opt)
+{
+    assert(dstTreePresent==false);
+    PhaseTimer phase(Phase::BackupScan);
+    cout<<"Scanning backup directory... "; cout.flush();
+    dstTree.scanDirectory(dst,opt);
+    countScanned(dstTree);
+    dstTreePresent=true;
+    cout<<"Done.\n";
+}
+
+void TreeManager::rescanSourceTree(const path& src, const vector<path>& dirs,
+                                   ScanOpt opt)
+{
+    assert(srcTreePresent==false);
+    PhaseTimer phase(Phase::SourceScan);
+    cout<<"Scanning "<<dirs.size()<<" changed directories of the source directory... ";
+    cout.flush();
+    srcTree.clear();
+    for(auto& n : meta1Tree.getDirectoryContent(meta1Tree.getTreeRoot()))
+        srcTree.copyFromTree(meta1Tree,n.name(),"");
+    srcTree.bindToTopPath(src);
+    for(auto& dir : dirs)
+    {
+        //Directories removed or replaced by files in the source directory are
+        //also in the journal of their parent, that was scanned before
+        if(dir.empty()==false)
+        {
+            auto e=srcTree.search(dir);
+            if(!e || e.value().isDirectory()==false) continue;
+            error_code ec;
+            if(is_directory(symlink_status(src / dir,ec))==false) continue;
+        }
+        srcTree.rescanDirectory(dir,opt);
+    }
+    srcTreePresent=true;
     cout<<"Done.\n";
-} catch(exception& e) {
-    cout<<e.what()<<"\nIt looks like at least one of the metadata files is "
-        <<"corrupted to the point that it cannot be read. The cause may be "
-        <<"an unclean unmount of the filesystem (did you run an fsck?), "
-        <<"you tried to edit a metadata file with a text editor or "
-        <<"bit rot occurred in a metadata file.\n"
-        <<redb<<"Unrecoverable inconsistencies found."<<reset<<" You will "
-        <<"need to manually fix the backup directory, possibly by "
-        <<"recreating metadata files and replacing the corrupted one(s).\n"
-        <<"the 'ddm diff' command may help to troubleshoot bad metadata.\n";
-    throw;
 }
 
 TreeManager::~TreeManager()
 {
     if(save==false) return;
+    PhaseTimer phase(Phase::MetadataWrite);
+    auto write=[this](const DirectoryTree& tree, const path& metadataFile,
+                      MetadataLogState fileState, bool keepPrevious){
+        auto bak=metadataFile;
+        bak+=".bak";
+        auto logFile=DirectoryTree::logPath(metadataFile);
+        auto bakLog=DirectoryTree::logPath(bak);
+        if(remote==nullptr)
+        {
+            //The previous version keeps its log, and the metadata file is
+            //written in full
+            if(keepPrevious)
+            {
+                rename(metadataFile,bak);
+                error_code ec;
+                if(exists(logFile,ec)) rename(logFile,bakLog);
+                else remove(bakLog,ec);
+                fileState=MetadataLogState();
+            }
+            countEntries(tree.size(),tree.commitTo(metadataFile,fileState,maxLogRatio));
+            return;
+        }
+        ostringstream os;
+        tree.writeTo(os);
+        if(keepPrevious)
+        {
+            remote->rename(metadataFile,bak);
+            remote->remove(bakLog);
+            if(remote->exists(logFile)) remote->rename(logFile,bakLog);
+            //Renames are not waited for, if they failed writing the metadata
+            //file would overwrite the only copy of the previous version
+            remote->sync();
+        }
+        remote->writeFile(metadataFile,os.str());
+        remote->remove(logFile);
+        countEntries(tree.size(),os.str().size());
+    };
     cout<<"Updating metadata file 1\n";
-    if(meta1NeedsBackup)
-    {
-        auto meta1bak=meta1;
-        meta1bak+=".bak";
-        rename(meta1,meta1bak);
-    }
-    meta1Tree.writeTo(meta1);
+    write(meta1Tree,meta1,meta1Tree.getLogState(),meta1NeedsBackup);
     cout<<"Updating metadata file 2\n";
-    if(meta2NeedsBackup)
-    {
-        auto meta2bak=meta2;
-        meta2bak+=".bak";
-        rename(meta2,meta2bak);
+    //Not a mistake, without meta2Tree write meta1Tree to both files
+    if(meta2TreePresent) write(meta2Tree,meta2,meta2Tree.getLogState(),meta2NeedsBackup);
+    else {
+        meta1Tree.setMetadataFormat(meta2Format);
+        write(meta1Tree,meta2,meta2Log,meta2NeedsBackup);
     }
-    if(meta2TreePresent) meta2Tree.writeTo(meta2);
-    else meta1Tree.writeTo(meta2); //Not a mistake, write meta1Tree to both files
 }
 
 /**
@@ -601,6 +1034,61 @@ static FixupResult fixMetadataEntry(DirectoryTree& goodTree,
     return FixupResult::SuccessMetadataInvalidated;
 }
 
+/**
+ * \param d diff entry
+ * \return the relative path of the entry
+ */
+static path diffEntryPath(const DirectoryDiffLine<3>& d)
+{
+    for(auto& e : d) if(e) return e.value().relativePath();
+    assert(false); //Invalid diff
+    return path();
+}
+
+/**
+ * \param p relative path
+ * \param top relative path of a subtree
+ * \return true if p is top or is in the subtree
+ */
+static bool isInSubtree(const path& p, const path& top)
+{
+    auto it=p.begin();
+    for(auto& component : top)
+        if(it==p.end() || *it++!=component) return false;
+    return true;
+}
+
+/**
+ * After a fixup invalidated the diff of a subtree, replace the diff entries in
+ * the subtree with an updated diff of the subtree. Entries outside the subtree
+ * are still valid, as fixups only modify the entry they are applied to
+ * \param tm the tree manager
+ * \param diff the diff
+ * \param it the entry whose fixup invalidated the diff
+ * \return the first entry of the updated diff of the subtree, or the entry
+ * following the subtree entries if none
+ */
+static DirectoryDiff<3>::iterator rediffSubtree(TreeManager& tm, DirectoryDiff<3>& diff,
+                                                DirectoryDiff<3>::iterator it)
+{
+    path top=diffEntryPath(*it);
+    it=diff.erase(it);
+    for(auto jt=it;jt!=diff.end();)
+    {
+        if(isInSubtree(diffEntryPath(*jt),top))
+        {
+            if(jt==it) it=jt=diff.erase(jt);
+            else jt=diff.erase(jt);
+        } else ++jt;
+    }
+    auto subtreeDiff=diff3Subtree(tm.getDstTree(),tm.getMeta1Tree(),
+                                  tm.getMeta2Tree(),top);
+    if(subtreeDiff.empty()) return it;
+    auto result=subtreeDiff.begin();
+    diff.splice(it,subtreeDiff);
+    return result;
+}
+
 /**
  * Implementation code that scrubs the backup directory
  * \param tm the tree manager containing:
@@ -609,14 +1097,18 @@ static FixupResult fixMetadataEntry(DirectoryTree& goodTree,
  * - first copy of the metadata tree
  * - second copy of the metadata tree
  * \param fixup if true, attempt to fix inconsistencies in the backup directory
+ * \param jobs number of threads used to compare the directory trees
  * \return 0 if no action was needed,
  *         1 if recoverable errors found and fixed
  *         2 if unrecoverable errors found
  */
-static int scrubImpl(TreeManager& tm, bool fixup)
+static int scrubImpl(TreeManager& tm, bool fixup, unsigned jobs)
 {
+    PhaseTimer phase(Phase::Scrub);
     cout<<"Comparing backup directory with metadata... "; cout.flush();
-    auto diff=diff3(tm.getDstTree(),tm.getMeta1Tree(),tm.getMeta2Tree());
+    auto diff=diff3(tm.getDstTree(),tm.getMeta1Tree(),tm.getMeta2Tree(),
+                    CompareOpt(),jobs);
+    countEntries(diff.size());
     cout<<"Done.\n";
 
     if(diff.empty())
@@ -627,84 +1119,75 @@ static int scrubImpl(TreeManager& tm, bool fixup)
     cout<<yellowb<<"Inconsitencies found."<<reset
         <<" Processing them one by one.\nNote: in the following diff a is "
         <<"the backup directory, b is metadata file 1 while c is metadata file 2\n";
-    bool unrecoverable=false, maybeRecoverable=false, redo=false,
+    bool unrecoverable=false, maybeRecoverable=false,
          updateMeta1=false, updateMeta2=false;
-    do {
-        if(redo)
-        {
-            redo=false;
-            cout<<"\nThe fixup operation modified the backup directory content "
-                <<"in a way that invalidated the list of inconsistencies. Rechecking.\n"
-                <<"Comparing backup directory with metadata... "; cout.flush();
-            diff=diff3(tm.getDstTree(),tm.getMeta1Tree(),tm.getMeta2Tree());
-            cout<<"Done.\n";
-        }
-        for(auto& d : diff)
+    for(auto it=diff.begin();it!=diff.end();)
+    {
+        auto& d=*it;
+        bool redo=false;
+        // NOTE: we're intentionally comparing the optional<FilesystemElement>
+        // and not the FilesystemElement as this covers also the cases where
+        // items are missing
+        if(d[0]==d[1] && d[0]!=d[2])
         {
-            // NOTE: we're intentionally comparing the optional<FilesystemElement>
-            // and not the FilesystemElement as this covers also the cases where
-            // items are missing
-            if(d[0]==d[1] && d[0]!=d[2])
+            cout<<d<<"Assuming metadata file 2 inconsistent in this case.\n";
+            auto result=fixMetadataEntry(tm.getDstTree(),tm.getMeta2Tree(),d[0],d[2]);
+            updateMeta2=true;
+            if(result==FixupResult::SuccessDiffMetadataInvalidated) redo=true;
+        } else if(d[0]==d[2] && d[0]!=d[1]) {
+            cout<<d<<"Assuming metadata file 1 inconsistent in this case.\n";
+            auto result=fixMetadataEntry(tm.getDstTree(),tm.getMeta1Tree(),d[0],d[1]);
+            updateMeta1=true;
+            if(result==FixupResult::SuccessDiffMetadataInvalidated) redo=true;
+        } else if(d[1]==d[2] && d[0]!=d[1]) {
+            cout<<d<<"Metadata files are consistent between themselves "
+                <<"but differ from backup directory content.\n";
+            if(fixup)
             {
-                cout<<d<<"Assuming metadata file 2 inconsistent in this case.\n";
-                auto result=fixMetadataEntry(tm.getDstTree(),tm.getMeta2Tree(),d[0],d[2]);
-                updateMeta2=true;
-                if(result==FixupResult::SuccessDiffMetadataInvalidated)
-                {
-                    redo=true;
-                    break;
-                }
-            } else if(d[0]==d[2] && d[0]!=d[1]) {
-                cout<<d<<"Assuming metadata file 1 inconsistent in this case.\n";
-                auto result=fixMetadataEntry(tm.getDstTree(),tm.getMeta1Tree(),d[0],d[1]);
-                updateMeta1=true;
-                if(result==FixupResult::SuccessDiffMetadataInvalidated)
+                cout<<"Trying to fix this.\n";
+                const DirectoryTree *src=nullptr;
+                if(tm.hasSourceTree()) src=&tm.getSrcTree();
+                auto result=tryToFixBackupEntry(src,tm.getDstTree(),
+                                                tm.getMeta1Tree(),
+                                                tm.getMeta2Tree(),d);
+                switch(result)
                 {
-                    redo=true;
-                    break;
+                    case FixupResult::Success:
+                        break;
+                    case FixupResult::Failed:
+                        unrecoverable=true;
+                        break;
+                    case FixupResult::SuccessDiffInvalidated:
+                        redo=true;
+                        break;
+                    case FixupResult::SuccessMetadataInvalidated:
+                        updateMeta1=updateMeta2=true;
+                        break;
+                    case FixupResult::SuccessDiffMetadataInvalidated:
+                        updateMeta1=updateMeta2=redo=true;
+                        break;
                 }
-            } else if(d[1]==d[2] && d[0]!=d[1]) {
-                cout<<d<<"Metadata files are consistent between themselves "
-                    <<"but differ from backup directory content.\n";
-                if(fixup)
-                {
-                    cout<<"Trying to fix this.\n";
-                    const DirectoryTree *src=nullptr;
-                    if(tm.hasSourceTree()) src=&tm.getSrcTree();
-                    auto result=tryToFixBackupEntry(src,tm.getDstTree(),
-                                                    tm.getMeta1Tree(),
-                                                    tm.getMeta2Tree(),d);
-                    switch(result)
-                    {
-                        case FixupResult::Success:
-                            break;
-                        case FixupResult::Failed:
-                            unrecoverable=true;
-                            break;
-                        case FixupResult::SuccessDiffInvalidated:
-                            redo=true;
-                            break;
-                        case FixupResult::SuccessMetadataInvalidated:
-                            updateMeta1=updateMeta2=true;
-                            break;
-                        case FixupResult::SuccessDiffMetadataInvalidated:
-                            updateMeta1=updateMeta2=redo=true;
-                            break;
-                    }
-                    if(redo) break;
-                } else {
-                    cout<<"Not attempting to fix this because --fixup option "
-                        <<"not given.\n";
-                    maybeRecoverable=true;
-                }
-            } else if(d[0]!=d[1] && d[1]!=d[2]) {
-                cout<<d<<"Metadata files are inconsistent both among themselves "
-                    <<"and with backup directory content. Nothing can be done.\n";
-                unrecoverable=true;
-            } else assert(false); //Invalid diff
+            } else {
+                cout<<"Not attempting to fix this because --fixup option "
+                    <<"not given.\n";
+                maybeRecoverable=true;
+            }
+        } else if(d[0]!=d[1] && d[1]!=d[2]) {
+            cout<<d<<"Metadata files are inconsistent both among themselves "
+                <<"and with backup directory content. Nothing can be done.\n";
+            unrecoverable=true;
+        } else assert(false); //Invalid diff
+        if(redo)
+        {
+            cout<<"\nThe fixup operation modified the backup directory content "
+                <<"in a way that invalidated the list of inconsistencies. "
+                <<"Rechecking "<<diffEntryPath(d)<<".\n";
+            it=rediffSubtree(tm,diff,it);
+        } else {
             cout<<'\n';
+            ++it;
         }
-    } while(redo==true);
+    }
     cout<<"Inconsistencies processed.\n";
 
     if(unrecoverable==false && maybeRecoverable==false)
@@ -739,61 +1222,307 @@ static int scrubImpl(TreeManager& tm, bool fixup)
     }
 }
 
+/**
+ * \param meta1 first metadata file
+ * \return the path of the file with the number of backups since the backup
+ * directory was last scrubbed, when using trustMetadata()
+ */
+static path trustedRunsPath(const path& meta1)
+{
+    path result=meta1;
+    result+=".runs";
+    return result;
+}
+
+/**
+ * \param meta1 first metadata file
+ * \return the path of the file with the number of backups that reused the
+ * hashes of unchanged files, which selects the files hashed anyway
+ */
+static path rehashRunsPath(const path& meta1)
+{
+    path result=meta1;
+    result+=".rehash";
+    return result;
+}
+
+/**
+ * \param file file with a number of backups
+ * \return the number of backups, or nothing if not known
+ */
+static optional<unsigned> readRuns(const path& file)
+{
+    ifstream in(file);
+    unsigned runs;
+    if(in>>runs) return runs;
+    return nullopt;
+}
+
+/**
+ * \param file file with a number of backups
+ * \param runs the number of backups
+ * \throws runtime_error if the file can't be written
+ */
+static void writeRuns(const path& file, unsigned runs)
+{
+    path temp=file;
+    temp+=".tmp";
+    {
+        ofstream out(temp);
+        out<<runs<<'\n';
+        if(!out) throw runtime_error(string("Can't write ")+temp.string());
+    }
+    rename(temp,file);
+}
+
+/**
+ * \param meta1 first metadata file
+ * \return the path of the file with the path of the last file hashed by a
+ * scrub with a budget, where the next one resumes
+ */
+static path scrubCursorPath(const path& meta1)
+{
+    path result=meta1;
+    result+=".scrub";
+    return result;
+}
+
+/**
+ * \param meta1 first metadata file
+ * \return the path of the last file hashed by a scrub with a budget, or an
+ * empty path if not known
+ */
+static path readScrubCursor(const path& meta1)
+{
+    ifstream in(scrubCursorPath(meta1));
+    string cursor;
+    if(in>>quoted(cursor)) return cursor;
+    return path();
+}
+
+/**
+ * \param meta1 first metadata file
+ * \param cursor the path of the last file hashed by a scrub with a budget
+ * \throws runtime_error if the file can't be written
+ */
+static void writeScrubCursor(const path& meta1, const path& cursor)
+{
+    path temp=scrubCursorPath(meta1);
+    temp+=".tmp";
+    {
+        ofstream out(temp);
+        out<<quoted(cursor.string())<<'\n';
+        if(!out) throw runtime_error(string("Can't write ")+temp.string());
+    }
+    rename(temp,scrubCursorPath(meta1));
+}
+
+/**
+ * Scrub the backup directory hashing only a sample of its files, resuming
+ * where the previous scrub with a budget ended
+ * \param tm tree manager, with the backup directory and the source directory
+ * if present scanned without hashes
+ * \param meta1 first metadata file
+ * \param dst destination (backup) directory path
+ * \param fixup if true, attempt to fix inconsistencies in the backup directory
+ * \param budgetBytes if not 0, stop hashing after this many bytes
+ * \param budgetSeconds if not 0, stop hashing after this many seconds
+ * \param jobs number of threads used to compare directories
+ * \return the result of scrub()
+ */
+static int sampleScrubImpl(TreeManager& tm, const path& meta1, const path& dst,
+                           bool fixup, uint64_t budgetBytes,
+                           unsigned budgetSeconds, unsigned jobs)
+{
+    cout<<"Hashing a sample of the files in the backup directory... "; cout.flush();
+    vector<path> sample;
+    {
+        PhaseTimer phase(Phase::Scrub);
+        sample=tm.getDstTree().computeSampleHashes(readScrubCursor(meta1),
+                                                   budgetBytes,budgetSeconds);
+        //Files found corrupted are fixed only by copying verified files
+        if(tm.hasSourceTree()) tm.hashSourceFiles(sample);
+    }
+    cout<<"Done, hashed "<<sample.size()<<" files.\n";
+    int result=scrubImpl(tm,fixup,jobs);
+    //Entries fixed by copying them from the backup directory to a metadata
+    //tree have no hash unless they were in the sample
+    if(tm.savingMetadataOnExit())
+    {
+        for(auto tree : {&tm.getMeta1Tree(),&tm.getMeta2Tree()})
+        {
+            tree->bindToTopPath(dst);
+            tree->computeMissingHashes();
+        }
+    }
+    //If problems are left, the next scrub hashes the same files again
+    if(result!=2 && sample.empty()==false) writeScrubCursor(meta1,sample.back());
+    return result;
+}
+
 void scanSourceTargetDir(const path& src, const path& dst, bool threads,
-    ScanOpt opt, DirectoryTree& srcTree, DirectoryTree& dstTree,
+    unsigned jobs, ScanOpt opt, DirectoryTree& srcTree, DirectoryTree& dstTree,
     function<void (const string&)> warningCallback)
 {
     cout<<"Scanning source and backup directory... "; cout.flush();
     if(warningCallback) srcTree.setWarningCallback(warningCallback);
     if(warningCallback) dstTree.setWarningCallback(warningCallback);
-    if(threads)
-    {
-        string foregroundException;
-        string backgroundException;
-        thread t([&](){
-            try {
-                srcTree.scanDirectory(src,opt);
-            } catch(exception& e) {
-                backgroundException=e.what();
-            }
-        });
-        try {
-            dstTree.scanDirectory(dst,opt);
-        } catch(exception& e) {
-            foregroundException=e.what();
-        }
-        t.join();
-        if(backgroundException.empty()==false)
-        {
-            if(foregroundException.empty()==false) foregroundException+=' ';
-            foregroundException+=backgroundException;
-        }
-        if(foregroundException.empty()==false)
-            throw runtime_error(foregroundException);
-    } else {
-        srcTree.scanDirectory(src,opt);
-        dstTree.scanDirectory(dst,opt);
-    }
+    srcTree.setJobs(jobs);
+    dstTree.setJobs(jobs);
+    runTasks({[&]{
+                  PhaseTimer phase(Phase::BackupScan);
+                  dstTree.scanDirectory(dst,opt);
+                  countScanned(dstTree);
+              },
+              [&]{
+                  PhaseTimer phase(Phase::SourceScan);
+                  srcTree.scanDirectory(src,opt);
+                  countScanned(srcTree);
+              }},threads);
     cout<<"Done.\n";
 }
 
 int scrub(const path& dst, const path& meta1, const path& meta2, bool fixup,
-          function<void (const string&)> warningCallback)
+          uint64_t budgetBytes, unsigned budgetSeconds, unsigned jobs,
+          RemoteTarget *remote, function<void (const string&)> warningCallback)
 {
     cout<<"Scrubbing backup directory "<<dst<<"\n"
         <<"by comparing it with metadata files:\n- "<<meta1<<"\n- "<<meta2<<"\n";
-    TreeManager tm(dst,meta1,meta2,ScanOpt::ComputeHash,warningCallback);
-    return scrubImpl(tm,fixup);
+    bool sample=budgetBytes>0 || budgetSeconds>0;
+    assert(sample==false || remote==nullptr);
+    ScanOpt opt=sample ? ScanOpt::OmitHash : ScanOpt::ComputeHash;
+    TreeManager tm(dst,meta1,meta2,opt,jobs,remote,warningCallback);
+    if(sample)
+        return sampleScrubImpl(tm,meta1,dst,fixup,budgetBytes,budgetSeconds,jobs);
+    return scrubImpl(tm,fixup,jobs);
 }
 
 int scrub(const path& src, const path& dst, const path& meta1, const path& meta2,
-          bool fixup, bool threads, function<void (const string&)> warningCallback)
+          bool fixup, uint64_t budgetBytes, unsigned budgetSeconds, bool threads,
+          unsigned jobs, RemoteTarget *remote,
+          function<void (const string&)> warningCallback)
 {
     cout<<"Scrubbing backup directory "<<dst<<"\n"
         <<"by comparing it with metadata files:\n- "<<meta1<<"\n- "<<meta2<<"\n"
         <<"and with source directory "<<src<<"\n";
-    TreeManager tm(src,dst,meta1,meta2,ScanOpt::ComputeHash,threads,warningCallback);
-    return scrubImpl(tm,fixup);
+    bool sample=budgetBytes>0 || budgetSeconds>0;
+    assert(sample==false || remote==nullptr);
+    ScanOpt opt=sample ? ScanOpt::OmitHash : ScanOpt::ComputeHash;
+    TreeManager tm(src,dst,meta1,meta2,opt,threads,jobs,0,0,remote,warningCallback);
+    if(sample)
+        return sampleScrubImpl(tm,meta1,dst,fixup,budgetBytes,budgetSeconds,jobs);
+    return scrubImpl(tm,fixup,jobs);
+}
+
+/**
+ * Files smaller than this are copied from the source directory even if a file
+ * with the same content is in the backup directory
+ */
+static const off_t minIndexedSize=64*1024;
+
+/**
+ * Before a backup, find the entries that were renamed or moved in the source
+ * directory, and rename them in the backup directory instead of removing and
+ * copying them again. Entries are matched by content, files by their hash and
+ * directories by their digest
+ * \param srcTree source directory
+ * \param dstTree backup directory
+ * \param metaTree metadata tree, consistent with the backup directory
+ * \param diff diff between srcTree and dstTree
+ * \return true if entries were moved, so the diff must be computed again
+ */
+static bool moveRenamedEntries(const DirectoryTree& srcTree, DirectoryTree& dstTree,
+                               DirectoryTree& metaTree, const DirectoryDiff<2>& diff)
+{
+    //Entries only in the backup directory, by file size or directory structure
+    typedef DirectoryDigest D;
+    unordered_map<off_t,vector<pair<path,FileHash>>> files;
+    unordered_map<uint64_t,vector<pair<path,DirectoryDigest>>> dirs;
+    for(auto& d : diff)
+    {
+        if(d[0]) continue;
+        auto& e=d[1].value();
+        if(e.type()==file_type::regular && e.size()>0)
+        {
+            auto m=metaTree.search(e.relativePath());
+            if(m && m->hash().empty()==false)
+                files[e.size()].emplace_back(e.relativePath(),m->hash());
+        } else if(e.isDirectory()) {
+            auto& node=as_const(dstTree).searchNode(e.relativePath());
+            if(node.contentSize()==0) continue;
+            auto digest=dstTree.computeDirectoryDigest(node);
+            dirs[digest.d[D::Structure]].emplace_back(e.relativePath(),digest);
+        }
+    }
+    bool moved=false;
+    auto move=[&](const FilesystemElement& e, const path& from)
+    {
+        cout<<"- Moving "<<e.typeAsString()<<" "<<from<<" to "<<e.relativePath()
+            <<" in the backup directory.\n";
+        dstTree.moveInTreeAndFilesystem(from,e.relativePath());
+        metaTree.moveInTree(from,e.relativePath());
+        moved=true;
+    };
+    for(auto& d : diff)
+    {
+        if(d[1]) continue;
+        auto& e=d[0].value();
+        if(e.type()==file_type::regular && e.size()>0)
+        {
+            auto it=files.find(e.size());
+            if(it==files.end()) continue;
+            FileHash hash;
+            if(srcTree.hashAlgorithm()==metaTree.hashAlgorithm()) hash=e.hash();
+            if(hash.empty())
+                hash=hashFile(srcTree.getTopPath().value() / e.relativePath(),
+                              metaTree.hashAlgorithm());
+            auto& candidates=it->second;
+            for(auto c=candidates.begin();c!=candidates.end();++c)
+            {
+                if(c->second!=hash) continue;
+                move(e,c->first);
+                candidates.erase(c);
+                break;
+            }
+        } else if(e.isDirectory()) {
+            auto& node=srcTree.searchNode(e.relativePath());
+            if(node.contentSize()==0) continue;
+            auto digest=srcTree.computeDirectoryDigest(node);
+            auto it=dirs.find(digest.d[D::Structure]);
+            if(it==dirs.end()) continue;
+            auto& candidates=it->second;
+            for(auto c=candidates.begin();c!=candidates.end();++c)
+            {
+                if(compare(digest,c->second,CompareOpt())==false) continue;
+                move(e,c->first);
+                candidates.erase(c);
+                break;
+            }
+        }
+    }
+    return moved;
+}
+
+/**
+ * Add the regular files of a metadata tree to a content index
+ * \param tree metadata tree, consistent with the backup directory
+ * \param dir directory to add
+ * \param relativePath path of dir
+ * \param excluded entries not to add, that the backup modifies
+ * \param index content index
+ */
+static void buildContentIndex(const DirectoryTree& tree, const DirectoryNode& dir,
+                              const path& relativePath, const set<path>& excluded,
+                              ContentIndex& index)
+{
+    for(auto& n : tree.getDirectoryContent(dir))
+    {
+        path p=relativePath / string(n.name());
+        if(excluded.count(p)) continue;
+        if(n.isDirectory()) buildContentIndex(tree,n,p,excluded,index);
+        else if(n.type()==file_type::regular && n.size()>=minIndexedSize)
+            index.add(n.size(),n.hash(),p);
+    }
 }
 
 /**
@@ -801,21 +1530,51 @@ int scrub(const path& src, const path& dst, const path& meta1, const path& meta2
  * differences so the target directory becomes equal to the source
  * \param scrTree source directory
  * \param dstTree backup directory
+ * \param jobs number of threads used to compare the directory trees
  * \param metaTree optional metadata tree
+ * \param skipped if not nullptr, the directories with entries that were not
+ * backed up are added here
+ * \param dedup if true, entries moved in the source directory are moved in the
+ * backup directory, and files already in the backup directory are copied from
+ * there, requires metaTree
  * \return 0 on success,
  *         1 if recoverable errors found and fixed
  *         2 if unrecoverable errors found
  */
 static int backupImpl(const DirectoryTree& srcTree, DirectoryTree& dstTree,
-                      DirectoryTree *metaTree=nullptr)
+                      unsigned jobs, DirectoryTree *metaTree=nullptr,
+                      vector<path> *skipped=nullptr, bool dedup=false)
 {
+    PhaseTimer phase(Phase::Diff);
     cout<<"Performing backup.\n"
         <<"Comparing source directory with backup directory... "; cout.flush();
-    auto diff=diff2(srcTree,dstTree);
+    auto diff=diff2(srcTree,dstTree,CompareOpt(),jobs);
     cout<<"Done.\n";
+    ContentIndex index;
+    if(dedup)
+    {
+        assert(metaTree);
+        //Moving a directory can show more moved entries inside it
+        while(moveRenamedEntries(srcTree,dstTree,*metaTree,diff))
+            diff=diff2(srcTree,dstTree,CompareOpt(),jobs);
+        //Files that the backup removes or modifies can't be copied from
+        set<path> excluded;
+        for(auto& d : diff) excluded.insert((d[0] ? d[0] : d[1]).value().relativePath());
+        buildContentIndex(*metaTree,metaTree->getTreeRoot(),"",excluded,index);
+        dstTree.setContentIndex(&index);
+    }
+    countEntries(diff.size());
 
     bool bitrot=false;
     if(diff.empty()) cout<<"No differences found.\n";
+    //Metadata changes are independent of each other, so they are made in
+    //parallel, and the mtime of directories is restored once at the end
+    dstTree.beginFilesystemBatch(jobs);
+    //Files copied to the backup directory are hashed while copying if the
+    //metadata tree needs their hash. Their hash is in dstTree only when the
+    //batch ends, so they are copied from dstTree to the metadata tree then
+    ScanOpt copyOpt=metaTree ? ScanOpt::ComputeHash : ScanOpt::OmitHash;
+    vector<path> metaCopies;
     for(auto& d : diff)
     {
         // NOTE: we're intentionally comparing the optional<FilesystemElement>
@@ -823,17 +1582,20 @@ static int backupImpl(const DirectoryTree& srcTree, DirectoryTree& dstTree,
         // items are missing
         if(!d[0])
         {
+            phase.change(Phase::Copy);
             path relPath=d[1].value().relativePath();
             cout<<"- Removing "<<d[1].value().typeAsString()<<" "<<relPath
                 <<" from backup directory.\n";
-            dstTree.removeFromTreeAndFilesystem(relPath);
+            countEntries(dstTree.removeFromTreeAndFilesystem(relPath));
             if(metaTree) metaTree->removeFromTree(relPath);
         } else if(!d[1]) {
+            phase.change(Phase::Copy);
             path relPath=d[0].value().relativePath();
             cout<<"- Copying "<<d[0].value().typeAsString()<<" "<<relPath
                 <<" to backup directory.\n";
-            dstTree.copyFromTreeAndFilesystem(srcTree,relPath,relPath.parent_path());
-            if(metaTree) metaTree->copyFromTree(srcTree,relPath,relPath.parent_path());
+            dstTree.copyFromTreeAndFilesystem(srcTree,relPath,relPath.parent_path(),
+                                              copyOpt);
+            if(metaTree) metaCopies.push_back(relPath);
         } else {
             path relPath=d[0].value().relativePath();
             CompareOpt opt;
@@ -855,6 +1617,8 @@ static int backupImpl(const DirectoryTree& srcTree, DirectoryTree& dstTree,
             }
             if(compare(d[0].value(),d[1].value(),opt))
             {
+                phase.change(Phase::MetadataUpdate);
+                countEntries(1);
                 cout<<"- Updating the metadata of the "
                     <<d[0].value().typeAsString()<<" "<<relPath
                     <<" in the backup directory.\n";
@@ -891,6 +1655,7 @@ static int backupImpl(const DirectoryTree& srcTree, DirectoryTree& dstTree,
                         <<" "<<relPath<<" changed but the modified time did not.\n"
                         <<"NOT backing up this "<<d[0].value().typeAsString()
                         <<" as the backup copy may be good one.\n";
+                    if(skipped) skipped->push_back(relPath.parent_path());
                 } else {
                     bool replace=true;
                     if(d[0].value().mtime()<d[1].value().mtime())
@@ -910,27 +1675,41 @@ static int backupImpl(const DirectoryTree& srcTree, DirectoryTree& dstTree,
                                 <<"and consider that the "
                                 <<d[0].value().typeAsString()<<" in the source "
                                 <<"directory is currently without a backup.\n";
+                            if(skipped) skipped->push_back(relPath.parent_path());
                         }
                     }
                     if(replace)
                     {
+                        phase.change(Phase::Copy);
                         cout<<"- Replacing the "<<d[1].value().typeAsString()
                             <<" "<<relPath<<" in the backup directory with the "
                             <<d[0].value().typeAsString()<<" in the source directory.\n";
                         dstTree.removeFromTreeAndFilesystem(relPath);
                         dstTree.copyFromTreeAndFilesystem(srcTree,relPath,
-                                                          relPath.parent_path());
+                                                          relPath.parent_path(),copyOpt);
                         if(metaTree)
                         {
                             metaTree->removeFromTree(relPath);
-                            metaTree->copyFromTree(srcTree,relPath,
-                                                  relPath.parent_path());
+                            metaCopies.push_back(relPath);
                         }
                     }
                 }
             }
         }
     }
+    //Waiting for the batch is counted in the phases of the changes made
+    //by the workers
+    phase.change(Phase::None);
+    dstTree.endFilesystemBatch();
+    if(dedup)
+    {
+        if(dstTree.contentIndexCopies()>0)
+            cout<<dstTree.contentIndexCopies()<<" files were copied from files "
+                <<"with the same content in the backup directory.\n";
+        dstTree.setContentIndex(nullptr);
+    }
+    for(auto& relPath : metaCopies)
+        metaTree->copyFromTree(dstTree,relPath,relPath.parent_path());
     if(bitrot)
         cout<<redb<<"Bit rot was detected in the source directory."<<reset
             <<" As this tool by design never writes into the source directory "
@@ -943,16 +1722,51 @@ static int backupImpl(const DirectoryTree& srcTree, DirectoryTree& dstTree,
     return bitrot ? 2 : 0;
 }
 
-int backup(const path& src, const path& dst, const path& meta1, const path& meta2,
-           bool fixup, bool hashAllFiles, bool threads,
-           function<void (const string&)> warningCallback)
+static const uint64_t mib=1024*1024;
+
+/**
+ * \param seconds a time interval
+ * \return the interval in a human readable form, rounded to the minute
+ * when longer than a minute
+ */
+static string formatSeconds(double seconds)
 {
-    cout<<"Backing up directory "<<src<<"\nto directory "<<dst<<"\n"
-        <<"and metadata files:\n- "<<meta1<<"\n- "<<meta2<<"\n";
-    ScanOpt opt=hashAllFiles ? ScanOpt::ComputeHash : ScanOpt::OmitHash;
-    TreeManager tm(src,dst,meta1,meta2,opt,threads,warningCallback);
-    cout<<"Scrubbing backup directory.\n";
-    int result=scrubImpl(tm,fixup);
+    auto s=static_cast<unsigned long long>(seconds+0.5);
+    if(s<60) return to_string(s)+" s";
+    auto m=(s+30)/60;
+    if(m<60) return to_string(m)+" min";
+    return to_string(m/60)+" h "+to_string(m%60)+" min";
+}
+
+/**
+ * Scrub and backup, once the trees are loaded
+ * \param tm tree manager, constructed without the source tree if changedDirs
+ * is not nullptr
+ * \param scrubDst if false, the backup tree was taken from the metadata files
+ * by trustMetadata(), so the backup directory is not scrubbed
+ * \param src source directory path (directory to be backed up)
+ * \param dst destination (backup) directory path
+ * \param opt scan options
+ * \param changedDirs if not nullptr, directories of the source directory that
+ * changed since the last backup, only these are scanned
+ * \param skipped directories with entries that were not backed up are added
+ * here
+ * \param dedup if true, deduplicate entries moved in the source directory
+ * \param done set to true if the backup was performed
+ * \return the result of backup()
+ */
+static int backupWithTrees(TreeManager& tm, const path& src, const path& dst,
+                           bool scrubDst, bool fixup, ScanOpt opt,
+                           unsigned hashLimit, unsigned jobs,
+                           const vector<path> *changedDirs,
+                           vector<path>& skipped, bool dedup, bool& done)
+{
+    int result=0;
+    if(scrubDst)
+    {
+        cout<<"Scrubbing backup directory.\n";
+        result=scrubImpl(tm,fixup,jobs);
+    }
     switch(result)
     {
         case 1:
@@ -964,6 +1778,10 @@ int backup(const path& src, const path& dst, const path& meta1, const path& meta
                 <<reset<<"\n";
             return result;
     }
+    //After the scrub the metadata trees are consistent with the backup
+    //directory, that is equal to the source directory as it was when the
+    //last backup completed, except for the directories in the journal
+    if(changedDirs) tm.rescanSourceTree(src,*changedDirs,opt);
     //NOTE: after the scrub the two metadata trees are consistent, so only keep
     //one to save RAM. Note that even though both metadata trees should be also
     //consistent with the dstTree (which would suggest we can clear both), this
@@ -973,14 +1791,27 @@ int backup(const path& src, const path& dst, const path& meta1, const path& meta
     //metadata files
     tm.discardMeta2Tree();
     tm.saveMetadataOnExit();
-    int result2=backupImpl(tm.getSrcTree(),tm.getDstTree(),&tm.getMeta1Tree());
+    int result2=backupImpl(tm.getSrcTree(),tm.getDstTree(),jobs,&tm.getMeta1Tree(),
+                           &skipped,dedup);
     if(result2!=0) result=result2;
-    if(hashAllFiles==false)
+    if(opt==ScanOpt::OmitHash)
     {
+        PhaseTimer phase(Phase::MissingHashes);
         cout<<"Computing missing hashes in metadata files... "; cout.flush();
-        tm.getMeta1Tree().bindToTopPath(dst);
+        tm.bindToDstPath(tm.getMeta1Tree(),dst);
+        bool reported=false;
+        auto progress=[&reported](const HashProgress& p){
+            reported=true;
+            cout<<"\n- "<<p.files<<"/"<<p.totalFiles<<" files, "
+                <<p.bytes/mib<<"/"<<p.totalBytes/mib<<" MiB";
+            //Estimate the time left from the average rate so far
+            if(p.bytes>0 && p.bytes<p.totalBytes)
+                cout<<", "<<formatSeconds(p.seconds*(p.totalBytes-p.bytes)/p.bytes)
+                    <<" left";
+            cout.flush();
+        };
         try {
-            tm.getMeta1Tree().computeMissingHashes();
+            tm.getMeta1Tree().computeMissingHashes(uint64_t(hashLimit)*mib,progress);
         } catch(exception& e) {
             cout<<redb<<"Warning:"<<reset<<" an exception was thrown while"
                 <<"computing missing hashes. The metadata files may be corrupt"
@@ -989,8 +1820,82 @@ int backup(const path& src, const path& dst, const path& meta1, const path& meta
                 <<"for those files.\n";
             throw;
         }
+        if(reported) cout<<"\n";
         cout<<"Done.\n";
     }
+    done=true;
+    return result;
+}
+
+int backup(const path& src, const path& dst, const path& meta1, const path& meta2,
+           bool fixup, bool hashAllFiles, unsigned rehashPeriod,
+           unsigned hashLimit, const path& journal, unsigned trustRuns,
+           bool dedup, bool threads, unsigned jobs, RemoteTarget *remote,
+           function<void (const string&)> warningCallback)
+{
+    cout<<"Backing up directory "<<src<<"\nto directory "<<dst<<"\n"
+        <<"and metadata files:\n- "<<meta1<<"\n- "<<meta2<<"\n";
+    ScanOpt opt=hashAllFiles ? ScanOpt::ComputeHash : ScanOpt::OmitHash;
+    if(hashAllFiles==false) rehashPeriod=0;
+    else trustRuns=0;
+    assert(remote==nullptr || (rehashPeriod==0 && trustRuns==0));
+    if(rehashPeriod>0)
+        cout<<"Reusing hashes of unchanged files, all files will be hashed "
+            <<"again over "<<rehashPeriod<<" backups.\n";
+    //Consecutive backups hash the files of consecutive slots, whatever the
+    //time between them
+    unsigned rehashRun=0;
+    if(rehashPeriod>0) rehashRun=readRuns(rehashRunsPath(meta1)).value_or(0);
+    optional<ChangeJournal> changes;
+    if(journal.empty()==false)
+    {
+        changes.emplace(journal);
+        if(changes->complete() && opt==ScanOpt::ComputeHash)
+            cout<<"Hashing all files, scanning the entire source directory "
+                <<"even though the change journal "<<journal<<" is complete.\n";
+        else if(changes->complete())
+            cout<<"Using change journal "<<journal<<", "<<changes->directories().size()
+                <<" directories of the source directory changed.\n";
+        else
+            cout<<"The change journal "<<journal<<" may not record all changes "
+                <<"(is 'ddm watch' running?), scanning the entire source directory.\n";
+    }
+    bool incremental=changes && changes->complete() && opt==ScanOpt::OmitHash;
+    //Every trustRuns backups, the backup directory is fully scanned and
+    //scrubbed, hashing all its files, in between the metadata is trusted
+    optional<unsigned> runs;
+    if(trustRuns>0) runs=readRuns(trustedRunsPath(meta1));
+    bool trust=runs && runs.value()+1<trustRuns;
+    if(trustRuns>0 && trust==false)
+        cout<<"Scanning and scrubbing the entire backup directory this time.\n";
+    int result;
+    vector<path> skipped;
+    bool done=false, scrubDst=true;
+    {
+        optional<TreeManager> tm;
+        if(trustRuns>0)
+        {
+            tm.emplace(incremental ? nullptr : &src,meta1,meta2,opt,jobs,
+                       warningCallback);
+            if(trust && tm->trustMetadata(dst,jobs)) scrubDst=false;
+            else tm->scanDstTree(dst,ScanOpt::ComputeHash);
+        } else if(incremental) {
+            tm.emplace(dst,meta1,meta2,opt,jobs,remote,warningCallback);
+        } else {
+            tm.emplace(src,dst,meta1,meta2,opt,threads,jobs,rehashPeriod,rehashRun,
+                       remote,warningCallback);
+        }
+        result=backupWithTrees(*tm,src,dst,scrubDst,fixup,opt,hashLimit,jobs,
+            incremental ? &changes->directories() : nullptr,skipped,dedup,done);
+    } //Metadata files are written here
+    if(changes && done)
+    {
+        //Entries not backed up still differ, so scan them again next time
+        for(auto& dir : skipped) changes->keep(dir);
+        changes->commit();
+    }
+    if(trustRuns>0 && done) writeRuns(trustedRunsPath(meta1),scrubDst ? 0 : runs.value()+1);
+    if(rehashPeriod>0 && done) writeRuns(rehashRunsPath(meta1),(rehashRun+1) % rehashPeriod);
     return result;
 }
 
@@ -999,7 +1904,7 @@ int backup(const path& src, const path& dst, bool threads,
 {
     cout<<"Backing up directory "<<src<<"\nto directory "<<dst<<"\n";
     DirectoryTree srcTree, dstTree;
-    scanSourceTargetDir(src,dst,threads,ScanOpt::OmitHash,srcTree,dstTree,
+    scanSourceTargetDir(src,dst,threads,1,ScanOpt::OmitHash,srcTree,dstTree,
                         warningCallback);
-    return backupImpl(srcTree,dstTree);
+    return backupImpl(srcTree,dstTree,1);
 }
@@ -25,6 +25,7 @@
  * \param src source directory path
  * \param dst destination directory path
  * \param threads if true, scan in parallel
+ * \param jobs number of threads used to scan each directory
  * \param opt scan options
  * \param scrTree scanned source directory will be placed here
  * \param dstTree scanned destination directory will be placed here
@@ -33,7 +34,7 @@
  */
 void scanSourceTargetDir(const std::filesystem::path& src,
                          const std::filesystem::path& dst,
-                         bool threads, ScanOpt opt,
+                         bool threads, unsigned jobs, ScanOpt opt,
                          DirectoryTree& srcTree,
                          DirectoryTree& dstTree,
                          std::function<void (const std::string&)> warningCallback={});
@@ -44,6 +45,17 @@ void scanSourceTargetDir(const std::filesystem::path& src,
  * \param meta1 first copy of the metadata for the destination directory
  * \param meta2 second copy of the metadata for the destination directory
  * \param fixup if true, attempt to fix inconsistencies in the backup directory
+ * \param budgetBytes if not 0, only hash files in the backup directory till
+ * this many bytes are read. Files are hashed in tree order starting after the
+ * last file hashed by the previous scrub with a budget, whose path is kept in
+ * a file named as meta1 with a .scrub suffix, so that all files are checked
+ * over several scrubs. The other files are only checked by their metadata
+ * \param budgetSeconds if not 0, only hash files in the backup directory for
+ * this many seconds, as for budgetBytes
+ * \param jobs number of threads used to scan and compare directories
+ * \param remote if not nullptr, the backup directory and the metadata files
+ * are on this remote target, and their paths are paths of the remote machine.
+ * Can't be used with a budget
  * \param warningCallback warning callback
  * \return 0 if no action was needed,
  *         1 if recoverable errors found and fixed
@@ -52,7 +64,8 @@ void scanSourceTargetDir(const std::filesystem::path& src,
 int scrub(const std::filesystem::path& dst,
           const std::filesystem::path& meta1,
           const std::filesystem::path& meta2,
-          bool fixup,
+          bool fixup, uint64_t budgetBytes, unsigned budgetSeconds, unsigned jobs,
+          RemoteTarget *remote,
           std::function<void (const std::string&)> warningCallback={});
 
 /**
@@ -63,7 +76,15 @@ int scrub(const std::filesystem::path& dst,
  * \param meta1 first copy of the metadata for the destination directory
  * \param meta2 second copy of the metadata for the destination directory
  * \param fixup if true, attempt to fix inconsistencies in the backup directory
+ * \param budgetBytes if not 0, only hash this many bytes of files in the
+ * backup directory, see the other overload. The same files are hashed in the
+ * source directory
+ * \param budgetSeconds if not 0, only hash files for this many seconds
  * \param threads if true, scan in parallel
+ * \param jobs number of threads used to scan each directory and to compare
+ * directories
+ * \param remote if not nullptr, the backup directory and the metadata files
+ * are on this remote target, see the other overload
  * \param warningCallback warning callback
  * \return 0 if no action was needed,
  *         1 if recoverable errors found and fixed
@@ -73,7 +94,8 @@ int scrub(const std::filesystem::path& src,
           const std::filesystem::path& dst,
           const std::filesystem::path& meta1,
           const std::filesystem::path& meta2,
-          bool fixup, bool threads,
+          bool fixup, uint64_t budgetBytes, unsigned budgetSeconds,
+          bool threads, unsigned jobs, RemoteTarget *remote,
           std::function<void (const std::string&)> warningCallback={});
 
 /**
@@ -92,7 +114,34 @@ int scrub(const std::filesystem::path& src,
  * anyway, so as to keep the metadata files with all the necessary information
  * for future use, so even with this option some hash computation may happen.
  * It is thus recommended to periodically do a backup with hashAllFiles=true
+ * \param rehashPeriod only used if hashAllFiles is true. If not 0, files that
+ * did not change since the metadata files were written are not hashed, their
+ * hash is taken from the metadata files instead. To still detect bit rot, a
+ * rotating fraction of those files is hashed anyway, so that every file is
+ * hashed at least once every rehashPeriod backups. See HashCache for details
+ * \param hashLimit only used if hashAllFiles is false. If not 0, limit the
+ * rate the files without hash are read at after the backup, in MiB/s
+ * \param journal if not empty, change journal of the source directory written
+ * by watchDirectory(). If hashAllFiles is false and the journal is complete,
+ * only the directories in the journal are scanned in the source directory.
+ * The journal is committed once the metadata files are written
+ * \param trustRuns only used if hashAllFiles is false. If not 0, the backup
+ * directory is not scanned and scrubbed, trusting the metadata files after a
+ * check that only lists its directories, except for once every trustRuns
+ * backups, when it is scanned and scrubbed hashing all its files. The number
+ * of backups since then is kept in a file named as meta1 with a .runs suffix
+ * \param dedup if true, entries renamed or moved in the source directory are
+ * renamed in the backup directory instead of being copied again, and new files
+ * with the same content as a file already in the backup directory are copied
+ * from that file, as a reflink where the filesystem supports it
  * \param threads if true, scan in parallel
+ * \param jobs number of threads used to scan each directory, to compare
+ * directories and to change the metadata of files in the backup directory
+ * \param remote if not nullptr, the backup directory and the metadata files
+ * are on this remote target, and their paths are paths of the remote machine.
+ * Changes to the backup directory are sent without waiting for each of them,
+ * and its files are hashed by the remote process. Can't be used with
+ * rehashPeriod and trustRuns
  * \param warningCallback warning callback
  * \return 0 if no action was needed,
  *         1 if recoverable errors found and fixed
@@ -102,7 +151,10 @@ int backup(const std::filesystem::path& src,
            const std::filesystem::path& dst,
            const std::filesystem::path& meta1,
            const std::filesystem::path& meta2,
-           bool fixup, bool hashAllFiles, bool threads,
+           bool fixup, bool hashAllFiles, unsigned rehashPeriod,
+           unsigned hashLimit, const std::filesystem::path& journal,
+           unsigned trustRuns, bool dedup, bool threads, unsigned jobs,
+           RemoteTarget *remote,
            std::function<void (const std::string&)> warningCallback={});
 
 /**
@@ -0,0 +1,510 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * ddm_bench: generates a synthetic directory tree and measures the throughput,
+ * peak resident memory and allocations per entry of the core operations of
+ * ddm on it, writing the results as JSON so that they can be compared across
+ * builds, for example with and without OPTIMIZE_MEMORY.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <boost/program_options.hpp>
+#include "core.h"
+#include "backup.h"
+
+using namespace std;
+using namespace std::filesystem;
+using namespace boost::program_options;
+
+//
+// Allocation counting, replacing the global operator new
+//
+
+static atomic<uint64_t> allocations(0);
+static atomic<uint64_t> allocatedBytes(0);
+
+static void *countedAlloc(size_t size)
+{
+    allocations.fetch_add(1,memory_order_relaxed);
+    allocatedBytes.fetch_add(size,memory_order_relaxed);
+    return malloc(size==0 ? 1 : size);
+}
+
+void *operator new(size_t size)
+{
+    if(void *p=countedAlloc(size)) return p;
+    throw bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    if(void *p=countedAlloc(size)) return p;
+    throw bad_alloc();
+}
+
+void *operator new(size_t size, const nothrow_t&) noexcept
+{
+    return countedAlloc(size);
+}
+
+void *operator new[](size_t size, const nothrow_t&) noexcept
+{
+    return countedAlloc(size);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+/**
+ * Parameters of the synthetic directory tree
+ */
+struct TreeConfig
+{
+    unsigned depth=3;        ///< Levels of subdirectories below the top one
+    unsigned fanout=8;       ///< Subdirectories in every directory
+    unsigned files=16;       ///< Files and symlinks in every directory
+    uint64_t minSize=0;      ///< Minimum file size in bytes
+    uint64_t maxSize=65536;  ///< Maximum file size in bytes
+    double symlinks=0.05;    ///< Fraction of the files that are symlinks
+    unsigned seed=1;         ///< Random seed, the same seed gives the same tree
+};
+
+/**
+ * Statistics of the synthetic directory tree
+ */
+struct TreeStats
+{
+    uint64_t directories=0;
+    uint64_t files=0;
+    uint64_t symlinks=0;
+    uint64_t bytes=0;
+
+    uint64_t entries() const { return directories+files+symlinks; }
+};
+
+/// Modified time of the generated entries, in the past so that a backup of
+/// the tree after it is changed never finds backup copies newer than the
+/// source files
+static const time_t generatedMtime=1640995200; //2022-01-01
+
+/**
+ * Write a file of the given size with pseudorandom content
+ */
+static void writeRandomFile(const path& p, uint64_t size, mt19937_64& rng)
+{
+    ofstream out(p,ios::binary);
+    vector<uint64_t> buffer(8192);
+    while(size>0)
+    {
+        for(auto& word : buffer) word=rng();
+        auto n=min<uint64_t>(size,buffer.size()*sizeof(uint64_t));
+        out.write(reinterpret_cast<const char*>(buffer.data()),n);
+        size-=n;
+    }
+    if(!out) throw runtime_error(string("Error writing ")+p.string());
+}
+
+/**
+ * Set the modified time of an entry, without following symlinks
+ */
+static void setMtime(const path& p, time_t mtime)
+{
+    struct timespec times[2]={{mtime,0},{mtime,0}};
+    if(utimensat(AT_FDCWD,p.c_str(),times,AT_SYMLINK_NOFOLLOW)!=0)
+        throw runtime_error(string("Error setting mtime of ")+p.string());
+}
+
+/**
+ * Recursively generate the content of a directory of the synthetic tree.
+ * File sizes are log-uniformly distributed between the minimum and maximum
+ * size, so that small files are common and large ones take most of the space,
+ * as in real directory trees. Symlinks point to a file of the same directory
+ */
+static void generateDirectory(const path& dir, unsigned level,
+                              const TreeConfig& cfg, mt19937_64& rng,
+                              TreeStats& stats)
+{
+    uniform_real_distribution<double> unit(0.0,1.0);
+    double logMin=log(double(cfg.minSize+1)), logMax=log(double(cfg.maxSize+1));
+    for(unsigned i=0;i<cfg.files;i++)
+    {
+        path p=dir / ("file"+to_string(i));
+        if(i>0 && unit(rng)<cfg.symlinks)
+        {
+            create_symlink("file0",p);
+            stats.symlinks++;
+        } else {
+            auto size=uint64_t(exp(logMin+(logMax-logMin)*unit(rng)))-1;
+            writeRandomFile(p,size,rng);
+            stats.files++;
+            stats.bytes+=size;
+        }
+        setMtime(p,generatedMtime);
+    }
+    if(level<cfg.depth)
+    {
+        for(unsigned i=0;i<cfg.fanout;i++)
+        {
+            path p=dir / ("dir"+to_string(i));
+            create_directory(p);
+            stats.directories++;
+            generateDirectory(p,level+1,cfg,rng,stats);
+        }
+    }
+    setMtime(dir,generatedMtime);
+}
+
+/**
+ * Generate a synthetic directory tree
+ * \param top top directory, created by this function
+ * \param cfg tree parameters
+ * \return the statistics of the tree, the top directory is not counted
+ */
+static TreeStats generateTree(const path& top, const TreeConfig& cfg)
+{
+    TreeStats stats;
+    mt19937_64 rng(cfg.seed);
+    create_directory(top);
+    generateDirectory(top,0,cfg,rng,stats);
+    return stats;
+}
+
+/**
+ * Change about one in a hundred files of a synthetic tree, so that a backup
+ * or a diff of the tree before and after has some work to do: files are
+ * appended to, removed or added
+ * \return the number of entries that were changed
+ */
+static uint64_t changeTree(const path& top, unsigned seed)
+{
+    mt19937_64 rng(seed+1);
+    vector<path> files;
+    for(auto& e : recursive_directory_iterator(top))
+        if(e.is_regular_file() && e.is_symlink()==false) files.push_back(e.path());
+    uint64_t changed=0;
+    for(size_t i=0;i<files.size();i+=100)
+    {
+        auto& p=files[i];
+        switch(rng()%3)
+        {
+            case 0:
+                ofstream(p,ios::binary|ios::app)<<"changed";
+                break;
+            case 1:
+                remove(p);
+                break;
+            case 2:
+                writeRandomFile(p.parent_path() / ("new"+to_string(i)),1000,rng);
+                break;
+        }
+        changed++;
+    }
+    return changed;
+}
+
+/**
+ * Discards everything written to it, to silence the output of backup()
+ */
+class NullStreambuf : public streambuf
+{
+protected:
+    int overflow(int c) override { return c; }
+};
+
+/**
+ * Result of a benchmark
+ */
+struct Result
+{
+    string name;
+    double seconds=0;
+    uint64_t entries=0;     ///< Entries processed
+    uint64_t bytes=0;       ///< File bytes processed, if meaningful
+    uint64_t peakRssKiB=0;  ///< Peak resident memory while running
+    uint64_t allocations=0;
+    uint64_t allocatedBytes=0;
+};
+
+/**
+ * Reset the peak resident memory of the process, so that the next call to
+ * peakRssKiB() returns the peak since now. On kernels that don't support it
+ * the peak since the process started is reported
+ */
+static void resetPeakRss()
+{
+    int fd=open("/proc/self/clear_refs",O_WRONLY);
+    if(fd<0) return;
+    if(write(fd,"5",1)!=1) {} //Not supported, the peak is not reset
+    close(fd);
+}
+
+/**
+ * \return the peak resident memory of the process in KiB
+ */
+static uint64_t peakRssKiB()
+{
+    ifstream in("/proc/self/status");
+    string line;
+    while(getline(in,line))
+        if(line.compare(0,6,"VmHWM:")==0) return stoull(line.substr(6));
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_maxrss;
+}
+
+/**
+ * Run a benchmark
+ * \param name benchmark name
+ * \param entries number of entries processed by the benchmark
+ * \param bytes number of file bytes processed by the benchmark, or 0
+ * \param f benchmark code
+ * \return the result
+ */
+static Result run(const string& name, uint64_t entries, uint64_t bytes,
+                  const function<void ()>& f)
+{
+    cerr<<"Running "<<name<<"... "; cerr.flush();
+    Result result;
+    result.name=name;
+    result.entries=entries;
+    result.bytes=bytes;
+    resetPeakRss();
+    auto allocations0=allocations.load();
+    auto allocatedBytes0=allocatedBytes.load();
+    auto start=chrono::steady_clock::now();
+    f();
+    auto end=chrono::steady_clock::now();
+    result.allocations=allocations.load()-allocations0;
+    result.allocatedBytes=allocatedBytes.load()-allocatedBytes0;
+    result.peakRssKiB=peakRssKiB();
+    result.seconds=chrono::duration<double>(end-start).count();
+    cerr<<result.seconds<<"s\n";
+    return result;
+}
+
+/**
+ * Write the results as JSON
+ */
+static void writeJson(ostream& os, const TreeConfig& cfg, unsigned jobs,
+                      const TreeStats& stats, const vector<Result>& results)
+{
+    #ifdef OPTIMIZE_MEMORY
+    const char *optimizeMemory="true";
+    #else
+    const char *optimizeMemory="false";
+    #endif
+    auto perSecond=[](double n, double seconds){ return seconds>0 ? n/seconds : 0; };
+    auto perEntry=[](uint64_t n, uint64_t entries){
+        return entries>0 ? double(n)/entries : 0;
+    };
+    os<<"{\n"
+      <<"  \"config\": {\"depth\": "<<cfg.depth<<", \"fanout\": "<<cfg.fanout
+      <<", \"files\": "<<cfg.files<<", \"min_size\": "<<cfg.minSize
+      <<", \"max_size\": "<<cfg.maxSize<<", \"symlinks\": "<<cfg.symlinks
+      <<", \"seed\": "<<cfg.seed<<", \"jobs\": "<<jobs
+      <<", \"optimize_memory\": "<<optimizeMemory<<"},\n"
+      <<"  \"tree\": {\"entries\": "<<stats.entries()
+      <<", \"directories\": "<<stats.directories<<", \"files\": "<<stats.files
+      <<", \"symlinks\": "<<stats.symlinks<<", \"bytes\": "<<stats.bytes<<"},\n"
+      <<"  \"benchmarks\": [\n";
+    for(size_t i=0;i<results.size();i++)
+    {
+        auto& r=results[i];
+        os<<"    {\"name\": \""<<r.name<<"\", \"seconds\": "<<r.seconds
+          <<", \"entries\": "<<r.entries<<", \"bytes\": "<<r.bytes
+          <<", \"entries_per_second\": "<<perSecond(r.entries,r.seconds)
+          <<", \"mib_per_second\": "<<perSecond(r.bytes/1048576.0,r.seconds)
+          <<", \"peak_rss_kib\": "<<r.peakRssKiB
+          <<", \"allocations\": "<<r.allocations
+          <<", \"allocations_per_entry\": "<<perEntry(r.allocations,r.entries)
+          <<", \"allocated_bytes_per_entry\": "<<perEntry(r.allocatedBytes,r.entries)
+          <<"}"<<(i+1<results.size() ? ",\n" : "\n");
+    }
+    os<<"  ]\n}\n";
+}
+
+/**
+ * Run all benchmarks on a synthetic tree generated in a scratch directory
+ * \param scratch scratch directory, must exist and be empty
+ */
+static vector<Result> runBenchmarks(const path& scratch, const TreeConfig& cfg,
+                                    unsigned jobs, TreeStats& stats)
+{
+    path src=scratch / "src", dst=scratch / "dst";
+    cerr<<"Generating tree... "; cerr.flush();
+    stats=generateTree(src,cfg);
+    cerr<<stats.entries()<<" entries, "<<stats.bytes/1048576<<" MiB\n";
+    vector<Result> results;
+
+    vector<path> files;
+    for(auto& e : recursive_directory_iterator(src))
+        if(e.is_regular_file() && e.is_symlink()==false) files.push_back(e.path());
+    for(auto alg : {HashAlgorithm::SHA1,HashAlgorithm::BLAKE3})
+    {
+        results.push_back(run("hashFile/"+hashAlgorithmName(alg),files.size(),
+                              stats.bytes,[&]{
+            for(auto& p : files) hashFile(p,alg);
+        }));
+    }
+
+    DirectoryTree a;
+    a.setJobs(jobs);
+    results.push_back(run("scanDirectory/nohash",stats.entries(),0,[&]{
+        a.scanDirectory(src,ScanOpt::OmitHash);
+    }));
+    results.push_back(run("scanDirectory/hash",stats.entries(),stats.bytes,[&]{
+        a.scanDirectory(src,ScanOpt::ComputeHash);
+    }));
+
+    //The elements of the tree as lines of a text metadata file
+    ostringstream metadata;
+    a.writeTo(metadata);
+    vector<string> lines;
+    {
+        istringstream is(metadata.str());
+        string line;
+        while(getline(is,line)) if(line.empty()==false && line[0]!='#') lines.push_back(line);
+    }
+    vector<FilesystemElement> elements(lines.size());
+    results.push_back(run("FilesystemElement::readFrom",lines.size(),0,[&]{
+        for(size_t i=0;i<lines.size();i++) elements[i].readFrom(lines[i]);
+    }));
+    NullStreambuf nullBuf;
+    results.push_back(run("FilesystemElement::writeTo",elements.size(),0,[&]{
+        ostream os(&nullBuf);
+        for(auto& e : elements) e.writeTo(os);
+    }));
+    elements.clear();
+    elements.shrink_to_fit();
+
+    //The simple backup also scans both directories, its time includes that
+    create_directory(dst);
+    auto *coutBuf=cout.rdbuf(&nullBuf);
+    try {
+        results.push_back(run("backup/full",stats.entries(),stats.bytes,[&]{
+            backup(src,dst,false);
+        }));
+    } catch(...) {
+        cout.rdbuf(coutBuf);
+        throw;
+    }
+    cout.rdbuf(coutBuf);
+
+    auto changed=changeTree(src,cfg.seed);
+    DirectoryTree b;
+    b.setJobs(jobs);
+    b.scanDirectory(src,ScanOpt::ComputeHash);
+    results.push_back(run("diff2/unchanged",stats.entries(),0,[&]{
+        diff2(a,a,CompareOpt(),jobs);
+    }));
+    results.push_back(run("diff2/changed",stats.entries(),0,[&]{
+        diff2(a,b,CompareOpt(),jobs);
+    }));
+    results.push_back(run("diff3/changed",stats.entries(),0,[&]{
+        diff3(a,b,a,CompareOpt(),jobs);
+    }));
+    a.clear();
+    b.clear();
+
+    coutBuf=cout.rdbuf(&nullBuf);
+    try {
+        results.push_back(run("backup/changed",stats.entries(),0,[&]{
+            backup(src,dst,false);
+        }));
+    } catch(...) {
+        cout.rdbuf(coutBuf);
+        throw;
+    }
+    cout.rdbuf(coutBuf);
+    cerr<<changed<<" entries changed before the diffs and the second backup\n";
+    return results;
+}
+
+int main(int argc, char *argv[]) try
+{
+    TreeConfig cfg;
+    unsigned jobs=1;
+    options_description desc("ddm_bench: benchmark ddm on a synthetic directory "
+                             "tree, write the results as JSON\noptions");
+    desc.add_options()
+        ("help,h",   "prints this")
+        ("depth",    value<unsigned>(&cfg.depth), "levels of subdirectories (3)")
+        ("fanout",   value<unsigned>(&cfg.fanout), "subdirectories per directory (8)")
+        ("files",    value<unsigned>(&cfg.files), "files per directory (16)")
+        ("minsize",  value<uint64_t>(&cfg.minSize), "minimum file size in bytes (0)")
+        ("maxsize",  value<uint64_t>(&cfg.maxSize), "maximum file size in bytes (65536)")
+        ("symlinks", value<double>(&cfg.symlinks), "fraction of files that are symlinks (0.05)")
+        ("seed",     value<unsigned>(&cfg.seed), "random seed (1)")
+        ("jobs,j",   value<unsigned>(&jobs), "threads to scan and compare directories (1)")
+        ("dir",      value<path>(), "where to generate the tree (temporary directory)")
+        ("output,o", value<path>(), "output JSON file (stdout)")
+    ;
+    variables_map vm;
+    store(parse_command_line(argc,argv,desc),vm);
+    notify(vm);
+    if(vm.count("help") || cfg.minSize>cfg.maxSize || cfg.symlinks<0 || cfg.symlinks>1)
+    {
+        cerr<<desc<<"File sizes are log-uniformly distributed between minsize and "
+            <<"maxsize. Files are read from the page cache, so hashing measures "
+            <<"the CPU time\n";
+        return 100;
+    }
+
+    string base=(vm.count("dir") ? vm["dir"].as<path>() : temp_directory_path())
+               / "ddm_bench.XXXXXX";
+    vector<char> scratchName(base.begin(),base.end());
+    scratchName.push_back('\0');
+    if(mkdtemp(scratchName.data())==nullptr)
+        throw runtime_error(string("Can't create scratch directory in ")+base);
+    path scratch(scratchName.data());
+    TreeStats stats;
+    vector<Result> results;
+    try {
+        results=runBenchmarks(scratch,cfg,jobs,stats);
+    } catch(...) {
+        remove_all(scratch);
+        throw;
+    }
+    remove_all(scratch);
+
+    if(vm.count("output"))
+    {
+        ofstream out(vm["output"].as<path>());
+        writeJson(out,cfg,jobs,stats,results);
+        if(!out) throw runtime_error("Error writing output file");
+    } else writeJson(cout,cfg,jobs,stats,results);
+    return 0;
+} catch(exception& e) {
+    cerr<<"\nError: "<<e.what()<<"\n";
+    return 10;
+}
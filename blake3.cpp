@@ -0,0 +1,227 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "blake3.h"
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+static const uint32_t iv[8]=
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const unsigned msgPermutation[16]=
+{
+    2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8
+};
+
+enum Flags : uint32_t
+{
+    chunkStart=1,
+    chunkEnd=2,
+    parent=4,
+    root=8
+};
+
+static inline uint32_t rotr(uint32_t x, unsigned n)
+{
+    return (x>>n) | (x<<(32-n));
+}
+
+static inline void g(uint32_t s[16], unsigned a, unsigned b, unsigned c,
+                     unsigned d, uint32_t mx, uint32_t my)
+{
+    s[a]=s[a]+s[b]+mx;
+    s[d]=rotr(s[d]^s[a],16);
+    s[c]=s[c]+s[d];
+    s[b]=rotr(s[b]^s[c],12);
+    s[a]=s[a]+s[b]+my;
+    s[d]=rotr(s[d]^s[a],8);
+    s[c]=s[c]+s[d];
+    s[b]=rotr(s[b]^s[c],7);
+}
+
+/**
+ * BLAKE3 compression function
+ * \param cv input chaining value
+ * \param blockWords message block
+ * \param counter chunk or output block counter
+ * \param blockSize number of valid bytes in the block
+ * \param flags domain separation flags
+ * \param out 16 words output, the first 8 are the output chaining value
+ */
+static void compress(const uint32_t cv[8], const uint32_t blockWords[16],
+                     uint64_t counter, uint32_t blockSize, uint32_t flags,
+                     uint32_t out[16])
+{
+    uint32_t s[16]=
+    {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        iv[0], iv[1], iv[2], iv[3],
+        static_cast<uint32_t>(counter), static_cast<uint32_t>(counter>>32),
+        blockSize, flags
+    };
+    uint32_t m[16], t[16];
+    memcpy(m,blockWords,sizeof(m));
+    for(int round=0;round<7;round++)
+    {
+        g(s,0,4, 8,12,m[ 0],m[ 1]);
+        g(s,1,5, 9,13,m[ 2],m[ 3]);
+        g(s,2,6,10,14,m[ 4],m[ 5]);
+        g(s,3,7,11,15,m[ 6],m[ 7]);
+        g(s,0,5,10,15,m[ 8],m[ 9]);
+        g(s,1,6,11,12,m[10],m[11]);
+        g(s,2,7, 8,13,m[12],m[13]);
+        g(s,3,4, 9,14,m[14],m[15]);
+        if(round==6) break;
+        for(int i=0;i<16;i++) t[i]=m[msgPermutation[i]];
+        memcpy(m,t,sizeof(m));
+    }
+    for(int i=0;i<8;i++)
+    {
+        out[i]=s[i]^s[i+8];
+        out[i+8]=s[i+8]^cv[i];
+    }
+}
+
+static void wordsFromBytes(const unsigned char *bytes, uint32_t words[16])
+{
+    for(int i=0;i<16;i++)
+        words[i]= static_cast<uint32_t>(bytes[4*i])
+               | (static_cast<uint32_t>(bytes[4*i+1])<<8)
+               | (static_cast<uint32_t>(bytes[4*i+2])<<16)
+               | (static_cast<uint32_t>(bytes[4*i+3])<<24);
+}
+
+static void parentCv(const uint32_t left[8], const uint32_t right[8],
+                     uint32_t flags, uint32_t result[8])
+{
+    uint32_t blockWords[16], out[16];
+    memcpy(blockWords,left,8*sizeof(uint32_t));
+    memcpy(blockWords+8,right,8*sizeof(uint32_t));
+    compress(iv,blockWords,0,64,flags | parent,out);
+    memcpy(result,out,8*sizeof(uint32_t));
+}
+
+//
+// class Blake3
+//
+
+Blake3::Blake3()
+{
+    memcpy(cv,iv,sizeof(cv));
+}
+
+void Blake3::update(const void *data, size_t size)
+{
+    auto p=reinterpret_cast<const unsigned char*>(data);
+    while(size>0)
+    {
+        //The current chunk is finalized only when more data arrives, as the
+        //last chunk needs the root flag
+        if(chunkSize()==chunkLen)
+        {
+            uint32_t blockWords[16], out[16];
+            wordsFromBytes(block,blockWords);
+            compress(cv,blockWords,chunkCounter,blockSize,
+                     flagsForBlock() | chunkEnd,out);
+            uint64_t totalChunks=chunkCounter+1;
+            addChunkChainingValue(out,totalChunks);
+            memcpy(cv,iv,sizeof(cv));
+            chunkCounter=totalChunks;
+            blockSize=0;
+            blocksCompressed=0;
+        }
+        size_t n=min<size_t>(chunkLen-chunkSize(),size);
+        chunkUpdate(p,n);
+        p+=n;
+        size-=n;
+    }
+}
+
+void Blake3::final(unsigned char *digest)
+{
+    //Output of the current chunk
+    uint32_t inputCv[8], blockWords[16], out[16];
+    memcpy(inputCv,cv,sizeof(inputCv));
+    memset(block+blockSize,0,blockLen-blockSize);
+    wordsFromBytes(block,blockWords);
+    uint64_t counter=chunkCounter;
+    uint32_t size=blockSize;
+    uint32_t flags=flagsForBlock() | chunkEnd;
+    //Merge with the subtrees on the stack, the last merge is the root
+    for(unsigned i=cvStackSize;i>0;i--)
+    {
+        compress(inputCv,blockWords,counter,size,flags,out);
+        memcpy(blockWords,cvStack[i-1],8*sizeof(uint32_t));
+        memcpy(blockWords+8,out,8*sizeof(uint32_t));
+        memcpy(inputCv,iv,sizeof(inputCv));
+        counter=0;
+        size=blockLen;
+        flags=parent;
+    }
+    compress(inputCv,blockWords,counter,size,flags | root,out);
+    for(unsigned i=0;i<DIGESTSIZE/4;i++)
+    {
+        digest[4*i]  =out[i];
+        digest[4*i+1]=out[i]>>8;
+        digest[4*i+2]=out[i]>>16;
+        digest[4*i+3]=out[i]>>24;
+    }
+}
+
+void Blake3::addChunkChainingValue(uint32_t newCv[8], uint64_t totalChunks)
+{
+    //Merge completed subtrees, as many as the trailing zeros of totalChunks
+    while((totalChunks & 1)==0)
+    {
+        parentCv(cvStack[--cvStackSize],newCv,0,newCv);
+        totalChunks>>=1;
+    }
+    memcpy(cvStack[cvStackSize++],newCv,8*sizeof(uint32_t));
+}
+
+void Blake3::chunkUpdate(const unsigned char *data, size_t size)
+{
+    while(size>0)
+    {
+        //Compress a full block only when more data arrives, as the last
+        //block of the chunk needs the chunk end flag
+        if(blockSize==blockLen)
+        {
+            uint32_t blockWords[16], out[16];
+            wordsFromBytes(block,blockWords);
+            compress(cv,blockWords,chunkCounter,blockLen,flagsForBlock(),out);
+            memcpy(cv,out,sizeof(cv));
+            blocksCompressed++;
+            blockSize=0;
+        }
+        size_t n=min<size_t>(blockLen-blockSize,size);
+        memcpy(block+blockSize,data,n);
+        blockSize+=n;
+        data+=n;
+        size-=n;
+    }
+}
+
+uint32_t Blake3::flagsForBlock() const
+{
+    return blocksCompressed==0 ? uint32_t(chunkStart) : 0;
+}
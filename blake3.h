@@ -0,0 +1,71 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Portable implementation of the BLAKE3 hash function, following the
+ * structure of the reference implementation. Only the default (unkeyed) hash
+ * mode is supported. It is much faster than SHA1 even without SIMD.
+ */
+class Blake3
+{
+public:
+    static const unsigned DIGESTSIZE=32; ///< Default digest size, in bytes
+
+    Blake3();
+
+    /**
+     * Add data to the hash computation
+     * \param data data to hash
+     * \param size data size in bytes
+     */
+    void update(const void *data, size_t size);
+
+    /**
+     * Compute the final hash. No more data can be added after this call
+     * \param digest the output hash, with a size of DIGESTSIZE bytes
+     */
+    void final(unsigned char *digest);
+
+private:
+    static const unsigned blockLen=64;
+    static const unsigned chunkLen=1024;
+    static const unsigned maxDepth=54; ///< Enough for 2^64 bytes of input
+
+    void addChunkChainingValue(uint32_t cv[8], uint64_t totalChunks);
+
+    void chunkUpdate(const unsigned char *data, size_t size);
+
+    unsigned chunkSize() const { return blockLen*blocksCompressed+blockSize; }
+
+    uint32_t flagsForBlock() const;
+
+    //Current chunk state
+    uint32_t cv[8];
+    uint64_t chunkCounter=0;
+    unsigned char block[blockLen];
+    unsigned blockSize=0;
+    unsigned blocksCompressed=0;
+
+    //Stack of subtree chaining values
+    uint32_t cvStack[maxDepth][8];
+    unsigned cvStackSize=0;
+};
@@ -18,22 +18,53 @@
 #include <sstream>
 #include <cassert>
 #include <iomanip>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <fstream>
+#include <set>
 #include <unordered_set>
-#include "cryptopp.h"
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "extfs.h"
+#include "threadpool.h"
+#include "remote.h"
+#include "stats.h"
 #include "core.h"
 
 using namespace std;
 using namespace std::filesystem;
 
-string hashFile(const path& p)
+//
+// class NameTable
+//
+
+NameTable& NameTable::instance()
 {
-    using namespace CryptoPP;
-    SHA1 hash;
-    string result;
-    FileSource fs(p.string().c_str(),true,
-                  new HashFilter(hash,new HexEncoder(new StringSink(result))));
-    return result;
+    static NameTable table;
+    return table;
+}
+
+uint32_t NameTable::intern(const string& name)
+{
+    unique_lock<mutex> l(m);
+    auto it=ids.find(name);
+    if(it!=ids.end()) return it->second;
+    uint32_t id=names.size();
+    names.push_back(name);
+    ids.insert({name,id});
+    return id;
+}
+
+const string& NameTable::name(uint32_t id) const
+{
+    unique_lock<mutex> l(m);
+    assert(id<names.size());
+    return names[id];
 }
 
 //
@@ -59,6 +90,220 @@ CompareOpt::CompareOpt(const string& ignoreString)
     }
 }
 
+//
+// class MetadataFormatter
+//
+
+/**
+ * Formats elements in the metadata file format. Elements are rendered into a
+ * buffer, reused from one element to the next, that is written to the ostream
+ * in large blocks, and the date part of mtimes is only formatted when it
+ * changes, as most files in a directory usually share it
+ */
+class MetadataFormatter
+{
+public:
+    explicit MetadataFormatter(ostream& os) : os(os) {}
+
+    /**
+     * Append an element
+     * \param e element to append
+     */
+    void append(const FilesystemElement& e)
+    {
+        append(e,e.symlinkView(),"",e.rpView());
+    }
+
+    /**
+     * Append a directory node
+     * \param n node to append
+     * \param dirPath path of the directory containing the node, relative to
+     * the top level directory
+     */
+    void append(const DirectoryNode& n, string_view dirPath)
+    {
+        append(n,n.symlinkTarget(),dirPath,n.name());
+    }
+
+    /**
+     * Append a path quoted as the paths in metadata lines
+     */
+    void appendPath(string_view p)
+    {
+        buffer+='"';
+        appendQuoted(p);
+        buffer+='"';
+        flushIfFull();
+    }
+
+    /**
+     * Append text as is
+     */
+    void append(string_view s) { buffer.append(s.data(),s.size()); flushIfFull(); }
+    void append(char c) { buffer+=c; flushIfFull(); }
+
+    /**
+     * Write the buffered data to the ostream
+     */
+    void flush()
+    {
+        os.write(buffer.data(),buffer.size());
+        buffer.clear();
+    }
+
+    ~MetadataFormatter() { flush(); }
+
+private:
+    MetadataFormatter(const MetadataFormatter&)=delete;
+    MetadataFormatter& operator=(const MetadataFormatter&)=delete;
+
+    /// Works for both FilesystemElement and DirectoryNode, that have fields
+    /// with the same names
+    template<typename T>
+    void append(const T& e, string_view symlink, string_view dirPath, string_view name);
+
+    void appendNumber(off_t n)
+    {
+        char s[24];
+        char *p=s+sizeof(s);
+        uint64_t u=n<0 ? -uint64_t(n) : n;
+        do *--p='0'+u%10; while(u/=10);
+        if(n<0) *--p='-';
+        buffer.append(p,s+sizeof(s)-p);
+    }
+
+    void appendTwoDigits(int n)
+    {
+        buffer+='0'+n/10;
+        buffer+='0'+n%10;
+    }
+
+    void appendTime(time_t mt);
+
+    void appendName(uint32_t id, uint32_t& lastId, const string *& lastName)
+    {
+        if(lastName==nullptr || id!=lastId)
+        {
+            lastId=id;
+            lastName=&NameTable::instance().name(id);
+        }
+        buffer+=*lastName;
+    }
+
+    /// Quote paths like operator<< of path does
+    void appendQuoted(string_view s)
+    {
+        for(char c : s)
+        {
+            if(c=='"' || c=='\\') buffer+='\\';
+            buffer+=c;
+        }
+    }
+
+    void flushIfFull() { if(buffer.size()>=bufferSize) flush(); }
+
+    static const size_t bufferSize=256*1024;
+    ostream& os;
+    string buffer;
+    uint32_t lastUserId=0, lastGroupId=0;
+    const string *lastUser=nullptr, *lastGroup=nullptr;
+    time_t lastDay=0;
+    char date[32];
+    size_t dateSize=0; ///< 0 if no date cached yet
+};
+
+template<typename T>
+void MetadataFormatter::append(const T& e, string_view symlink,
+                               string_view dirPath, string_view name)
+{
+    switch(e.ty)
+    {
+        case file_type::regular:   buffer+='-'; break;
+        case file_type::directory: buffer+='d'; break;
+        case file_type::symlink:   buffer+='l'; break;
+        default:                   buffer+='?'; break;
+    }
+    int pe=static_cast<int>(e.per);
+    const char rwx[]="rwxrwxrwx";
+    for(int i=0;i<9;i++) buffer+=pe & (0400>>i) ? rwx[i] : '-';
+    buffer+=' ';
+    appendName(e.us,lastUserId,lastUser);
+    buffer+=' ';
+    appendName(e.gs,lastGroupId,lastGroup);
+    buffer+=' ';
+    appendTime(e.mt);
+    buffer+=' ';
+    switch(e.ty)
+    {
+        case file_type::regular:
+            appendNumber(e.sz);
+            //Print * instead of hash when omitted
+            if(e.fileHash.empty()) buffer+=" * ";
+            else {
+                const char hex[]="0123456789ABCDEF";
+                buffer+=' ';
+                for(unsigned i=0;i<e.fileHash.size();i++)
+                {
+                    buffer+=hex[e.fileHash.data()[i]>>4];
+                    buffer+=hex[e.fileHash.data()[i] & 0xf];
+                }
+                buffer+=' ';
+            }
+            break;
+        case file_type::symlink:
+            buffer+='"';
+            appendQuoted(symlink);
+            buffer+="\" ";
+            break;
+        default:
+            break;
+    }
+    buffer+='"';
+    if(dirPath.empty()==false)
+    {
+        appendQuoted(dirPath);
+        buffer+='/';
+    }
+    appendQuoted(name);
+    buffer+='"';
+    flushIfFull();
+}
+
+void MetadataFormatter::appendTime(time_t mt)
+{
+    // Time is complicated. The gmtime_r functions, given its name, should fill
+    // a struct tm with GMT time, but the documentation says UTC. And it's
+    // unclear how it handles leap seconds, that should be the difference
+    // between GMT and UTC. Nobody on the Internet appears to know exactly, but
+    // it appears to be OS dependent.
+    // Additionally strftime has a format string %z to print the time zone, but
+    // a struct tm has no fields to encode the time zone, so where does strftime
+    // take the time zone information that it prints? Not sure.
+    // So I decided to print +0000 manually as a string to be extra sure
+    time_t day=mt/86400, seconds=mt%86400;
+    if(seconds<0)
+    {
+        day--;
+        seconds+=86400;
+    }
+    if(dateSize==0 || day!=lastDay)
+    {
+        struct tm t;
+        auto ret=gmtime_r(&mt,&t);
+        assert(ret==&t);
+        dateSize=strftime(date,sizeof(date),"%F ",&t);
+        assert(dateSize>0);
+        lastDay=day;
+    }
+    buffer.append(date,dateSize);
+    appendTwoDigits(seconds/3600);
+    buffer+=':';
+    appendTwoDigits(seconds/60%60);
+    buffer+=':';
+    appendTwoDigits(seconds%60);
+    buffer+=" +0000";
+}
+
 //
 // class FilesystemElement
 //
@@ -66,27 +311,19 @@ CompareOpt::CompareOpt(const string& ignoreString)
 FilesystemElement::FilesystemElement()
     : ty(file_type::unknown), per(perms::unknown) {}
 
-FilesystemElement::FilesystemElement(const path& p, const path& top, ScanOpt opt)
+FilesystemElement::FilesystemElement(const path& p, const path& top, ScanOpt opt,
+                                     HashAlgorithm alg)
 #ifndef OPTIMIZE_MEMORY
     : rp(p.lexically_relative(top))
 #else //OPTIMIZE_MEMORY
     : rp(p.lexically_relative(top).string())
 #endif //OPTIMIZE_MEMORY
 {
-    auto s=ext_symlink_status(p);
-    per=s.permissions();
-    us=s.user();
-    gs=s.group();
-    mt=s.mtime();
-    ty=s.type();
-    hardLinkCnt=s.hard_link_count();
-    switch(s.type())
+    setStatus(ext_symlink_status(p));
+    switch(ty)
     {
         case file_type::regular:
-            sz=s.file_size();
-            if(opt==ScanOpt::ComputeHash) fileHash=hashFile(p);
-            break;
-        case file_type::directory:
+            if(opt==ScanOpt::ComputeHash) fileHash=hashFile(p,alg);
             break;
         case file_type::symlink:
 #ifndef OPTIMIZE_MEMORY
@@ -96,7 +333,29 @@ FilesystemElement::FilesystemElement(const path& p, const path& top, ScanOpt opt
 #endif //OPTIMIZE_MEMORY
             break;
         default:
-            ty=file_type::unknown; //We don't handle other types
+            break;
+    }
+}
+
+FilesystemElement::FilesystemElement(int dirfd, const char *name,
+    const path& dirPath, ScanOpt opt, HashAlgorithm alg)
+#ifndef OPTIMIZE_MEMORY
+    : rp(dirPath / name)
+#else //OPTIMIZE_MEMORY
+    : rp(dirPath.empty() ? string(name) : dirPath.native()+'/'+name)
+#endif //OPTIMIZE_MEMORY
+{
+    setStatus(ext_file_status(dirfd,name));
+    switch(ty)
+    {
+        case file_type::regular:
+            if(opt==ScanOpt::ComputeHash) fileHash=hashFile(dirfd,name,alg);
+            break;
+        case file_type::symlink:
+            symlink=ext_read_symlink(dirfd,name);
+            break;
+        default:
+            break;
     }
 }
 
@@ -111,8 +370,165 @@ FilesystemElement::FilesystemElement(const FilesystemElement& other,
 #endif //OPTIMIZE_MEMORY
 }
 
-void FilesystemElement::readFrom(const string& metadataLine,
-                                 const string& metadataFileName, int lineNo)
+/**
+ * Pointer based tokenizer used to parse metadata lines in place. Tokens are
+ * separated by whitespace as with operator>> of istream, and quoted strings
+ * are unquoted as std::quoted does, so metadata lines are parsed in the same
+ * way as with an istringstream, but without allocating memory
+ */
+class LineParser
+{
+public:
+    explicit LineParser(string_view line)
+        : p(line.data()), end(line.data()+line.size()) {}
+
+    /**
+     * \param result the next whitespace delimited token
+     * \return false if there are no more tokens
+     */
+    bool token(string_view& result)
+    {
+        skipSpace();
+        auto start=p;
+        while(p!=end && !isSpace(*p)) p++;
+        result=string_view(start,p-start);
+        return p!=start;
+    }
+
+    /**
+     * \param result the next token parsed as a decimal integer
+     * \return false on error
+     */
+    bool integer(off_t& result)
+    {
+        skipSpace();
+        bool negative=false;
+        if(p!=end && (*p=='-' || *p=='+')) negative=*p++=='-';
+        if(p==end || !isDigit(*p)) return false;
+        uint64_t value=0;
+        const uint64_t limit=negative ? uint64_t(numeric_limits<off_t>::max())+1
+                                      : numeric_limits<off_t>::max();
+        while(p!=end && isDigit(*p))
+        {
+            value=value*10+(*p++-'0');
+            if(value>limit) return false;
+        }
+        result=negative ? -off_t(value-1)-1 : off_t(value);
+        return true;
+    }
+
+    /**
+     * \param result the next token, unquoted if quoted
+     * \return false on error
+     */
+    bool quoted(string& result)
+    {
+        result.clear();
+        skipSpace();
+        if(p==end) return false;
+        if(*p!='"')
+        {
+            string_view t;
+            token(t);
+            result.assign(t.data(),t.size());
+            return true;
+        }
+        for(p++;;)
+        {
+            if(p==end) return false;
+            char c=*p++;
+            if(c=='\\')
+            {
+                if(p==end) return false;
+                c=*p++;
+            } else if(c=='"') return true;
+            result+=c;
+        }
+    }
+
+    /**
+     * \param result the next token parsed as a time in the fixed format
+     * "YYYY-MM-DD HH:MM:SS +0000". Only UTC is supported
+     * \return false on error
+     */
+    bool time(time_t& result)
+    {
+        skipSpace();
+        const char format[]="0000-00-00 00:00:00 +0000";
+        const size_t size=sizeof(format)-1;
+        if(size_t(end-p)<size) return false;
+        for(size_t i=0;i<size;i++)
+        {
+            if(format[i]=='0' && i<19 && isDigit(p[i])) continue;
+            if(format[i]!=p[i]) return false;
+        }
+        int year=number(p,4), month=number(p+5,2), day=number(p+8,2);
+        int hour=number(p+11,2), minute=number(p+14,2), second=number(p+17,2);
+        p+=size;
+        if(month<1 || month>12 || day<1 || day>31 || hour>23 || minute>59
+           || second>60) return false;
+        result=((daysFromCivil(year,month,day)*24+hour)*60+minute)*60+second;
+        return true;
+    }
+
+    /**
+     * \return true if the whole line has been parsed
+     */
+    bool atEnd() const { return p==end; }
+
+private:
+    static bool isSpace(char c) { return c==' ' || (c>='\t' && c<='\r'); }
+
+    static bool isDigit(char c) { return c>='0' && c<='9'; }
+
+    static int number(const char *s, int digits)
+    {
+        int result=0;
+        for(int i=0;i<digits;i++) result=result*10+(s[i]-'0');
+        return result;
+    }
+
+    /**
+     * \return the number of days since 1970-01-01 of a date, normalizing days
+     * past the end of month as timegm does
+     */
+    static int64_t daysFromCivil(int year, int month, int day)
+    {
+        year-=month<=2;
+        int era=(year>=0 ? year : year-399)/400;
+        int yoe=year-era*400;
+        int doy=(153*(month>2 ? month-3 : month+9)+2)/5+day-1;
+        int doe=yoe*365+yoe/4-yoe/100+doy;
+        return int64_t(era)*146097+doe-719468;
+    }
+
+    void skipSpace() { while(p!=end && isSpace(*p)) p++; }
+
+    const char *p, *end;
+};
+
+/**
+ * Intern a user or group name read from a metadata file. Consecutive lines
+ * usually have the same user and group, so the last name is remembered to
+ * avoid looking it up in the NameTable every time
+ * \param name name to intern
+ * \param lastName last name interned
+ * \param lastId id of the last name interned
+ * \return the id of the name
+ */
+static uint32_t internName(string_view name, string& lastName, uint32_t& lastId)
+{
+    if(name!=lastName)
+    {
+        lastName.assign(name.data(),name.size());
+        lastId=NameTable::instance().intern(lastName);
+    }
+    return lastId;
+}
+
+void FilesystemElement::readFrom(string_view metadataLine,
+                                 const string& metadataFileName, int lineNo,
+                                 HashAlgorithm alg)
 {
     auto fail=[&](const string& m)
     {
@@ -120,15 +536,14 @@ void FilesystemElement::readFrom(const string& metadataLine,
         if(metadataFileName.empty()==false) s+=": ";
         s+=m;
         if(lineNo>0) s+=" at line "+to_string(lineNo);
-        s+=", wrong line is '"+metadataLine+"'";
+        s+=", wrong line is '"+string(metadataLine)+"'";
         throw runtime_error(s);
     };
 
-    istringstream in(metadataLine);
-    string permStr;
-    in>>permStr;
-    if(!in || permStr.size()!=10) fail("Error reading permission string");
-    switch(permStr.at(0))
+    LineParser in(metadataLine);
+    string_view permStr;
+    if(!in.token(permStr) || permStr.size()!=10) fail("Error reading permission string");
+    switch(permStr[0])
     {
         case '-': ty=file_type::regular;   break;
         case 'd': ty=file_type::directory; break;
@@ -139,8 +554,7 @@ void FilesystemElement::readFrom(const string& metadataLine,
     int pe=0;
     for(int i=0;i<3;i++)
     {
-        string permTriple=permStr.substr(3*i+1,3);
-        assert(permTriple.size()==3);
+        auto permTriple=permStr.substr(3*i+1,3);
         pe<<=3;
         if(permTriple[0]=='r') pe |= 0004;
         else if(permTriple[0]!='-') fail("Permissions not correct");
@@ -150,120 +564,62 @@ void FilesystemElement::readFrom(const string& metadataLine,
         else if(permTriple[2]!='-') fail("Permissions not correct");
     }
     per=static_cast<perms>(pe);
-    in>>us>>gs;
-    if(!in) fail("Error reading user/group");
-    // Time is complicated. The format string "%F %T" always causes the stream
-    // fail bit to be set. But expanding %F as %Y-%m-%d works, go figure.
-    // Additionally, trying to add %z to parse time zone always fails. After all
-    // there's no field for the time zone in struct tm, so where exactly is
-    // get_time expected to put that data? Since time zone correction would have
-    // to be done with custom code and there may be corner cases I'm not aware
-    // of, I decided to only support UTC and check the +0000 string manually
-    struct tm t;
-    in>>get_time(&t,"%Y-%m-%d %T");
-    mt=timegm(&t);
-    if(!in || mt==-1) fail("Error reading mtime");
-    string tz;
-    tz.resize(6);
-    in.read(tz.data(),6);
-    if(!in || tz!=" +0000") fail("Error reading mtime");
-#ifdef OPTIMIZE_MEMORY
-    path temp;
-#endif //OPTIMIZE_MEMORY
+    string_view userStr, groupStr;
+    if(!in.token(userStr) || !in.token(groupStr)) fail("Error reading user/group");
+    static thread_local string lastUser, lastGroup;
+    static thread_local uint32_t lastUserId=0, lastGroupId=0;
+    us=internName(userStr,lastUser,lastUserId);
+    gs=internName(groupStr,lastGroup,lastGroupId);
+    // Only UTC time is supported, see writeTo
+    if(!in.time(mt) || mt==-1) fail("Error reading mtime");
     //Initialize type-dependent fields to default
     sz=0;
     fileHash.clear();
     symlink.clear();
+#ifndef OPTIMIZE_MEMORY
+    string temp;
+#endif //OPTIMIZE_MEMORY
     switch(ty)
     {
         case file_type::regular:
-            in>>sz;
-            if(!in) fail("Error reading size");
-            in>>fileHash;
-            if(!in) fail("Error reading hash");
-            if(fileHash=="*") fileHash.clear(); // * means omitted hash
-            else if(fileHash.size()!=40) fail("Error reading hash");
+            if(!in.integer(sz)) fail("Error reading size");
+            {
+                string_view hashStr;
+                if(!in.token(hashStr)) fail("Error reading hash");
+                if(hashStr!="*") // * means omitted hash
+                {
+                    auto h=FileHash::fromHex(hashStr);
+                    if(!h || h.value().size()!=hashSize(alg)) fail("Error reading hash");
+                    fileHash=h.value();
+                }
+            }
             break;
         case file_type::symlink:
 #ifndef OPTIMIZE_MEMORY
-            in>>symlink;
+            if(!in.quoted(temp)) fail("Error reading symlink target");
+            symlink=temp;
 #else //OPTIMIZE_MEMORY
-            in>>temp;
-            symlink=temp.string();
+            if(!in.quoted(symlink)) fail("Error reading symlink target");
 #endif //OPTIMIZE_MEMORY
-            if(!in) fail("Error reading symlink target");
+            break;
+        default:
             break;
     }
 #ifndef OPTIMIZE_MEMORY
-    in>>rp;
+    if(!in.quoted(temp)) fail("Error reading path");
+    rp=temp;
 #else //OPTIMIZE_MEMORY
-    in>>temp;
-    rp=temp.string();
+    if(!in.quoted(rp)) fail("Error reading path");
 #endif //OPTIMIZE_MEMORY
-    if(!in) fail("Error reading path");
-    if(in.get()!=EOF) fail("Extra characters at end of line");
+    if(!in.atEnd()) fail("Extra characters at end of line");
     //Initialize non-written fields to defaults
     hardLinkCnt=1;
+    ct=0;
 }
 
 void FilesystemElement::writeTo(ostream& os) const
 {
-    switch(ty)
-    {
-        case file_type::regular:   os<<'-'; break;
-        case file_type::directory: os<<'d'; break;
-        case file_type::symlink:   os<<'l'; break;
-        default:                   os<<'?'; break;
-    }
-    int pe=static_cast<int>(per);
-    os<<(pe & 0400 ? 'r' : '-')
-      <<(pe & 0200 ? 'w' : '-')
-      <<(pe & 0100 ? 'x' : '-')
-      <<(pe & 0040 ? 'r' : '-')
-      <<(pe & 0020 ? 'w' : '-')
-      <<(pe & 0010 ? 'x' : '-')
-      <<(pe & 0004 ? 'r' : '-')
-      <<(pe & 0002 ? 'w' : '-')
-      <<(pe & 0001 ? 'x' : '-');
-    os<<' '<<us<<' '<<gs<<' ';
-    // Time is complicated. The gmtime_r functions, given its name, should fill
-    // a struct tm with GMT time, but the documentation says UTC. And it's
-    // unclear how it handles leap seconds, that should be the difference
-    // between GMT and UTC. Nobody on the Internet appears to know exactly, but
-    // it appears to be OS dependent.
-    // Additionally put_time has a format string %z to print the time zone, but
-    // a struct tm has no fields to encode the time zone, so where does put_time
-    // take the time zone information that it prints? Not sure.
-    // So I decided to print +0000 manually as a string to be extra sure
-    struct tm t;
-    auto ret=gmtime_r(&mt,&t);
-    assert(ret==&t);
-    os<<put_time(&t,"%F %T +0000")<<' ';
-#ifdef OPTIMIZE_MEMORY
-    path temp;
-#endif //OPTIMIZE_MEMORY
-    switch(ty)
-    {
-        case file_type::regular:
-            //Print * instead of hash when omitted
-            if(fileHash.empty()) os<<sz<<" * ";
-            else os<<sz<<' '<<fileHash<<' ';
-            break;
-        case file_type::symlink:
-#ifndef OPTIMIZE_MEMORY
-            os<<symlink<<' ';
-#else //OPTIMIZE_MEMORY
-            temp=symlink;
-            os<<temp<<' ';
-#endif //OPTIMIZE_MEMORY
-            break;
-    }
-#ifndef OPTIMIZE_MEMORY
-    os<<rp;
-#else //OPTIMIZE_MEMORY
-    temp=rp;
-    os<<temp;
-#endif //OPTIMIZE_MEMORY
+    MetadataFormatter(os).append(*this);
 }
 
 string FilesystemElement::typeAsString() const
@@ -277,10 +633,59 @@ string FilesystemElement::typeAsString() const
     }
 }
 
-void FilesystemElement::computeHashIfNeeded(const path& top)
+/**
+ * \return the NameTable id of the name of a user. Ids are cached per thread, as
+ * ext_lookup_user() is, so that scanning threads don't take the NameTable lock
+ */
+static uint32_t userNameId(uid_t uid)
+{
+    thread_local unordered_map<uid_t,uint32_t> ids;
+    auto it=ids.find(uid);
+    if(it!=ids.end()) return it->second;
+    auto id=NameTable::instance().intern(ext_lookup_user(uid));
+    ids.emplace(uid,id);
+    return id;
+}
+
+/**
+ * \return the NameTable id of the name of a group, see userNameId()
+ */
+static uint32_t groupNameId(gid_t gid)
+{
+    thread_local unordered_map<gid_t,uint32_t> ids;
+    auto it=ids.find(gid);
+    if(it!=ids.end()) return it->second;
+    auto id=NameTable::instance().intern(ext_lookup_group(gid));
+    ids.emplace(gid,id);
+    return id;
+}
+
+void FilesystemElement::setStatus(const ext_file_status& s)
+{
+    per=s.permissions();
+    us=userNameId(s.uid());
+    gs=groupNameId(s.gid());
+    mt=s.mtime();
+    ty=s.type();
+    hardLinkCnt=s.hard_link_count();
+    ct=s.ctime();
+    switch(ty)
+    {
+        case file_type::regular:
+            sz=s.file_size();
+            break;
+        case file_type::directory:
+        case file_type::symlink:
+            break;
+        default:
+            ty=file_type::unknown; //We don't handle other types
+    }
+}
+
+void FilesystemElement::computeHashIfNeeded(const path& top, HashAlgorithm alg)
 {
     if(ty!=file_type::regular || fileHash.empty()==false) return;
-    fileHash=hashFile(top / rp);
+    fileHash=hashFile(top / rp,alg);
 }
 
 bool operator< (const FilesystemElement& a, const FilesystemElement& b)
@@ -320,206 +725,1745 @@ bool compare(const FilesystemElement& a, const FilesystemElement& b,
 // class DirectoryNode
 //
 
-list<DirectoryNode>& DirectoryNode::setDirectoryContent(list<DirectoryNode>&& content)
+bool compare(const DirectoryNode& a, const DirectoryNode& b,
+             const CompareOpt& opt)
 {
-    assert(elem.isDirectory());
-    this->content=std::move(content);
-    return this->content;
+    if(a.ty!=b.ty || a.name()!=b.name()) return false;
+    if(opt.perm    && a.per!=b.per) return false;
+    if(opt.owner   && (a.us!=b.us || a.gs!=b.gs)) return false;
+    if(opt.mtime   && a.mt!=b.mt) return false;
+    if(opt.size    && a.sz!=b.sz) return false;
+    // NOTE: either a or b may have been constructed with file hash computation
+    // omitted. Only compare hashes if both have them
+    if(opt.hash    && a.fileHash != b.fileHash
+                   && !a.fileHash.empty() && !b.fileHash.empty()) return false;
+    if(opt.symlink && a.symlinkTarget()!=b.symlinkTarget()) return false;
+    return true;
 }
 
-void DirectoryNode::removeFromDirectoryContent(const DirectoryNode& toRemove)
+//
+// class DirectoryDigest
+//
+
+bool compare(const DirectoryDigest& a, const DirectoryDigest& b,
+             const CompareOpt& opt)
 {
-    //NOTE: removing the node could invalidate the toRemove reference, so copy
-    FilesystemElement removeElem=toRemove.elem;
-    content.remove_if([&](const DirectoryNode& e){
-        return e.elem==removeElem;
-    });
+    typedef DirectoryDigest D;
+    if(a.d[D::Structure]!=b.d[D::Structure]) return false;
+    if(opt.perm    && a.d[D::Perm]!=b.d[D::Perm]) return false;
+    if(opt.owner   && a.d[D::Owner]!=b.d[D::Owner]) return false;
+    if(opt.mtime   && a.d[D::Mtime]!=b.d[D::Mtime]) return false;
+    if(opt.size    && a.d[D::Size]!=b.d[D::Size]) return false;
+    // NOTE: hashes are only compared if both files have them, so the hash
+    // digests can be compared only if all files have a hash, while they need
+    // not be compared if no file in either directory has a hash
+    if(opt.hash && a.noneHashed==false && b.noneHashed==false
+       && (a.allHashed==false || b.allHashed==false || a.d[D::Hash]!=b.d[D::Hash]))
+        return false;
+    if(opt.symlink && a.d[D::Symlink]!=b.d[D::Symlink]) return false;
+    return true;
 }
 
-DirectoryNode& DirectoryNode::addToDirectoryContent(const DirectoryNode& toAdd)
+//
+// class MetadataLogState
+//
+
+bool operator== (const MetadataLogState& a, const MetadataLogState& b)
 {
-    path newName=this->elem.relativePath() / toAdd.elem.relativePath().filename();
-    for(auto& n : this->content) assert(n.elem.relativePath()!=newName);
-    auto& result=recursiveAdd(*this,toAdd);
-    content.sort(); //Keep content sorted
-    return result;
+    return a.valid && b.valid && a.baseDigest==b.baseDigest
+        && a.baseSize==b.baseSize && a.logSize==b.logSize
+        && a.logDigest==b.logDigest;
 }
 
-void DirectoryNode::computeMissingHashes(const std::filesystem::path& top)
+/**
+ * Add a value to a directory digest field
+ */
+static void digestAdd(uint64_t& digest, uint64_t x)
 {
-    elem.computeHashIfNeeded(top);
-    for(auto& n : content) n.computeMissingHashes(top);
+    //The splitmix64 finalizer, applied both to the value and to the digest so
+    //that the digest depends on the order of the values
+    auto mix=[](uint64_t x)
+    {
+        x^=x>>30;
+        x*=0xbf58476d1ce4e5b9ull;
+        x^=x>>27;
+        x*=0x94d049bb133111ebull;
+        x^=x>>31;
+        return x;
+    };
+    digest=mix(digest ^ mix(x+0x9e3779b97f4a7c15ull));
 }
 
-DirectoryNode& DirectoryNode::recursiveAdd(DirectoryNode& dst, const DirectoryNode& src)
+/**
+ * \return the digest of a string, independent of the byte order of the machine
+ */
+static uint64_t stringDigest(string_view s)
 {
-    assert(dst.elem.isDirectory());
-    path name=src.elem.relativePath().filename();
-    assert(name.empty()==false);
-    // Assign to the copied node the source element with fixed path
-    DirectoryNode newNode(FilesystemElement(src.elem,dst.elem.relativePath() / name));
-    for(auto& n : src.content) recursiveAdd(newNode,n);
-    newNode.content.sort(); //Keep content sorted
-    // Move the node in the destination directory and return a reference to it
-    dst.content.push_back(std::move(newNode));
-    return dst.content.back();
+    uint64_t result=s.size();
+    for(size_t i=0;i<s.size();i+=8)
+    {
+        uint64_t x=0;
+        for(size_t j=0;j<8 && i+j<s.size();j++)
+            x|=uint64_t(static_cast<unsigned char>(s[i+j]))<<(8*j);
+        digestAdd(result,x);
+    }
+    return result;
 }
 
 //
-// class DirectoryTree
+// class StringPool
 //
 
-void DirectoryTree::scanDirectory(const path& topPath, ScanOpt opt)
+string_view StringPool::add(string_view s, string_view s2)
 {
-    clear();
-    this->opt=opt;
-    this->topPath=absolute(topPath);
-    if(!is_directory(this->topPath.value()))
-        throw logic_error(topPath.string()+" is not a directory");
-    recursiveBuildFromPath(""); //Top level directory has empty relative path
+    size_t size=s.size()+s2.size();
+    if(size==0) return "";
+    if(size>chunkSize-used)
+    {
+        //Strings larger than a chunk get a chunk of their own
+        chunks.push_back(unique_ptr<char[]>(new char[max(chunkSize,size)]));
+        used=0;
+    }
+    char *result=chunks.back().get()+used;
+    memcpy(result,s.data(),s.size());
+    memcpy(result+s.size(),s2.data(),s2.size());
+    used=size>chunkSize ? chunkSize : used+size;
+    return string_view(result,size);
 }
 
-void DirectoryTree::readFrom(const path& metadataFile)
+void StringPool::clear()
 {
-    clear();
-    ifstream in(metadataFile);
-    if(!in) throw runtime_error(string("file not found: ")+metadataFile.string());
-    readFrom(in,metadataFile.string());
+    chunks.clear();
+    used=chunkSize;
 }
 
-void DirectoryTree::readFrom(istream& is, const string& metadataFileName)
+//
+// class HashCache
+//
+
+/**
+ * FNV-1a hash, used to assign files to rehash slots. Unlike std::hash it is
+ * guaranteed to be the same across runs and standard library implementations
+ */
+static uint32_t fnv1a(const string& s)
+{
+    uint32_t result=2166136261u;
+    for(unsigned char c : s)
+    {
+        result^=c;
+        result*=16777619u;
+    }
+    return result;
+}
+
+HashCache::HashCache(const DirectoryTree& meta1, const DirectoryTree& meta2,
+                     time_t trustedBefore, unsigned rehashPeriod, unsigned run)
+    : meta1(meta1), meta2(meta2), trustedBefore(trustedBefore),
+      rehashPeriod(max(1u,rehashPeriod)), rehashSlot(run % max(1u,rehashPeriod)) {}
+
+FileHash HashCache::lookup(const FilesystemElement& e) const
+{
+    assert(e.type()==file_type::regular);
+    if(e.changeTime()>=trustedBefore) return {}; //Changed, or too close to tell
+    string rp=e.relativePath().string();
+    if(fnv1a(rp) % rehashPeriod==rehashSlot) return {}; //Time to check it again
+    auto m1=meta1.getIndex().find(rp);
+    if(!m1 || m1->type()!=file_type::regular) return {};
+    if(m1->size()!=e.size() || m1->mtime()!=e.mtime()) return {};
+    auto m2=meta2.getIndex().find(rp);
+    if(!m2 || compare(*m1,*m2,CompareOpt())==false) return {};
+    return m1->hash();
+}
+
+//
+// class ContentIndex
+//
+
+void ContentIndex::add(off_t size, const FileHash& hash, const path& relativePath)
+{
+    if(hash.empty()) return;
+    files[size].emplace_back(hash,relativePath);
+    count++;
+}
+
+const path *ContentIndex::find(off_t size, const FileHash& hash) const
+{
+    auto it=files.find(size);
+    if(it==files.end()) return nullptr;
+    for(auto& f : it->second) if(f.first==hash) return &f.second;
+    return nullptr;
+}
+
+//
+// class DirectoryIndex
+//
+
+const DirectoryNode *DirectoryIndex::find(const path& p) const
+{
+    if(p.empty()) return nullptr;
+    auto index=tree.findIndex(p);
+    if(index==DirectoryTree::notFound) return nullptr;
+    return &tree.nodes[index];
+}
+
+size_t DirectoryIndex::size() const
+{
+    return tree.size();
+}
+
+//
+// class NameOrderCursor
+//
+
+/**
+ * Iterates over the content of a directory in name order. Directory content is
+ * sorted with directories first, so this merges the directories with the other
+ * files without allocating memory, allowing diffs to match nodes by name also
+ * when a directory has been replaced by a file or vice versa
+ */
+class NameOrderCursor
+{
+public:
+    explicit NameOrderCursor(DirectoryContent content)
+        : d(content.begin()), e(content.end())
+    {
+        dirEnd=f=partition_point(content.begin(),content.end(),
+            [](const DirectoryNode& n){ return n.isDirectory(); });
+    }
+
+    /**
+     * \return the current node, or nullptr if at the end
+     */
+    const DirectoryNode *get() const
+    {
+        if(d==dirEnd) return f==e ? nullptr : &*f;
+        if(f==e || d->name()<f->name()) return &*d;
+        return &*f;
+    }
+
+    /**
+     * \param name name of a node
+     * \return the current node if it has the given name, nullptr otherwise
+     */
+    const DirectoryNode *get(string_view name) const
+    {
+        auto result=get();
+        return result && result->name()==name ? result : nullptr;
+    }
+
+    /**
+     * Move to the next node
+     */
+    void next()
+    {
+        if(d!=dirEnd && (f==e || d->name()<f->name())) ++d; else ++f;
+    }
+
+private:
+    DirectoryContent::const_iterator d, dirEnd, f, e;
+};
+
+//
+// Binary metadata format
+//
+
+// A binary metadata file is made of
+// - a header: the magic bytes "DDMB", a version byte, the hash algorithm
+//   (0 SHA1, 1 BLAKE3) and two reserved bytes, set to 0
+// - the directory blocks, in breadth first order with the top level directory
+//   first, so the blocks of the subdirectories of a directory are consecutive
+// - the name table, with the user and group names
+// - the block table, with the offset of every block from the start of file
+// - a trailer with the offsets of the name table and of the block table, as
+//   64 bit little endian integers
+// Blocks and tables are sections made of a 32 bit little endian payload size,
+// the CRC-32 of the payload and the payload itself.
+// The payload of a directory block is the index of the block of its first
+// subdirectory and the number of entries, followed by the entries sorted as
+// in DirectoryNode, with directories first. Every entry is
+// - a flags byte, with the file type in the low bits and a bit set if a
+//   regular file has a hash
+// - the permissions, the user and group as indices into the name table, the
+//   zigzag encoded mtime and the sizes of the name and symlink target, then
+//   the name followed by the symlink target
+// - for regular files the size, followed by the raw hash if present
+// Integers are varints unless specified otherwise. The name table payload is
+// the number of names followed by the size and characters of every name. The
+// block table payload has a record for every block, so that the content of a
+// directory can be found without decoding the blocks that come before it, with
+// - the 64 bit offset and the 32 bit number of entries of the block
+// - 32 bit flags, bit 0 and 1 are the allHashed and noneHashed fields of the
+//   DirectoryDigest of the directory, the other bits are reserved, set to 0
+// - the 64 bit digests of the directory, in DirectoryDigest::Field order
+// all little endian.
+
+static const char binaryMagic[]="DDMB";
+static const size_t binaryHeaderSize=8;
+static const size_t binaryTrailerSize=16;
+static const unsigned char binaryVersion=1;
+static const unsigned char binaryHasHash=0x80;
+static const size_t binaryBlockRecordSize=16+8*DirectoryDigest::NumFields;
+
+/**
+ * \return true if data is the content of a metadata file in the binary format
+ */
+static bool isBinaryMetadata(string_view data)
+{
+    return data.substr(0,4)==string_view(binaryMagic,4);
+}
+
+/**
+ * \param header header of a metadata file in the binary format
+ * \return the hash algorithm of the metadata file
+ * \throws runtime_error if the header is not valid
+ */
+static HashAlgorithm binaryHashAlgorithm(string_view header)
+{
+    if(header.size()<binaryHeaderSize || header[4]!=binaryVersion)
+        throw runtime_error("unsupported binary metadata version");
+    switch(header[5])
+    {
+        case 0: return HashAlgorithm::SHA1;
+        case 1: return HashAlgorithm::BLAKE3;
+    }
+    throw runtime_error("unsupported hash algorithm");
+}
+
+/**
+ * \return the file type as stored in binary metadata files, where types
+ * other than regular files, directories and symlinks are stored as unknown
+ */
+static unsigned char binaryFileType(file_type ty)
+{
+    switch(ty)
+    {
+        case file_type::regular:   return 0;
+        case file_type::directory: return 1;
+        case file_type::symlink:   return 2;
+        default:                   return 3;
+    }
+}
+
+/**
+ * Encodes the binary metadata format
+ */
+class BinaryEncoder
+{
+public:
+    explicit BinaryEncoder(string& s) : s(s) {}
+
+    void varint(uint64_t x)
+    {
+        while(x>=0x80)
+        {
+            s+=static_cast<char>(x | 0x80);
+            x>>=7;
+        }
+        s+=static_cast<char>(x);
+    }
+
+    void zigzag(int64_t x) { varint((uint64_t(x)<<1) ^ uint64_t(x>>63)); }
+
+    void fixed(uint64_t x, int bytes)
+    {
+        for(int i=0;i<bytes;i++) s+=static_cast<char>(x>>(8*i));
+    }
+
+    void bytes(const void *data, size_t size)
+    {
+        s.append(static_cast<const char*>(data),size);
+    }
+
+private:
+    string& s;
+};
+
+/**
+ * Decodes the binary metadata format, checking bounds
+ */
+class BinaryDecoder
+{
+public:
+    explicit BinaryDecoder(string_view data) : data(data) {}
+
+    bool varint(uint64_t& x)
+    {
+        x=0;
+        for(int shift=0;shift<64;shift+=7)
+        {
+            if(data.empty()) return false;
+            unsigned char c=data.front();
+            data.remove_prefix(1);
+            x|=uint64_t(c & 0x7f)<<shift;
+            if((c & 0x80)==0) return true;
+        }
+        return false;
+    }
+
+    bool zigzag(int64_t& x)
+    {
+        uint64_t u;
+        if(!varint(u)) return false;
+        x=int64_t(u>>1) ^ -int64_t(u & 1);
+        return true;
+    }
+
+    bool fixed(uint64_t& x, int bytes)
+    {
+        if(data.size()<size_t(bytes)) return false;
+        x=0;
+        for(int i=0;i<bytes;i++) x|=uint64_t(static_cast<unsigned char>(data[i]))<<(8*i);
+        data.remove_prefix(bytes);
+        return true;
+    }
+
+    bool bytes(string_view& result, uint64_t size)
+    {
+        if(data.size()<size) return false;
+        result=data.substr(0,size);
+        data.remove_prefix(size);
+        return true;
+    }
+
+    bool atEnd() const { return data.empty(); }
+
+private:
+    string_view data;
+};
+
+/**
+ * Append a section of the binary format
+ * \param os where to write
+ * \param payload section payload
+ */
+static void writeSection(ostream& os, const string& payload)
+{
+    string header;
+    BinaryEncoder e(header);
+    e.fixed(payload.size(),4);
+    e.fixed(crc32(payload.data(),payload.size()),4);
+    os.write(header.data(),header.size());
+    os.write(payload.data(),payload.size());
+}
+
+/**
+ * \param data content of the metadata file
+ * \param offset offset of the section
+ * \param payload the section payload
+ * \return false if the section is truncated or its checksum does not match
+ */
+static bool readSection(string_view data, uint64_t offset, string_view& payload)
+{
+    if(offset>data.size()) return false;
+    BinaryDecoder d(data.substr(offset));
+    uint64_t size, crc;
+    if(!d.fixed(size,4) || !d.fixed(crc,4) || !d.bytes(payload,size)) return false;
+    return crc32(payload.data(),payload.size())==crc;
+}
+
+//
+// class DirectoryTree
+//
+
+void DirectoryTree::scanDirectory(const path& topPath, ScanOpt opt)
+{
+    clear();
+    this->opt=opt;
+    this->topPath=absolute(topPath);
+    if(!is_directory(this->topPath.value()))
+        throw logic_error(topPath.string()+" is not a directory");
+    ext_directory top(AT_FDCWD,this->topPath.value());
+    //Top level directory has empty path
+    if(jobs==1) recursiveBuildFromPath(top.fd(),"",0);
+    else {
+        //Every directory is listed by a separate task, that queues a task for
+        //each of its subdirectories and, if hashes are needed, for each regular
+        //file. Tasks refer to nodes by index, which never changes while scanning
+        //as nodes are only appended to the arena, and access the arena only
+        //holding the scan mutex, so the rest of the walk can continue meanwhile
+        ThreadPool pool(jobs);
+        mutex m;
+        scanPool=&pool;
+        scanMutex=&m;
+        pool.submit([this,topfd=top.fd()]{ recursiveBuildFromPath(topfd,"",0); });
+        try {
+            pool.wait();
+        } catch(...) {
+            scanPool=nullptr;
+            scanMutex=nullptr;
+            throw;
+        }
+        scanPool=nullptr;
+        scanMutex=nullptr;
+    }
+    digests=computeDigests(false);
+    hasDigests=true;
+}
+
+void DirectoryTree::scanDirectoryTo(const path& topPath, ostream& os, ScanOpt opt)
+{
+    clear();
+    this->opt=opt;
+    path top=absolute(topPath);
+    if(!is_directory(top))
+        throw logic_error(topPath.string()+" is not a directory");
+    ext_directory topDir(AT_FDCWD,top);
+    optional<ThreadPool> pool;
+    if(jobs!=1) pool.emplace(jobs);
+    MetadataFormatter f(os);
+    formatter=&f;
+    printBreak=false;
+    if(hashAlg!=HashAlgorithm::SHA1)
+        f.append("# hash "+hashAlgorithmName(hashAlg)+'\n');
+    try {
+        recursiveScanTo(topDir.fd(),"",pool ? &pool.value() : nullptr);
+    } catch(...) {
+        formatter=nullptr;
+        throw;
+    }
+    formatter=nullptr;
+}
+
+void DirectoryTree::rescanDirectory(const path& relativePath, ScanOpt opt)
+{
+    checkTopPath("rescanDirectory");
+    loadAll();
+    discardDigests();
+    uint32_t dir=relativePath.empty() ? 0 : searchIndex(relativePath,"rescanDirectory");
+    if(nodes[dir].isDirectory()==false)
+        throw runtime_error(string("rescanDirectory: ")+relativePath.string()
+            +" is not a directory");
+    if(dir!=0)
+    {
+        FilesystemElement e(topPath.value() / relativePath,topPath.value(),opt,hashAlg);
+        if(e.isDirectory()==false)
+            throw runtime_error(string("rescanDirectory: ")+relativePath.string()
+                +" is no longer a directory");
+        markChanged(nodes[dir].parent);
+        auto& n=nodes[dir];
+        n.per=static_cast<uint16_t>(e.per);
+        n.us=e.us;
+        n.gs=e.gs;
+        n.mt=e.mt;
+    }
+
+    this->opt=opt;
+    ext_directory top(AT_FDCWD,topPath.value());
+    vector<FilesystemElement> elements;
+    {
+        ext_directory d(top.fd(),relativePath);
+        for(auto& name : d.entries())
+            elements.push_back(FilesystemElement(d.fd(),name.c_str(),
+                                                 relativePath,opt,hashAlg));
+    }
+    sort(elements.begin(),elements.end());
+    replaceDirectoryContent(dir,elements,elements.size(),
+        [&](uint32_t index, const FilesystemElement& e){
+            recursiveBuildFromPath(top.fd(),e.relativePath(),index);
+            markSubtreeChanged(index);
+        });
+}
+
+/**
+ * Release the pages of a memory mapped metadata file that have been parsed,
+ * or they would add up to the memory used by the tree till the end of parsing.
+ * Pages are released in large chunks, to reduce the number of system calls
+ * \param released start of the pages still mapped, updated
+ * \param parsed data before this pointer has been parsed
+ */
+static void releaseParsedPages(const char *& released, const char *parsed)
+{
+    const size_t releaseSize=16*1024*1024; //Multiple of the page size
+    if(parsed-released<ptrdiff_t(releaseSize)) return;
+    madvise(const_cast<char*>(released),releaseSize,MADV_DONTNEED);
+    released+=releaseSize;
+}
+
+/**
+ * \param line header line of a metadata file
+ * \return the hash algorithm of the header
+ * \throws runtime_error if the header is not valid
+ */
+static HashAlgorithm hashAlgorithmFromHeader(string_view line)
+{
+    const string_view header="# hash ";
+    if(line.substr(0,header.size())!=header)
+        throw runtime_error("unrecognized header");
+    return hashAlgorithmFromName(string(line.substr(header.size())));
+}
+
+HashAlgorithm DirectoryTree::readHashAlgorithm(const path& metadataFile)
+{
+    ifstream in(metadataFile);
+    if(!in) throw runtime_error(string("file not found: ")+metadataFile.string());
+    char header[binaryHeaderSize];
+    in.read(header,sizeof(header));
+    if(in && isBinaryMetadata(string_view(header,sizeof(header))))
+        return binaryHashAlgorithm(string_view(header,sizeof(header)));
+    in.clear();
+    in.seekg(0);
+    if(in.peek()!='#') return HashAlgorithm::SHA1;
+    string line;
+    getline(in,line);
+    return hashAlgorithmFromHeader(line);
+}
+
+/**
+ * Sync a file or directory to disk
+ * \param p path of the file or directory
+ * \throws runtime_error in case of errors
+ */
+static void syncPath(const path& p)
+{
+    //The descriptor of an ofstream is not accessible, but syncing any
+    //descriptor of a file syncs its data
+    int fd=open(p.c_str(),O_RDONLY | O_CLOEXEC);
+    if(fd<0) throw runtime_error(string("error syncing ")+p.string());
+    int result=fsync(fd);
+    close(fd);
+    if(result!=0) throw runtime_error(string("error syncing ")+p.string());
+}
+
+/**
+ * \return the directory containing a file, to be synced after renaming it
+ */
+static path parentDirectory(const path& p)
+{
+    auto result=p.parent_path();
+    return result.empty() ? path(".") : result;
+}
+
+/**
+ * Replace a file atomically, by writing a temporary file that is renamed over
+ * the file once synced to disk. The directory is not synced
+ * \param p path of the file
+ * \param write called to write the content of the file
+ * \throws runtime_error in case of errors
+ */
+static void replaceFile(const path& p, const function<void (ostream&)>& write)
+{
+    path temp=p;
+    temp+=".tmp";
+    {
+        ofstream out(temp);
+        if(!out) throw runtime_error(string("could not open for writing: ")+temp.string());
+        write(out);
+        out.close();
+        if(!out) throw runtime_error(string("error writing ")+temp.string());
+    }
+    syncPath(temp);
+    rename(temp,p);
+}
+
+/**
+ * Append to a file and sync it to disk
+ * \param p path of the file
+ * \param offset where to append, any content after it is discarded
+ * \param data data to append
+ * \throws runtime_error in case of errors
+ */
+static void appendToFile(const path& p, uint64_t offset, string_view data)
+{
+    int fd=open(p.c_str(),O_WRONLY | O_CLOEXEC);
+    if(fd<0) throw runtime_error(string("could not open for writing: ")+p.string());
+    unique_ptr<int,void (*)(int*)> guard(&fd,[](int *fd){ close(*fd); });
+    if(ftruncate(fd,offset)!=0) throw runtime_error(string("error writing ")+p.string());
+    while(data.empty()==false)
+    {
+        auto written=pwrite(fd,data.data(),data.size(),offset);
+        if(written<0 && errno==EINTR) continue;
+        if(written<=0) throw runtime_error(string("error writing ")+p.string());
+        data.remove_prefix(written);
+        offset+=written;
+    }
+    if(fsync(fd)!=0) throw runtime_error(string("error syncing ")+p.string());
+}
+
+/// First line of logs, followed by the digest of the metadata file
+static const string_view logHeader="# log ";
+/// Line ending the records of a commit in logs
+static const string_view logCommit="# commit";
+
+void DirectoryTree::readFrom(const path& metadataFile)
+{
+    clear();
+    string name=metadataFile.string();
+    int fd=open(name.c_str(),O_RDONLY | O_CLOEXEC);
+    if(fd<0) throw runtime_error(string("file not found: ")+name);
+    unique_ptr<int,void (*)(int*)> guard(&fd,[](int *fd){ close(*fd); });
+    struct stat st;
+    if(fstat(fd,&st)!=0) throw runtime_error(string("error reading ")+name);
+    if(S_ISREG(st.st_mode)==false)
+    {
+        //Pipes and the like can't be mapped
+        ifstream in(metadataFile);
+        if(!in) throw runtime_error(string("file not found: ")+name);
+        readFrom(in,name);
+        return;
+    }
+    if(st.st_size==0) parseMetadata("",name);
+    else {
+        void *data=mmap(nullptr,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if(data==MAP_FAILED) throw runtime_error(string("error reading ")+name);
+        size_t size=st.st_size;
+        shared_ptr<const void> mapping(data,[size](const void *data){
+            munmap(const_cast<void*>(data),size);
+        });
+        madvise(data,size,MADV_SEQUENTIAL);
+        parseMetadata(string_view(static_cast<const char*>(data),size),name,mapping);
+    }
+    path logFile=logPath(metadataFile);
+    error_code ec;
+    if(exists(logFile,ec)==false) return;
+    ifstream in(logFile);
+    if(!in) throw runtime_error(string("error reading ")+logFile.string());
+    string log(istreambuf_iterator<char>(in),{});
+    replayLog(log,logFile.string());
+    logState.baseSize=st.st_size;
+}
+
+void DirectoryTree::replayLog(string_view log, const string& logFileName)
+{
+    int lineNo=0;
+    auto fail=[&logFileName,&lineNo](const string& m)
+    {
+        throw runtime_error(logFileName+": "+m+" at line "+to_string(lineNo));
+    };
+    auto nextLine=[&log](string_view& line)
+    {
+        if(log.empty()) return false;
+        auto newline=log.find('\n');
+        //A last line without newline was not completely written
+        if(newline==string_view::npos) return false;
+        line=log.substr(0,newline);
+        log.remove_prefix(newline+1);
+        return true;
+    };
+    string_view all=log, line;
+    lineNo++;
+    if(nextLine(line)==false || line.substr(0,logHeader.size())!=logHeader)
+        fail("unrecognized header");
+    string digestStr(line.substr(logHeader.size()));
+    char *end;
+    uint64_t digest=strtoull(digestStr.c_str(),&end,16);
+    if(digestStr.empty() || *end!='\0') fail("unrecognized header");
+    //Records after the last commit line were not completely written
+    size_t headerSize=line.size()+1;
+    string commit=string("\n")+string(logCommit)+'\n';
+    auto last=all.rfind(commit);
+    size_t committed=last==string_view::npos ? headerSize : last+commit.size();
+    log=all.substr(headerSize,committed-headerSize);
+    MetadataLogState state;
+    state.valid=true;
+    state.baseDigest=digest;
+    state.logSize=headerSize+log.size();
+    state.logDigest=stringDigest(log);
+    if(log.empty())
+    {
+        //Checking the digest needs the whole tree, unless it is stored in the
+        //metadata file, and without records it is only needed if the tree is
+        //modified, so it is checked then
+        logState=state;
+        logVerified=false;
+        return;
+    }
+    if(readDigest()!=digest)
+    {
+        //The metadata file was written in full, but the log not yet replaced
+        warningCallback(string("Warning: ignoring ")+logFileName
+            +", as it is for a previous version of the metadata file");
+        return;
+    }
+    loadAll();
+    discardDigests();
+
+    auto parentOf=[](string_view rp)
+    {
+        auto slash=rp.rfind('/');
+        return slash==string_view::npos ? string_view() : rp.substr(0,slash);
+    };
+    //Each record replaces the content of a directory
+    optional<string> dirPath;
+    vector<FilesystemElement> elements;
+    uint32_t count=0;
+    auto apply=[&]{
+        if(!dirPath) return;
+        uint32_t dir=dirPath->empty() ? 0 : findIndex(*dirPath);
+        if(dir==notFound || nodes[dir].isDirectory()==false)
+            fail("record for directory not in metadata file");
+        auto begin=elements.begin(), end=begin+count;
+        if(is_sorted(begin,end)==false) sort(begin,end);
+        replaceDirectoryContent(dir,elements,count,nullptr);
+        dirPath.reset();
+        count=0;
+    };
+    while(nextLine(line))
+    {
+        lineNo++;
+        if(line==logCommit) apply();
+        else if(line.substr(0,2)=="> ") {
+            apply();
+            LineParser in(line.substr(2));
+            dirPath.emplace();
+            if(!in.quoted(*dirPath) || !in.atEnd()) fail("Error reading path");
+        } else {
+            if(!dirPath) fail("entry not preceded by directory");
+            if(count==elements.size()) elements.emplace_back();
+            elements[count++].readFrom(line,logFileName,lineNo,hashAlg);
+            if(parentOf(elements[count-1].rpView())!=*dirPath)
+                fail("entry not in directory");
+        }
+    }
+    apply();
+    logState=state;
+    logVerified=true;
+}
+
+void DirectoryTree::readFrom(istream& is, const string& metadataFileName)
+{
+    clear();
+    string data(istreambuf_iterator<char>(is),{});
+    parseMetadata(data,metadataFileName);
+}
+
+void DirectoryTree::parseMetadata(string_view data, const string& metadataFileName,
+                                  shared_ptr<const void> mapping)
+{
+    if(isBinaryMetadata(data))
+    {
+        parseBinaryMetadata(data,metadataFileName,mapping);
+        return;
+    }
+    format=MetadataFormat::Text;
+    int lineNo=0;
+    //Elements are reused from one directory to the next, so that their
+    //strings keep the memory allocated for the previous ones
+    vector<FilesystemElement> elements;
+    uint32_t count=0;
+    bool first=true;
+    
+    auto fail=[&metadataFileName,&lineNo](const string& m)
+    {
+        string s=metadataFileName;
+        if(metadataFileName.empty()==false) s+=": ";
+        s+=m+" before line "+to_string(lineNo);
+        throw runtime_error(s);
+    };
+
+    auto parentOf=[](string_view rp)
+    {
+        auto slash=rp.rfind('/');
+        return slash==string_view::npos ? string_view() : rp.substr(0,slash);
+    };
+    
+    auto add=[&](){
+        if(count==0) return;
+        string_view p=parentOf(elements.front().rpView());
+        for(uint32_t i=0;i<count;i++)
+            if(p!=parentOf(elements[i].rpView())) fail("different paths grouped");
+        uint32_t dir=0;
+        if(first)
+        {
+            if(p.empty()==false) fail("file does not start with top level directory");
+            first=false;
+        } else {
+            dir=p.empty() ? notFound : findIndex(path(p));
+            if(dir==notFound || nodes[dir].isDirectory()==false)
+                fail("directory content not preceded by index insert");
+            if(nodes[dir].count>0) fail("duplicate noncontiguous directory content");
+        }
+        uint32_t firstIndex=mergeDirectoryContent(dir,elements.data(),count);
+        //Metadata files written by ddm are already sorted, otherwise sort the
+        //nodes in place, they have no content yet
+        auto begin=nodes.begin()+firstIndex, end=begin+count;
+        auto byTypeAndName=[](const DirectoryNode& a, const DirectoryNode& b)
+        {
+            if(a.isDirectory()==b.isDirectory()) return a.name()<b.name();
+            return a.isDirectory() > b.isDirectory();
+        };
+        if(is_sorted(begin,end,byTypeAndName)==false) sort(begin,end,byTypeAndName);
+        //Names must be unique also between directories and other files
+        NameOrderCursor cursor(getDirectoryContent(nodes[dir]));
+        string_view last;
+        for(uint32_t i=0;i<count;i++,cursor.next())
+        {
+            auto name=cursor.get()->name();
+            if(i>0 && name==last) fail("index insert failed (duplicate?)");
+            last=name;
+        }
+        count=0;
+    };
+
+    const char *released=data.data();
+    auto nextLine=[&](string_view& line)
+    {
+        if(mapping) releaseParsedPages(released,data.data());
+        if(data.empty()) return false;
+        auto newline=data.find('\n');
+        if(newline==string_view::npos) newline=data.size();
+        line=data.substr(0,newline);
+        data.remove_prefix(min(newline+1,data.size()));
+        return true;
+    };
+
+    //Metadata files with hash algorithms other than SHA1 start with a header
+    //line, so that files written before the header was introduced can be read
+    hashAlg=HashAlgorithm::SHA1;
+    string_view line;
+    if(data.empty()==false && data.front()=='#')
+    {
+        lineNo++;
+        nextLine(line);
+        try {
+            hashAlg=hashAlgorithmFromHeader(line);
+        } catch(exception& e) {
+            fail(e.what());
+        }
+    }
+    while(nextLine(line))
+    {
+        lineNo++;
+        if(line.empty()) add();
+        else {
+            if(count==elements.size()) elements.emplace_back();
+            elements[count++].readFrom(line,metadataFileName,lineNo,hashAlg);
+        }
+    }
+    add();
+}
+
+void DirectoryTree::writeTo(const path& metadataFile) const
+{
+    loadAll(); //The metadata file may be the one the tree is loaded from
+    //A crash leaves either the old or the new content, and the log of the old
+    //content is ignored if it is not removed, see replayLog()
+    replaceFile(metadataFile,[this](ostream& os){ writeTo(os); });
+    error_code ec;
+    remove(logPath(metadataFile),ec);
+    syncPath(parentDirectory(metadataFile));
+}
+
+uint64_t DirectoryTree::commitTo(const path& metadataFile,
+    const MetadataLogState& fileState, double maxLogRatio) const
+{
+    path logFile=logPath(metadataFile);
+    //If the tree was not modified, a log without records was not checked yet
+    if(logState.valid && fileState==logState &&
+       (logVerified || readDigest()==logState.baseDigest))
+    {
+        ostringstream os;
+        {
+            MetadataFormatter f(os);
+            //Parent directories are sorted before their subdirectories, and
+            //directories no longer in the tree are in the record of their parent
+            for(auto& p : changedDirs)
+            {
+                uint32_t dir=p.empty() ? 0 : findIndex(p);
+                if(dir==notFound || nodes[dir].isDirectory()==false) continue;
+                f.append("> ");
+                f.appendPath(p);
+                f.append('\n');
+                for(auto& n : getDirectoryContent(nodes[dir]))
+                {
+                    f.append(n,p);
+                    f.append('\n');
+                }
+            }
+            f.append(logCommit);
+            f.append('\n');
+        }
+        string records=os.str();
+        if(logState.logSize+records.size()<=maxLogRatio*logState.baseSize)
+        {
+            appendToFile(logFile,logState.logSize,records);
+            return records.size();
+        }
+    }
+    writeTo(metadataFile);
+    string header=string(logHeader);
+    char digest[17];
+    snprintf(digest,sizeof(digest),"%016llx",
+             static_cast<unsigned long long>(metadataDigest()));
+    header+=digest;
+    header+='\n';
+    replaceFile(logFile,[&header](ostream& os){ os<<header; });
+    syncPath(parentDirectory(metadataFile));
+    return file_size(metadataFile)+header.size();
+}
+
+void DirectoryTree::writeTo(ostream& os) const
+{
+    if(format==MetadataFormat::Binary)
+    {
+        writeBinary(os);
+        return;
+    }
+    MetadataFormatter f(os);
+    formatter=&f;
+    printBreak=false;
+    if(hashAlg!=HashAlgorithm::SHA1)
+        f.append("# hash "+hashAlgorithmName(hashAlg)+'\n');
+    string dirPath;
+    recursiveWrite(getTreeRoot(),dirPath);
+    formatter=nullptr;
+}
+
+void DirectoryTree::writeBinary(ostream& os) const
+{
+    string s;
+    //The users and groups of the tree are given consecutive indices
+    vector<uint32_t> nameIndex;
+    vector<uint32_t> names;
+    auto nameToIndex=[&](uint32_t id)
+    {
+        if(id>=nameIndex.size()) nameIndex.resize(id+1,uint32_t(notFound));
+        if(nameIndex[id]==notFound)
+        {
+            nameIndex[id]=names.size();
+            names.push_back(id);
+        }
+        return nameIndex[id];
+    };
+    BinaryEncoder header(s);
+    header.bytes(binaryMagic,4);
+    header.fixed(binaryVersion,1);
+    header.fixed(hashAlg==HashAlgorithm::SHA1 ? 0 : 1,1);
+    header.fixed(0,2);
+    os.write(s.data(),s.size());
+    uint64_t offset=s.size();
+    auto digestTable=computeDigests(true);
+    vector<pair<uint64_t,const DirectoryNode*>> blockOffsets;
+    //With breadth first order, the blocks of the subdirectories of a directory
+    //follow the blocks of the directories already queued
+    deque<const DirectoryNode*> queue={&getTreeRoot()};
+    uint32_t blocks=1;
+    while(queue.empty()==false)
+    {
+        auto dir=queue.front();
+        queue.pop_front();
+        auto content=getDirectoryContent(*dir);
+        s.clear();
+        BinaryEncoder e(s);
+        e.varint(blocks);
+        e.varint(dir->count);
+        for(auto& n : content)
+        {
+            unsigned char flags=binaryFileType(n.ty);
+            if(n.ty==file_type::regular && n.fileHash.empty()==false)
+                flags|=binaryHasHash;
+            e.fixed(flags,1);
+            //Like the text format, only the rwxrwxrwx bits are stored
+            e.varint(n.per & 0777);
+            e.varint(nameToIndex(n.us));
+            e.varint(nameToIndex(n.gs));
+            e.zigzag(n.mt);
+            e.varint(n.nameLen);
+            e.varint(n.ty==file_type::symlink ? n.symlinkLen : 0);
+            e.bytes(n.nm,n.nameLen+(n.ty==file_type::symlink ? n.symlinkLen : 0));
+            if(n.ty==file_type::regular)
+            {
+                e.varint(n.sz);
+                if(flags & binaryHasHash) e.bytes(n.fileHash.data(),n.fileHash.size());
+            }
+            if(n.isDirectory())
+            {
+                queue.push_back(&n);
+                blocks++;
+            }
+        }
+        blockOffsets.push_back({offset,dir});
+        writeSection(os,s);
+        offset+=8+s.size();
+    }
+    uint64_t namesOffset=offset;
+    s.clear();
+    BinaryEncoder ne(s);
+    ne.varint(names.size());
+    for(auto id : names)
+    {
+        auto& name=NameTable::instance().name(id);
+        ne.varint(name.size());
+        ne.bytes(name.data(),name.size());
+    }
+    writeSection(os,s);
+    offset+=8+s.size();
+    uint64_t tableOffset=offset;
+    s.clear();
+    BinaryEncoder te(s);
+    for(auto o : blockOffsets)
+    {
+        te.fixed(o.first,8);
+        te.fixed(o.second->count,4);
+        auto& digest=findDigest(digestTable,*o.second);
+        te.fixed((digest.allHashed ? 1 : 0) | (digest.noneHashed ? 2 : 0),4);
+        for(auto x : digest.d) te.fixed(x,8);
+    }
+    writeSection(os,s);
+    s.clear();
+    BinaryEncoder trailer(s);
+    trailer.fixed(namesOffset,8);
+    trailer.fixed(tableOffset,8);
+    os.write(s.data(),s.size());
+}
+
+/**
+ * The directory blocks of a binary metadata file, that are decoded on first
+ * access by lazily loaded trees
+ */
+struct DirectoryTree::BinaryBlocks
+{
+    string_view data;             ///< Content of the metadata file
+    shared_ptr<const void> mapping; ///< Keeps data mapped
+    string metadataFileName;      ///< Used for error reporting
+    vector<uint32_t> names;       ///< NameTable id of the names in the file
+    vector<uint64_t> offsets;     ///< Offset of every block
+    vector<uint32_t> firstNode;   ///< First node of every block, and the end
+    vector<uint32_t> owner;       ///< Directory of every block, once known
+    unique_ptr<atomic<bool>[]> loaded; ///< True if a block has been decoded
+    mutex m;                      ///< Guards decoding blocks
+};
+
+void DirectoryTree::parseBinaryMetadata(string_view data,
+    const string& metadataFileName, shared_ptr<const void> mapping)
+{
+    auto fail=[&metadataFileName](const string& m)
+    {
+        string s=metadataFileName;
+        if(metadataFileName.empty()==false) s+=": ";
+        s+=m;
+        throw runtime_error(s);
+    };
+
+    if(data.size()<binaryHeaderSize+binaryTrailerSize) fail("truncated binary metadata");
+    try {
+        hashAlg=binaryHashAlgorithm(data);
+    } catch(exception& e) {
+        fail(e.what());
+    }
+    format=MetadataFormat::Binary;
+    auto b=make_shared<BinaryBlocks>();
+    b->data=data;
+    b->metadataFileName=metadataFileName;
+    uint64_t namesOffset, tableOffset;
+    BinaryDecoder trailer(data.substr(data.size()-binaryTrailerSize));
+    if(!trailer.fixed(namesOffset,8) || !trailer.fixed(tableOffset,8))
+        fail("truncated binary metadata");
+
+    string_view payload;
+    if(!readSection(data,namesOffset,payload)) fail("corrupted name table");
+    BinaryDecoder nd(payload);
+    uint64_t nameCount;
+    if(!nd.varint(nameCount)) fail("corrupted name table");
+    for(uint64_t i=0;i<nameCount;i++)
+    {
+        uint64_t size;
+        string_view name;
+        if(!nd.varint(size) || !nd.bytes(name,size)) fail("corrupted name table");
+        b->names.push_back(NameTable::instance().intern(string(name)));
+    }
+    if(!readSection(data,tableOffset,payload)
+       || payload.size()%binaryBlockRecordSize!=0 || payload.empty())
+        fail("corrupted block table");
+    BinaryDecoder td(payload);
+    uint64_t blockCount=payload.size()/binaryBlockRecordSize;
+    //The arena is allocated in advance and the content of every block has its
+    //place in it, so decoding a block never moves nodes
+    uint64_t total=1;
+    b->firstNode.push_back(total);
+    for(uint64_t block=0;block<blockCount;block++)
+    {
+        uint64_t offset, count, flags;
+        if(!td.fixed(offset,8) || !td.fixed(count,4) || !td.fixed(flags,4)
+           || flags>3) fail("corrupted block table");
+        DirectoryDigest digest;
+        digest.allHashed=flags & 1;
+        digest.noneHashed=flags & 2;
+        for(auto& x : digest.d)
+            if(!td.fixed(x,8)) fail("corrupted block table");
+        //The digests are those of the directory the block belongs to, and
+        //empty directories need no digest
+        if(count>0) digests.push_back({total,digest});
+        total+=count;
+        if(total>=notFound) fail("DirectoryTree: too many files and directories");
+        b->offsets.push_back(offset);
+        b->firstNode.push_back(total);
+    }
+    hasDigests=true;
+    b->owner.resize(blockCount,uint32_t(notFound));
+    b->owner[0]=0;
+    b->loaded.reset(new atomic<bool>[blockCount]);
+    for(uint64_t block=0;block<blockCount;block++) b->loaded[block]=false;
+    nodes.resize(total);
+    nodes[0].first=b->firstNode[0];
+    nodes[0].count=nodes[0].capacity=b->firstNode[1]-b->firstNode[0];
+    //The digest of the root directory is the one of the file, so checking
+    //it against a log needs not decode the tree
+    if(nodes[0].count>0)
+    {
+        uint64_t result=0;
+        for(auto field : findDigest(digests,nodes[0]).d) digestAdd(result,field);
+        fileDigest=result;
+    }
+    entries=total-1;
+    blocks=b;
+    if(lazyLoading && mapping)
+    {
+        b->mapping=mapping;
+        madvise(const_cast<char*>(data.data()),data.size(),MADV_RANDOM);
+        return;
+    }
+    const char *released=data.data();
+    for(uint32_t block=0;block<blockCount;block++)
+    {
+        //Blocks are in breadth first order, so the directory of a block is
+        //in a block that comes before it
+        if(b->owner[block]==notFound)
+            fail("unreferenced directory block "+to_string(block));
+        auto offset=b->offsets[block];
+        if(mapping && offset<data.size())
+            releaseParsedPages(released,data.data()+offset);
+        loadBlock(block);
+    }
+    blocks.reset();
+}
+
+void DirectoryTree::loadBlock(uint32_t block) const
+{
+    auto& b=*blocks;
+    auto fail=[&](const string& m)
+    {
+        string s=b.metadataFileName;
+        if(s.empty()==false) s+=": ";
+        s+=m+" in directory block "+to_string(block);
+        throw runtime_error(s);
+    };
+
+    string_view payload;
+    if(!readSection(b.data,b.offsets[block],payload)) fail("checksum mismatch");
+    uint32_t dir=b.owner[block];
+    uint32_t first=b.firstNode[block];
+    uint32_t count=b.firstNode[block+1]-first;
+    BinaryDecoder d(payload);
+    uint64_t subdirBlock, payloadCount;
+    if(!d.varint(subdirBlock) || !d.varint(payloadCount) || payloadCount!=count)
+        fail("corrupted header");
+    for(uint32_t i=0;i<count;i++)
+    {
+        auto& n=nodes[first+i];
+        uint64_t flags, per, us, gs, nameLen, symlinkLen;
+        int64_t mt;
+        string_view s;
+        if(!d.fixed(flags,1) || !d.varint(per) || !d.varint(us) || !d.varint(gs)
+           || !d.zigzag(mt) || !d.varint(nameLen) || !d.varint(symlinkLen)
+           || !d.bytes(s,nameLen+symlinkLen)) fail("truncated entry");
+        switch(flags & ~binaryHasHash)
+        {
+            case 0: n.ty=file_type::regular;   break;
+            case 1: n.ty=file_type::directory; break;
+            case 2: n.ty=file_type::symlink;   break;
+            case 3: n.ty=file_type::unknown;   break;
+            default: fail("unrecognized file type");
+        }
+        if(per>0777 || us>=b.names.size() || gs>=b.names.size() || nameLen==0
+           || nameLen>0xffff || symlinkLen>0xffff
+           || (symlinkLen>0 && n.ty!=file_type::symlink))
+            fail("corrupted entry");
+        string_view name=s.substr(0,nameLen);
+        if(name=="." || name==".." || name.find('/')!=string_view::npos)
+            fail("invalid name");
+        n.per=per;
+        n.us=b.names[us];
+        n.gs=b.names[gs];
+        n.mt=mt;
+        n.nm=strings.add(s).data();
+        n.nameLen=nameLen;
+        n.symlinkLen=symlinkLen;
+        n.parent=dir;
+        if(n.ty==file_type::regular)
+        {
+            uint64_t sz;
+            if(!d.varint(sz) || sz>uint64_t(numeric_limits<off_t>::max()))
+                fail("truncated entry");
+            n.sz=sz;
+            if(flags & binaryHasHash)
+            {
+                string_view hash;
+                if(!d.bytes(hash,hashSize(hashAlg))) fail("truncated entry");
+                n.fileHash=FileHash(reinterpret_cast<const unsigned char*>(hash.data()),
+                                    hash.size());
+            }
+        } else if(flags & binaryHasHash) fail("corrupted entry");
+        if(n.isDirectory())
+        {
+            //Subdirectories get their place in the arena now, their content
+            //is decoded when their block is loaded
+            if(subdirBlock<=block || subdirBlock>=b.owner.size()
+               || b.owner[subdirBlock]!=notFound) fail("wrong subdirectory index");
+            b.owner[subdirBlock]=first+i;
+            n.first=b.firstNode[subdirBlock];
+            n.count=n.capacity=b.firstNode[subdirBlock+1]-n.first;
+            subdirBlock++;
+        }
+        if(n.ty==file_type::unknown)
+            warningCallback(string("Warning: ")+relativePath(n).string()+" unsupported file type");
+    }
+    if(!d.atEnd()) fail("extra data");
+    auto begin=nodes.begin()+first;
+    if(is_sorted(begin,begin+count)==false) fail("unsorted entries");
+    //Names must be unique also between directories and other files
+    NameOrderCursor cursor(DirectoryContent(begin,begin+count));
+    string_view last;
+    for(uint32_t i=0;i<count;i++,cursor.next())
+    {
+        auto name=cursor.get()->name();
+        if(i>0 && name==last) fail("duplicate name");
+        last=name;
+    }
+    b.loaded[block].store(true,memory_order_release);
+}
+
+void DirectoryTree::load(const DirectoryNode& dir) const
+{
+    if(dir.count==0) return;
+    auto& b=*blocks;
+    //Among blocks starting at the same node only the last one is not empty
+    uint32_t block=upper_bound(b.firstNode.begin(),b.firstNode.end(),dir.first)
+                  -b.firstNode.begin()-1;
+    if(b.loaded[block].load(memory_order_acquire)) return;
+    unique_lock<mutex> l(b.m);
+    if(b.loaded[block].load(memory_order_relaxed)==false) loadBlock(block);
+}
+
+void DirectoryTree::loadAll() const
+{
+    if(!blocks) return;
+    {
+        unique_lock<mutex> l(blocks->m);
+        for(uint32_t block=0;block<blocks->owner.size();block++)
+        {
+            if(blocks->loaded[block]) continue;
+            if(blocks->owner[block]==notFound)
+            {
+                string s=blocks->metadataFileName;
+                if(s.empty()==false) s+=": ";
+                throw runtime_error(s+"unreferenced directory block "+to_string(block));
+            }
+            loadBlock(block);
+        }
+    }
+    blocks.reset();
+}
+
+const DirectoryDigest *DirectoryTree::getDirectoryDigest(const DirectoryNode& dir) const
+{
+    if(hasDigests==false) return nullptr;
+    return &findDigest(digests,dir);
+}
+
+DirectoryDigest DirectoryTree::computeDirectoryDigest(const DirectoryNode& dir) const
+{
+    if(auto digest=getDirectoryDigest(dir)) return *digest;
+    loadAll();
+    DigestTable table;
+    vector<uint64_t> nameDigests;
+    return digestContent(dir,false,table,nameDigests);
+}
+
+DirectoryDigest DirectoryTree::digestContent(const DirectoryNode& dir, bool binary,
+    DigestTable& table, vector<uint64_t>& nameDigests) const
 {
-    clear();
-    int lineNo=0;
-    string line;
-    list<DirectoryNode> nodes;
-    
-    auto fail=[&metadataFileName,&lineNo](const string& m)
+    typedef DirectoryDigest D;
+    auto nameDigest=[&nameDigests](uint32_t id)
     {
-        string s=metadataFileName;
-        if(metadataFileName.empty()==false) s+=": ";
-        s+=m+" before line "+to_string(lineNo);
-        throw runtime_error(s);
+        if(id>=nameDigests.size()) nameDigests.resize(id+1,0);
+        if(nameDigests[id]==0)
+            nameDigests[id]=stringDigest(NameTable::instance().name(id));
+        return nameDigests[id];
     };
-    
-    auto add=[&nodes,&fail,this](){
-        if(nodes.empty()) return;
-        string p=nodes.front().getElement().relativePath().parent_path();
-        for(auto& n : nodes)
+    D result;
+    for(auto& n : getDirectoryContent(dir))
+    {
+        //Types and permission bits not stored in binary metadata files get
+        //different digests, as they are compared
+        uint64_t type=binaryFileType(n.ty);
+        if(binary==false && type==3 && n.ty!=file_type::unknown)
+            type=4+static_cast<int>(n.ty);
+        digestAdd(result.d[D::Structure],type);
+        digestAdd(result.d[D::Structure],stringDigest(n.name()));
+        digestAdd(result.d[D::Perm],binary ? n.per & 0777 : n.per);
+        digestAdd(result.d[D::Owner],nameDigest(n.us));
+        digestAdd(result.d[D::Owner],nameDigest(n.gs));
+        digestAdd(result.d[D::Mtime],n.mt);
+        digestAdd(result.d[D::Size],n.sz);
+        digestAdd(result.d[D::Hash],stringDigest(string_view(
+            reinterpret_cast<const char*>(n.fileHash.data()),n.fileHash.size())));
+        digestAdd(result.d[D::Symlink],stringDigest(n.symlinkTarget()));
+        if(n.ty==file_type::regular)
         {
-            auto& e=n.getElement();
-            if(p!=e.relativePath().parent_path()) fail("different paths grouped");
-            auto inserted=index.insert({e.relativePath().string(),&n});
-            if(inserted.second==false) fail("index insert failed (duplicate?)");
-            if(e.type()==file_type::unknown)
-                warningCallback(string("Warning: ")+e.relativePath().string()+" unsupported file type");
+            if(n.fileHash.empty()) result.allHashed=false;
+            else result.noneHashed=false;
         }
-        if(topContent.empty())
+        if(n.isDirectory())
         {
-            if(p.empty()==false) fail("file does not start with top level directory");
-            topContent=std::move(nodes);
-            nodes=list<DirectoryNode>();
-        } else {
-            auto it=index.find(p);
-            if(it==index.end()) fail("directory content not preceded by index insert");
-            if(it->second->getDirectoryContent().empty()==false)
-                fail("duplicate noncontiguous directory content");
-            it->second->setDirectoryContent(std::move(nodes));
-            nodes=list<DirectoryNode>();
+            auto content=digestContent(n,binary,table,nameDigests);
+            for(int i=0;i<D::NumFields;i++) digestAdd(result.d[i],content.d[i]);
+            result.allHashed=result.allHashed && content.allHashed;
+            result.noneHashed=result.noneHashed && content.noneHashed;
         }
-    };
+    }
+    if(dir.count>0) table.push_back({dir.first,result});
+    return result;
+}
+
+uint64_t DirectoryTree::metadataDigest() const
+{
+    //Types and permissions are reduced to those stored in binary metadata
+    //files, that are also those stored in text ones
+    loadAll();
+    DigestTable table;
+    vector<uint64_t> nameDigests;
+    auto digest=digestContent(getTreeRoot(),true,table,nameDigests);
+    uint64_t result=0;
+    for(auto field : digest.d) digestAdd(result,field);
+    return result;
+}
+
+uint64_t DirectoryTree::readDigest() const
+{
+    return fileDigest ? fileDigest.value() : metadataDigest();
+}
+
+void DirectoryTree::verifyLog()
+{
+    logVerified=true;
+    if(readDigest()==logState.baseDigest) return;
+    //The log has no records, so ignoring it loses nothing
+    logState=MetadataLogState();
+    changedDirs.clear();
+}
+
+DirectoryTree::DigestTable DirectoryTree::computeDigests(bool binary) const
+{
+    DigestTable result;
+    vector<uint64_t> nameDigests;
+    digestContent(getTreeRoot(),binary,result,nameDigests);
+    sort(result.begin(),result.end(),[](auto& a, auto& b){ return a.first<b.first; });
+    return result;
+}
 
-    while(getline(is,line))
+const DirectoryDigest& DirectoryTree::findDigest(const DigestTable& table,
+                                                 const DirectoryNode& dir)
+{
+    static const DirectoryDigest empty;
+    if(dir.count==0) return empty;
+    auto it=lower_bound(table.begin(),table.end(),dir.first,
+        [](auto& e, uint32_t first){ return e.first<first; });
+    assert(it!=table.end() && it->first==dir.first);
+    return it->second;
+}
+
+/**
+ * Shared by the threads of DirectoryTree::computeMissingHashes() to limit the
+ * rate files are read at and to report progress
+ */
+class HashMeter
+{
+public:
+    HashMeter(const HashProgress& total, uint64_t maxBytesPerSecond,
+              function<void (const HashProgress&)> progress)
+        : p(total), maxBytesPerSecond(maxBytesPerSecond),
+          progress(std::move(progress)), start(chrono::steady_clock::now()),
+          next(start), report(start+chrono::seconds(1)) {}
+
+    /// Called after reading, waits as long as needed not to exceed the rate
+    void read(size_t bytes)
     {
-        lineNo++;
-        if(line.empty()) add();
-        else {
-            DirectoryNode n(FilesystemElement(line,metadataFileName,lineNo));
-            nodes.push_back(std::move(n));
-        }
+        unique_lock<mutex> l(m);
+        p.bytes+=bytes;
+        auto now=chrono::steady_clock::now();
+        update(now);
+        if(maxBytesPerSecond==0) return;
+        //Time not spent reading does not allow reading faster later
+        chrono::duration<double> t(double(bytes)/maxBytesPerSecond);
+        next=max(next,now)+chrono::duration_cast<chrono::steady_clock::duration>(t);
+        auto until=next;
+        l.unlock();
+        this_thread::sleep_until(until);
     }
-    add();
+
+    /// Called after hashing a file
+    void hashed()
+    {
+        unique_lock<mutex> l(m);
+        p.files++;
+        update(chrono::steady_clock::now());
+    }
+
+private:
+    void update(chrono::steady_clock::time_point now)
+    {
+        if(!progress || now<report) return;
+        p.seconds=chrono::duration<double>(now-start).count();
+        progress(p);
+        report=now+chrono::seconds(1);
+    }
+
+    HashProgress p;
+    const uint64_t maxBytesPerSecond;
+    const function<void (const HashProgress&)> progress;
+    const chrono::steady_clock::time_point start;
+    chrono::steady_clock::time_point next;   ///< When reading is allowed again
+    chrono::steady_clock::time_point report; ///< When to report progress again
+    mutex m;
+};
+
+void DirectoryTree::computeMissingHashes(uint64_t maxBytesPerSecond,
+    function<void (const HashProgress&)> progress)
+{
+    checkTopPath("computeMissingHashes");
+    if(remote)
+    {
+        remote->computeMissingHashes(*this,jobs,maxBytesPerSecond,progress);
+        return;
+    }
+    loadAll();
+    discardDigests();
+    vector<uint32_t> files;
+    collectFiles(0,files,true);
+    markFilesChanged(files);
+    //Filesystems usually allocate the data of files close to their inode, so
+    //hashing in inode order reduces seeks on rotating disks. Files that can't
+    //be stat'ed are left first, and fail when hashing
+    HashProgress total;
+    vector<pair<ino_t,uint32_t>> order;
+    order.reserve(files.size());
+    for(auto index : files)
+    {
+        string p=(topPath.value() / relativePath(nodes[index])).string();
+        struct stat st;
+        order.emplace_back(lstat(p.c_str(),&st)==0 ? st.st_ino : 0,index);
+        total.totalBytes+=nodes[index].size();
+    }
+    sort(order.begin(),order.end());
+    total.totalFiles=order.size();
+
+    HashMeter meter(total,maxBytesPerSecond,progress);
+    function<void (size_t)> read;
+    if(maxBytesPerSecond>0 || progress) read=[&meter](size_t n){ meter.read(n); };
+    //Each thread writes the hash of different nodes, and no node is added
+    auto hash=[&](uint32_t index){
+        auto& n=nodes[index];
+        n.fileHash=hashFile(topPath.value() / relativePath(n),hashAlg,read);
+        meter.hashed();
+    };
+    if(jobs==1) for(auto& o : order) hash(o.second);
+    else {
+        ThreadPool pool(jobs,4096);
+        for(auto& o : order) pool.submit([&hash,index=o.second]{ hash(index); });
+        pool.wait();
+    }
+    digests=computeDigests(false);
+    hasDigests=true;
 }
 
-void DirectoryTree::writeTo(const path& metadataFile) const
+/**
+ * \param a relative path of a regular file
+ * \param b relative path of another regular file
+ * \return true if a comes before b in tree order, where the content of every
+ * directory is sorted as by operator< of DirectoryNode, and the content of
+ * subdirectories comes before the files, as in collectFiles(). The files need
+ * not be both in the tree
+ */
+static bool beforeInTreeOrder(const path& a, const path& b)
 {
-    ofstream out(metadataFile);
-    if(!out)
-        throw runtime_error(string("could not open for writing: ")+metadataFile.string());
-    writeTo(out);
+    auto i=a.begin(), j=b.begin();
+    for(;i!=a.end() && j!=b.end();++i,++j)
+    {
+        bool aDirectory=next(i)!=a.end(), bDirectory=next(j)!=b.end();
+        if(aDirectory!=bDirectory) return aDirectory;
+        if(*i!=*j) return i->native()<j->native();
+    }
+    return false;
 }
 
-void DirectoryTree::writeTo(ostream& os) const
+vector<path> DirectoryTree::computeSampleHashes(const path& after,
+    uint64_t maxBytes, unsigned maxSeconds)
 {
-    this->os=&os;
-    printBreak=false;
-    recursiveWrite(topContent);
-    this->os=nullptr;
+    checkTopPath("computeSampleHashes");
+    if(remote) throw runtime_error("computeSampleHashes: not supported on remote targets");
+    loadAll();
+    discardDigests();
+    vector<uint32_t> files;
+    collectFiles(0,files,false);
+    //The last file may have been removed, so start from the first file after
+    //its path, wrapping around only after the last file
+    size_t start=0;
+    if(after.empty()==false)
+    {
+        auto it=partition_point(files.begin(),files.end(),[&](uint32_t file){
+            return beforeInTreeOrder(after,relativePath(nodes[file]))==false;
+        });
+        if(it!=files.end()) start=it-files.begin();
+    }
+    rotate(files.begin(),files.begin()+start,files.end());
+
+    //The size budget selects the files in advance, the time budget is checked
+    //before each file
+    auto deadline=chrono::steady_clock::time_point::max();
+    if(maxSeconds>0) deadline=chrono::steady_clock::now()+chrono::seconds(maxSeconds);
+    uint64_t bytes=0;
+    size_t count=0;
+    for(;count<files.size();count++)
+    {
+        auto size=nodes[files[count]].size();
+        if(maxBytes>0 && bytes+size>maxBytes && count>0) break;
+        bytes+=size;
+    }
+    files.resize(count);
+    size_t hashed=hashFiles(files,deadline);
+    vector<path> result;
+    result.reserve(hashed);
+    for(size_t i=0;i<hashed;i++) result.push_back(relativePath(nodes[files[i]]));
+    digests=computeDigests(false);
+    hasDigests=true;
+    return result;
 }
 
-void DirectoryTree::computeMissingHashes()
+void DirectoryTree::computeHashes(const vector<path>& files)
 {
-    checkTopPath("computeMissingHashes");
-    for(auto& n : topContent) n.computeMissingHashes(topPath.value());
+    checkTopPath("computeHashes");
+    if(remote) throw runtime_error("computeHashes: not supported on remote targets");
+    loadAll();
+    discardDigests();
+    vector<uint32_t> indices;
+    for(auto& p : files)
+    {
+        auto index=p.empty() ? notFound : findIndex(p);
+        if(index!=notFound && nodes[index].type()==file_type::regular)
+            indices.push_back(index);
+    }
+    hashFiles(indices);
+    digests=computeDigests(false);
+    hasDigests=true;
 }
 
 void DirectoryTree::clear()
 {
     topPath.reset();
-    topContent.clear();
-    index.clear();
+    remote=nullptr;
+    nodes.clear();
+    strings.clear();
+    blocks.reset();
+    discardDigests();
+    logState=MetadataLogState();
+    logVerified=false;
+    changedDirs.clear();
+    fileDigest.reset();
+    entries=0;
+    nodes.emplace_back();
+    nodes.front().ty=file_type::directory;
+}
+
+const DirectoryNode *DirectoryTree::findInDirectory(const DirectoryNode& dir,
+                                                    string_view name) const
+{
+    auto index=findIndexInDirectory(dir,name);
+    if(index==notFound) return nullptr;
+    return &nodes[index];
+}
+
+path DirectoryTree::relativePath(const DirectoryNode& node) const
+{
+    if(&node==&nodes.front()) return path();
+    vector<string_view> names;
+    for(auto n=&node;;n=&nodes[n->parent])
+    {
+        names.push_back(n->name());
+        if(n->parent==0) break;
+    }
+    path result;
+    for(auto it=names.rbegin();it!=names.rend();++it) result/=*it;
+    return result;
 }
 
 optional<FilesystemElement> DirectoryTree::search(const path& p) const
 {
-    auto it=index.find(p);
-    if(it==index.end()) return nullopt;
-    return it->second->getElement();
+    auto index=p.empty() ? notFound : findIndex(p);
+    if(index==notFound) return nullopt;
+    return getElement(nodes[index]);
 }
 
 const DirectoryNode& DirectoryTree::searchNode(const path& p, const string& where) const
 {
-    auto it=index.find(p);
-    if(it==index.end())
+    return nodes[searchIndex(p,where)];
+}
+
+/**
+ * Filesystem changes batched by beginFilesystemBatch(). Consecutive changes of
+ * the same entry are made by a single task, in order
+ */
+struct DirectoryTree::FilesystemBatch
+{
+    //Bound the queued changes, as they are produced much faster than made
+    explicit FilesystemBatch(unsigned jobs) : pool(jobs,4096) {}
+
+    /// Submit the changes of the current entry
+    void submit()
     {
-        string message="DirectoryTree::searchNode could not find the path ";
-        message+=p.string();
-        if(where.empty()==false) message+=". Called from "+where;
-        throw runtime_error(message);
+        if(changes.empty()) return;
+        submitted.insert(current.string());
+        pool.submit([changes=std::move(changes)]{
+            for(auto& change : changes) change();
+        });
+        changes.clear();
     }
-    return *it->second;
-}
+
+    /// Wait for all the changes submitted
+    void wait()
+    {
+        submit();
+        submitted.clear();
+        pool.wait();
+    }
+
+    /// \return true if the entry has changes not yet completed
+    bool pending(const path& absPath) const
+    {
+        return (absPath==current && changes.empty()==false) ||
+               submitted.count(absPath.string());
+    }
+
+    ThreadPool pool;
+    path current;                    ///< Entry of the changes not yet submitted
+    vector<function<void ()>> changes; ///< Changes not yet submitted
+    unordered_set<string> submitted; ///< Entries with changes in the pool
+    set<path> parents;               ///< Directories whose mtime needs fixing
+    vector<function<void ()>> directories; ///< Copied, attributes not yet set
+    vector<pair<path,FileHash>> hashes; ///< Of copied files, not yet in tree
+    mutex m;                         ///< Guards warningCallback and hashes
+};
 
 void DirectoryTree::copyFromTreeAndFilesystem(const DirectoryTree& srcTree,
-    const path& relativeSrcPath, const path& relativeDstPath)
+    const path& relativeSrcPath, const path& relativeDstPath, ScanOpt opt)
 {
     this->checkTopPath("copyFromTreeAndFilesystem");
     srcTree.checkTopPath("copyFromTreeAndFilesystem");
 
-    auto result=treeCopy(srcTree,relativeSrcPath,relativeDstPath);
-    recursiveFilesystemCopy(srcTree.topPath.value(),result);
+    auto index=treeCopy(srcTree,relativeSrcPath,relativeDstPath);
+    //Copies are made in parallel with the other changes of the batch, except
+    //those of the directory being copied into
+    if(batch && batch->pending(topPath.value() / relativeDstPath))
+        waitFilesystemBatch();
+    recursiveFilesystemCopy(srcTree,srcTree.searchNode(relativeSrcPath),index,
+                            relativeSrcPath,relativeDstPath / nodes[index].name(),opt);
     fixupParentMtime(relativeDstPath);
 }
 
 void DirectoryTree::removeFromTree(const path& relativePath)
 {
-    auto& node=searchNode(relativePath,"removeFromTree");
-
-    //If directory remove from index all childs
-    if(node.getElement().isDirectory()) recursiveRemoveFromIndex(node);
-
+    auto index=searchIndex(relativePath,"removeFromTree");
     //Remove the DirectoryNode itself (and all its childs if directory)
-    path parent=relativePath.parent_path();
-    if(parent.empty()==false) searchNode(parent).removeFromDirectoryContent(node);
-    else {
-        //NOTE: removing the node could invalidate the node reference, so copy
-        FilesystemElement removeElem=node.getElement();
-        topContent.remove_if([&](const DirectoryNode& e){
-            return e.getElement()==removeElem;
-        });
-    }
-    //Remove the path from the index (done last as invalidates it)
-    index.erase(relativePath.string());
+    removeFromDirectory(nodes[index].parent,index);
 }
 
 int DirectoryTree::removeFromTreeAndFilesystem(const path& relativePath)
@@ -527,10 +2471,19 @@ int DirectoryTree::removeFromTreeAndFilesystem(const path& relativePath)
     checkTopPath("removeFromTreeAndFilesystem");
 
     //Remove from tree first, this checks if path exists too
+    auto& node=nodes[searchIndex(relativePath,"removeFromTreeAndFilesystem")];
+    bool directory=node.isDirectory();
+    int result=subtreeSize(node);
     removeFromTree(relativePath);
 
-    //Remove from filesystem
-    int result=remove_all(topPath.value() / relativePath);
+    //Remove from filesystem, directories may have pending changes in them
+    path absPath=topPath.value() / relativePath;
+    if(batch && (directory || batch->pending(absPath))) waitFilesystemBatch();
+    if(remote)
+    {
+        remote->remove(absPath);
+        fsSync();
+    } else result=remove_all(absPath);
 
     //TODO: tested without this and remove_all did not seem to update the parent
     //directory mtime, is this really needed?
@@ -539,18 +2492,61 @@ int DirectoryTree::removeFromTreeAndFilesystem(const path& relativePath)
     return result;
 }
 
+void DirectoryTree::moveInTree(const path& from, const path& to)
+{
+    auto index=searchIndex(from,"moveInTree");
+    auto toIndex=findIndex(to);
+    if(toIndex!=notFound)
+        throw runtime_error(string("moveInTree: ")+to.string()+" already exists");
+    auto parent=to.parent_path();
+    for(auto p=parent;p.empty()==false;p=p.parent_path())
+        if(p==from) throw runtime_error(string("moveInTree: can't move ")
+            +from.string()+" into itself");
+    if(parent.empty()==false && searchNode(parent,"moveInTree").isDirectory()==false)
+        throw runtime_error(string("moveInTree: ")+parent.string()+" not a directory");
+    //The node is moved keeping its content where it is in the arena
+    DirectoryNode n=nodes[index];
+    string name=to.filename().string();
+    string nameAndTarget=name+string(n.symlinkTarget());
+    n.nm=strings.add(nameAndTarget).data();
+    n.nameLen=name.size();
+    nodes[index].count=0; //So that removing it does not count its content
+    removeFromDirectory(nodes[index].parent,index);
+    //Removing the node moved other nodes, so the parent is looked up now
+    uint32_t dir=parent.empty() ? 0 : searchIndex(parent,"moveInTree");
+    auto moved=addToDirectory(dir,n);
+    fixupContentParent(moved);
+    //The content of the moved directories is recorded at their new path
+    markSubtreeChanged(moved);
+}
+
+void DirectoryTree::moveInTreeAndFilesystem(const path& from, const path& to)
+{
+    checkTopPath("moveInTreeAndFilesystem");
+    moveInTree(from,to);
+    path fromAbs=topPath.value() / from;
+    if(batch && (searchNode(to).isDirectory() || batch->pending(fromAbs)))
+        waitFilesystemBatch();
+    if(remote)
+    {
+        remote->rename(fromAbs,topPath.value() / to);
+        fsSync();
+    } else rename(fromAbs,topPath.value() / to);
+    fixupParentMtime(from.parent_path());
+    fixupParentMtime(to.parent_path());
+}
+
 void DirectoryTree::addSymlinkToTree(const FilesystemElement& symlink)
 {
     assert(symlink.type()==file_type::symlink);
-    string parentPath=symlink.relativePath().parent_path().string();
-    if(parentPath.empty())
-    {
-        topContent.push_back(DirectoryNode(symlink));
-        topContent.sort(); // Keep topContent sorted
-    } else {
-        auto& parent=searchNode(parentPath,"addSymlinkToTree: missing parent");
-        parent.addToDirectoryContent(DirectoryNode(symlink));
-    }
+    path parentPath=symlink.relativePath().parent_path();
+    uint32_t dir=0;
+    if(parentPath.empty()==false)
+        dir=searchIndex(parentPath,"addSymlinkToTree: missing parent");
+    assert(nodes[dir].isDirectory());
+    assert(findIndexInDirectory(nodes[dir],
+        symlink.relativePath().filename().string())==notFound);
+    addToDirectory(dir,makeNode(symlink));
 }
 
 void DirectoryTree::addSymlinkToTreeAndFilesystem(const FilesystemElement& symlink)
@@ -559,255 +2555,848 @@ void DirectoryTree::addSymlinkToTreeAndFilesystem(const FilesystemElement& symli
 
     addSymlinkToTree(symlink);
     path absPath=topPath.value() / symlink.relativePath();
+    waitFilesystemBatch();
     //Code is not portable outside of POSIX systems, as we should call
     //create_directory_symlink if the link is to a directory, but we don't know
-    create_symlink(symlink.symlinkTarget(),absPath);
+    fsCreateSymlink(symlink.symlinkTarget(),absPath);
+    fsOwner(absPath,symlink.user(),symlink.group());
+    //Fix mtime
+    fsMtime(absPath,symlink.mtime());
+    fixupParentMtime(symlink.relativePath().parent_path());
+}
 
-    //Don't consider owner/group setting failure an error
+void DirectoryTree::modifyPermissionsInTree(const path& relativePath, perms perm)
+{
+    auto& node=searchNode(relativePath,"modifyPermissionsInTree");
+    node.per=static_cast<uint16_t>(perm);
+}
+
+void DirectoryTree::modifyPermissionsInTreeAndFilesystem(const path& relativePath,
+                                                         perms perm)
+{
+    checkTopPath("modifyPermissionsInTreeAndFilesystem");
+    modifyPermissionsInTree(relativePath,perm);
+    path absPath=topPath.value() / relativePath;
+    changeInFilesystem(absPath,[this,absPath,perm]{ fsPermissions(absPath,perm); });
+    fixupParentMtime(relativePath.parent_path()); //TODO: is this really needed?
+}
+
+void DirectoryTree::modifyOwnerInTree(const path& relativePath,
+                                      const string& user, const string& group)
+{
+    auto& node=searchNode(relativePath,"modifyOwnerInTree");
+    node.us=NameTable::instance().intern(user);
+    node.gs=NameTable::instance().intern(group);
+}
+
+void DirectoryTree::modifyOwnerInTreeAndFilesystem(const path& relativePath,
+                                                   const string& user, const string& group)
+{
+    checkTopPath("modifyUserInTreeAndFilesystem");
+    modifyOwnerInTree(relativePath,user,group);
+    path absPath=topPath.value() / relativePath;
+    changeInFilesystem(absPath,[this,absPath,user,group]{
+        fsOwner(absPath,user,group);
+    });
+    fixupParentMtime(relativePath.parent_path()); //TODO: is this really needed?
+}
+
+void DirectoryTree::modifyMtimeInTree(const path& relativePath, time_t mtime)
+{
+    auto& node=searchNode(relativePath,"modifyMtimeInTree");
+    node.mt=mtime;
+}
+
+void DirectoryTree::modifyMtimeInTreeAndFilesystem(const path& relativePath,
+                                                   time_t mtime)
+{
+    checkTopPath("modifyMtimeInTreeAndFilesystem");
+    modifyMtimeInTree(relativePath,mtime);
+    path absPath=topPath.value() / relativePath;
+    changeInFilesystem(absPath,[this,absPath,mtime]{ fsMtime(absPath,mtime); });
+}
+
+DirectoryNode& DirectoryTree::searchNode(const path& p, const string& where)
+{
+    discardDigests(); //The node may be modified
+    auto index=searchIndex(p,where);
+    if(index!=0) markChanged(nodes[index].parent);
+    return nodes[index];
+}
+
+void DirectoryTree::checkTopPath(const std::string& where) const
+{
+    if(topPath.has_value()==false)
+        throw runtime_error(where+": DirectoryTree not constructed from filesystem");
+}
+
+void DirectoryTree::beginFilesystemBatch(unsigned jobs)
+{
+    checkTopPath("beginFilesystemBatch");
+    endFilesystemBatch();
+    batch=make_shared<FilesystemBatch>(jobs);
+}
+
+void DirectoryTree::endFilesystemBatch()
+{
+    if(!batch) return;
+    string errors;
     try {
-        ext_symlink_change_ownership(absPath,symlink.user(),symlink.group());
-    } catch(exception&) {
-        warningCallback(string("Warning: could not change ownership of ")
-            +absPath.string()+": maybe retry with sudo?");
+        waitFilesystemBatch();
+    } catch(exception& e) {
+        errors=e.what();
     }
-    //Fix mtime
-    ext_symlink_last_write_time(absPath,symlink.mtime());
-    fixupParentMtime(symlink.relativePath().parent_path());
+    auto parents=std::move(batch->parents);
+    batch.reset();
+    for(auto& p : parents)
+    {
+        //Directories may have been removed after changing their content
+        if(findIndex(p)==notFound) continue;
+        //Remote changes are waited for once, below
+        if(remote) remote->setMtime(topPath.value() / p,searchNode(p).mtime());
+        else fixupParentMtime(p);
+    }
+    if(remote)
+    {
+        try {
+            remote->sync();
+        } catch(exception& e) {
+            if(errors.empty()==false) errors+=' ';
+            errors+=e.what();
+        }
+    }
+    if(errors.empty()==false) throw runtime_error(errors);
+}
+
+void DirectoryTree::changeInFilesystem(const path& absPath, function<void ()> change)
+{
+    if(!batch)
+    {
+        change();
+        return;
+    }
+    auto& b=*batch;
+    if(absPath!=b.current)
+    {
+        b.submit();
+        //Changes of the same entry must not be made concurrently
+        if(b.submitted.count(absPath.string())) b.wait();
+        b.current=absPath;
+    }
+    b.changes.push_back(std::move(change));
+}
+
+void DirectoryTree::waitFilesystemBatch()
+{
+    if(!batch) return;
+    //Complete the copies even if some changes failed, so that the copied
+    //directories get their attributes
+    string errors;
+    try {
+        batch->wait();
+    } catch(exception& e) {
+        errors=e.what();
+    }
+    //Directories were added after their content, complete the innermost first
+    auto directories=std::move(batch->directories);
+    batch->directories.clear();
+    for(auto& complete : directories)
+    {
+        try {
+            complete();
+        } catch(exception& e) {
+            if(errors.empty()) errors=e.what();
+        }
+    }
+    //Tree indices may have changed while copying, so look up copied files by path
+    for(auto& h : batch->hashes)
+        searchNode(h.first,"waitFilesystemBatch").fileHash=h.second;
+    batch->hashes.clear();
+    if(errors.empty()==false) throw runtime_error(errors);
+}
+
+void DirectoryTree::warning(const string& s)
+{
+    if(!batch)
+    {
+        warningCallback(s);
+        return;
+    }
+    unique_lock<mutex> l(batch->m);
+    warningCallback(s);
+}
+
+void DirectoryTree::fixupParentMtime(const path& parent)
+{
+    if(parent.empty()) return;
+    if(batch)
+    {
+        batch->parents.insert(parent);
+        return;
+    }
+    //If file is in a subdirectory, fixup mtime of parent directory
+    fsMtime(topPath.value() / parent,searchNode(parent).mtime());
+}
+
+uint32_t DirectoryTree::findIndex(const path& p) const
+{
+    uint32_t index=0;
+    for(auto& component : p)
+    {
+        index=findIndexInDirectory(nodes[index],component.native());
+        if(index==notFound) break;
+    }
+    return index;
+}
+
+uint32_t DirectoryTree::searchIndex(const path& p, const string& where) const
+{
+    auto index=p.empty() ? notFound : findIndex(p);
+    if(index==notFound)
+    {
+        string message="DirectoryTree::searchNode could not find the path ";
+        message+=p.string();
+        if(where.empty()==false) message+=". Called from "+where;
+        throw runtime_error(message);
+    }
+    return index;
+}
+
+uint32_t DirectoryTree::findIndexInDirectory(const DirectoryNode& dir,
+                                             string_view name) const
+{
+    //Directory content is sorted with directories first, so binary search the
+    //name among both the directories and the other files
+    auto content=getDirectoryContent(dir);
+    auto isDir=[](const DirectoryNode& n){ return n.isDirectory(); };
+    auto byName=[](const DirectoryNode& n, string_view name){ return n.name()<name; };
+    auto dirEnd=partition_point(content.begin(),content.end(),isDir);
+    auto it=lower_bound(content.begin(),dirEnd,name,byName);
+    if(it==dirEnd || it->name()!=name)
+    {
+        it=lower_bound(dirEnd,content.end(),name,byName);
+        if(it==content.end() || it->name()!=name) return notFound;
+    }
+    return dir.first+(it-content.begin());
+}
+
+DirectoryNode DirectoryTree::makeNode(const FilesystemElement& e)
+{
+    DirectoryNode result;
+    result.fileHash=e.fileHash;
+    result.ty=e.ty;
+    result.per=static_cast<uint16_t>(e.per);
+    result.us=e.us;
+    result.gs=e.gs;
+    result.mt=e.mt;
+    result.sz=e.sz;
+    auto rp=e.rpView();
+    auto slash=rp.rfind('/');
+    auto name=slash==string_view::npos ? rp : rp.substr(slash+1);
+    auto symlink=e.symlinkView();
+    if(name.size()>0xffff || symlink.size()>0xffff)
+        throw runtime_error(string("path too long: ")+e.relativePath().string());
+    result.nm=strings.add(name,symlink).data();
+    result.nameLen=name.size();
+    result.symlinkLen=symlink.size();
+    return result;
+}
+
+DirectoryNode DirectoryTree::copyNode(const DirectoryNode& n)
+{
+    DirectoryNode result=n;
+    result.nm=strings.add(string_view(n.nm,n.nameLen+n.symlinkLen)).data();
+    result.parent=result.first=result.count=result.capacity=0;
+    return result;
+}
+
+FilesystemElement DirectoryTree::toElement(const DirectoryNode& node,
+                                           const path& relativePath)
+{
+    FilesystemElement result;
+    result.ty=node.ty;
+    result.per=node.permissions();
+    result.us=node.us;
+    result.gs=node.gs;
+    result.mt=node.mt;
+    result.sz=node.sz;
+    result.fileHash=node.fileHash;
+#ifndef OPTIMIZE_MEMORY
+    result.rp=relativePath;
+#else //OPTIMIZE_MEMORY
+    result.rp=relativePath.string();
+#endif //OPTIMIZE_MEMORY
+    result.symlink=string(node.symlinkTarget());
+    return result;
 }
 
-void DirectoryTree::modifyPermissionsInTree(const path& relativePath, perms perm)
+uint32_t DirectoryTree::allocateContent(uint32_t dir, uint32_t size)
 {
-    auto& node=searchNode(relativePath,"modifyPermissionsInTree");
-    node.setPermissions(perm);
+    if(nodes.size()+size>=notFound)
+        throw runtime_error("DirectoryTree: too many files and directories");
+    uint32_t first=nodes.size();
+    nodes.resize(nodes.size()+size);
+    auto& d=nodes[dir];
+    d.first=first;
+    d.count=d.capacity=size;
+    entries+=size;
+    return first;
 }
 
-void DirectoryTree::modifyPermissionsInTreeAndFilesystem(const path& relativePath,
-                                                         perms perm)
+void DirectoryTree::relocateContent(uint32_t dir, uint32_t capacity)
 {
-    checkTopPath("modifyPermissionsInTreeAndFilesystem");
-    modifyPermissionsInTree(relativePath,perm);
-    permissions(topPath.value() / relativePath,perm);
-    fixupParentMtime(relativePath.parent_path()); //TODO: is this really needed?
+    auto& d=nodes[dir];
+    assert(capacity>=d.count);
+    if(d.first+d.capacity==nodes.size())
+    {
+        //Content already at the end of the arena, just grow it in place
+        nodes.resize(d.first+capacity);
+        d.capacity=capacity;
+        return;
+    }
+    if(nodes.size()+capacity>=notFound)
+        throw runtime_error("DirectoryTree: too many files and directories");
+    //NOTE: the space previously used by the content is not reclaimed
+    uint32_t first=nodes.size();
+    nodes.resize(nodes.size()+capacity);
+    for(uint32_t i=0;i<d.count;i++)
+    {
+        nodes[first+i]=nodes[d.first+i];
+        nodes[d.first+i]=DirectoryNode();
+        fixupContentParent(first+i);
+    }
+    d.first=first;
+    d.capacity=capacity;
 }
 
-void DirectoryTree::modifyOwnerInTree(const path& relativePath,
-                                      const string& user, const string& group)
+void DirectoryTree::fixupContentParent(uint32_t dir)
 {
-    auto& node=searchNode(relativePath,"modifyOwnerInTree");
-    node.setOwner(user,group);
+    auto& d=nodes[dir];
+    for(uint32_t i=0;i<d.count;i++) nodes[d.first+i].parent=dir;
 }
 
-void DirectoryTree::modifyOwnerInTreeAndFilesystem(const path& relativePath,
-                                                   const string& user, const string& group)
+uint32_t DirectoryTree::addToDirectory(uint32_t dir, DirectoryNode node)
 {
-    checkTopPath("modifyUserInTreeAndFilesystem");
-    modifyOwnerInTree(relativePath,user,group);
-    path absPath=topPath.value() / relativePath;
-    //Don't consider owner/group setting failure an error
-    try {
-        ext_symlink_change_ownership(absPath,user,group);
-    } catch(exception&) {
-        warningCallback(string("Warning: could not change ownership of ")
-            +absPath.string()+": maybe retry with sudo?");
+    loadAll();
+    discardDigests();
+    markChanged(dir);
+    if(nodes[dir].count==nodes[dir].capacity)
+        relocateContent(dir,max(4u,2*nodes[dir].count));
+    auto& d=nodes[dir];
+    auto content=getDirectoryContent(d);
+    //Keep content sorted
+    uint32_t pos=upper_bound(content.begin(),content.end(),node)-content.begin();
+    for(uint32_t i=d.count;i>pos;i--)
+    {
+        nodes[d.first+i]=nodes[d.first+i-1];
+        fixupContentParent(d.first+i);
     }
-    fixupParentMtime(relativePath.parent_path()); //TODO: is this really needed?
+    node.parent=dir;
+    nodes[d.first+pos]=node;
+    d.count++;
+    entries++;
+    return d.first+pos;
 }
 
-void DirectoryTree::modifyMtimeInTree(const path& relativePath, time_t mtime)
+void DirectoryTree::removeFromDirectory(uint32_t dir, uint32_t index)
 {
-    auto& node=searchNode(relativePath,"modifyMtimeInTree");
-    node.setMtime(mtime);
+    loadAll();
+    discardDigests();
+    markChanged(dir);
+    auto& d=nodes[dir];
+    assert(index>=d.first && index<d.first+d.count);
+    //NOTE: the space used by the content of removed directories is not reclaimed
+    entries-=subtreeSize(nodes[index]);
+    for(uint32_t i=index;i+1<d.first+d.count;i++)
+    {
+        nodes[i]=nodes[i+1];
+        fixupContentParent(i);
+    }
+    d.count--;
+    nodes[d.first+d.count]=DirectoryNode();
 }
 
-void DirectoryTree::modifyMtimeInTreeAndFilesystem(const path& relativePath,
-                                                   time_t mtime)
+size_t DirectoryTree::subtreeSize(const DirectoryNode& node) const
 {
-    checkTopPath("modifyMtimeInTreeAndFilesystem");
-    modifyMtimeInTree(relativePath,mtime);
-    ext_symlink_last_write_time(topPath.value() / relativePath,mtime);
+    size_t result=1;
+    for(auto& n : getDirectoryContent(node)) result+=subtreeSize(n);
+    return result;
 }
 
-DirectoryNode& DirectoryTree::searchNode(const path& p, const string& where)
+void DirectoryTree::recursiveBuildFromPath(int topfd, const path& p, uint32_t dir)
 {
-    auto it=index.find(p);
-    if(it==index.end())
+    vector<FilesystemElement> elements;
+    //When scanning in parallel or with a hash cache, the hash is computed later
+    ScanOpt elemOpt=scanPool || hashCache ? ScanOpt::OmitHash : opt;
     {
-        string message="DirectoryTree::searchNode could not find the path ";
-        message+=p.string();
-        if(where.empty()==false) message+=". Called from "+where;
-        throw runtime_error(message);
+        ext_directory d(topfd,p);
+        auto names=d.entries();
+        elements.reserve(names.size());
+        for(auto& name : names)
+            elements.push_back(FilesystemElement(d.fd(),name.c_str(),p,
+                                                 elemOpt,hashAlg));
     }
-    return *it->second;
-}
+    sort(elements.begin(),elements.end());
+    uint32_t first=mergeDirectoryContent(dir,elements.data(),elements.size());
 
-void DirectoryTree::checkTopPath(const std::string& where) const
-{
-    if(topPath.has_value()==false)
-        throw runtime_error(where+": DirectoryTree not constructed from filesystem");
+    //NOTE: we list directories, not symlinks to directories. This also
+    //saves us from worrying about filesystem loops through directory symlinks.
+    //Directories are sorted first, so stop at the first non-directory
+    for(uint32_t i=0;i<elements.size();i++)
+    {
+        auto& e=elements[i];
+        if(e.isDirectory()==false) break;
+        if(scanPool==nullptr) recursiveBuildFromPath(topfd,e.relativePath(),first+i);
+        else scanPool->submit([topfd,p=e.relativePath(),index=first+i,this]{
+            recursiveBuildFromPath(topfd,p,index);
+        });
+    }
+    //Hash tasks are queued last so they are run first by this worker, while
+    //idle workers steal directories, this bounds the number of queued tasks
+    if(elemOpt==opt) return; //Hashes already computed, or not needed
+    for(uint32_t i=0;i<elements.size();i++)
+    {
+        if(elements[i].type()!=file_type::regular) continue;
+        if(scanPool==nullptr) hashNode(first+i,elements[i]);
+        else scanPool->submit([e=std::move(elements[i]),index=first+i,this]{
+            hashNode(index,e);
+        });
+    }
 }
 
-void DirectoryTree::fixupParentMtime(const path& parent)
+void DirectoryTree::hashNode(uint32_t index, const FilesystemElement& e)
 {
-    if(parent.empty()) return;
-    //If file is in a subdirectory, fixup mtime of parent directory
-    ext_symlink_last_write_time(topPath.value() / parent,
-                                searchNode(parent).getElement().mtime());
+    FileHash h;
+    if(hashCache) h=hashCache->lookup(e);
+    if(h.empty()) h=hashFile(topPath.value() / e.relativePath(),hashAlg);
+    unique_lock<mutex> l;
+    if(scanMutex) l=unique_lock<mutex>(*scanMutex);
+    nodes[index].fileHash=h;
 }
 
-void DirectoryTree::recursiveBuildFromPath(const path& p)
+void DirectoryTree::recursiveScanTo(int topfd, const path& p, ThreadPool *pool)
 {
-    list<DirectoryNode> nodes, *nodesPtr;
-    for(auto& it : directory_iterator(topPath.value() / p))
-        nodes.push_back(DirectoryNode(FilesystemElement(it.path(),topPath.value(),opt)));
-    nodes.sort();
-    if(topContent.empty())
+    vector<FilesystemElement> elements;
     {
-        topContent=std::move(nodes);
-        nodesPtr=&topContent;
-    } else {
-        auto it=index.find(p.string());
-        assert(it!=index.end());
-        nodesPtr=&it->second->setDirectoryContent(std::move(nodes));
+        ext_directory d(topfd,p);
+        auto names=d.entries();
+        if(pool==nullptr)
+        {
+            elements.reserve(names.size());
+            for(auto& name : names)
+                elements.push_back(FilesystemElement(d.fd(),name.c_str(),p,
+                                                     opt,hashAlg));
+        } else {
+            elements.resize(names.size());
+            //Entries are read in batches, to amortize the cost of the tasks
+            const size_t batchSize=64;
+            for(size_t i=0;i<names.size();i+=batchSize)
+                pool->submit([&elements,&names,&d,&p,i,this]{
+                    for(size_t j=i;j<min(i+batchSize,names.size());j++)
+                        elements[j]=FilesystemElement(d.fd(),names[j].c_str(),
+                                                      p,opt,hashAlg);
+                });
+            pool->wait();
+        }
+    }
+    sort(elements.begin(),elements.end());
+    for(auto& e : elements)
+    {
+        if(e.type()==file_type::unknown)
+            warningCallback(string("Warning: ")+e.relativePath().string()+" unsupported file type");
+        if(e.type()!=file_type::directory && e.hardLinkCount()!=1)
+            warningCallback(string("Warning: ")+e.relativePath().string()+" has multiple hardlinks");
+    }
+
+    //Same output as recursiveWrite
+    if(printBreak) formatter->append('\n');
+    for(auto& e : elements)
+    {
+        formatter->append(e);
+        formatter->append('\n');
+    }
+    printBreak=elements.empty()==false;
+
+    //Only keep the subdirectories while going down, to bound memory use
+    vector<path> subdirectories;
+    for(auto& e : elements)
+    {
+        if(e.isDirectory()==false) break;
+        subdirectories.push_back(e.relativePath());
     }
+    elements=vector<FilesystemElement>();
+    for(auto& d : subdirectories) recursiveScanTo(topfd,d,pool);
+}
 
-    for(auto& n : *nodesPtr)
+uint32_t DirectoryTree::mergeDirectoryContent(uint32_t dir,
+    const FilesystemElement *elements, uint32_t count)
+{
+    //When scanning in parallel, the arena and the warning callback are shared
+    //between tasks
+    unique_lock<mutex> l;
+    if(scanMutex) l=unique_lock<mutex>(*scanMutex);
+    uint32_t first=allocateContent(dir,count);
+    for(uint32_t i=0;i<count;i++)
     {
-        auto& e=n.getElement();
-        auto inserted=index.insert({e.relativePath().string(),&n});
-        assert(inserted.second==true);
+        auto& e=elements[i];
+        auto& n=nodes[first+i];
+        n=makeNode(e);
+        n.parent=dir;
         if(e.type()==file_type::unknown)
             warningCallback(string("Warning: ")+e.relativePath().string()+" unsupported file type");
         if(e.type()!=file_type::directory && e.hardLinkCount()!=1)
             warningCallback(string("Warning: ")+e.relativePath().string()+" has multiple hardlinks");
     }
+    return first;
+}
+
+void DirectoryTree::replaceDirectoryContent(uint32_t dir,
+    const vector<FilesystemElement>& elements, uint32_t count,
+    function<void (uint32_t, const FilesystemElement&)> newDirectory)
+{
+    markChanged(dir);
+    //The old content is only referenced by the subdirectories that are kept,
+    //its space is not reclaimed as when removing entries
+    auto oldContent=getDirectoryContent(nodes[dir]);
+    vector<DirectoryNode> old(oldContent.begin(),oldContent.end());
+    entries-=subtreeSize(nodes[dir])-1;
+    uint32_t first=mergeDirectoryContent(dir,elements.data(),count);
+    for(uint32_t i=0;i<count;i++)
+    {
+        if(elements[i].isDirectory()==false) break;
+        auto& n=nodes[first+i];
+        auto it=lower_bound(old.begin(),old.end(),n);
+        if(it!=old.end() && it->isDirectory() && it->name()==n.name())
+        {
+            n.first=it->first;
+            n.count=it->count;
+            n.capacity=it->capacity;
+            fixupContentParent(first+i);
+            entries+=subtreeSize(n)-1;
+        } else if(newDirectory) newDirectory(first+i,elements[i]);
+    }
+}
+
+void DirectoryTree::markSubtreeChanged(uint32_t dir)
+{
+    if(logState.valid==false) return;
+    markChanged(dir);
+    auto& d=nodes[dir];
+    for(uint32_t i=0;i<d.count;i++)
+    {
+        if(nodes[d.first+i].isDirectory()==false) break;
+        markSubtreeChanged(d.first+i);
+    }
+}
+
+void DirectoryTree::markFilesChanged(const vector<uint32_t>& files)
+{
+    if(logState.valid==false) return;
+    //Files of a directory are contiguous in tree order
+    uint32_t parent=notFound;
+    for(auto index : files)
+    {
+        if(nodes[index].parent==parent) continue;
+        parent=nodes[index].parent;
+        markChanged(parent);
+    }
+}
 
-    for(auto& n : *nodesPtr)
+void DirectoryTree::collectFiles(uint32_t dir, vector<uint32_t>& files,
+                                 bool missingHashes) const
+{
+    for(uint32_t i=0;i<nodes[dir].count;i++)
     {
-        //NOTE: we list directories, not symlinks to directories. This also
-        //saves us from worrying about filesystem loops through directory symlinks.
-        auto& e=n.getElement();
-        if(e.isDirectory()) recursiveBuildFromPath(e.relativePath());
+        auto& n=nodes[nodes[dir].first+i];
+        if(n.isDirectory()) collectFiles(nodes[dir].first+i,files,missingHashes);
+        else if(n.type()==file_type::regular &&
+                (missingHashes==false || n.fileHash.empty()))
+            files.push_back(nodes[dir].first+i);
+    }
+}
+
+size_t DirectoryTree::hashFiles(const vector<uint32_t>& files,
+                               chrono::steady_clock::time_point deadline)
+{
+    markFilesChanged(files);
+    //Files are taken in order, so that those hashed before the deadline are
+    //always the first ones. Each thread writes the hash of different nodes,
+    //and no node is added
+    mutex m;
+    size_t next=0;
+    auto hashNext=[&]{
+        size_t i;
+        {
+            unique_lock<mutex> l(m);
+            if(next>=files.size() || chrono::steady_clock::now()>=deadline) return;
+            i=next++;
+        }
+        auto& n=nodes[files[i]];
+        n.fileHash=hashFile(topPath.value() / relativePath(n),hashAlg);
+    };
+    if(jobs==1 || files.size()<2) for(size_t i=0;i<files.size();i++) hashNext();
+    else {
+        ThreadPool pool(jobs,4096);
+        for(size_t i=0;i<files.size();i++) pool.submit(hashNext);
+        pool.wait();
     }
+    return next;
 }
 
-void DirectoryTree::recursiveWrite(const list<DirectoryNode>& nodes) const
+void DirectoryTree::recursiveWrite(const DirectoryNode& dir, string& dirPath) const
 {
-    if(printBreak) *os<<'\n';
-    for(auto& n : nodes) *os<<n.getElement()<<'\n';
-    printBreak=nodes.empty()==false;
-    for(auto& n : nodes)
+    auto content=getDirectoryContent(dir);
+    if(printBreak) formatter->append('\n');
+    for(auto& n : content)
+    {
+        formatter->append(n,dirPath);
+        formatter->append('\n');
+    }
+    printBreak=content.empty()==false;
+    for(auto& n : content)
     {
-        if(n.getElement().isDirectory()==false) break;
-        recursiveWrite(n.getDirectoryContent());
+        if(n.isDirectory()==false) break;
+        //The path of subdirectories is built in place, to avoid allocations
+        size_t size=dirPath.size();
+        if(size>0) dirPath+='/';
+        dirPath+=n.name();
+        recursiveWrite(n,dirPath);
+        dirPath.resize(size);
     }
 }
 
-DirectoryTree::CopyResult DirectoryTree::treeCopy(const DirectoryTree& srcTree,
+uint32_t DirectoryTree::treeCopy(const DirectoryTree& srcTree,
     const path& relativeSrcPath, const path& relativeDstPath)
 {
-    const auto& src=srcTree.searchNode(relativeSrcPath,"treeCopy: can't find src");
+    srcTree.loadAll();
+    auto src=srcTree.searchIndex(relativeSrcPath,"treeCopy: can't find src");
+    uint32_t dst=0;
     if(relativeDstPath.empty()==false)
     {
-        auto& dst=this->searchNode(relativeDstPath,"treeCopy: can't find dst");
-        if(dst.getElement().isDirectory()==false)
+        dst=this->searchIndex(relativeDstPath,"treeCopy: can't find dst");
+        if(nodes[dst].isDirectory()==false)
             throw runtime_error(string("treeCopy: dst not a directory: ")
                 +relativeDstPath.string());
-        auto& newNode=dst.addToDirectoryContent(src);
-        recursiveAddToIndex(newNode);
-        return CopyResult(src,newNode);
-    } else {
-        auto& e=src.getElement();
-        path name=e.relativePath().filename();
-        assert(name.empty()==false);
-        for(auto& n : topContent) assert(n.getElement().relativePath()!=name);
-        // Assign to the copied node the source element with fixed path
-        DirectoryNode newNode(FilesystemElement(e,name));
-        for(auto& n : src.getDirectoryContent())
-            newNode.addToDirectoryContent(n);
-        topContent.push_back(std::move(newNode));
-        auto& result=topContent.back();
-        topContent.sort(); // Keep topContent sorted
-        recursiveAddToIndex(result);
-        return CopyResult(src,result);
+    }
+    auto& srcNode=srcTree.nodes[src];
+    assert(findIndexInDirectory(nodes[dst],srcNode.name())==notFound);
+    auto result=addToDirectory(dst,copyNode(srcNode));
+    //When copying within the same tree, adding the node may have moved src
+    if(&srcTree==this) src=searchIndex(relativeSrcPath,"treeCopy");
+    recursiveTreeCopy(srcTree,src,result);
+    markSubtreeChanged(result);
+    return result;
+}
+
+void DirectoryTree::recursiveTreeCopy(const DirectoryTree& srcTree, uint32_t srcDir,
+                                      uint32_t dstDir)
+{
+    //NOTE: srcTree may be this, so refer to nodes by index, as allocating
+    //content only appends nodes to the arena this is safe
+    uint32_t srcFirst=srcTree.nodes[srcDir].first;
+    uint32_t count=srcTree.nodes[srcDir].count;
+    uint32_t first=allocateContent(dstDir,count);
+    for(uint32_t i=0;i<count;i++)
+    {
+        auto n=copyNode(srcTree.nodes[srcFirst+i]);
+        n.parent=dstDir;
+        nodes[first+i]=n;
+    }
+    for(uint32_t i=0;i<count;i++)
+    {
+        if(nodes[first+i].isDirectory()==false) break;
+        recursiveTreeCopy(srcTree,srcFirst+i,first+i);
     }
 }
 
-void DirectoryTree::recursiveFilesystemCopy(const path& srcTopPath, CopyResult nodes)
+void DirectoryTree::recursiveFilesystemCopy(const DirectoryTree& srcTree,
+    const DirectoryNode& src, uint32_t dstIndex, const path& srcRelativePath,
+    const path& dstRelativePath, ScanOpt opt)
 {
-    auto e=nodes.dst.getElement();
-    path srcPathAbs=srcTopPath / nodes.src.getElement().relativePath();
-    path dstPathAbs=this->topPath.value() / e.relativePath();
-    switch(e.type())
+    path srcPathAbs=srcTree.topPath.value() / srcRelativePath;
+    path dstPathAbs=this->topPath.value() / dstRelativePath;
+    auto& dst=nodes[dstIndex];
+    switch(dst.type())
     {
         case file_type::regular:
-            //NOTE: copy_file copies also permissions
-            if(copy_file(srcPathAbs,dstPathAbs)==false)
-                throw runtime_error(string("Error copying ")
-                    +srcPathAbs.string()+" to "+dstPathAbs.string());
-            break;
-        case file_type::symlink:
-            copy_symlink(srcPathAbs,dstPathAbs);
-            break;
-        case file_type::directory:
-            if(create_directory(dstPathAbs)==false)
-                throw runtime_error(string("Error creating directory ")
-                    +dstPathAbs.string());
-            for(auto& contentSrc : nodes.src.getDirectoryContent())
+        {
+            //When batching, files are copied by the threads of the batch, and
+            //their hash is set in the tree once the batch is waited for
+            bool hash=opt==ScanOpt::ComputeHash && dst.fileHash.empty();
+            //Hashes computed with another algorithm can't be looked up
+            FileHash srcHash;
+            if(srcTree.hashAlg==hashAlg) srcHash=src.fileHash;
+            if(!batch)
             {
-                path p=e.relativePath() /
-                    contentSrc.getElement().relativePath().filename();
-                auto& contentDst=this->searchNode(p);
-                recursiveFilesystemCopy(srcTopPath,CopyResult(contentSrc,contentDst));
+                auto fileHash=copyRegularFile(srcPathAbs,dstPathAbs,srcHash,dst,hash);
+                if(hash) dst.fileHash=fileHash;
+                return;
             }
-            permissions(dstPathAbs,e.permissions());
-            break;
+            batch->submitted.insert(dstPathAbs.string());
+            batch->pool.submit([this,srcPathAbs,dstPathAbs,dstRelativePath,
+                                srcHash,node=dst,hash]{
+                auto fileHash=copyRegularFile(srcPathAbs,dstPathAbs,srcHash,node,hash);
+                if(hash==false) return;
+                unique_lock<mutex> l(batch->m);
+                batch->hashes.emplace_back(dstRelativePath,fileHash);
+            });
+            return;
+        }
+        case file_type::symlink:
+            if(remote) fsCreateSymlink(string(dst.symlinkTarget()),dstPathAbs);
+            else copy_symlink(srcPathAbs,dstPathAbs);
+            copyOwnerAndMtime(dstPathAbs,dst);
+            return;
+        case file_type::directory:
+        {
+            fsCreateDirectory(dstPathAbs);
+            //The content of dst is a copy of the content of src, in the same order
+            auto srcContent=srcTree.getDirectoryContent(src);
+            auto dstContent=this->getDirectoryContent(dst);
+            assert(srcContent.size()==dstContent.size());
+            for(size_t i=0;i<srcContent.size();i++)
+                recursiveFilesystemCopy(srcTree,srcContent[i],dst.first+i,
+                                        srcRelativePath / srcContent[i].name(),
+                                        dstRelativePath / dstContent[i].name(),opt);
+            //Fix attributes last, as writing the content would alter mtime
+            //again, and the permissions may not allow writing it. When
+            //batching, this waits for the content to be copied
+            auto complete=[this,dstPathAbs,node=dst]{
+                fsPermissions(dstPathAbs,node.permissions());
+                copyOwnerAndMtime(dstPathAbs,node);
+            };
+            if(batch) batch->directories.push_back(complete);
+            else complete();
+            return;
+        }
         default:
             throw runtime_error(string("DirectoryTree::recursiveFilesystemCopy")
                 +": unknown file type "+srcPathAbs.string());
     }
-    //Don't consider owner/group setting failure an error
-    try {
-        ext_symlink_change_ownership(dstPathAbs,e.user(),e.group());
-    } catch(exception& e) {
-        warningCallback(string("Warning: could not change ownership of ")
-            +dstPathAbs.string()+": maybe retry with sudo?");
-    }
-    //Fix mtime last, for directories it's important as recursive write would
-    //alter mtime again
-    ext_symlink_last_write_time(dstPathAbs,e.mtime());
 }
 
-void DirectoryTree::recursiveAddToIndex(const DirectoryNode& node)
+FileHash DirectoryTree::copyFile(const path& from, const path& to,
+    const DirectoryNode& node, bool hash)
+{
+    //Files are copied with their attributes, and hashed while copying if needed
+    auto& names=NameTable::instance();
+    optional<Hasher> hasher;
+    if(hash) hasher.emplace(hashAlg);
+    function<void (const unsigned char*, size_t)> read;
+    if(hasher) read=[&hasher](const unsigned char *data, size_t size){
+        hasher->update(data,size);
+    };
+    if(ext_copy_file(from,to,node.permissions(),names.name(node.us),
+        names.name(node.gs),node.mtime(),read)==false)
+        warning(string("Warning: could not change ownership of ")
+            +to.string()+": maybe retry with sudo?");
+    if(!hasher) return FileHash();
+    unsigned char digest[maxHashSize];
+    hasher->final(digest);
+    return FileHash(digest,hashSize(hashAlg));
+}
+
+FileHash DirectoryTree::copyRegularFile(const path& from, const path& to,
+    FileHash fromHash, const DirectoryNode& node, bool hash)
 {
-    //NOTE: we don't modify any DirectoryNode, but we need to put in the
-    //index non-const pointers to the nodes, hence the const_cast
-    auto inserted=index.insert({node.getElement().relativePath().string(),
-         const_cast<DirectoryNode*>(&node)});
-    assert(inserted.second);
-    for(auto& n : node.getDirectoryContent())
+    countEntries(1,node.size());
+    if(remote)
     {
-        if(n.getElement().isDirectory())
-        {
-            //The recursive call will add the element itself too
-            recursiveAddToIndex(n);
-        } else {
-            auto inserted=index.insert({n.getElement().relativePath().string(),
-                const_cast<DirectoryNode*>(&n)});
-            assert(inserted.second);
-        }
+        auto& names=NameTable::instance();
+        auto result=remote->copyFile(from,to,node.permissions(),names.name(node.us),
+            names.name(node.gs),node.mtime(),hashAlg,hash);
+        fsSync();
+        return result;
     }
+    //Hashing from only to look it up would read it twice when it is not found
+    if(contentIndex==nullptr || fromHash.empty() ||
+       contentIndex->hasSize(node.size())==false)
+        return copyFile(from,to,node,hash);
+    auto local=contentIndex->find(node.size(),fromHash);
+    if(local==nullptr) return copyFile(from,to,node,hash);
+    //The local file may have changed since it was added to the index, so the
+    //copy is hashed, which with a reflink only reads the file
+    if(copyFile(topPath.value() / *local,to,node,true)!=fromHash)
+    {
+        warning(string("Warning: ")+(topPath.value() / *local).string()
+            +" does not match its metadata, copying "+from.string()+" instead");
+        remove(to);
+        return copyFile(from,to,node,hash);
+    }
+    if(batch)
+    {
+        unique_lock<mutex> l(batch->m);
+        indexCopies++;
+    } else indexCopies++;
+    return hash ? fromHash : FileHash();
+}
+
+void DirectoryTree::copyOwnerAndMtime(const path& absPath, const DirectoryNode& node)
+{
+    auto& names=NameTable::instance();
+    fsOwner(absPath,names.name(node.us),names.name(node.gs));
+    fsMtime(absPath,node.mtime());
+}
+
+void DirectoryTree::fsCreateDirectory(const path& absPath)
+{
+    if(remote)
+    {
+        remote->createDirectory(absPath);
+        fsSync();
+    } else if(create_directory(absPath)==false)
+        throw runtime_error(string("Error creating directory ")+absPath.string());
+}
+
+void DirectoryTree::fsCreateSymlink(const string& target, const path& absPath)
+{
+    if(remote)
+    {
+        remote->createSymlink(target,absPath);
+        fsSync();
+    } else create_symlink(target,absPath);
+}
+
+void DirectoryTree::fsPermissions(const path& absPath, perms perm)
+{
+    if(remote)
+    {
+        remote->setPermissions(absPath,perm);
+        fsSync();
+    } else permissions(absPath,perm);
 }
 
-void DirectoryTree::recursiveRemoveFromIndex(const DirectoryNode& node)
+void DirectoryTree::fsOwner(const path& absPath, const string& user, const string& group)
 {
-    for(auto& n : node.getDirectoryContent())
+    if(remote)
     {
-        if(n.getElement().isDirectory()) recursiveRemoveFromIndex(n);
-        int cnt=index.erase(n.getElement().relativePath().string());
-        assert(cnt==1);
+        remote->setOwner(absPath,user,group);
+        fsSync();
+        return;
+    }
+    //Don't consider owner/group setting failure an error
+    try {
+        ext_symlink_change_ownership(absPath,user,group);
+    } catch(exception&) {
+        warning(string("Warning: could not change ownership of ")
+            +absPath.string()+": maybe retry with sudo?");
     }
 }
 
+void DirectoryTree::fsMtime(const path& absPath, time_t mtime)
+{
+    if(remote)
+    {
+        remote->setMtime(absPath,mtime);
+        fsSync();
+    } else ext_symlink_last_write_time(absPath,mtime);
+}
+
+void DirectoryTree::fsSync()
+{
+    if(remote && !batch) remote->sync();
+}
+
 //
 // class DirectoryDiff
 //
@@ -839,68 +3428,191 @@ ostream& operator<<(ostream& os, const DirectoryDiff<3>& diff)
     return os;
 }
 
+/**
+ * \return the smallest name among the given nodes, that must not all be nullptr
+ */
+static string_view minName(initializer_list<const DirectoryNode*> nodes)
+{
+    const DirectoryNode *result=nullptr;
+    for(auto n : nodes) if(n && (!result || n->name()<result->name())) result=n;
+    assert(result);
+    return result->name();
+}
+
+/**
+ * Collects the parts of a diff computed in parallel. To split the work, the
+ * first levels of the trees are compared sequentially, while the comparison of
+ * the deeper common directories is done by tasks run by a thread pool. Every
+ * directory compared sequentially and every task produce a separate part of
+ * the diff, in the same order a sequential diff produces them, so the result
+ * does not depend on the number of threads
+ */
+template<unsigned N>
+class DiffParts
+{
+public:
+    /// Common directories at this depth are compared by a separate task
+    static const unsigned splitDepth=2;
+
+    /**
+     * Constructor
+     * \param jobs number of threads, if 0 use the hardware concurrency
+     */
+    explicit DiffParts(unsigned jobs) : jobs(jobs) {}
+
+    /**
+     * \return a new part, appended after the existing ones
+     */
+    DirectoryDiff<N>& addPart()
+    {
+        parts.emplace_back();
+        return parts.back();
+    }
+
+    /**
+     * Append a new part, that will be computed by a task
+     * \param task task that fills the part
+     */
+    void addTask(function<void (DirectoryDiff<N>&)> task)
+    {
+        auto& part=addPart();
+        tasks.push_back([task,&part]{ task(part); });
+    }
+
+    /**
+     * Run the tasks and join all the parts
+     * \return the diff
+     */
+    DirectoryDiff<N> join()
+    {
+        if(tasks.empty()==false)
+        {
+            ThreadPool pool(jobs);
+            for(auto& task : tasks) pool.submit(std::move(task));
+            pool.wait();
+        }
+        DirectoryDiff<N> result;
+        for(auto& part : parts) result.splice(result.end(),part);
+        return result;
+    }
+
+private:
+    const unsigned jobs;
+    deque<DirectoryDiff<N>> parts; ///< Deque, so tasks can refer to parts
+    vector<function<void ()>> tasks;
+};
+
+/**
+ * \return true if the content of two directories is known to be the same from
+ * their digests, so comparing it can be skipped
+ */
+static bool sameContent(const DirectoryTree& a, const DirectoryNode& aDir,
+                        const DirectoryTree& b, const DirectoryNode& bDir,
+                        const CompareOpt& opt)
+{
+    auto aDigest=a.getDirectoryDigest(aDir);
+    auto bDigest=b.getDirectoryDigest(bDir);
+    return aDigest && bDigest && compare(*aDigest,*bDigest,opt);
+}
+
 /**
  * Helper class to implement diff2 recursively
  */
 class Diff2Helper
 {
 public:
+    typedef array<const DirectoryNode*,2> Directories;
+
     Diff2Helper(const DirectoryTree& a, const DirectoryTree& b,
-                const CompareOpt& opt)
-        : aIndex(a.getIndex()), bIndex(b.getIndex()), opt(opt) {}
+                const CompareOpt& opt) : a(a), b(b), opt(opt) {}
+
+    void recursiveCompare(const DirectoryNode& aDir, const DirectoryNode& bDir);
 
-    Diff2Helper(const unordered_map<string,DirectoryNode*>& aIndex,
-                const unordered_map<string,DirectoryNode*>& bIndex,
-                const CompareOpt& opt)
-        : aIndex(aIndex), bIndex(bIndex), opt(opt) {}
+    void splitCompare(const DirectoryNode& aDir, const DirectoryNode& bDir,
+                      unsigned depth, DiffParts<2>& parts);
 
-    void recursiveCompare(const list<DirectoryNode>& a,
-                          const list<DirectoryNode>& b);
+    /// Compare the content of two directories, not recursively
+    /// \return the common directories in the content
+    vector<Directories> compareContent(const DirectoryNode& aDir,
+                                       const DirectoryNode& bDir);
 
-    const unordered_map<string,DirectoryNode*>& aIndex;
-    const unordered_map<string,DirectoryNode*>& bIndex;
+    const DirectoryTree& a;
+    const DirectoryTree& b;
     const CompareOpt opt;
     DirectoryDiff<2> result;
 };
 
-void Diff2Helper::recursiveCompare(const list<DirectoryNode>& a,
-                                   const list<DirectoryNode>& b)
+void Diff2Helper::recursiveCompare(const DirectoryNode& aDir,
+                                   const DirectoryNode& bDir)
+{
+    auto commonDrectories=compareContent(aDir,bDir);
+    for(auto& dirs : commonDrectories) recursiveCompare(*dirs[0],*dirs[1]);
+}
+
+void Diff2Helper::splitCompare(const DirectoryNode& aDir, const DirectoryNode& bDir,
+                               unsigned depth, DiffParts<2>& parts)
+{
+    auto commonDrectories=compareContent(aDir,bDir);
+    parts.addPart()=std::move(result);
+    result.clear();
+    for(auto& dirs : commonDrectories)
+    {
+        if(depth+1<parts.splitDepth)
+            splitCompare(*dirs[0],*dirs[1],depth+1,parts);
+        else parts.addTask([this,dirs](DirectoryDiff<2>& part){
+            Diff2Helper cmp(a,b,opt);
+            cmp.recursiveCompare(*dirs[0],*dirs[1]);
+            part=std::move(cmp.result);
+        });
+    }
+}
+
+vector<Diff2Helper::Directories> Diff2Helper::compareContent(
+    const DirectoryNode& aDir, const DirectoryNode& bDir)
 {
-    unordered_set<string> itemNames;
-    for(auto& n : a) itemNames.insert(n.getElement().relativePath().string());
-    for(auto& n : b) itemNames.insert(n.getElement().relativePath().string());
-    list<array<DirectoryNode*,2>> commonDrectories;
-    for(auto& itn : itemNames)
+    //Subtrees that did not change are skipped without accessing their content
+    if(sameContent(a,aDir,b,bDir,opt)) return {};
+    //Merge the two directories in name order, then go down common directories,
+    //so the diff is in a deterministic order
+    NameOrderCursor aCur(a.getDirectoryContent(aDir));
+    NameOrderCursor bCur(b.getDirectoryContent(bDir));
+    vector<Directories> commonDrectories;
+    while(aCur.get() || bCur.get())
     {
-        auto ita=aIndex.find(itn);
-        auto itb=bIndex.find(itn);
-        if(ita!=aIndex.end() && itb!=bIndex.end())
+        auto name=minName({aCur.get(),bCur.get()});
+        auto an=aCur.get(name);
+        auto bn=bCur.get(name);
+        if(an && bn)
         {
-            auto& ae=ita->second->getElement();
-            auto& be=itb->second->getElement();
-            if(compare(ae,be,opt)==false) result.push_back({ae,be});
+            if(compare(*an,*bn,opt)==false)
+                result.push_back({a.getElement(*an),b.getElement(*bn)});
 
             // Pruning comparison, only go down common directories
-            if(ae.isDirectory() && be.isDirectory())
-                commonDrectories.push_back({ita->second,itb->second});
-        } else if(ita==aIndex.end() && itb!=bIndex.end()) {
-            result.push_back({nullopt,itb->second->getElement()});
-        } else if(ita!=aIndex.end() && itb==bIndex.end()) {
-            result.push_back({ita->second->getElement(),nullopt});
-        } else assert(false);
-    }
-    itemNames.clear(); //Save memory while doing recursion
-    for(auto& dirs : commonDrectories)
-        recursiveCompare(dirs[0]->getDirectoryContent(),
-                         dirs[1]->getDirectoryContent());
+            if(an->isDirectory() && bn->isDirectory())
+                commonDrectories.push_back({an,bn});
+        } else if(bn) {
+            result.push_back({nullopt,b.getElement(*bn)});
+        } else {
+            result.push_back({a.getElement(*an),nullopt});
+        }
+        if(an) aCur.next();
+        if(bn) bCur.next();
+    }
+    return commonDrectories;
 }
 
 DirectoryDiff<2> diff2(const DirectoryTree& a, const DirectoryTree& b,
-                       const CompareOpt& opt)
+                       const CompareOpt& opt, unsigned jobs)
 {
     Diff2Helper cmp(a,b,opt);
-    cmp.recursiveCompare(a.getTreeRoot(),b.getTreeRoot());
-    return std::move(cmp.result);
+    if(jobs==1)
+    {
+        cmp.recursiveCompare(a.getTreeRoot(),b.getTreeRoot());
+        return std::move(cmp.result);
+    }
+    DiffParts<2> parts(jobs);
+    cmp.splitCompare(a.getTreeRoot(),b.getTreeRoot(),0,parts);
+    return parts.join();
 }
 
 /**
@@ -909,123 +3621,194 @@ DirectoryDiff<2> diff2(const DirectoryTree& a, const DirectoryTree& b,
 class Diff3Helper
 {
 public:
+    typedef array<const DirectoryNode*,3> Directories;
+
     Diff3Helper(const DirectoryTree& a, const DirectoryTree& b,
                 const DirectoryTree& c, const CompareOpt& opt)
-        : aIndex(a.getIndex()), bIndex(b.getIndex()), cIndex(c.getIndex()),
-          opt(opt) {}
+        : a(a), b(b), c(c), opt(opt) {}
+
+    void recursiveCompare(const DirectoryNode& aDir, const DirectoryNode& bDir,
+                          const DirectoryNode& cDir);
+
+    void splitCompare(const DirectoryNode& aDir, const DirectoryNode& bDir,
+                      const DirectoryNode& cDir, unsigned depth,
+                      DiffParts<3>& parts);
 
-    void recursiveCompare(const list<DirectoryNode>& a,
-                          const list<DirectoryNode>& b,
-                          const list<DirectoryNode>& c);
+    /// Compare the content of three directories, not recursively
+    /// \return the directories in the content that need to be compared
+    vector<Directories> compareContent(const DirectoryNode& aDir,
+                                       const DirectoryNode& bDir,
+                                       const DirectoryNode& cDir);
 
-    const unordered_map<string,DirectoryNode*>& aIndex;
-    const unordered_map<string,DirectoryNode*>& bIndex;
-    const unordered_map<string,DirectoryNode*>& cIndex;
+    /// Compare the nodes with the same name in the three trees, of which at
+    /// least one is not nullptr, not recursively
+    void compareEntry(const DirectoryNode *an, const DirectoryNode *bn,
+                      const DirectoryNode *cn, vector<Directories>& commonDrectories);
+
+    /// Recursively compare the content of directories with the same name, of
+    /// which at most one is nullptr
+    void compareDirectories(const Directories& dirs);
+
+    const DirectoryTree& a;
+    const DirectoryTree& b;
+    const DirectoryTree& c;
     const CompareOpt opt;
     DirectoryDiff<3> result;
 };
 
-void Diff3Helper::recursiveCompare(const list<DirectoryNode>& a,
-                                   const list<DirectoryNode>& b,
-                                   const list<DirectoryNode>& c)
-{
-    unordered_set<string> itemNames;
-    for(auto& n : a) itemNames.insert(n.getElement().relativePath().string());
-    for(auto& n : b) itemNames.insert(n.getElement().relativePath().string());
-    for(auto& n : c) itemNames.insert(n.getElement().relativePath().string());
-    list<array<DirectoryNode*,3>> commonDrectories;
-    for(auto& itn : itemNames)
-    {
-        auto ita=aIndex.find(itn);
-        auto itb=bIndex.find(itn);
-        auto itc=cIndex.find(itn);
-        array<unordered_map<string,DirectoryNode*>::const_iterator,3> existing;
-        int numExisting=0;
-        if(ita!=aIndex.end()) existing[numExisting++]=ita;
-        if(itb!=bIndex.end()) existing[numExisting++]=itb;
-        if(itc!=cIndex.end()) existing[numExisting++]=itc;
-        assert(numExisting>0);
-        if(numExisting==3)
-        {
-            auto& ae=ita->second->getElement();
-            auto& be=itb->second->getElement();
-            auto& ce=itc->second->getElement();
-            bool ab=compare(ae,be,opt);
-            bool bc=compare(be,ce,opt);
-            if(ab==false || bc==false) result.push_back({ae,be,ce});
-            else assert(compare(ae,ce,opt)); //Transitive property check
-
-            int numDirs=0;
-            if(ae.isDirectory()) numDirs++;
-            if(be.isDirectory()) numDirs++;
-            if(ce.isDirectory()) numDirs++;
-            //Pruning comparison, only go down if more than one directory
-            if(numDirs>=2)
-                commonDrectories.push_back({
-                    ae.isDirectory() ? ita->second : nullptr,
-                    be.isDirectory() ? itb->second : nullptr,
-                    ce.isDirectory() ? itc->second : nullptr
-                });
-        } else {
-            //At least one element is missing, it's always a difference
-            #define OP(x) optional<FilesystemElement>(x)
-            result.push_back({
-                ita!=aIndex.end() ? OP(ita->second->getElement()) : nullopt,
-                itb!=bIndex.end() ? OP(itb->second->getElement()) : nullopt,
-                itc!=cIndex.end() ? OP(itc->second->getElement()) : nullopt
+void Diff3Helper::recursiveCompare(const DirectoryNode& aDir,
+                                   const DirectoryNode& bDir,
+                                   const DirectoryNode& cDir)
+{
+    auto commonDrectories=compareContent(aDir,bDir,cDir);
+    for(auto& dirs : commonDrectories) compareDirectories(dirs);
+}
+
+void Diff3Helper::splitCompare(const DirectoryNode& aDir, const DirectoryNode& bDir,
+                               const DirectoryNode& cDir, unsigned depth,
+                               DiffParts<3>& parts)
+{
+    auto commonDrectories=compareContent(aDir,bDir,cDir);
+    parts.addPart()=std::move(result);
+    result.clear();
+    for(auto& dirs : commonDrectories)
+    {
+        if(depth+1<parts.splitDepth && dirs[0] && dirs[1] && dirs[2])
+            splitCompare(*dirs[0],*dirs[1],*dirs[2],depth+1,parts);
+        else parts.addTask([this,dirs](DirectoryDiff<3>& part){
+            Diff3Helper cmp(a,b,c,opt);
+            cmp.compareDirectories(dirs);
+            part=std::move(cmp.result);
+        });
+    }
+}
+
+vector<Diff3Helper::Directories> Diff3Helper::compareContent(
+    const DirectoryNode& aDir, const DirectoryNode& bDir, const DirectoryNode& cDir)
+{
+    //Subtrees that did not change are skipped without accessing their content
+    if(sameContent(a,aDir,b,bDir,opt) && sameContent(b,bDir,c,cDir,opt)) return {};
+    //Merge the three directories in name order, then go down common
+    //directories, so the diff is in a deterministic order
+    NameOrderCursor aCur(a.getDirectoryContent(aDir));
+    NameOrderCursor bCur(b.getDirectoryContent(bDir));
+    NameOrderCursor cCur(c.getDirectoryContent(cDir));
+    vector<Directories> commonDrectories;
+    while(aCur.get() || bCur.get() || cCur.get())
+    {
+        auto name=minName({aCur.get(),bCur.get(),cCur.get()});
+        auto an=aCur.get(name);
+        auto bn=bCur.get(name);
+        auto cn=cCur.get(name);
+        compareEntry(an,bn,cn,commonDrectories);
+        if(an) aCur.next();
+        if(bn) bCur.next();
+        if(cn) cCur.next();
+    }
+    return commonDrectories;
+}
+
+void Diff3Helper::compareEntry(const DirectoryNode *an, const DirectoryNode *bn,
+    const DirectoryNode *cn, vector<Directories>& commonDrectories)
+{
+    array<const DirectoryNode*,3> existing;
+    int numExisting=0;
+    if(an) existing[numExisting++]=an;
+    if(bn) existing[numExisting++]=bn;
+    if(cn) existing[numExisting++]=cn;
+    assert(numExisting>0);
+    if(numExisting==3)
+    {
+        bool ab=compare(*an,*bn,opt);
+        bool bc=compare(*bn,*cn,opt);
+        if(ab==false || bc==false)
+            result.push_back({a.getElement(*an),b.getElement(*bn),
+                              c.getElement(*cn)});
+        else assert(compare(*an,*cn,opt)); //Transitive property check
+
+        int numDirs=0;
+        if(an->isDirectory()) numDirs++;
+        if(bn->isDirectory()) numDirs++;
+        if(cn->isDirectory()) numDirs++;
+        //Pruning comparison, only go down if more than one directory
+        if(numDirs>=2)
+            commonDrectories.push_back({
+                an->isDirectory() ? an : nullptr,
+                bn->isDirectory() ? bn : nullptr,
+                cn->isDirectory() ? cn : nullptr
             });
-            #undef OP
-
-            //Pruning comparison, only go down if more than one directory
-            if(numExisting==2 &&
-               existing[0]->second->getElement().isDirectory() &&
-               existing[1]->second->getElement().isDirectory())
-                    commonDrectories.push_back({
-                        ita!=aIndex.end() ? ita->second : nullptr,
-                        itb!=bIndex.end() ? itb->second : nullptr,
-                        itc!=cIndex.end() ? itc->second : nullptr
-                    });
-        }
+    } else {
+        //At least one element is missing, it's always a difference
+        #define OP(t,x) optional<FilesystemElement>(t.getElement(*x))
+        result.push_back({
+            an ? OP(a,an) : nullopt,
+            bn ? OP(b,bn) : nullopt,
+            cn ? OP(c,cn) : nullopt
+        });
+        #undef OP
+
+        //Pruning comparison, only go down if more than one directory
+        if(numExisting==2 &&
+           existing[0]->isDirectory() && existing[1]->isDirectory())
+                commonDrectories.push_back({an,bn,cn});
     }
-    itemNames.clear(); //Save memory while doing recursion
-    for(auto& dirs : commonDrectories)
+}
+
+void Diff3Helper::compareDirectories(const Directories& dirs)
+{
+    if(dirs[0] && dirs[1] && dirs[2])
     {
-        if(dirs[0] && dirs[1] && dirs[2])
+        //Three non-null directories, continue 3-way diff
+        recursiveCompare(*dirs[0],*dirs[1],*dirs[2]);
+    } else {
+        //One directory is null, problem reduces to a 2-way diff
+        if(dirs[0]==nullptr)
         {
-            //Three non-null directories, continue 3-way diff
-            recursiveCompare(dirs[0]->getDirectoryContent(),
-                             dirs[1]->getDirectoryContent(),
-                             dirs[2]->getDirectoryContent());
-        } else {
-            //One directory is null, problem reduces to a 2-way diff
-            if(dirs[0]==nullptr)
-            {
-                assert(dirs[1] && dirs[2]);
-                Diff2Helper cmp(bIndex,cIndex,opt);
-                cmp.recursiveCompare(dirs[1]->getDirectoryContent(),
-                                     dirs[2]->getDirectoryContent());
-                for(auto& r : cmp.result) result.push_back({nullopt,r[0],r[1]});
-            } else if(dirs[1]==nullptr) {
-                assert(dirs[0] && dirs[2]);
-                Diff2Helper cmp(aIndex,cIndex,opt);
-                cmp.recursiveCompare(dirs[0]->getDirectoryContent(),
-                                     dirs[2]->getDirectoryContent());
-                for(auto& r : cmp.result) result.push_back({r[0],nullopt,r[1]});
-            } else if(dirs[2]==nullptr) {
-                assert(dirs[0] && dirs[1]);
-                Diff2Helper cmp(aIndex,bIndex,opt);
-                cmp.recursiveCompare(dirs[0]->getDirectoryContent(),
-                                     dirs[1]->getDirectoryContent());
-                for(auto& r : cmp.result) result.push_back({r[0],r[1],nullopt});
-            }
+            assert(dirs[1] && dirs[2]);
+            Diff2Helper cmp(b,c,opt);
+            cmp.recursiveCompare(*dirs[1],*dirs[2]);
+            for(auto& r : cmp.result) result.push_back({nullopt,r[0],r[1]});
+        } else if(dirs[1]==nullptr) {
+            assert(dirs[0] && dirs[2]);
+            Diff2Helper cmp(a,c,opt);
+            cmp.recursiveCompare(*dirs[0],*dirs[2]);
+            for(auto& r : cmp.result) result.push_back({r[0],nullopt,r[1]});
+        } else if(dirs[2]==nullptr) {
+            assert(dirs[0] && dirs[1]);
+            Diff2Helper cmp(a,b,opt);
+            cmp.recursiveCompare(*dirs[0],*dirs[1]);
+            for(auto& r : cmp.result) result.push_back({r[0],r[1],nullopt});
         }
     }
 }
 
 DirectoryDiff<3> diff3(const DirectoryTree& a, const DirectoryTree& b,
-                       const DirectoryTree& c, const CompareOpt& opt)
+                       const DirectoryTree& c, const CompareOpt& opt,
+                       unsigned jobs)
+{
+    Diff3Helper cmp(a,b,c,opt);
+    if(jobs==1)
+    {
+        cmp.recursiveCompare(a.getTreeRoot(),b.getTreeRoot(),c.getTreeRoot());
+        return std::move(cmp.result);
+    }
+    DiffParts<3> parts(jobs);
+    cmp.splitCompare(a.getTreeRoot(),b.getTreeRoot(),c.getTreeRoot(),0,parts);
+    return parts.join();
+}
+
+DirectoryDiff<3> diff3Subtree(const DirectoryTree& a, const DirectoryTree& b,
+                              const DirectoryTree& c, const path& relativePath,
+                              const CompareOpt& opt)
 {
+    if(relativePath.empty()) return diff3(a,b,c,opt);
+    auto an=a.getIndex().find(relativePath);
+    auto bn=b.getIndex().find(relativePath);
+    auto cn=c.getIndex().find(relativePath);
     Diff3Helper cmp(a,b,c,opt);
-    cmp.recursiveCompare(a.getTreeRoot(),b.getTreeRoot(),c.getTreeRoot());
+    if(!an && !bn && !cn) return std::move(cmp.result);
+    vector<Diff3Helper::Directories> commonDrectories;
+    cmp.compareEntry(an,bn,cn,commonDrectories);
+    for(auto& dirs : commonDrectories) cmp.compareDirectories(dirs);
     return std::move(cmp.result);
 }
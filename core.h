@@ -22,18 +22,24 @@
 #include <ostream>
 #include <istream>
 #include <list>
+#include <deque>
+#include <vector>
 #include <array>
+#include <memory>
+#include <string_view>
 #include <optional>
+#include <set>
 #include <unordered_map>
 #include <functional>
+#include <mutex>
 #include <ctime>
+#include <chrono>
+#include "hash.h"
 
-/**
- * Computes SHA1 of a file. Only to detect changes, no crypto strength needed
- * \param p file path
- * \return a string with the SHA1 hash in ASCII hex digits
- */
-std::string hashFile(const std::filesystem::path& p);
+class ThreadPool;
+class MetadataFormatter;
+class RemoteTarget;
+class ext_file_status;
 
 /**
  * Directory tree scanning options
@@ -44,6 +50,53 @@ enum class ScanOpt
     OmitHash     ///< When scanning directories, omit file hash computation
 };
 
+/**
+ * Metadata file formats
+ */
+enum class MetadataFormat
+{
+    Text,  ///< Human readable text, one line per file
+    Binary ///< Compact binary format, with a checksum per directory
+};
+
+/**
+ * Global table of interned strings. A directory tree usually has only a
+ * handful of distinct users and groups, so FilesystemElement stores them as
+ * ids into this table instead of storing a copy of the strings for every file.
+ * The table is shared by all directory trees, so ids can be compared also
+ * between elements of different trees. Thread safe.
+ */
+class NameTable
+{
+public:
+    /**
+     * \return the only instance of the table
+     */
+    static NameTable& instance();
+
+    /**
+     * \param name string to intern
+     * \return the id of the string, the same string always has the same id.
+     * The empty string has id 0
+     */
+    uint32_t intern(const std::string& name);
+
+    /**
+     * \param id id returned by a previous call to intern()
+     * \return the corresponding string
+     */
+    const std::string& name(uint32_t id) const;
+
+private:
+    NameTable() { intern(""); }
+    NameTable(const NameTable&)=delete;
+    NameTable& operator=(const NameTable&)=delete;
+
+    mutable std::mutex m;
+    std::unordered_map<std::string,uint32_t> ids;
+    std::deque<std::string> names; ///< Deque, so references are never invalidated
+};
+
 /**
  * Compare options for directory tree comparisons
  */
@@ -78,22 +131,41 @@ public:
      * \param p absolute path
      * \param top top level directory, used to compute relative path
      * \param opt scan options
+     * \param alg hash algorithm
      */
     FilesystemElement(const std::filesystem::path& p,
                       const std::filesystem::path& top,
-                      ScanOpt opt=ScanOpt::ComputeHash);
+                      ScanOpt opt=ScanOpt::ComputeHash,
+                      HashAlgorithm alg=HashAlgorithm::SHA1);
+
+    /**
+     * Constructor from an entry of an open directory, faster than from a path
+     * as the kernel does not walk the full path of the entry
+     * \param dirfd file descriptor of the directory, see ext_directory
+     * \param name name of the entry in the directory
+     * \param dirPath path of the directory relative to the top level
+     * directory, used to compute relative path
+     * \param opt scan options
+     * \param alg hash algorithm
+     */
+    FilesystemElement(int dirfd, const char *name,
+                      const std::filesystem::path& dirPath,
+                      ScanOpt opt=ScanOpt::ComputeHash,
+                      HashAlgorithm alg=HashAlgorithm::SHA1);
 
     /**
      * Constructor from string, used when reading from metadata files
      * \param metadataLine line of the metadata file to construct the object from
      * \param metadataFileName name of metadata file, used for error reporting
      * \param lineNo line number of metadata file, used for error reporting
+     * \param alg hash algorithm of the metadata file
      * \throws runtime_error in case of errors
      */
-    explicit FilesystemElement(const std::string& metadataLine,
-                               const std::string& metadataFileName="", int lineNo=-1)
+    explicit FilesystemElement(std::string_view metadataLine,
+                               const std::string& metadataFileName="", int lineNo=-1,
+                               HashAlgorithm alg=HashAlgorithm::SHA1)
     {
-        readFrom(metadataLine,metadataFileName,lineNo);
+        readFrom(metadataLine,metadataFileName,lineNo,alg);
     }
 
     /**
@@ -111,10 +183,13 @@ public:
      * \param metadataLine line of the metadata file to construct the object from
      * \param metadataFileName name of metadata file, used for error reporting
      * \param lineNo line number of metadata file, used for error reporting
+     * \param alg hash algorithm of the metadata file, used to validate the
+     * hash length
      * \throws runtime_error in case of errors
      */
-    void readFrom(const std::string& metadataLine,
-                  const std::string& metadataFileName="", int lineNo=-1);
+    void readFrom(std::string_view metadataLine,
+                  const std::string& metadataFileName="", int lineNo=-1,
+                  HashAlgorithm alg=HashAlgorithm::SHA1);
 
     /**
      * Write the object to an ostream based on the metadata file format
@@ -145,22 +220,22 @@ public:
     /**
      * \return the owner (user) of the FilesystemElement as a string
      */
-    std::string user() const { return us; }
+    const std::string& user() const { return NameTable::instance().name(us); }
 
     /**
      * Modify user
      */
-    void setUser(const std::string& us) { this->us=us; }
+    void setUser(const std::string& us) { this->us=NameTable::instance().intern(us); }
 
     /**
      * \return the group of the FilesystemElement as a string
      */
-    std::string group() const { return gs; }
+    const std::string& group() const { return NameTable::instance().name(gs); }
 
     /**
      * Modify group
      */
-    void setGroup(const std::string& gs) { this->gs=gs; }
+    void setGroup(const std::string& gs) { this->gs=NameTable::instance().intern(gs); }
 
     /**
      * \return the last modified time
@@ -182,14 +257,22 @@ public:
      * If the FilesystemElement is a regular file and the hash computation was
      * omitted, compute it now, otherwise do nothing
      * \param top top level directory, used to compute absolute path
+     * \param alg hash algorithm
      */
-    void computeHashIfNeeded(const std::filesystem::path& top);
+    void computeHashIfNeeded(const std::filesystem::path& top,
+                             HashAlgorithm alg=HashAlgorithm::SHA1);
 
     /**
      * \return the file hash.
      * Only valid if the FilesystemElement is a regular file
      */
-    std::string hash() const { return fileHash; }
+    const FileHash& hash() const { return fileHash; }
+
+    /**
+     * Modify the file hash, used when the hash is known without reading the
+     * file, such as when it is reused from a metadata file
+     */
+    void setHash(const FileHash& fileHash) { this->fileHash=fileHash; }
 
     /**
      * \return the path of the FilesystemElement, relative to the top directory
@@ -209,20 +292,38 @@ public:
      */
     uintmax_t hardLinkCount() const { return hardLinkCnt; }
 
+    /**
+     * \return the last status change time (ctime). Note that this information
+     * is not saved in the metadata file, so it is only available if the
+     * FilesystemElement has been read from disk, otherwise it is 0.
+     */
+    time_t changeTime() const { return ct; }
+
     /**
      * \return true if the FilesystemElement is a directory
      */
     bool isDirectory() const { return ty==std::filesystem::file_type::directory; }
 
 private:
+    /// Set the fields obtained by stat'ing the entry
+    void setStatus(const ext_file_status& s);
+
+#ifndef OPTIMIZE_MEMORY
+    std::string_view rpView() const { return rp.native(); }
+    std::string_view symlinkView() const { return symlink.native(); }
+#else //OPTIMIZE_MEMORY
+    std::string_view rpView() const { return rp; }
+    std::string_view symlinkView() const { return symlink; }
+#endif //OPTIMIZE_MEMORY
+
     //Fields that are written to metadata files
     std::filesystem::file_type ty; ///< File type (regular, directory, ...)
     std::filesystem::perms per;    ///< File permissions (rwxrwxrwx)
-    std::string us;                ///< File user (owner)
-    std::string gs;                ///< File group
+    uint32_t us=0;                 ///< File user (owner), id into NameTable
+    uint32_t gs=0;                 ///< File group, id into NameTable
     time_t mt=0;                   ///< Modified time
     off_t sz=0;                    ///< Size, only if regular file
-    std::string fileHash;          ///< SHA1 hash, only if regular file
+    FileHash fileHash;             ///< File hash, only if regular file
 #ifndef OPTIMIZE_MEMORY
     std::filesystem::path rp;      ///< File path relative to top level directory
     std::filesystem::path symlink; ///< Symlink target path, only if symlink
@@ -236,7 +337,10 @@ private:
 
     //Fields that are not written to metadata files
     uintmax_t hardLinkCnt=1;       ///< Number of hardlinks
+    time_t ct=0;                   ///< Status change time
 
+    friend class DirectoryTree;
+    friend class MetadataFormatter;
     friend bool operator== (const FilesystemElement& a, const FilesystemElement& b);
     friend bool compare(const FilesystemElement& a, const FilesystemElement& b,
                         const CompareOpt& opt);
@@ -275,103 +379,348 @@ inline std::ostream& operator<<(std::ostream& os, const FilesystemElement& e)
 }
 
 /**
- * A node of an in-memory representation of the metadata of a directory tree
+ * A node of an in-memory representation of the metadata of a directory tree.
+ * To save memory, nodes are stored by value in an arena owned by the
+ * DirectoryTree, and store only the file name, not the full path. The name is
+ * stored in a string pool also owned by the tree. The content of a directory
+ * is a range of contiguous nodes in the arena, sorted as by operator<, so the
+ * directory content and the full path can only be accessed through the
+ * DirectoryTree the node belongs to.
+ * NOTE: like iterators of an std::vector, references to nodes are invalidated
+ * by member functions that add or remove nodes from the tree
  */
 class DirectoryNode
 {
 public:
     DirectoryNode() {}
 
-    // Heavy object not ment to be copyable, only move assignable.
-    // This declaration implicitly deletes copy constructor and copy assignment
-    // in a way that does not upset std::list. Explicit copy is possible with
-    // addToDirectoryContent(), used for copying part of a tree into another but
-    // it correctly fixes the path when copying so the nodes belong to the tree
-    DirectoryNode(DirectoryNode&&)=default;
-    DirectoryNode& operator=(DirectoryNode&&)=default;
-
     /**
-     * Constructor
+     * \return the type of the node (reguler file, directory, ...)
      */
-    explicit DirectoryNode(FilesystemElement elem) : elem(elem) {}
+    std::filesystem::file_type type() const { return ty; }
 
     /**
-     * This member function is meant to be used when constructing a tree only.
-     * If the node is a directory, this member function allows to set its content
-     * Note that the directory content is moved, not copied into this object.
-     * \param content, a list of other DirectoryNodes to be moved into this object
-     * \return a reference to the directory content after being moved
+     * \return true if the node is a directory
      */
-    std::list<DirectoryNode>& setDirectoryContent(std::list<DirectoryNode>&& content);
+    bool isDirectory() const { return ty==std::filesystem::file_type::directory; }
 
     /**
-     * \return a const reference to the FilesystemElement of this node
+     * \return the file name, that is the last component of the relative path
      */
-    const FilesystemElement& getElement() const { return elem; }
+    std::string_view name() const { return std::string_view(nm,nameLen); }
 
     /**
-     * \return a const reference to the nodes contained in the directory, or an
-     * empty list otherwise (empty directory or not a directory)
+     * \return the access permissions
      */
-    const std::list<DirectoryNode>& getDirectoryContent() const { return content; }
+    std::filesystem::perms permissions() const
+    {
+        return static_cast<std::filesystem::perms>(per);
+    }
 
     /**
-     * Remove an element from the directory content. If the element is a
-     * directory also the directory content is recursively removed
-     * \param toRemove DirectoryNode to remove
+     * \return the last modified time
      */
-    void removeFromDirectoryContent(const DirectoryNode& toRemove);
+    time_t mtime() const { return mt; }
 
     /**
-     * Make a copy of another directory node into the directory content of this
-     * directory. This object must be a directory and must not contain a node
-     * with the same name. If also the element to add is a directory,
-     * recursively add the entire directory content.
-     * \param toAdd DirectoryNode to add
-     * \return a reference to the newly added node
+     * \return the file size. Only valid if the node is a regular file
      */
-    DirectoryNode& addToDirectoryContent(const DirectoryNode& toAdd);
+    off_t size() const { return sz; }
 
     /**
-     * Modify permissions
+     * \return the file hash. Only valid if the node is a regular file
      */
-    void setPermissions(std::filesystem::perms perm) { elem.setPermissions(perm); }
+    const FileHash& hash() const { return fileHash; }
 
     /**
-     * Modify owner (user/group)
+     * \return the symlink target. Only valid if the node is a symlink
      */
-    void setOwner(const std::string& user, const std::string& group)
+    std::string_view symlinkTarget() const
     {
-        elem.setUser(user);
-        elem.setGroup(group);
+        return std::string_view(nm+nameLen,symlinkLen);
     }
 
     /**
-     * Modify mtime
+     * \return the number of nodes in the directory content, 0 if the node is
+     * not a directory
+     */
+    uint32_t contentSize() const { return count; }
+
+private:
+    //Fields of FilesystemElement, except for the fields not written to
+    //metadata files and the relative path, of which only the name is stored
+    FileHash fileHash;
+    std::filesystem::file_type ty=std::filesystem::file_type::unknown;
+    uint16_t per=static_cast<uint16_t>(std::filesystem::perms::unknown);
+    uint16_t nameLen=0;
+    uint16_t symlinkLen=0;
+    uint32_t us=0;
+    uint32_t gs=0;
+    time_t mt=0;
+    off_t sz=0;
+    const char *nm="";      ///< Name followed by the symlink target, if any,
+                            ///< stored in the string pool of the tree
+    //Tree structure, as indices into the node arena of the tree
+    uint32_t parent=0;      ///< Parent directory, the root is its own parent
+    uint32_t first=0;       ///< First node of the directory content
+    uint32_t count=0;       ///< Number of nodes in the directory content
+    uint32_t capacity=0;    ///< Nodes allocated for the directory content
+
+    friend class DirectoryTree;
+    friend class MetadataFormatter;
+    friend bool compare(const DirectoryNode& a, const DirectoryNode& b,
+                        const CompareOpt& opt);
+};
+
+/**
+ * Compare operator for sorting.
+ * It puts directories first and sorts alphabetically, like the FilesystemElement
+ * one, so nodes and elements of the same directory sort the same way
+ */
+inline bool operator< (const DirectoryNode& a, const DirectoryNode& b)
+{
+    if(a.isDirectory()==b.isDirectory()) return a.name() < b.name();
+    return a.isDirectory() > b.isDirectory();
+}
+
+/**
+ * Compare two DirectoryNode according to the given options, with the same
+ * semantics of compare() for FilesystemElement, except that only the name is
+ * compared instead of the relative path
+ */
+bool compare(const DirectoryNode& a, const DirectoryNode& b,
+             const CompareOpt& opt);
+
+/**
+ * Digest of the content of a directory, including the content of its
+ * subdirectories. A separate digest is kept for every field that can be
+ * ignored in comparisons, so that the content of two directories can be found
+ * equal with any CompareOpt by comparing only their digests. Digests are 64 bit
+ * non cryptographic hashes of the fields as stored in metadata files, with
+ * users and groups hashed by name, so they can be stored in metadata files
+ */
+class DirectoryDigest
+{
+public:
+    /// The fields that have a separate digest. Structure is the digest of the
+    /// file types and names, that are always compared
+    enum Field { Structure, Perm, Owner, Mtime, Size, Hash, Symlink, NumFields };
+
+    std::array<uint64_t,NumFields> d={}; ///< Digest of every field
+    bool allHashed=true;  ///< True if all regular files have a hash
+    bool noneHashed=true; ///< True if no regular file has a hash
+};
+
+/**
+ * Compare the digests of two directories
+ * \return true if the content of the directories is the same according to the
+ * given options. If false the content may still be the same, as regular files
+ * have to be compared one by one if only some of them have a hash
+ */
+bool compare(const DirectoryDigest& a, const DirectoryDigest& b,
+             const CompareOpt& opt);
+
+/**
+ * State of a metadata file and of its log as it was when a directory tree was
+ * read from it. The log of a metadata file records the content of the
+ * directories changed since the metadata file was last written in full, see
+ * DirectoryTree::commitTo()
+ */
+class MetadataLogState
+{
+public:
+    bool valid=false;      ///< True if the file has a log that applies to it
+    uint64_t baseDigest=0; ///< Digest of the content without the log
+    uint64_t baseSize=0;   ///< Size of the metadata file
+    uint64_t logSize=0;    ///< Size of the committed part of the log
+    uint64_t logDigest=0;  ///< Digest of the committed part of the log
+};
+
+/**
+ * \return true if two metadata files with a log have the same content
+ */
+bool operator== (const MetadataLogState& a, const MetadataLogState& b);
+
+/**
+ * The content of a directory in a directory tree, a range of DirectoryNode
+ */
+class DirectoryContent
+{
+public:
+    typedef std::deque<DirectoryNode>::const_iterator const_iterator;
+
+    DirectoryContent(const_iterator b, const_iterator e) : b(b), e(e) {}
+
+    const_iterator begin() const { return b; }
+    const_iterator end() const { return e; }
+    size_t size() const { return e-b; }
+    bool empty() const { return b==e; }
+    const DirectoryNode& operator[](size_t i) const { return b[i]; }
+
+private:
+    const_iterator b, e;
+};
+
+/**
+ * Append only storage of strings. Strings are never moved once added, so
+ * pointers to them stay valid until the pool is cleared or destroyed, and
+ * adding strings does not require reallocating the ones already stored.
+ */
+class StringPool
+{
+public:
+    StringPool() {}
+    StringPool(StringPool&&)=default;
+    StringPool& operator=(StringPool&&)=default;
+
+    /**
+     * \param s string to add
+     * \param s2 optional string to add contiguously after s
+     * \return the strings as stored in the pool
      */
-    void setMtime(time_t mtime) { elem.setMtime(mtime); }
+    std::string_view add(std::string_view s, std::string_view s2={});
 
     /**
-     * If the node is a file with a missing hash, compute the hash, otherwise
-     * if it is a directory recursively comute all missing hashes
-     * \param top top level directory, used to compute absolute path
+     * Remove all strings
      */
-    void computeMissingHashes(const std::filesystem::path& top);
+    void clear();
 
 private:
-    static DirectoryNode& recursiveAdd(DirectoryNode& dst, const DirectoryNode& src);
+    static const size_t chunkSize=1024*1024;
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t used=chunkSize; ///< Bytes used in the last chunk
+};
+
+class DirectoryTree;
 
-    FilesystemElement elem;           ///< The filesystem element
-    std::list<DirectoryNode> content; ///< If element is a directory, its content
+/**
+ * Progress of DirectoryTree::computeMissingHashes()
+ */
+struct HashProgress
+{
+    uint64_t files=0;      ///< Files hashed so far
+    uint64_t totalFiles=0; ///< Files to hash
+    uint64_t bytes=0;      ///< Bytes read so far
+    uint64_t totalBytes=0; ///< Bytes to read
+    double seconds=0;      ///< Time elapsed since hashing started
 };
 
 /**
- * Compare operator for sorting
+ * Allows to reuse file hashes from metadata files when scanning a directory,
+ * so that files that did not change since the metadata files were written are
+ * not hashed again.
+ * A file is considered unchanged if path, size and mtime match and if its
+ * status change time (ctime) is older than the last write of the metadata
+ * files. Since any write to a file or change of its mtime updates the ctime,
+ * this detects also files modified retaining size and mtime. To be safe, the
+ * hash is reused only if both metadata files agree on it.
+ * Trusting hashes however means not checking those files for bit rot, so a
+ * rotating fraction of the unchanged files is hashed anyway, in such a way that
+ * every file is hashed again at least once every rehashPeriod runs.
  */
-inline bool operator< (const DirectoryNode& a, const DirectoryNode& b)
+class HashCache
 {
-    return a.getElement() < b.getElement();
-}
+public:
+    /**
+     * Constructor
+     * \param meta1 first copy of the metadata tree, must outlive this object
+     * \param meta2 second copy of the metadata tree, must outlive this object
+     * \param trustedBefore only files whose ctime is older than this are
+     * considered unchanged, usually the last modified time of the metadata files
+     * \param rehashPeriod number of runs in which all files are hashed again
+     * \param run number of this run, consecutive runs hash the files of
+     * consecutive fractions
+     */
+    HashCache(const DirectoryTree& meta1, const DirectoryTree& meta2,
+              time_t trustedBefore, unsigned rehashPeriod, unsigned run);
+
+    /**
+     * \param e FilesystemElement of a regular file just read from disk
+     * \return the cached hash if e can be trusted to be unchanged, or an empty
+     * hash if the file needs to be hashed
+     */
+    FileHash lookup(const FilesystemElement& e) const;
+
+private:
+    const DirectoryTree& meta1;
+    const DirectoryTree& meta2;
+    const time_t trustedBefore;
+    const unsigned rehashPeriod;
+    const unsigned rehashSlot; ///< Files in this slot are hashed anyway
+};
+
+/**
+ * An index of regular files by size and hash, used when copying files into a
+ * directory tree to copy instead a file already in the same filesystem with
+ * the same content, which is faster and allows reflinks. Files are added with
+ * their hash as known from metadata, so whoever uses a file found in the index
+ * must check that its content still has that hash.
+ */
+class ContentIndex
+{
+public:
+    /**
+     * Add a regular file to the index
+     * \param size file size
+     * \param hash file hash, files without hash are not added
+     * \param relativePath path of the file
+     */
+    void add(off_t size, const FileHash& hash,
+             const std::filesystem::path& relativePath);
+
+    /**
+     * \param size file size
+     * \return true if the index has files of the given size, used to avoid
+     * hashing a file only to find it is not in the index
+     */
+    bool hasSize(off_t size) const { return files.count(size)>0; }
+
+    /**
+     * \param size file size
+     * \param hash file hash
+     * \return the path of a file with the given size and hash, or nullptr
+     */
+    const std::filesystem::path *find(off_t size, const FileHash& hash) const;
+
+    /**
+     * \return the number of files in the index
+     */
+    size_t size() const { return count; }
+
+private:
+    std::unordered_map<off_t,std::vector<std::pair<FileHash,std::filesystem::path>>> files;
+    size_t count=0;
+};
+
+/**
+ * A flat view of all the files and directories in a directory tree, that is
+ * the top directory and all its subdirectories, allowing to look them up by
+ * relative path. No separate index is stored, lookups walk the tree with a
+ * binary search in each directory
+ */
+class DirectoryIndex
+{
+public:
+    /**
+     * Constructor
+     * \param tree directory tree
+     */
+    explicit DirectoryIndex(const DirectoryTree& tree) : tree(tree) {}
+
+    /**
+     * \param p relative path to search
+     * \return the corresponding DirectoryNode or nullptr if not found
+     */
+    const DirectoryNode *find(const std::filesystem::path& p) const;
+
+    /**
+     * \return the number of files and directories in the tree
+     */
+    size_t size() const;
+
+private:
+    const DirectoryTree& tree;
+};
 
 /**
  * An in-memory representation of the metadata of a directory tree
@@ -379,7 +728,13 @@ inline bool operator< (const DirectoryNode& a, const DirectoryNode& b)
 class DirectoryTree
 {
 public:
-    DirectoryTree() {}
+    DirectoryTree() { clear(); }
+
+    // Heavy object not meant to be copyable, only movable. Nodes point into
+    // the string pool of the tree, so they can't be copied to another tree
+    // with a memberwise copy, use copyFromTree() instead
+    DirectoryTree(DirectoryTree&&)=default;
+    DirectoryTree& operator=(DirectoryTree&&)=default;
 
     /**
      * Construct a directory tree from either a metadata file or a directory
@@ -413,6 +768,91 @@ public:
         warningCallback=cb;
     }
 
+    /**
+     * Set the number of threads used when scanning directories. With more
+     * than one thread, subdirectories are listed in parallel by a pool of
+     * worker threads with work stealing, and with ScanOpt::ComputeHash file
+     * hashes are computed in parallel too. This helps both on fast storage
+     * and when stat latency dominates, such as on network filesystems.
+     * The resulting tree is the same regardless of the number of threads.
+     * \param jobs number of scanning threads, if 0 use as many threads as the
+     * hardware concurrency. Default is 1, that is scan sequentially
+     */
+    void setJobs(unsigned jobs) { this->jobs=jobs; }
+
+    /**
+     * Set a hash cache to reuse the hash of unchanged files when scanning
+     * directories with ScanOpt::ComputeHash
+     * \param cache hash cache, must outlive the scan, or nullptr to hash all
+     * files
+     */
+    void setHashCache(const HashCache *cache) { hashCache=cache; }
+
+    /**
+     * Set a content index to look up regular files that are copied into this
+     * tree with copyFromTreeAndFilesystem(). A file whose size and hash are in
+     * the index is copied from the path in the index, relative to the top path
+     * of this tree, instead of the source tree. Source files whose hash is not
+     * known are not looked up, and copied from the source tree. The copy is
+     * hashed, and if the content turns out to differ from the index the file
+     * is copied again from the source tree
+     * \param index content index, must outlive the copies, or nullptr to copy
+     * all files from the source tree. The files in the index must not change
+     * while copying
+     */
+    void setContentIndex(const ContentIndex *index)
+    {
+        contentIndex=index;
+        indexCopies=0;
+    }
+
+    /**
+     * \return the number of files copied from the content index since the
+     * last call to setContentIndex()
+     */
+    size_t contentIndexCopies() const { return indexCopies; }
+
+    /**
+     * Set the hash algorithm used when scanning directories and computing
+     * missing hashes. When reading metadata files, the algorithm is set to
+     * the one recorded in the file, and it is written back by writeTo.
+     * NOTE: changing the algorithm does not recompute the hashes already in
+     * the tree, so it should be done only on an empty tree
+     * \param alg hash algorithm, default is SHA1
+     */
+    void setHashAlgorithm(HashAlgorithm alg) { hashAlg=alg; }
+
+    /**
+     * \return the hash algorithm of the hashes in this tree
+     */
+    HashAlgorithm hashAlgorithm() const { return hashAlg; }
+
+    /**
+     * Set the format used by writeTo. When reading metadata files, the format
+     * is set to the one of the file, so trees are written back in the same
+     * format they were read
+     * \param format metadata file format, default is MetadataFormat::Text
+     */
+    void setMetadataFormat(MetadataFormat format) { this->format=format; }
+
+    /**
+     * \return the format used by writeTo
+     */
+    MetadataFormat metadataFormat() const { return format; }
+
+    /**
+     * Enable lazy loading of binary metadata files. When enabled, binary
+     * metadata files read from a path are kept memory mapped, and the content
+     * of every directory is only decoded the first time it is accessed, so
+     * operations that access only part of a tree do not read the rest of the
+     * file. The metadata file must not be modified while the tree is in
+     * use. Lazily loaded trees can be accessed from multiple threads. Text
+     * metadata files, and trees whose structure is changed, are always fully
+     * loaded.
+     * \param lazy true to enable lazy loading, default is disabled
+     */
+    void setLazyLoading(bool lazy) { lazyLoading=lazy; }
+
     /**
      * Construct a directory tree from either a metadata file or a directory
      * \param inputPath if the path is to a directory, use it as the top level
@@ -436,11 +876,84 @@ public:
                        ScanOpt opt=ScanOpt::ComputeHash);
 
     /**
-     * Read from metadata files
+     * Scan directory tree starting from the given top path and write it to
+     * an ostream based on the metadata file format, without keeping it in
+     * memory. The output is the same as scanDirectory() followed by writeTo(),
+     * but directories are written as soon as they are scanned, so memory use
+     * is bounded by the depth of the tree times the number of entries per
+     * directory instead of by the number of entries in the tree.
+     * With more than one job, the entries of every directory are read, and
+     * their hash computed, in parallel.
+     * This tree is left empty.
+     * \param topPath top level directory where to start the directory tree
+     * \param os ostream where to write
+     * \param opt scan options
+     */
+    void scanDirectoryTo(const std::filesystem::path& topPath, std::ostream& os,
+                         ScanOpt opt=ScanOpt::ComputeHash);
+
+    /**
+     * Scan again a directory of the tree, replacing its content with the one
+     * in the filesystem and updating the directory itself. Subdirectories
+     * that are still there keep their content as it is in the tree, without
+     * scanning it, while new subdirectories are scanned entirely.
+     * Only works if the tree is bound to a top path, see bindToTopPath().
+     * \param relativePath path of the directory relative to the top path,
+     * empty for the top directory
+     * \param opt scan options
+     * \throws runtime_error if the path is not a directory in this tree or in
+     * the filesystem, or if the tree is not bound to a top path
+     */
+    void rescanDirectory(const std::filesystem::path& relativePath,
+                         ScanOpt opt=ScanOpt::ComputeHash);
+
+    /**
+     * Read from metadata files, either in the text or in the binary format.
+     * Regular files are memory mapped and parsed in place, without copying
+     * them line by line. If the metadata file has a log, see commitTo(), the
+     * changes recorded in it are applied too
      * \param metadataFile path of the metadata file
+     * \throws runtime_error in case of errors
      */
     void readFrom(const std::filesystem::path& metadataFile);
 
+    /**
+     * Apply the changes recorded in the log of a metadata file to a tree just
+     * read from the metadata file with readFrom(std::istream&). A log written
+     * for a previous content of the metadata file is ignored with a warning
+     * \param log content of the log
+     * \param logFileName name of the log, used for error reporting
+     * \throws runtime_error if the log is corrupted
+     */
+    void replayLog(std::string_view log, const std::string& logFileName);
+
+    /**
+     * \param metadataFile path of a metadata file
+     * \return the path of the log of the metadata file
+     */
+    static std::filesystem::path logPath(const std::filesystem::path& metadataFile)
+    {
+        auto result=metadataFile;
+        result+=".log";
+        return result;
+    }
+
+    /**
+     * \return the state of the metadata file the tree was read from, not valid
+     * if the tree was not read from a metadata file with a log
+     */
+    const MetadataLogState& getLogState() const { return logState; }
+
+    /**
+     * Read only the header of a metadata file
+     * \param metadataFile path of the metadata file
+     * \return the hash algorithm of the metadata file, that readFrom() would
+     * set as the hash algorithm of the tree
+     * \throws runtime_error if the file can't be read or the header is not
+     * valid
+     */
+    static HashAlgorithm readHashAlgorithm(const std::filesystem::path& metadataFile);
+
     /**
      * Read from metadata files
      * \param is istream where to read
@@ -449,11 +962,36 @@ public:
     void readFrom(std::istream& is, const std::string& metadataFileName="");
 
     /**
-     * Write to metadata files
+     * Write to metadata files. The metadata file is replaced atomically by
+     * writing a temporary file, and renaming it once synced to disk. The log
+     * of the metadata file is removed, as it no longer applies
      * \param metadataFile path of the metadata file
+     * \throws runtime_error in case of errors
      */
     void writeTo(const std::filesystem::path& metadataFile) const;
 
+    /**
+     * Save the tree to a metadata file, appending to the log of the file the
+     * content of the directories changed since the tree was read, with a
+     * single sync. The log is a text file starting with a line that
+     * identifies the content of the metadata file it applies to, and
+     * containing for each changed directory a line with its path followed by
+     * its content as in metadata files. The records of a commit are followed
+     * by a commit line, so records not completely written are ignored.
+     * If the changes can't be appended, or the log would grow larger than
+     * maxLogRatio times the metadata file, the metadata file is written in
+     * full as writeTo() does, and the log is replaced by an empty one
+     * \param metadataFile path of the metadata file
+     * \param fileState state of the metadata file, as returned by
+     * getLogState() of a tree read from it. Changes are only appended if it
+     * is the same state of the file this tree was read from
+     * \param maxLogRatio maximum size of the log relative to the metadata file
+     * \return the number of bytes written
+     * \throws runtime_error in case of errors
+     */
+    uint64_t commitTo(const std::filesystem::path& metadataFile,
+                      const MetadataLogState& fileState, double maxLogRatio) const;
+
     /**
      * Write the object to an ostream based on the metadata file format
      * \param os ostream where to write
@@ -472,17 +1010,74 @@ public:
     void bindToTopPath(const std::filesystem::path& topPath)
     {
         this->topPath=absolute(topPath);
+        remote=nullptr;
+    }
+
+    /**
+     * Used to assign a top path in a remote machine to a directory tree, as
+     * bindToTopPath() does. The member functions that alter the filesystem
+     * alter it through the remote target, and the hashes computed by
+     * computeMissingHashes() are computed by the remote machine. Changes made
+     * outside of a batch, see beginFilesystemBatch(), wait for the remote
+     * machine to make them, those in a batch don't, as they are waited for by
+     * endFilesystemBatch(). The other member functions that use the
+     * filesystem don't work with remote targets
+     * \param target remote target, must outlive the binding
+     * \param topPath top level directory in the remote machine
+     */
+    void bindToRemoteTarget(RemoteTarget& target, const std::filesystem::path& topPath)
+    {
+        this->topPath=topPath;
+        remote=&target;
     }
 
     /**
      * Walk the entire directory tree and compute all missing hashes
      * Only works if the tree was constructed by scanning a directory, not if
      * it was constructed from a metadata file.
+     * Files are hashed in inode order, which on most filesystems follows the
+     * order of their data on disk, using as many threads as set by setJobs()
+     * \param maxBytesPerSecond if not 0, limit the rate at which files are
+     * read, so as to leave disk bandwidth to other programs
+     * \param progress if set, called about once a second while hashing, from
+     * any of the hashing threads but never concurrently
      * \throws runtime_error if at least a file in the tree that requires hash
      * computation is not found in the filesystem or if the tree was not
      * constructed by scanning a directory
      */
-    void computeMissingHashes();
+    void computeMissingHashes(uint64_t maxBytesPerSecond=0,
+        std::function<void (const HashProgress&)> progress={});
+
+    /**
+     * Compute the hashes of a sample of the regular files of the tree, so that
+     * a directory can be checked for bit rot a part at a time. Files are
+     * taken in tree order, starting after the file where the previous sample
+     * ended and wrapping around, until all files are hashed or the budget is
+     * exhausted. Hashes already in the tree are computed again.
+     * Only works if the tree was constructed by scanning a directory.
+     * \param after relative path of the last file of the previous sample, the
+     * sample starts from the first file after it in tree order, also if it is
+     * no longer in the tree. If empty start from the first file
+     * \param maxBytes if not 0, stop before hashing more than this many bytes,
+     * except that at least one file is hashed
+     * \param maxSeconds if not 0, stop once hashing took this many seconds
+     * \return the relative paths of the files that were hashed, in the order
+     * they were taken
+     * \throws runtime_error if a file can't be hashed or if the tree was not
+     * constructed by scanning a directory
+     */
+    std::vector<std::filesystem::path> computeSampleHashes(
+        const std::filesystem::path& after, uint64_t maxBytes, unsigned maxSeconds);
+
+    /**
+     * Compute again the hashes of some regular files of the tree.
+     * Only works if the tree was constructed by scanning a directory.
+     * \param files relative paths of the files, those not in the tree or not
+     * regular files are skipped
+     * \throws runtime_error if a file can't be hashed or if the tree was not
+     * constructed by scanning a directory
+     */
+    void computeHashes(const std::vector<std::filesystem::path>& files);
     
     /**
      * Deallocate the entire directory tree
@@ -490,24 +1085,80 @@ public:
     void clear();
 
     /**
-     * \return the root of the directory tree, containing the content of the top
-     * directory and all its subfolders, if any
-     * NOTE: since all ellements are stored by value this may be a very
-     * heavy object, never copy this tree, only access it by reference
+     * \return the root of the directory tree, a directory node whose content
+     * is the content of the top directory. The root node itself has an empty
+     * name and does not correspond to any file or directory in the tree
      */
-    const std::list<DirectoryNode>& getTreeRoot() const { return topContent; }
+    const DirectoryNode& getTreeRoot() const { return nodes.front(); }
 
     /**
-     * \return the a flat index of all the files and directories in the
-     * directory tree, that is the top directory and all its subdirectories
-     * The key is the relative path, while the value is a pointer into the tree
-     * data structure
+     * \param dir a directory node of this tree
+     * \return the content of the directory, sorted with directories first,
+     * or an empty range if the node is not a directory
      */
-    const std::unordered_map<std::string,DirectoryNode*>& getIndex() const
+    DirectoryContent getDirectoryContent(const DirectoryNode& dir) const
     {
-        return index;
+        if(blocks) load(dir);
+        auto b=nodes.begin()+dir.first;
+        return DirectoryContent(b,b+dir.count);
     }
 
+    /**
+     * Directory digests are computed when scanning a directory and stored in
+     * binary metadata files, and are discarded when the tree is modified
+     * \param dir a directory node of this tree
+     * \return the digest of the directory content, or nullptr if the digests
+     * of this tree are not known
+     */
+    const DirectoryDigest *getDirectoryDigest(const DirectoryNode& dir) const;
+
+    /**
+     * \param dir a directory node of this tree
+     * \return the digest of the directory content, computing it if the
+     * digests of this tree are not known
+     */
+    DirectoryDigest computeDirectoryDigest(const DirectoryNode& dir) const;
+
+    /**
+     * \return the top path of the tree, if it was constructed by scanning a
+     * directory or bound to a top path
+     */
+    const std::optional<std::filesystem::path>& getTopPath() const { return topPath; }
+
+    /**
+     * \param dir a directory node of this tree
+     * \param name name of the node to find in the directory content
+     * \return the node, or nullptr if not found
+     */
+    const DirectoryNode *findInDirectory(const DirectoryNode& dir,
+                                         std::string_view name) const;
+
+    /**
+     * \param node a node of this tree, except the root node
+     * \return the path of the node, relative to the top directory
+     */
+    std::filesystem::path relativePath(const DirectoryNode& node) const;
+
+    /**
+     * \param node a node of this tree, except the root node
+     * \return the FilesystemElement corresponding to the node
+     */
+    FilesystemElement getElement(const DirectoryNode& node) const
+    {
+        return toElement(node,relativePath(node));
+    }
+
+    /**
+     * \return the a flat index of all the files and directories in the
+     * directory tree, that is the top directory and all its subdirectories
+     */
+    DirectoryIndex getIndex() const { return DirectoryIndex(*this); }
+
+    /**
+     * \return the number of files and directories in the tree
+     */
+    size_t size() const { return entries; }
+
     /**
      * \param p relative path to search
      * \return the corresponding FilesystemElemet if found
@@ -558,11 +1209,15 @@ public:
      * \param relativeDstPath path relative to this tree pointing to an existing
      * directory where the item has to be copied. Path can be empty, in this
      * case add the item to the top directory
+     * \param opt with ScanOpt::ComputeHash, the hash of the copied files that
+     * have none in the source tree is computed while copying them (when
+     * batching, see beginFilesystemBatch(), it is set later)
      * \throws runtime_error if paths not found or dst path not a directory
      */
     void copyFromTreeAndFilesystem(const DirectoryTree& srcTree,
                                    const std::filesystem::path& relativeSrcPath,
-                                   const std::filesystem::path& relativeDstPath);
+                                   const std::filesystem::path& relativeDstPath,
+                                   ScanOpt opt=ScanOpt::OmitHash);
 
     /**
      * Remove the specified path from this tree.
@@ -591,6 +1246,31 @@ public:
      */
     int removeFromTreeAndFilesystem(const std::filesystem::path& relativePath);
 
+    /**
+     * Move a file or directory, with all its content, to another path of this
+     * tree, also renaming it
+     * \param from path to move, cannot be empty
+     * \param to new path, whose parent must be a directory of this tree
+     * \throws runtime_error if from is not found, to already exists or its
+     * parent is not a directory, or to is in the subtree of from
+     */
+    void moveInTree(const std::filesystem::path& from,
+                    const std::filesystem::path& to);
+
+    /**
+     * Move a file or directory, with all its content, to another path of this
+     * tree and the filesystem, also renaming it.
+     * Only works if the tree was constructed by scanning a directory, not if
+     * it was constructed from a metadata file.
+     * WARNING: this actually renames files in your filesystem!
+     * \param from path to move, cannot be empty
+     * \param to new path, whose parent must be a directory of this tree
+     * \throws runtime_error if the entry can't be moved, see moveInTree(), or
+     * if the tree was not constructed by scanning a directory
+     */
+    void moveInTreeAndFilesystem(const std::filesystem::path& from,
+                                 const std::filesystem::path& to);
+
     /**
      * Add a symlink to this tree.
      * \param symlink FilesystemElement of type symlink. It will be added to the
@@ -679,6 +1359,31 @@ public:
     void modifyMtimeInTreeAndFilesystem(const std::filesystem::path& relativePath,
                                         time_t mtime);
 
+    /**
+     * Start batching the changes made to the filesystem by the member
+     * functions that alter it. Changes to the permissions, owner and mtime of
+     * different entries, as well as copies of regular files, are made in
+     * parallel by a pool of threads. Changes of the same entry, or of a
+     * directory and its content, are still made in the same order as without
+     * batching. The attributes of copied directories are set once their
+     * content is copied, and restoring the mtime of the parent directory of
+     * changed entries is done only once per directory, by
+     * endFilesystemBatch(). The tree itself is always changed immediately,
+     * except for the hashes computed while copying files, which are set
+     * when the batch is waited for.
+     * \param jobs number of threads, if 0 use as many threads as the hardware
+     * concurrency
+     * \throws runtime_error if the tree was not constructed by scanning a
+     * directory
+     */
+    void beginFilesystemBatch(unsigned jobs);
+
+    /**
+     * Complete the changes made to the filesystem since beginFilesystemBatch()
+     * \throws runtime_error if some of the changes failed
+     */
+    void endFilesystemBatch();
+
 private:
     // This version of searchNode that returns a non-const pointer is private
     DirectoryNode& searchNode(const std::filesystem::path& p,
@@ -688,39 +1393,277 @@ private:
 
     void fixupParentMtime(const std::filesystem::path& parent);
 
-    void recursiveBuildFromPath(const std::filesystem::path& p);
+    /// Change an attribute of an entry in the filesystem, as part of the
+    /// current batch if any, see beginFilesystemBatch()
+    void changeInFilesystem(const std::filesystem::path& absPath,
+                            std::function<void ()> change);
+
+    /// Wait for the changes of the current batch, if any, then complete the
+    /// copied directories and set the hashes of the copied files
+    void waitFilesystemBatch();
+
+    /// Call the warning callback, also from the threads of a batch
+    void warning(const std::string& s);
+
+    /// Value returned by findIndex when the path is not found
+    static const uint32_t notFound=0xffffffff;
+
+    /// \return the index of the node with the given relative path, the root
+    /// for the empty path, or notFound
+    uint32_t findIndex(const std::filesystem::path& p) const;
+
+    /// \return the index of the node with the given relative path
+    /// \throws runtime_error if the path is empty or not found
+    uint32_t searchIndex(const std::filesystem::path& p,
+                         const std::string& where) const;
+
+    /// \return the index of the node with the given name in a directory or
+    /// notFound
+    uint32_t findIndexInDirectory(const DirectoryNode& dir,
+                                  std::string_view name) const;
+
+    /// \return a node with the same content of the element, except for the
+    /// directory content, with strings stored in the string pool of this tree
+    DirectoryNode makeNode(const FilesystemElement& e);
+
+    /// \return a copy of a node of another tree, except for the directory
+    /// content, with strings stored in the string pool of this tree
+    DirectoryNode copyNode(const DirectoryNode& n);
+
+    static FilesystemElement toElement(const DirectoryNode& node,
+                                       const std::filesystem::path& relativePath);
+
+    /// Allocate the content of an empty directory at the end of the arena,
+    /// \return the index of the first node of the content
+    uint32_t allocateContent(uint32_t dir, uint32_t size);
+
+    /// Move the content of a directory at the end of the arena, with the
+    /// given capacity, to make room for adding nodes
+    void relocateContent(uint32_t dir, uint32_t capacity);
+
+    /// Set the parent of the content of the directory with the given index,
+    /// needed after the directory node is moved in the arena
+    void fixupContentParent(uint32_t dir);
+
+    /// Add a node to a directory, keeping the directory content sorted
+    /// \return the index of the added node
+    uint32_t addToDirectory(uint32_t dir, DirectoryNode node);
 
-    void recursiveWrite(const std::list<DirectoryNode>& nodes) const;
+    /// Remove a node, and its content if it is a directory, from a directory
+    void removeFromDirectory(uint32_t dir, uint32_t index);
 
-    struct CopyResult
+    /// \return the number of nodes in the subtree starting from node,
+    /// including node itself
+    size_t subtreeSize(const DirectoryNode& node) const;
+
+    /// Directories are opened relative to the top directory descriptor topfd,
+    /// and their entries relative to their own
+    void recursiveBuildFromPath(int topfd, const std::filesystem::path& p,
+                                uint32_t dir);
+
+    void hashNode(uint32_t index, const FilesystemElement& e);
+
+    void recursiveScanTo(int topfd, const std::filesystem::path& p,
+                         ThreadPool *pool);
+
+    /**
+     * Parse the content of a metadata file
+     * \param data content of the metadata file
+     * \param metadataFileName name of metadata file, used for error reporting
+     * \param mapping if data is a memory mapped file, the mapping. Pages of
+     * the mapping are released as soon as they have been parsed, unless the
+     * tree is lazily loaded and keeps the mapping
+     */
+    void parseMetadata(std::string_view data, const std::string& metadataFileName,
+                       std::shared_ptr<const void> mapping=nullptr);
+
+    /**
+     * Parse the content of a metadata file in the binary format
+     * \param data content of the metadata file
+     * \param metadataFileName name of metadata file, used for error reporting
+     * \param mapping if data is a memory mapped file, the mapping
+     */
+    void parseBinaryMetadata(std::string_view data,
+                             const std::string& metadataFileName,
+                             std::shared_ptr<const void> mapping);
+
+    /// Decode a block of a binary metadata file, see BinaryBlocks
+    void loadBlock(uint32_t block) const;
+
+    /// Decode the block with the content of a directory, if not done yet
+    void load(const DirectoryNode& dir) const;
+
+    /// Decode all the blocks not decoded yet, making the tree no longer lazy.
+    /// Needed before changing the structure of the tree
+    void loadAll() const;
+
+    void writeBinary(std::ostream& os) const;
+
+    /// Digests of the non empty directories, sorted by first node
+    typedef std::vector<std::pair<uint32_t,DirectoryDigest>> DigestTable;
+
+    /// Compute the digests of a directory and of all its subdirectories
+    /// \param binary if true, file types and permissions are reduced to those
+    /// stored in binary metadata files
+    /// \param table where the digests of non empty directories are added
+    /// \param nameDigests digests of user and group names, by NameTable id
+    DirectoryDigest digestContent(const DirectoryNode& dir, bool binary,
+                                  DigestTable& table,
+                                  std::vector<uint64_t>& nameDigests) const;
+
+    /// \return the digests of all the directories of this tree
+    DigestTable computeDigests(bool binary) const;
+
+    /// \return the digest of a directory in a table, see DigestTable
+    static const DirectoryDigest& findDigest(const DigestTable& table,
+                                             const DirectoryNode& dir);
+
+    /// Called when modifying the tree, as the digests are no longer valid
+    void discardDigests()
     {
-        CopyResult(const DirectoryNode& src, const DirectoryNode& dst)
-            : src(src), dst(dst) {}
-        const DirectoryNode& src;
-        const DirectoryNode& dst;
-    };
+        digests.clear();
+        hasDigests=false;
+    }
 
-    CopyResult treeCopy(const DirectoryTree& srcTree,
-                        const std::filesystem::path& relativeSrcPath,
-                        const std::filesystem::path& relativeDstPath);
+    /// \return the digest of the tree as stored in metadata files, that
+    /// identifies the metadata file a log applies to
+    uint64_t metadataDigest() const;
 
-    void recursiveFilesystemCopy(const std::filesystem::path& srcTopPath,
-                                 CopyResult nodes);
+    /// \return the metadataDigest() of the metadata file the tree was read
+    /// from, only valid till the tree is modified
+    uint64_t readDigest() const;
 
-    /// Add the subtree starting from node including node itself
-    void recursiveAddToIndex(const DirectoryNode& node);
+    /// Check that a log without records applies to the metadata file, before
+    /// the tree is first modified, see replayLog()
+    void verifyLog();
 
-    /// Removes the subtree starting from node from index, but not node itself
-    void recursiveRemoveFromIndex(const DirectoryNode& node);
+    /// Record that the content of a directory changed, for commitTo()
+    void markChanged(uint32_t dir)
+    {
+        if(logState.valid && logVerified==false) verifyLog();
+        if(logState.valid) changedDirs.insert(relativePath(nodes[dir]).string());
+    }
+
+    /// Record that the content of a directory and of all its subdirectories
+    /// changed, for commitTo()
+    void markSubtreeChanged(uint32_t dir);
+
+    /// Record that the content of the directories of some files changed
+    /// \param files indices of the files, in tree order
+    void markFilesChanged(const std::vector<uint32_t>& files);
+
+    /// Replace the content of a directory, keeping the content of the
+    /// subdirectories that are still there
+    /// \param elements new content of the directory, sorted
+    /// \param newDirectory called with the index and element of the
+    /// subdirectories that were not there, whose content is empty
+    void replaceDirectoryContent(uint32_t dir,
+        const std::vector<FilesystemElement>& elements, uint32_t count,
+        std::function<void (uint32_t, const FilesystemElement&)> newDirectory);
+
+    uint32_t mergeDirectoryContent(uint32_t dir, const FilesystemElement *elements,
+                                   uint32_t count);
+
+    /// Add the index of the regular files in dir to files, in tree order
+    /// \param missingHashes if true, only add the files without hash
+    void collectFiles(uint32_t dir, std::vector<uint32_t>& files,
+                      bool missingHashes) const;
+
+    /// Hash the given regular files using as many threads as set by setJobs()
+    /// \param deadline files are taken in order, and those not yet taken when
+    /// the deadline passes are not hashed
+    /// \return the number of files hashed, always the first ones
+    size_t hashFiles(const std::vector<uint32_t>& files,
+        std::chrono::steady_clock::time_point deadline=
+            std::chrono::steady_clock::time_point::max());
+
+    void recursiveWrite(const DirectoryNode& dir, std::string& dirPath) const;
+
+    /// \return index of the added node
+    uint32_t treeCopy(const DirectoryTree& srcTree,
+                      const std::filesystem::path& relativeSrcPath,
+                      const std::filesystem::path& relativeDstPath);
+
+    void recursiveTreeCopy(const DirectoryTree& srcTree, uint32_t srcDir,
+                           uint32_t dstDir);
+
+    void recursiveFilesystemCopy(const DirectoryTree& srcTree,
+                                 const DirectoryNode& src, uint32_t dst,
+                                 const std::filesystem::path& srcRelativePath,
+                                 const std::filesystem::path& dstRelativePath,
+                                 ScanOpt opt);
+
+    /// Copy a regular file with the attributes of node, also from the threads
+    /// of a batch
+    /// \return the hash of the file if hash is true, empty otherwise
+    FileHash copyFile(const std::filesystem::path& from,
+                      const std::filesystem::path& to,
+                      const DirectoryNode& node, bool hash);
+
+    /// Copy a regular file as copyFile(), but from a file with the same
+    /// content in the content index if there is one
+    /// \param fromHash hash of from if known, or empty to always copy from
+    FileHash copyRegularFile(const std::filesystem::path& from,
+                             const std::filesystem::path& to, FileHash fromHash,
+                             const DirectoryNode& node, bool hash);
+
+    //Primitive changes to the filesystem, made through the remote target if
+    //the tree is bound to one. Remote changes are waited for unless batching
+
+    void fsCreateDirectory(const std::filesystem::path& absPath);
 
-    std::list<DirectoryNode> topContent;
-    std::unordered_map<std::string,DirectoryNode*> index;
+    void fsCreateSymlink(const std::string& target, const std::filesystem::path& absPath);
+
+    void fsPermissions(const std::filesystem::path& absPath, std::filesystem::perms perm);
+
+    /// Ownership failures are warnings
+    void fsOwner(const std::filesystem::path& absPath, const std::string& user,
+                 const std::string& group);
+
+    void fsMtime(const std::filesystem::path& absPath, time_t mtime);
+
+    /// Wait for the remote changes, outside of a batch
+    void fsSync();
+
+    /// Set owner and mtime of a copied entry, ownership failures are warnings
+    void copyOwnerAndMtime(const std::filesystem::path& absPath,
+                           const DirectoryNode& node);
+
+    //Node arena. The first node is the root. Nodes are only appended, and as
+    //the arena is a deque this never moves the existing ones, only adding or
+    //removing nodes from a directory moves the other nodes of the directory.
+    //Mutable, as lazily loaded trees decode directories on first access
+    mutable std::deque<DirectoryNode> nodes;
+    mutable StringPool strings;       // Names and symlink targets
+    size_t entries=0;                 // Number of nodes reachable from root
     std::function<void (const std::string&)> warningCallback=
         [](const std::string& s){ std::cerr<<s<<'\n'; };
     std::optional<std::filesystem::path> topPath; // Only if built from directory
+    unsigned jobs=1;                  // Number of scanning threads
+    HashAlgorithm hashAlg=HashAlgorithm::SHA1;
+    MetadataFormat format=MetadataFormat::Text;
+    bool lazyLoading=false;
+    struct BinaryBlocks;
+    mutable std::shared_ptr<BinaryBlocks> blocks; // Only for lazily loaded trees
+    DigestTable digests;              // Only if hasDigests
+    bool hasDigests=false;
+    MetadataLogState logState;        // Only if read from a metadata file
+    bool logVerified=false;           // If logState.valid, see verifyLog()
+    std::set<std::string> changedDirs; // Only if logState.valid
+    std::optional<uint64_t> fileDigest; // Only if read from a binary metadata file
+    struct FilesystemBatch;
+    std::shared_ptr<FilesystemBatch> batch; // Only while batching changes
     ScanOpt opt;                      // Only used by recursiveBuildFromPath
-    mutable std::ostream *os=nullptr; // Only used by recursiveWrite
-    mutable bool printBreak;          // Only used by recursiveWrite
+    ThreadPool *scanPool=nullptr;     // Only used by recursiveBuildFromPath
+    const HashCache *hashCache=nullptr; // Only used by recursiveBuildFromPath
+    RemoteTarget *remote=nullptr;     // Set by bindToRemoteTarget()
+    const ContentIndex *contentIndex=nullptr; // Only used when copying files
+    size_t indexCopies=0;                     // Copies from contentIndex
+    std::mutex *scanMutex=nullptr;    // Only used by mergeDirectoryContent
+    mutable MetadataFormatter *formatter=nullptr; // Only used by recursiveWrite/ScanTo
+    mutable bool printBreak;                      // Only used by recursiveWrite/ScanTo
+
+    friend class DirectoryIndex;
 };
 
 /**
@@ -776,13 +1719,33 @@ std::ostream& operator<<(std::ostream& os, const DirectoryDiff<3>& diff);
 
 /**
  * Two way diff between two directory trees
+ * \param jobs number of threads used to compare common subdirectories in
+ * parallel, if 0 use the hardware concurrency. The diff is the same regardless
+ * of the number of threads
  */
 DirectoryDiff<2> diff2(const DirectoryTree& a, const DirectoryTree& b,
-                       const CompareOpt& opt=CompareOpt());
+                       const CompareOpt& opt=CompareOpt(), unsigned jobs=1);
 
 /**
- * Two way diff between two directory trees
+ * Three way diff between three directory trees
+ * \param jobs number of threads used to compare common subdirectories in
+ * parallel, if 0 use the hardware concurrency. The diff is the same regardless
+ * of the number of threads
  */
 DirectoryDiff<3> diff3(const DirectoryTree& a, const DirectoryTree& b,
-                       const DirectoryTree& c, const CompareOpt& opt=CompareOpt());
+                       const DirectoryTree& c, const CompareOpt& opt=CompareOpt(),
+                       unsigned jobs=1);
+
+/**
+ * Three way diff between the same subtree of three directory trees, used to
+ * update a diff after modifying the subtree
+ * \param relativePath path of the top of the subtree, that may be missing in
+ * some or all of the trees. If empty, diff the entire trees
+ * \return the differences of the top of the subtree and its content, in the
+ * same order as diff3()
+ */
+DirectoryDiff<3> diff3Subtree(const DirectoryTree& a, const DirectoryTree& b,
+                              const DirectoryTree& c,
+                              const std::filesystem::path& relativePath,
+                              const CompareOpt& opt=CompareOpt());
 
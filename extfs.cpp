@@ -20,6 +20,14 @@
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
+#include <memory>
+#include <unordered_map>
+#include <cerrno>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif //__linux__
 
 using namespace std;
 using namespace std::filesystem;
@@ -74,11 +82,75 @@ static void allocateStructBuffer()
     structBuffer.resize(max(u,g));
 }
 
-string ext_lookup_user(uid_t uid)
+//
+// class ext_directory
+//
+
+ext_directory::ext_directory(int dirfd, const path& p)
+{
+    const char *name=p.empty() ? "." : p.c_str();
+    this->dirfd=openat(dirfd,name,O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(this->dirfd<0)
+        throw runtime_error(string("ext_directory: can't open ")+p.string());
+}
+
+vector<string> ext_directory::entries() const
+{
+    //fdopendir takes ownership of the file descriptor
+    int fd=dup(dirfd);
+    if(fd<0) throw runtime_error("ext_directory: dup failed");
+    DIR *dir=fdopendir(fd);
+    if(dir==nullptr)
+    {
+        close(fd);
+        throw runtime_error("ext_directory: fdopendir failed");
+    }
+    unique_ptr<DIR,int (*)(DIR*)> guard(dir,closedir);
+    rewinddir(dir);
+    vector<string> result;
+    for(;;)
+    {
+        errno=0;
+        auto e=readdir(dir);
+        if(e==nullptr) break;
+        if(e->d_name[0]=='.' && (e->d_name[1]=='\0' ||
+           (e->d_name[1]=='.' && e->d_name[2]=='\0'))) continue;
+        result.emplace_back(e->d_name);
+    }
+    if(errno!=0) throw runtime_error("ext_directory: error reading directory");
+    return result;
+}
+
+string ext_read_symlink(int dirfd, const char *name)
 {
+    string result(256,'\0');
+    for(;;)
+    {
+        ssize_t n=readlinkat(dirfd,name,result.data(),result.size());
+        if(n<0) throw runtime_error(string("ext_read_symlink: can't read ")+name);
+        //A full buffer may mean the target was truncated
+        if(static_cast<size_t>(n)<result.size())
+        {
+            result.resize(n);
+            return result;
+        }
+        result.resize(2*result.size());
+    }
+}
+
+const string& ext_lookup_user(uid_t uid)
+{
+    //Entries of the global caches are never removed, so they can be referenced
+    thread_local unordered_map<uid_t,const string*> local;
+    auto lit=local.find(uid);
+    if(lit!=local.end()) return *lit->second;
     unique_lock<mutex> l(m);
     auto it=userCache.find(uid);
-    if(it!=userCache.end()) return it->second;
+    if(it!=userCache.end())
+    {
+        local.emplace(uid,&it->second);
+        return it->second;
+    }
 
     if(structBuffer.empty()) allocateStructBuffer();
 
@@ -95,14 +167,22 @@ string ext_lookup_user(uid_t uid)
         it=userCache.insert(it,{uid,to_string(uid)});
         userReverseCache.insert({to_string(uid),uid});
     }
+    local.emplace(uid,&it->second);
     return it->second;
 }
 
 uid_t ext_lookup_user(const string& user)
 {
+    thread_local unordered_map<string,uid_t> local;
+    auto lit=local.find(user);
+    if(lit!=local.end()) return lit->second;
     unique_lock<mutex> l(m);
     auto it=userReverseCache.find(user);
-    if(it!=userReverseCache.end()) return it->second;
+    if(it!=userReverseCache.end())
+    {
+        local.emplace(user,it->second);
+        return it->second;
+    }
 
     if(structBuffer.empty()) allocateStructBuffer();
 
@@ -119,14 +199,22 @@ uid_t ext_lookup_user(const string& user)
         throw runtime_error(string("ext_lookup_user(const string& user): user ")
             +user+" not found in the system");
     }
+    local.emplace(user,it->second);
     return it->second;
 }
 
-string ext_lookup_group(gid_t gid)
+const string& ext_lookup_group(gid_t gid)
 {
+    thread_local unordered_map<gid_t,const string*> local;
+    auto lit=local.find(gid);
+    if(lit!=local.end()) return *lit->second;
     unique_lock<mutex> l(m);
     auto it=groupCache.find(gid);
-    if(it!=groupCache.end()) return it->second;
+    if(it!=groupCache.end())
+    {
+        local.emplace(gid,&it->second);
+        return it->second;
+    }
 
     if(structBuffer.empty()) allocateStructBuffer();
 
@@ -143,14 +231,22 @@ string ext_lookup_group(gid_t gid)
         it=groupCache.insert(it,{gid,to_string(gid)});
         groupReverseCache.insert({to_string(gid),gid});
     }
+    local.emplace(gid,&it->second);
     return it->second;
 }
 
 gid_t ext_lookup_group(const string& group)
 {
+    thread_local unordered_map<string,gid_t> local;
+    auto lit=local.find(group);
+    if(lit!=local.end()) return lit->second;
     unique_lock<mutex> l(m);
     auto it=groupReverseCache.find(group);
-    if(it!=groupReverseCache.end()) return it->second;
+    if(it!=groupReverseCache.end())
+    {
+        local.emplace(group,it->second);
+        return it->second;
+    }
 
     if(structBuffer.empty()) allocateStructBuffer();
 
@@ -167,6 +263,7 @@ gid_t ext_lookup_group(const string& group)
         throw runtime_error(string("ext_lookup_group(const string& group): group ")
             +group+" not found in the system");
     }
+    local.emplace(group,it->second);
     return it->second;
 }
 
@@ -189,3 +286,149 @@ void ext_symlink_change_ownership(const filesystem::path& p,
     if(lchown(s.c_str(),ext_lookup_user(user),ext_lookup_group(group)))
         throw runtime_error(string("ext_symlink_change_ownership failed with path ")+s);
 }
+
+/// Size of the buffer used by ext_copy_file to copy through user space
+static const size_t copyBufferSize=1024*1024;
+
+/**
+ * Set the attributes of a file just written, and close it
+ * \param out file descriptor, closed also in case of errors
+ * \param fail called in case of errors, must throw
+ * \return false if the owner and group could not be set
+ */
+static bool completeFile(int out, perms perm, const string& user,
+                         const string& group, time_t mtime, function<void ()> fail)
+{
+    unique_ptr<int,void (*)(int*)> outGuard(&out,[](int *fd){ close(*fd); });
+    //Set the owner first, as changing it may clear the setuid and setgid bits
+    bool result=true;
+    try {
+        if(fchown(out,ext_lookup_user(user),ext_lookup_group(group))!=0)
+            result=false;
+    } catch(exception&) {
+        result=false;
+    }
+    if(fchmod(out,static_cast<mode_t>(perm) & 07777)!=0) fail();
+    //Set mtime last, as writing alters it
+    timespec times[2];
+    times[0].tv_sec=0;
+    times[0].tv_nsec=UTIME_OMIT;
+    times[1].tv_sec=mtime;
+    times[1].tv_nsec=0;
+    if(futimens(out,times)!=0) fail();
+    outGuard.release();
+    //Errors writing to network filesystems may be reported only by close
+    if(close(out)!=0) fail();
+    return result;
+}
+
+bool ext_copy_file(const path& from, const path& to, perms perm,
+                   const string& user, const string& group, time_t mtime,
+                   function<void (const unsigned char*, size_t)> read)
+{
+    string f=from.string(), t=to.string();
+    auto fail=[&f,&t]()
+    {
+        throw runtime_error(string("Error copying ")+f+" to "+t);
+    };
+    int in=open(f.c_str(),O_RDONLY | O_CLOEXEC);
+    if(in<0) fail();
+    unique_ptr<int,void (*)(int*)> inGuard(&in,[](int *fd){ close(*fd); });
+    //Also open for reading, as the hash of a reflink is computed reading it
+    int out=open(t.c_str(),O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,0600);
+    if(out<0) fail();
+    unique_ptr<int,void (*)(int*)> outGuard(&out,[](int *fd){ close(*fd); });
+    posix_fadvise(in,0,0,POSIX_FADV_SEQUENTIAL);
+    static thread_local unique_ptr<unsigned char[]> buffer;
+    if(!buffer) buffer.reset(new unsigned char[copyBufferSize]);
+
+    bool copied=false;
+    #ifdef FICLONE
+    copied=ioctl(out,FICLONE,in)==0;
+    if(copied && read)
+    {
+        for(off_t offset=0;;)
+        {
+            ssize_t n=pread(out,buffer.get(),copyBufferSize,offset);
+            if(n==0) break;
+            if(n<0)
+            {
+                if(errno==EINTR) continue;
+                fail();
+            }
+            read(buffer.get(),n);
+            offset+=n;
+        }
+    }
+    #endif //FICLONE
+    //An in-kernel copy would have to be read again to compute the hash, so
+    //when hashing copy through user space
+    while(!copied && !read)
+    {
+        ssize_t n=copy_file_range(in,nullptr,out,nullptr,copyBufferSize,0);
+        if(n==0) copied=true;
+        else if(n<0)
+        {
+            if(errno==EINTR) continue;
+            //Not supported, copy the rest through user space
+            if(errno==EXDEV || errno==EINVAL || errno==ENOSYS || errno==EOPNOTSUPP)
+                break;
+            fail();
+        }
+    }
+    while(!copied)
+    {
+        ssize_t n=::read(in,buffer.get(),copyBufferSize);
+        if(n==0) break;
+        if(n<0)
+        {
+            if(errno==EINTR) continue;
+            fail();
+        }
+        if(read) read(buffer.get(),n);
+        for(ssize_t written=0;written<n;)
+        {
+            ssize_t w=write(out,buffer.get()+written,n-written);
+            if(w<0)
+            {
+                if(errno==EINTR) continue;
+                fail();
+            }
+            written+=w;
+        }
+    }
+
+    outGuard.release();
+    return completeFile(out,perm,user,group,mtime,fail);
+}
+
+bool ext_write_file(const path& to, perms perm, const string& user,
+                    const string& group, time_t mtime,
+                    function<size_t (unsigned char*, size_t)> fill)
+{
+    string t=to.string();
+    auto fail=[&t]()
+    {
+        throw runtime_error(string("Error writing ")+t);
+    };
+    int out=open(t.c_str(),O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,0600);
+    if(out<0) fail();
+    unique_ptr<int,void (*)(int*)> outGuard(&out,[](int *fd){ close(*fd); });
+    static thread_local unique_ptr<unsigned char[]> buffer;
+    if(!buffer) buffer.reset(new unsigned char[copyBufferSize]);
+    while(size_t n=fill(buffer.get(),copyBufferSize))
+    {
+        for(size_t written=0;written<n;)
+        {
+            ssize_t w=write(out,buffer.get()+written,n-written);
+            if(w<0)
+            {
+                if(errno==EINTR) continue;
+                fail();
+            }
+            written+=w;
+        }
+    }
+    outGuard.release();
+    return completeFile(out,perm,user,group,mtime,fail);
+}
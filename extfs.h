@@ -23,21 +23,24 @@
 #pragma once
 
 #include <filesystem>
+#include <functional>
 #include <string>
+#include <vector>
 #include <map>
 #include <mutex>
 #include <stdexcept>
 #include <cstring>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 //Forward declarartions
 class ext_file_status;
 ext_file_status ext_status(const std::filesystem::path& p);
 ext_file_status ext_symlink_status(const std::filesystem::path& p);
-std::string ext_lookup_user(uid_t uid);
-std::string ext_lookup_group(gid_t gid);
+const std::string& ext_lookup_user(uid_t uid);
+const std::string& ext_lookup_group(gid_t gid);
 
 /**
  * Extended version of std::filesystem::file_status. The standard does not
@@ -57,6 +60,18 @@ public:
         memset(&st,0,sizeof(st));
     }
 
+    /**
+     * Constructor from an entry of an open directory, does not follow symlinks
+     * \param dirfd directory file descriptor, see ext_directory
+     * \param name name of the entry in the directory
+     * \throws runtime_error if the entry can't be stat'ed
+     */
+    ext_file_status(int dirfd, const char *name)
+    {
+        if(fstatat(dirfd,name,&st,AT_SYMLINK_NOFOLLOW)!=0)
+            throw std::runtime_error(std::string("ext_file_status: can't stat ")+name);
+    }
+
     /**
      * \return the file type (as std::file_status)
      */
@@ -83,6 +98,11 @@ public:
      */
     time_t mtime() const { return st.st_mtime; }
 
+    /**
+     * \return the file last status change time
+     */
+    time_t ctime() const { return st.st_ctime; }
+
     /**
      * \return the number of hard links
      */
@@ -91,12 +111,22 @@ public:
     /**
      * \return the file user string
      */
-    std::string user() const { return ext_lookup_user(st.st_uid); }
+    const std::string& user() const { return ext_lookup_user(st.st_uid); }
 
     /**
      * \return the file group string
      */
-    std::string group() const { return ext_lookup_group(st.st_gid); }
+    const std::string& group() const { return ext_lookup_group(st.st_gid); }
+
+    /**
+     * \return the file numerical user id
+     */
+    uid_t uid() const { return st.st_uid; }
+
+    /**
+     * \return the file numerical group id
+     */
+    gid_t gid() const { return st.st_gid; }
 
 private:
     static const std::filesystem::file_type typeLut[16];
@@ -133,11 +163,63 @@ inline ext_file_status ext_symlink_status(const std::filesystem::path& p)
     return result;
 }
 
+/**
+ * A directory opened relative to another one. Its entries can be accessed by
+ * name through its file descriptor, so the kernel does not walk the full path
+ * of every entry, and no path needs to be built for them
+ */
+class ext_directory
+{
+public:
+    /**
+     * Constructor
+     * \param dirfd directory p is relative to, or AT_FDCWD
+     * \param p path of the directory, if empty the dirfd directory itself
+     * \throws runtime_error if the directory can't be opened
+     */
+    ext_directory(int dirfd, const std::filesystem::path& p);
+
+    ext_directory(const ext_directory&)=delete;
+    ext_directory& operator=(const ext_directory&)=delete;
+
+    /**
+     * \return the names of the entries except for . and .., in directory order
+     * \throws runtime_error if the directory can't be read
+     */
+    std::vector<std::string> entries() const;
+
+    /**
+     * \return the directory file descriptor
+     */
+    int fd() const { return dirfd; }
+
+    ~ext_directory() { close(dirfd); }
+
+private:
+    int dirfd;
+};
+
+/**
+ * Extended version of std::filesystem::read_symlink, for an entry of an open
+ * directory
+ * \param dirfd directory file descriptor, see ext_directory
+ * \param name name of the symlink in the directory
+ * \return the symlink target
+ * \throws runtime_error if the symlink can't be read
+ */
+std::string ext_read_symlink(int dirfd, const char *name);
+
+/*
+ * User and group lookups are cached, and every thread keeps its own copy of
+ * the entries it used, so that only the first lookup of an id or name in a
+ * thread needs a lock
+ */
+
 /**
  * \param uid numerical user id
- * \return user as string
+ * \return user as string, valid until the program ends
  */
-std::string ext_lookup_user(uid_t uid);
+const std::string& ext_lookup_user(uid_t uid);
 
 /**
  * \param user as string
@@ -147,9 +229,9 @@ uid_t ext_lookup_user(const std::string& user);
 
 /**
  * \param numerical group id
- * \return group as string
+ * \return group as string, valid until the program ends
  */
-std::string ext_lookup_group(gid_t gid);
+const std::string& ext_lookup_group(gid_t gid);
 
 /**
  * \param group as string
@@ -176,3 +258,43 @@ void ext_symlink_last_write_time(const std::filesystem::path& p, time_t mtime);
  */
 void ext_symlink_change_ownership(const std::filesystem::path& p,
                                   const std::string& user, const std::string& group);
+
+/**
+ * Copy a regular file using the fastest method supported by the filesystems:
+ * a reflink, that shares the data with the source file until either is
+ * modified, an in-kernel copy, or a read/write loop. Permissions, owner and
+ * mtime are then set on the open copy, without looking up its path again
+ * \param from source file path
+ * \param to destination file path, must not exist
+ * \param perm permissions of the copy
+ * \param user owner of the copy
+ * \param group group of the copy
+ * \param mtime last modified time of the copy
+ * \param read if not empty, called with the content of the copy in order, so
+ * that it can be hashed while copying
+ * \return false if the owner and group could not be set, that is not
+ * considered an error
+ * \throws runtime_error in case of errors
+ */
+bool ext_copy_file(const std::filesystem::path& from,
+                   const std::filesystem::path& to, std::filesystem::perms perm,
+                   const std::string& user, const std::string& group, time_t mtime,
+                   std::function<void (const unsigned char*, size_t)> read={});
+
+/**
+ * Write a regular file with the given content, then set its permissions,
+ * owner and mtime as ext_copy_file() does
+ * \param to file path, must not exist
+ * \param perm permissions of the file
+ * \param user owner of the file
+ * \param group group of the file
+ * \param mtime last modified time of the file
+ * \param fill called to get the content, in order, till it returns 0. It is
+ * passed a buffer and its size, and returns the number of bytes it wrote
+ * \return false if the owner and group could not be set, that is not
+ * considered an error
+ * \throws runtime_error in case of errors, the partially written file is left
+ */
+bool ext_write_file(const std::filesystem::path& to, std::filesystem::perms perm,
+                    const std::string& user, const std::string& group, time_t mtime,
+                    std::function<size_t (unsigned char*, size_t)> fill);
@@ -0,0 +1,197 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "hash.h"
+#include "stats.h"
+#include <stdexcept>
+#include <memory>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace std::filesystem;
+
+unsigned hashSize(HashAlgorithm alg)
+{
+    switch(alg)
+    {
+        case HashAlgorithm::SHA1:   return CryptoPP::SHA1::DIGESTSIZE;
+        case HashAlgorithm::BLAKE3: return Blake3::DIGESTSIZE;
+    }
+    throw logic_error("hashSize");
+}
+
+string hashAlgorithmName(HashAlgorithm alg)
+{
+    switch(alg)
+    {
+        case HashAlgorithm::SHA1:   return "sha1";
+        case HashAlgorithm::BLAKE3: return "blake3";
+    }
+    throw logic_error("hashAlgorithmName");
+}
+
+HashAlgorithm hashAlgorithmFromName(const string& name)
+{
+    if(name=="sha1")   return HashAlgorithm::SHA1;
+    if(name=="blake3") return HashAlgorithm::BLAKE3;
+    throw runtime_error(string("Hash algorithm ")+name+" not valid");
+}
+
+//
+// class Hasher
+//
+
+Hasher::Hasher(HashAlgorithm alg)
+{
+    if(alg==HashAlgorithm::BLAKE3) h.emplace<Blake3>();
+}
+
+void Hasher::update(const void *data, size_t size)
+{
+    auto p=reinterpret_cast<const CryptoPP::byte*>(data);
+    if(auto sha1=get_if<CryptoPP::SHA1>(&h)) sha1->Update(p,size);
+    else get<Blake3>(h).update(p,size);
+}
+
+void Hasher::final(unsigned char *digest)
+{
+    if(auto sha1=get_if<CryptoPP::SHA1>(&h)) sha1->Final(digest);
+    else get<Blake3>(h).final(digest);
+}
+
+string hashToHex(const unsigned char *digest, unsigned size)
+{
+    const char hex[]="0123456789ABCDEF";
+    string result;
+    result.resize(2*size);
+    for(unsigned i=0;i<size;i++)
+    {
+        result[2*i]  =hex[digest[i]>>4];
+        result[2*i+1]=hex[digest[i] & 0xf];
+    }
+    return result;
+}
+
+uint32_t crc32(const void *data, size_t size)
+{
+    static const auto table=[]{
+        array<uint32_t,256> result;
+        for(uint32_t i=0;i<256;i++)
+        {
+            uint32_t c=i;
+            for(int j=0;j<8;j++) c=c & 1 ? 0xedb88320u ^ (c>>1) : c>>1;
+            result[i]=c;
+        }
+        return result;
+    }();
+    auto p=static_cast<const unsigned char*>(data);
+    uint32_t crc=0xffffffffu;
+    for(size_t i=0;i<size;i++) crc=table[(crc ^ p[i]) & 0xff] ^ (crc>>8);
+    return crc ^ 0xffffffffu;
+}
+
+//
+// class FileHash
+//
+
+/**
+ * \return the value of an hex digit, or -1 if c is not an hex digit
+ */
+static int hexValue(char c)
+{
+    if(c>='0' && c<='9') return c-'0';
+    if(c>='A' && c<='F') return c-'A'+10;
+    if(c>='a' && c<='f') return c-'a'+10;
+    return -1;
+}
+
+optional<FileHash> FileHash::fromHex(string_view hex)
+{
+    if(hex.empty() || hex.size()%2!=0 || hex.size()>2*maxHashSize) return nullopt;
+    FileHash result;
+    result.len=hex.size()/2;
+    for(unsigned i=0;i<result.len;i++)
+    {
+        int hi=hexValue(hex[2*i]);
+        int lo=hexValue(hex[2*i+1]);
+        if(hi<0 || lo<0) return nullopt;
+        result.d[i]=hi<<4 | lo;
+    }
+    return result;
+}
+
+/// Size of the buffer used to read files
+static const size_t bufferSize=256*1024;
+
+/**
+ * \return a per-thread buffer of bufferSize bytes, page aligned so that the
+ * kernel can copy file data efficiently
+ */
+static unsigned char *readBuffer()
+{
+    static thread_local unique_ptr<unsigned char,decltype(&free)> buffer(
+        static_cast<unsigned char*>(aligned_alloc(4096,bufferSize)),free);
+    if(!buffer) throw bad_alloc();
+    return buffer.get();
+}
+
+/**
+ * Hash a file opened relative to dirfd, or with an absolute path
+ */
+static FileHash hashFileAt(int dirfd, const char *s, HashAlgorithm alg,
+                           const function<void (size_t)>& progress)
+{
+    int fd=openat(dirfd,s,O_RDONLY | O_CLOEXEC);
+    if(fd<0) throw runtime_error(string("hashFile: error opening ")+s);
+    //Close the file also in case of exceptions
+    unique_ptr<int,void (*)(int*)> guard(&fd,[](int *fd){ close(*fd); });
+    posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+    auto buffer=readBuffer();
+    Hasher hasher(alg);
+    uint64_t size=0;
+    for(;;)
+    {
+        ssize_t n=read(fd,buffer,bufferSize);
+        if(n==0) break;
+        if(n<0)
+        {
+            if(errno==EINTR) continue;
+            throw runtime_error(string("hashFile: error reading ")+s);
+        }
+        hasher.update(buffer,n);
+        size+=n;
+        if(progress) progress(n);
+    }
+    countHashed(size);
+    unsigned char digest[maxHashSize];
+    hasher.final(digest);
+    return FileHash(digest,hashSize(alg));
+}
+
+FileHash hashFile(const path& p, HashAlgorithm alg,
+                  const function<void (size_t)>& progress)
+{
+    return hashFileAt(AT_FDCWD,p.c_str(),alg,progress);
+}
+
+FileHash hashFile(int dirfd, const char *name, HashAlgorithm alg)
+{
+    return hashFileAt(dirfd,name,alg,{});
+}
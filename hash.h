@@ -0,0 +1,205 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include "cryptopp.h"
+#include "blake3.h"
+
+/**
+ * Hash algorithms that can be used to detect file changes.
+ * No crypto strength is needed, SHA1 is the default for compatibility with
+ * existing metadata files, while BLAKE3 is much faster
+ */
+enum class HashAlgorithm
+{
+    SHA1,  ///< SHA1, 20 bytes
+    BLAKE3 ///< BLAKE3, 32 bytes
+};
+
+/// Size of the largest hash supported, in bytes
+const unsigned maxHashSize=32;
+
+/**
+ * \param alg hash algorithm
+ * \return the size of the hash, in bytes
+ */
+unsigned hashSize(HashAlgorithm alg);
+
+/**
+ * \param alg hash algorithm
+ * \return the name of the hash algorithm as used in metadata files
+ */
+std::string hashAlgorithmName(HashAlgorithm alg);
+
+/**
+ * \param name name of the hash algorithm as used in metadata files
+ * \return the hash algorithm
+ * \throws runtime_error if the name is not that of a supported algorithm
+ */
+HashAlgorithm hashAlgorithmFromName(const std::string& name);
+
+/**
+ * Incremental hash computation with a selectable algorithm
+ */
+class Hasher
+{
+public:
+    /**
+     * Constructor
+     * \param alg hash algorithm
+     */
+    explicit Hasher(HashAlgorithm alg);
+
+    /**
+     * Add data to the hash computation
+     * \param data data to hash
+     * \param size data size in bytes
+     */
+    void update(const void *data, size_t size);
+
+    /**
+     * Compute the final hash. No more data can be added after this call
+     * \param digest the output hash, with a size of hashSize(alg) bytes
+     */
+    void final(unsigned char *digest);
+
+private:
+    std::variant<CryptoPP::SHA1,Blake3> h;
+};
+
+/**
+ * Convert a hash to a string of (uppercase) ASCII hex digits
+ * \param digest hash
+ * \param size hash size in bytes
+ * \return the hash as string
+ */
+std::string hashToHex(const unsigned char *digest, unsigned size);
+
+/**
+ * Compute the CRC-32 (as used by zlib) of a buffer. Used to detect corruption
+ * of data that is not hashed with a HashAlgorithm, such as metadata files
+ * \param data data to checksum
+ * \param size data size in bytes
+ * \return the CRC-32 of the data
+ */
+uint32_t crc32(const void *data, size_t size);
+
+/**
+ * A file hash stored inline in binary form, so that storing it takes no heap
+ * allocations and comparing it is a memcmp. A FileHash can also be empty, used
+ * when the hash computation has been omitted.
+ */
+class FileHash
+{
+public:
+    /**
+     * Construct an empty hash
+     */
+    FileHash() {}
+
+    /**
+     * Constructor from binary digest
+     * \param digest hash
+     * \param size hash size in bytes, at most maxHashSize
+     */
+    FileHash(const unsigned char *digest, unsigned size) : len(size)
+    {
+        memcpy(d.data(),digest,size);
+    }
+
+    /**
+     * \param hex hash as ASCII hex digits, either uppercase or lowercase
+     * \return the hash, or nullopt if hex is not a valid hash
+     */
+    static std::optional<FileHash> fromHex(std::string_view hex);
+
+    /**
+     * \return the hash as a string of (uppercase) ASCII hex digits
+     */
+    std::string toHex() const { return hashToHex(d.data(),len); }
+
+    /**
+     * \return true if the hash is empty (omitted)
+     */
+    bool empty() const { return len==0; }
+
+    /**
+     * \return the hash size in bytes, 0 if empty
+     */
+    unsigned size() const { return len; }
+
+    /**
+     * \return a pointer to the binary digest
+     */
+    const unsigned char *data() const { return d.data(); }
+
+    /**
+     * Make the hash empty
+     */
+    void clear() { len=0; }
+
+private:
+    std::array<unsigned char,maxHashSize> d;
+    uint8_t len=0;
+};
+
+/**
+ * Equality/inequality comparison. Two empty hashes are equal
+ */
+inline bool operator== (const FileHash& a, const FileHash& b)
+{
+    return a.size()==b.size() && memcmp(a.data(),b.data(),a.size())==0;
+}
+inline bool operator!= (const FileHash& a, const FileHash& b)
+{
+    return !(a==b);
+}
+
+/**
+ * Computes the hash of a file. Only to detect changes, no crypto strength needed
+ * The file is read sequentially through a per-thread buffer, so that hashing
+ * many small files does not cause allocations.
+ * \param p file path
+ * \param alg hash algorithm
+ * \param progress if set, called with the number of bytes after every read
+ * \return the file hash
+ * \throws runtime_error if the file cannot be read
+ */
+FileHash hashFile(const std::filesystem::path& p,
+                  HashAlgorithm alg=HashAlgorithm::SHA1,
+                  const std::function<void (size_t)>& progress={});
+
+/**
+ * Computes the hash of an entry of an open directory, see ext_directory
+ * \param dirfd directory file descriptor
+ * \param name file name in the directory
+ * \param alg hash algorithm
+ * \return the file hash
+ * \throws runtime_error if the file cannot be read
+ */
+FileHash hashFile(int dirfd, const char *name,
+                  HashAlgorithm alg=HashAlgorithm::SHA1);
@@ -0,0 +1,344 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "journal.h"
+#include "extfs.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+#include <memory>
+#include <map>
+#include <set>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif //__linux__
+
+using namespace std;
+using namespace std::filesystem;
+
+static path lockPath(const path& journal)
+{
+    path result=journal;
+    result+=".lock";
+    return result;
+}
+
+/**
+ * Open and lock the journal. As commit() replaces the journal with a new file,
+ * the lock is taken again if the file was replaced while waiting for it
+ * \param journal journal file path
+ * \param create if true, create the journal if it does not exist
+ * \return the file descriptor, or -1 if it does not exist and create is false
+ * \throws runtime_error in case of errors
+ */
+static int lockJournal(const path& journal, bool create)
+{
+    for(;;)
+    {
+        int flags=O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT : 0);
+        int fd=open(journal.c_str(),flags,0644);
+        if(fd<0)
+        {
+            if(errno==ENOENT && create==false) return -1;
+            throw runtime_error(string("Can't open change journal ")+journal.string());
+        }
+        struct stat st;
+        if(flock(fd,LOCK_EX)!=0 || fstat(fd,&st)!=0)
+        {
+            close(fd);
+            throw runtime_error(string("Can't lock change journal ")+journal.string());
+        }
+        if(st.st_nlink>0) return fd;
+        close(fd);
+    }
+}
+
+static void writeAll(int fd, const string& s, const path& journal)
+{
+    for(size_t written=0;written<s.size();)
+    {
+        ssize_t n=write(fd,s.data()+written,s.size()-written);
+        if(n<0 && errno==EINTR) continue;
+        if(n<0) throw runtime_error(string("Can't write change journal ")+journal.string());
+        written+=n;
+    }
+}
+
+static string readAll(int fd, const path& journal)
+{
+    string result;
+    char buffer[4096];
+    for(;;)
+    {
+        ssize_t n=pread(fd,buffer,sizeof(buffer),result.size());
+        if(n<0 && errno==EINTR) continue;
+        if(n<0) throw runtime_error(string("Can't read change journal ")+journal.string());
+        if(n==0) return result;
+        result.append(buffer,n);
+    }
+}
+
+/**
+ * \param journal journal file path
+ * \return true if a watcher holds the lock of the journal
+ */
+static bool watcherRunning(const path& journal)
+{
+    int fd=open(lockPath(journal).c_str(),O_RDONLY | O_CLOEXEC);
+    if(fd<0) return false;
+    bool result=flock(fd,LOCK_SH | LOCK_NB)!=0 && errno==EWOULDBLOCK;
+    close(fd); //Also releases the lock if taken
+    return result;
+}
+
+static string journalLine(const path& dir)
+{
+    ostringstream ss;
+    ss<<quoted(dir.string())<<'\n';
+    return ss.str();
+}
+
+//
+// class ChangeJournal
+//
+
+ChangeJournal::ChangeJournal(const path& journal) : journal(journal)
+{
+    //Check the watcher first, if it starts after this it records it anyway
+    isComplete=watcherRunning(journal);
+    int fd=lockJournal(journal,false);
+    if(fd<0) return;
+    string content;
+    try {
+        content=readAll(fd,journal);
+    } catch(...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    size=content.size();
+    set<path> unique;
+    istringstream ss(content);
+    string line;
+    while(getline(ss,line))
+    {
+        if(line=="*")
+        {
+            isComplete=false;
+            continue;
+        }
+        istringstream ls(line);
+        string dir;
+        if(!(ls>>quoted(dir)))
+            throw runtime_error(string("Corrupted change journal ")+journal.string());
+        unique.insert(dir);
+    }
+    dirs.assign(unique.begin(),unique.end());
+    //Parent directories first, so that removed subdirectories are not scanned
+    stable_sort(dirs.begin(),dirs.end(),[](const path& a, const path& b){
+        return distance(a.begin(),a.end())<distance(b.begin(),b.end());
+    });
+}
+
+void ChangeJournal::commit()
+{
+    int fd=lockJournal(journal,true);
+    //The lock is released when closing, after the journal is replaced
+    unique_ptr<int,void (*)(int*)> guard(&fd,[](int *fd){ close(*fd); });
+    string content=readAll(fd,journal).substr(size);
+    for(auto& dir : kept) content+=journalLine(dir);
+    path temp=journal;
+    temp+=".tmp";
+    int tfd=open(temp.c_str(),O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+    if(tfd<0) throw runtime_error(string("Can't write change journal ")+temp.string());
+    try {
+        writeAll(tfd,content,temp);
+        if(fsync(tfd)!=0) throw runtime_error(string("Can't write change journal ")+temp.string());
+    } catch(...) {
+        close(tfd);
+        throw;
+    }
+    close(tfd);
+    rename(temp,journal);
+    size=0;
+    kept.clear();
+}
+
+//
+// watchDirectory
+//
+
+#ifdef __linux__
+
+/**
+ * Keeps an inotify watch on every directory of a tree
+ */
+class Watcher
+{
+public:
+    Watcher(const path& top, function<void (const string&)> warningCallback)
+        : top(top), warningCallback(warningCallback)
+    {
+        fd=inotify_init1(IN_CLOEXEC);
+        if(fd<0) throw runtime_error("Can't initialize inotify");
+    }
+
+    Watcher(const Watcher&)=delete;
+    Watcher& operator=(const Watcher&)=delete;
+
+    /**
+     * Watch a directory and all its subdirectories
+     * \param dir directory relative to top
+     * \param changed if true, the directories are new, so also record them as
+     * changed, as entries may have been added before watching them
+     */
+    void add(const path& dir, bool changed)
+    {
+        const uint32_t mask=IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MODIFY |
+            IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+        int wd=inotify_add_watch(fd,(top / dir).c_str(),mask);
+        if(wd<0)
+        {
+            if(errno==ENOENT || errno==ENOTDIR) return; //Removed meanwhile
+            warningCallback(string("Warning: can't watch ")+(top / dir).string()
+                +(errno==ENOSPC ? ", consider raising fs.inotify.max_user_watches" : ""));
+            lost=true;
+            return;
+        }
+        //A directory moved within the tree keeps its watch, that gets its new path
+        watches[wd]=dir;
+        if(changed) this->changed.insert(dir);
+        try {
+            ext_directory d(AT_FDCWD,top / dir);
+            for(auto& name : d.entries())
+            {
+                try {
+                    if(ext_file_status(d.fd(),name.c_str()).type()==file_type::directory)
+                        add(dir / name,changed);
+                } catch(exception&) {} //Removed meanwhile
+            }
+        } catch(exception&) {} //Removed meanwhile
+    }
+
+    /**
+     * Wait for events for at most one second
+     */
+    void wait()
+    {
+        pollfd p;
+        p.fd=fd;
+        p.events=POLLIN;
+        if(poll(&p,1,1000)<=0) return;
+        alignas(inotify_event) char buffer[64*1024];
+        ssize_t n=read(fd,buffer,sizeof(buffer));
+        if(n<=0) return;
+        for(char *ptr=buffer;ptr<buffer+n;)
+        {
+            auto e=reinterpret_cast<inotify_event*>(ptr);
+            ptr+=sizeof(inotify_event)+e->len;
+            if(e->mask & IN_Q_OVERFLOW)
+            {
+                lost=true;
+                continue;
+            }
+            auto it=watches.find(e->wd);
+            if(it==watches.end()) continue;
+            if(e->mask & IN_IGNORED)
+            {
+                watches.erase(it);
+                continue;
+            }
+            //Events without a name are about the watched directory itself
+            changed.insert(it->second);
+            if(e->len>0 && (e->mask & IN_ISDIR) && (e->mask & (IN_CREATE | IN_MOVED_TO)))
+                add(it->second / e->name,true);
+        }
+    }
+
+    /**
+     * \return the journal lines for the changes since the last call
+     */
+    string take()
+    {
+        string result;
+        if(lost) result+="*\n";
+        for(auto& dir : changed) result+=journalLine(dir);
+        lost=false;
+        changed.clear();
+        return result;
+    }
+
+    ~Watcher() { close(fd); }
+
+private:
+    const path top;
+    function<void (const string&)> warningCallback;
+    int fd;
+    map<int,path> watches;
+    set<path> changed;
+    bool lost=false;
+};
+
+static void appendToJournal(const path& journal, const string& lines)
+{
+    if(lines.empty()) return;
+    int fd=lockJournal(journal,true);
+    unique_ptr<int,void (*)(int*)> guard(&fd,[](int *fd){ close(*fd); });
+    writeAll(fd,lines,journal);
+}
+
+void watchDirectory(const path& dir, const path& journal,
+                    function<void (const string&)> warningCallback)
+{
+    int lfd=open(lockPath(journal).c_str(),O_RDWR | O_CREAT | O_CLOEXEC,0644);
+    if(lfd<0) throw runtime_error(string("Can't open ")+lockPath(journal).string());
+    if(flock(lfd,LOCK_EX | LOCK_NB)!=0)
+    {
+        close(lfd);
+        throw runtime_error(string("Change journal ")+journal.string()
+            +" is already being written by another watcher");
+    }
+    //The lock is held till the process exits
+    Watcher watcher(absolute(dir),warningCallback);
+    watcher.add("",false);
+    watcher.take();
+    //Changes made before watching are unknown, so the next backup scans all
+    appendToJournal(journal,"*\n");
+    cout<<"Watching "<<dir<<", recording changes in "<<journal<<"\n"; cout.flush();
+    for(;;)
+    {
+        watcher.wait();
+        appendToJournal(journal,watcher.take());
+    }
+}
+
+#else //__linux__
+
+void watchDirectory(const path& dir, const path& journal,
+                    function<void (const string&)> warningCallback)
+{
+    throw runtime_error("Watching directories is only supported on Linux");
+}
+
+#endif //__linux__
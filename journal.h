@@ -0,0 +1,96 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * A change journal records the directories of a directory tree whose content
+ * or attributes changed, so that a backup can scan again only those
+ * directories instead of the entire tree.
+ * The journal is written by watchDirectory(), that holds a lock on a file
+ * named as the journal with a .lock suffix while running. The journal records
+ * all changes only if the watcher has been running since the journal was last
+ * committed, so when the watcher starts or loses events it records that the
+ * next backup needs to scan the entire tree.
+ * Every line of the journal is either a quoted path relative to the watched
+ * directory, or a * meaning that changes were lost.
+ */
+class ChangeJournal
+{
+public:
+    /**
+     * Read the journal, leaving it as it is until commit() is called
+     * \param journal journal file path, may not exist if nothing changed
+     * \throws runtime_error if the journal can't be read
+     */
+    explicit ChangeJournal(const std::filesystem::path& journal);
+
+    ChangeJournal(const ChangeJournal&)=delete;
+    ChangeJournal& operator=(const ChangeJournal&)=delete;
+
+    /**
+     * \return true if the journal records all the changes since it was last
+     * committed, false if the watcher is not running or lost changes
+     */
+    bool complete() const { return isComplete; }
+
+    /**
+     * \return the directories that changed, relative to the watched
+     * directory, with parent directories before their subdirectories
+     */
+    const std::vector<std::filesystem::path>& directories() const { return dirs; }
+
+    /**
+     * Record a directory to be scanned again by the next backup, for example
+     * because some entries in it were not backed up
+     * \param dir path relative to the watched directory
+     */
+    void keep(const std::filesystem::path& dir) { kept.push_back(dir); }
+
+    /**
+     * Remove the changes that were read from the journal, leaving only the
+     * ones recorded since then and the kept directories. Call only once the
+     * changes are backed up and the metadata files written, so that if the
+     * backup fails the next one scans the same directories again
+     * \throws runtime_error if the journal can't be written
+     */
+    void commit();
+
+private:
+    std::filesystem::path journal;
+    std::vector<std::filesystem::path> dirs, kept;
+    size_t size=0;          ///< Size of the journal when read
+    bool isComplete=false;
+};
+
+/**
+ * Watch a directory tree and record in a change journal the directories whose
+ * content or attributes change, until the process is killed. Only supported
+ * on Linux, as it uses inotify
+ * \param dir directory to watch
+ * \param journal journal file path
+ * \param warningCallback warning callback
+ * \throws runtime_error if the tree can't be watched or the journal written
+ */
+void watchDirectory(const std::filesystem::path& dir,
+                    const std::filesystem::path& journal,
+                    std::function<void (const std::string&)> warningCallback);
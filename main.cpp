@@ -19,9 +19,14 @@
 #include <fstream>
 #include <vector>
 #include <map>
+#include <memory>
+#include <unistd.h>
 #include <boost/program_options.hpp>
 #include "core.h"
 #include "backup.h"
+#include "journal.h"
+#include "remote.h"
+#include "stats.h"
 #include "color.h"
 
 using namespace std;
@@ -40,6 +45,7 @@ Legend:
 <met> : metadata file
 <d|m> : either directory or metadata file
 <dif> : diff file
+<jrn> : change journal file
 <ign> : list of metadata to ignore
         one or more of {perm,owner,mtime,size,hash,symlink,all}
         (when using 'all' only the presence of a file and its type matters)
@@ -48,6 +54,10 @@ Usage:
 ddm ls <dir>                        # List directory, write metadata to stdout
 ddm ls <dir> -n                     # List directory, omit hash computation
 ddm ls <dir> -o <met>               # List directory, write metadata to file
+ddm ls <dir> -j <n>                 # List directory using n threads
+ddm ls <dir> --hash <alg>           # List directory, hash with {sha1,blake3}
+ddm ls <dir> --format <fmt>         # List directory, write as {text,binary}
+ddm ls <met> --format <fmt> -o <met> # Convert metadata file to {text,binary}
 ddm diff <d|m> <d|m>                # Diff directories or metadata, write stdout
 ddm diff <d|m> <d|m> -n             # Diff directories (omit hash) or metadata
 ddm diff <d|m> <d|m> -o <dif>       # Diff directories or metadata, write file
@@ -57,10 +67,49 @@ ddm diff <d|m> <d|m> <d|m>          # Three way diff, write stdout
 ddm scrub <dir> <met> <met>             # Check for bit rot, correct if possible
 ddm scrub -s <dir> -t <dir> <met> <met> # Check for bit rot, correct if possible
                                         # using source dir to copy files from
+ddm scrub ... --budget <time|size>      # Only hash part of the files, such as
+                                        # 8h or 500G, resuming the next time
+ddm scrub ... --remote <cmd>            # Backup dir and metadata files are on
+                                        # the machine where cmd runs ddm serve
 
 ddm backup -s <dir> -t <dir>                # Backup source dir to target dir
 ddm backup -s <dir> -t <dir> <met> <met>    # Backup and update bit rot copies
                                             # also performs scrub of backup
+ddm backup -s <dir> -t <dir> <met> <met> --rehash <runs>
+                                            # Same, but don't hash unchanged
+                                            # files, except for a fraction of
+                                            # them so all files are hashed
+                                            # again every runs backups
+ddm backup -s <dir> -t <dir> <met> <met> --nohash --hashlimit <MiB/s>
+                                            # Fast backup, limit the rate the
+                                            # files without hash are read at
+ddm backup -s <dir> -t <dir> <met> <met> --nohash --journal <jrn>
+                                            # Fast backup, scan only the source
+                                            # directories in the change journal
+ddm backup -s <dir> -t <dir> <met> <met> --nohash --trustmeta <runs>
+                                            # Fast backup, scan and scrub the
+                                            # target dir only every runs times,
+                                            # trust metadata files otherwise
+ddm backup -s <dir> -t <dir> <met> <met> --dedup
+                                            # Rename entries moved in source dir
+                                            # and copy files already in target
+                                            # dir from there
+ddm backup -s <dir> -t <dir> <met> <met> --remote <cmd>
+                                            # Target dir and metadata files are
+                                            # on the machine where cmd runs
+                                            # ddm serve, such as ssh host ddm serve
+
+ddm watch <dir> --journal <jrn>     # Record changes to dir in change journal
+ddm serve                           # Serve --remote requests on stdin/stdout
+
+All commands that scan directories accept -j <n> to scan directories,
+compute file hashes and compare directories using n threads (0 means one
+thread per CPU core)
+All commands accept --stats to print the time and resources used by every
+phase of scrub and backup to stderr at exit, --statsformat <fmt> to print
+them as {text,json,prometheus} and --statsfile <file> to write them to a file
+Scrub and backup use the hash algorithm recorded in the metadata files, and
+write them back in the same format they have
 )";
 // ddm sync -s <d|m> -t <d|m> -o <dir> # ??? TODO
 // )";
@@ -75,6 +124,103 @@ static void printWarning(const string& message)
     cerr<<yellowb<<message<<reset<<'\n';
 }
 
+/**
+ * \return the number of scanning threads selected with the --jobs option
+ */
+static unsigned jobs(variables_map& vm)
+{
+    return vm.count("jobs") ? vm["jobs"].as<unsigned>() : 1;
+}
+
+/**
+ * \return the hash algorithm selected with the --hash option, or SHA1
+ */
+static HashAlgorithm hashAlgorithm(variables_map& vm)
+{
+    if(vm.count("hash")==0) return HashAlgorithm::SHA1;
+    return hashAlgorithmFromName(vm["hash"].as<string>());
+}
+
+/**
+ * \return the metadata file format selected with the --format option, or text
+ */
+static MetadataFormat metadataFormat(variables_map& vm)
+{
+    if(vm.count("format")==0) return MetadataFormat::Text;
+    auto name=vm["format"].as<string>();
+    if(name=="text")   return MetadataFormat::Text;
+    if(name=="binary") return MetadataFormat::Binary;
+    throw runtime_error(string("Metadata format ")+name+" not valid");
+}
+
+/**
+ * Write the statistics selected with the --stats, --statsformat and
+ * --statsfile options
+ */
+static void writeStats(variables_map& vm)
+{
+    StatsFormat format=StatsFormat::Text;
+    if(vm.count("statsformat"))
+    {
+        auto name=vm["statsformat"].as<string>();
+        if(name=="json") format=StatsFormat::Json;
+        else if(name=="prometheus") format=StatsFormat::Prometheus;
+        else if(name!="text")
+            throw runtime_error(string("Statistics format ")+name+" not valid");
+    }
+    if(vm.count("statsfile")==0) return writeStats(cerr,format);
+    //Written to a temporary file and renamed, so that a reader such as the
+    //Prometheus textfile collector never sees a partially written file
+    auto statsFile=vm["statsfile"].as<path>();
+    auto temp=statsFile;
+    temp+=".tmp";
+    {
+        ofstream out(temp);
+        writeStats(out,format);
+        if(!out) throw runtime_error(string("Error writing ")+temp.string());
+    }
+    rename(temp,statsFile);
+}
+
+/**
+ * \return the connection to the remote target selected with the --remote
+ * option, or nothing
+ */
+static unique_ptr<RemoteTarget> remoteTarget(variables_map& vm)
+{
+    if(vm.count("remote")==0) return nullptr;
+    auto command=vm["remote"].as<string>();
+    cout<<"Connecting to remote target with "<<command<<"... "; cout.flush();
+    auto result=make_unique<RemoteTarget>(command);
+    cout<<"Done.\n";
+    return result;
+}
+
+/**
+ * Get the scrub budget selected with the --budget option, either a time such
+ * as 90s, 30min, 8h or 1d, or an amount of data such as 500M, 2G or 1T
+ * \param bytes set to the budget in bytes, or 0
+ * \param seconds set to the budget in seconds, or 0
+ */
+static void budget(variables_map& vm, uint64_t& bytes, unsigned& seconds)
+{
+    bytes=0;
+    seconds=0;
+    if(vm.count("budget")==0) return;
+    auto option=vm["budget"].as<string>();
+    size_t end=0;
+    unsigned long long value=0;
+    try {
+        value=stoull(option,&end);
+    } catch(exception&) {}
+    const map<string,unsigned> times={{"s",1},{"min",60},{"h",3600},{"d",86400}};
+    const map<string,int> sizes={{"K",10},{"M",20},{"G",30},{"T",40}};
+    auto unit=option.substr(end);
+    if(value>0 && times.count(unit)) seconds=value*times.at(unit);
+    else if(value>0 && sizes.count(unit)) bytes=value<<sizes.at(unit);
+    else throw runtime_error(string("Budget ")+option+" not valid");
+}
+
 /**
  * ddm ls command
  */
@@ -91,15 +237,36 @@ Usage:
 ddm ls <dir>                        # List directory, write metadata to stdout
 ddm ls <dir> -n                     # List directory, omit hash computation
 ddm ls <dir> -o <met>               # List directory, write metadata to file
+ddm ls <dir> -j <n>                 # List directory using n threads
+ddm ls <dir> --hash <alg>           # List directory, hash with {sha1,blake3}
+ddm ls <dir> --format <fmt>         # List directory, write as {text,binary}
+ddm ls <met> --format <fmt> -o <met> # Convert metadata file to {text,binary}
 )";
         return 100;
     }
 
     ScanOpt opt=vm.count("nohash") ? ScanOpt::OmitHash : ScanOpt::ComputeHash;
+    path input=inputs.empty() ? "." : inputs.at(0);
     DirectoryTree dt;
     dt.setWarningCallback(printWarning);
-    dt.scanDirectory(inputs.empty() ? "." : inputs.at(0), opt);
-    out<<dt;
+    dt.setJobs(jobs(vm));
+    dt.setHashAlgorithm(hashAlgorithm(vm));
+    auto format=metadataFormat(vm);
+    if(is_directory(input)==false)
+    {
+        //Convert a metadata file, keeping its hash algorithm
+        dt.readFrom(input);
+        dt.setMetadataFormat(format);
+        dt.writeTo(out);
+    } else if(format==MetadataFormat::Binary) {
+        //The binary format can only be written once the whole tree is known
+        dt.setMetadataFormat(format);
+        dt.scanDirectory(input,opt);
+        dt.writeTo(out);
+    } else {
+        //Write directories as they are scanned, to not keep the tree in memory
+        dt.scanDirectoryTo(input,out,opt);
+    }
     return 0;
 }
 
@@ -129,25 +296,41 @@ ddm diff <d|m> <d|m> <d|m>          # Three way diff, write stdout
     CompareOpt copt;
     if(vm.count("ignore")) copt=CompareOpt(vm["ignore"].as<string>());
 
+    //Read metadata files first, so that directories are scanned with the same
+    //hash algorithm of the metadata files, unless one is explicitly selected
+    vector<DirectoryTree> trees(inputs.size());
+    optional<HashAlgorithm> alg;
+    if(vm.count("hash")) alg=hashAlgorithm(vm);
+    for(unsigned i=0;i<inputs.size();i++)
+    {
+        trees[i].setWarningCallback(printWarning);
+        if(is_directory(inputs.at(i))) continue;
+        //Diffs don't modify the trees, so binary metadata files are decoded
+        //only where needed
+        trees[i].setLazyLoading(true);
+        trees[i].readFrom(inputs.at(i));
+        if(!alg) alg=trees[i].hashAlgorithm();
+    }
+    for(unsigned i=0;i<inputs.size();i++)
+    {
+        if(is_directory(inputs.at(i))==false) continue;
+        trees[i].setJobs(jobs(vm));
+        trees[i].setHashAlgorithm(alg.value_or(HashAlgorithm::SHA1));
+        trees[i].scanDirectory(inputs.at(i),sopt);
+    }
+    //Hashes computed with different algorithms would all differ
+    for(auto& t : trees)
+        if(copt.hash && t.hashAlgorithm()!=trees.at(0).hashAlgorithm())
+            throw runtime_error("Cannot compare hashes computed with different "
+                                "algorithms, use -i hash to ignore them");
+
     if(inputs.size()==2)
     {
-        DirectoryTree a,b;
-        a.setWarningCallback(printWarning);
-        b.setWarningCallback(printWarning);
-        a.fromPath(inputs.at(0),sopt);
-        b.fromPath(inputs.at(1),sopt);
-        auto diff=diff2(a,b,copt);
+        auto diff=diff2(trees.at(0),trees.at(1),copt,jobs(vm));
         out<<diff;
         return diff.size()==0 ? 0 : 1; //Allow to check if differences found
     } else {
-        DirectoryTree a,b,c;
-        a.setWarningCallback(printWarning);
-        b.setWarningCallback(printWarning);
-        c.setWarningCallback(printWarning);
-        a.fromPath(inputs.at(0),sopt);
-        b.fromPath(inputs.at(1),sopt);
-        c.fromPath(inputs.at(2),sopt);
-        auto diff=diff3(a,b,c,copt);
+        auto diff=diff3(trees.at(0),trees.at(1),trees.at(2),copt,jobs(vm));
         out<<diff;
         return diff.size()==0 ? 0 : 1; //Allow to check if differences found
     }
@@ -162,7 +345,8 @@ static int scrubCmd(variables_map& vm, ostream& out)
     if(vm.count("input")) inputs=vm["input"].as<vector<path>>();
 
     bool err=true;
-    if(!vm.count("help") && !vm.count("ignore") && !vm.count("nohash"))
+    if(!vm.count("help") && !vm.count("ignore") && !vm.count("nohash")
+    && !vm.count("hash") && !(vm.count("remote") && vm.count("budget")))
     {
         if(vm.count("source") && vm.count("target") && inputs.size()==2)
             err=false;
@@ -176,17 +360,27 @@ Usage:
 ddm scrub <dir> <met> <met>             # Check for bit rot, correct if possible
 ddm scrub -s <dir> -t <dir> <met> <met> # Check for bit rot, correct if possible
                                         # also checks source dir
+ddm scrub ... --budget <time|size>      # Only hash part of the files, such as
+                                        # 8h or 500G, resuming the next time
+ddm scrub ... --remote <cmd>            # Backup dir and metadata files are on
+                                        # the machine where cmd runs ddm serve
 )";
         return 100;
     }
 
+    uint64_t budgetBytes;
+    unsigned budgetSeconds;
+    budget(vm,budgetBytes,budgetSeconds);
+    auto remote=remoteTarget(vm);
     if(vm.count("source") && vm.count("target"))
         return scrub(vm["source"].as<path>(),vm["target"].as<path>(),
                      inputs.at(0),inputs.at(1),vm.count("fixup"),
-                     !vm.count("singlethread"),printWarning);
+                     budgetBytes,budgetSeconds,!vm.count("singlethread"),
+                     jobs(vm),remote.get(),printWarning);
     else
         return scrub(inputs.at(0),inputs.at(1),inputs.at(2),vm.count("fixup"),
-                     printWarning);
+                     budgetBytes,budgetSeconds,jobs(vm),
+                     remote.get(),printWarning);
 }
 
 /**
@@ -197,28 +391,115 @@ static int backupCmd(variables_map& vm, ostream& out)
     vector<path> inputs;
     if(vm.count("input")) inputs=vm["input"].as<vector<path>>();
 
-    if(vm.count("help") || vm.count("ignore") ||
+    if(vm.count("help") || vm.count("ignore") || vm.count("hash") ||
        !vm.count("source") || !vm.count("target") ||
-       (inputs.size()!=0 && inputs.size()!=2))
+       (inputs.size()!=0 && inputs.size()!=2) ||
+       (vm.count("rehash") && (vm.count("nohash") || inputs.size()!=2)) ||
+       (vm.count("hashlimit") && (!vm.count("nohash") || inputs.size()!=2)) ||
+       (vm.count("journal") && inputs.size()!=2) ||
+       (vm.count("trustmeta") && (!vm.count("nohash") || inputs.size()!=2)) ||
+       (vm.count("dedup") && inputs.size()!=2) ||
+       (vm.count("remote") && (inputs.size()!=2 || vm.count("rehash") ||
+                               vm.count("trustmeta"))))
     {
         cerr<<R"(ddm backup
 Usage:
 ddm backup -s <dir> -t <dir>                # Backup source dir to target dir
 ddm backup -s <dir> -t <dir> <met> <met>    # Backup and update bit rot copies
                                             # also performs scrub of backup
+ddm backup -s <dir> -t <dir> <met> <met> --rehash <runs>
+                                            # Same, but don't hash unchanged
+                                            # files, except for a fraction of
+                                            # them so all files are hashed
+                                            # again every runs backups
+ddm backup -s <dir> -t <dir> <met> <met> --nohash --hashlimit <MiB/s>
+                                            # Fast backup, limit the rate the
+                                            # files without hash are read at
+ddm backup -s <dir> -t <dir> <met> <met> --nohash --journal <jrn>
+                                            # Fast backup, scan only the source
+                                            # directories in the change journal
+ddm backup -s <dir> -t <dir> <met> <met> --nohash --trustmeta <runs>
+                                            # Fast backup, scan and scrub the
+                                            # target dir only every runs times,
+                                            # trust metadata files otherwise
+ddm backup -s <dir> -t <dir> <met> <met> --dedup
+                                            # Rename entries moved in source dir
+                                            # and copy files already in target
+                                            # dir from there
+ddm backup -s <dir> -t <dir> <met> <met> --remote <cmd>
+                                            # Target dir and metadata files are
+                                            # on the machine where cmd runs
+                                            # ddm serve, such as ssh host ddm serve
 )";
         return 100;
     }
 
     if(inputs.size()==2)
+    {
+        unsigned rehashPeriod=vm.count("rehash") ? vm["rehash"].as<unsigned>() : 0;
+        unsigned hashLimit=vm.count("hashlimit") ? vm["hashlimit"].as<unsigned>() : 0;
+        path journal=vm.count("journal") ? vm["journal"].as<path>() : path();
+        unsigned trustRuns=vm.count("trustmeta") ? vm["trustmeta"].as<unsigned>() : 0;
+        auto remote=remoteTarget(vm);
         return backup(vm["source"].as<path>(),vm["target"].as<path>(),
                       inputs.at(0),inputs.at(1),vm.count("fixup"),
-                      !vm.count("nohash"),!vm.count("singlethread"),printWarning);
+                      !vm.count("nohash"),rehashPeriod,hashLimit,journal,trustRuns,
+                      vm.count("dedup"),!vm.count("singlethread"),jobs(vm),
+                      remote.get(),printWarning);
+    }
     else
         return backup(vm["source"].as<path>(),vm["target"].as<path>(),
                       !vm.count("singlethread"),printWarning);
 }
 
+/**
+ * ddm watch command
+ */
+static int watchCmd(variables_map& vm, ostream& out)
+{
+    vector<path> inputs;
+    if(vm.count("input")) inputs=vm["input"].as<vector<path>>();
+
+    if(vm.count("help") || vm.count("source") || vm.count("target") ||
+       vm.count("output") || !vm.count("journal") || inputs.size()!=1)
+    {
+        cerr<<R"(ddm watch
+Usage:
+ddm watch <dir> --journal <jrn>     # Record changes to dir in change journal
+                                    # till killed, for backup --journal
+)";
+        return 100;
+    }
+
+    watchDirectory(inputs.at(0),vm["journal"].as<path>(),printWarning);
+    return 0;
+}
+
+/**
+ * ddm serve command
+ */
+static int serveCmd(variables_map& vm, ostream& out)
+{
+    if(vm.count("help") || vm.count("input") || vm.count("source") ||
+       vm.count("target") || vm.count("output"))
+    {
+        cerr<<R"(ddm serve
+Usage:
+ddm serve                           # Serve the requests of a --remote scrub
+                                    # or backup on stdin/stdout, usually
+                                    # started by ssh
+)";
+        return 100;
+    }
+
+    //Stdout is reserved to the replies, anything else goes to stderr
+    int replies=dup(STDOUT_FILENO);
+    if(replies<0 || dup2(STDERR_FILENO,STDOUT_FILENO)<0)
+        throw runtime_error("ddm serve: can't redirect stdout");
+    serveRemoteTarget(STDIN_FILENO,replies,printWarning);
+    return 0;
+}
+
 int main(int argc, char *argv[]) try
 {
     //Basic sanity check
@@ -239,6 +520,19 @@ int main(int argc, char *argv[]) try
         ("nohash,n", "omit hash computation")
         ("fixup",    "attempt to fixup backup directory if scrub finds issues")
         ("singlethread", "don't scan source and target dir in separate threads")
+        ("jobs,j",   value<unsigned>(), "number of threads for scanning directories")
+        ("rehash",   value<unsigned>(), "reuse hashes of unchanged files")
+        ("hashlimit", value<unsigned>(), "limit reading files to hash (MiB/s)")
+        ("journal",  value<path>(), "change journal")
+        ("trustmeta", value<unsigned>(), "scrub backup directory every n backups")
+        ("dedup",    "move and copy files already in the backup directory")
+        ("budget",   value<string>(), "time or data budget for hashing")
+        ("remote",   value<string>(), "command running ddm serve on backup machine")
+        ("stats",    "print statistics at exit")
+        ("statsformat", value<string>(), "statistics format")
+        ("statsfile", value<path>(), "write statistics to file")
+        ("hash",     value<string>(), "hash algorithm")
+        ("format",   value<string>(), "metadata file format")
         ("input",    value<vector<path>>(), "input") //Positional catch-all
     ;
     positional_options_description p;
@@ -275,10 +569,16 @@ int main(int argc, char *argv[]) try
         {"diff",   diffCmd},
         {"scrub",  scrubCmd},
         {"backup", backupCmd},
+        {"watch",  watchCmd},
+        {"serve",  serveCmd},
     };
     auto it=operations.find(argv[0]);
     if(it==operations.end()) help();
-    return it->second(vm,*out);
+    bool stats=vm.count("stats") || vm.count("statsformat") || vm.count("statsfile");
+    if(stats) enableStats();
+    int result=it->second(vm,*out);
+    if(stats) writeStats(vm);
+    return result;
 } catch(exception& e) {
     cerr<<"\n"<<redb<<"Error: "<<e.what()<<reset<<"\n";
     return 10;
@@ -0,0 +1,831 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "remote.h"
+#include "extfs.h"
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <map>
+#include <optional>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+using namespace std::filesystem;
+
+/*
+ * The protocol between RemoteTarget and serveRemoteTarget().
+ * The remote process starts by sending the greeting line. Then every request
+ * is a line with the name of the request followed by its arguments, separated
+ * by spaces, with strings quoted as std::quoted does:
+ * alg <file>                        hash algorithm of metadata file
+ * exists <path>                     a data byte, 1 if path exists, 0 if not
+ * read <file>                       content of file
+ * write <file> + body               write file
+ * scan <dir> <hash> <alg> <jobs>    scan dir, hash is 0 or 1
+ * hashes <dir> <bytes/s> <jobs> + body   compute missing hashes of tree
+ * copy <file> <perm> <user> <group> <mtime> + body
+ * mkdir <dir>
+ * symlink <target> <path>
+ * remove <path>
+ * rename <from> <to>
+ * chmod <path> <perm>
+ * chown <path> <user> <group>
+ * mtime <path> <mtime>
+ * A body is sent as a sequence of data chunks, that are a line "data <size>"
+ * followed by size bytes, ended by a line "end", or "abort" if the client
+ * could not send all of it.
+ * Every request gets a reply, in the order of the requests, made of data
+ * chunks with the result, if any, and of lines
+ * "progress <files> <total files> <bytes> <total bytes> <seconds>", ended by
+ * a line "ok" or "error <message>". Directory trees are sent as text metadata
+ * files, as the binary format does not store all permission bits and types.
+ */
+
+static const char greeting[]="ddm serve 1";
+
+/// Size of the data chunks
+static const size_t chunkSize=1024*1024;
+
+static string quote(const string& s)
+{
+    ostringstream ss;
+    ss<<quoted(s);
+    return ss.str();
+}
+
+static string quote(const path& p) { return quote(p.string()); }
+
+static path readPath(istream& is)
+{
+    string s;
+    if(!(is>>quoted(s))) throw runtime_error("Malformed remote request");
+    return s;
+}
+
+/**
+ * Buffered reads from a file descriptor
+ */
+class Reader
+{
+public:
+    explicit Reader(int fd) : fd(fd) {}
+
+    /**
+     * \param line the line read, without the newline
+     * \return false if the file descriptor is at end of file
+     * \throws runtime_error in case of errors
+     */
+    bool line(string& line)
+    {
+        line.clear();
+        for(;;)
+        {
+            if(pos==size && fill()==false)
+            {
+                if(line.empty()) return false;
+                throw runtime_error("Connection to remote target lost");
+            }
+            auto end=static_cast<char*>(memchr(buffer+pos,'\n',size-pos));
+            if(end==nullptr)
+            {
+                line.append(buffer+pos,size-pos);
+                pos=size;
+                continue;
+            }
+            line.append(buffer+pos,end-(buffer+pos));
+            pos=end-buffer+1;
+            return true;
+        }
+    }
+
+    /**
+     * Read exactly size bytes
+     * \throws runtime_error in case of errors or end of file
+     */
+    void read(void *data, size_t size)
+    {
+        auto ptr=static_cast<char*>(data);
+        while(size>0)
+        {
+            if(pos==this->size && fill()==false)
+                throw runtime_error("Connection to remote target lost");
+            size_t n=min(size,this->size-pos);
+            memcpy(ptr,buffer+pos,n);
+            pos+=n;
+            ptr+=n;
+            size-=n;
+        }
+    }
+
+    /**
+     * \return true if data was read from the file descriptor and not consumed
+     */
+    bool buffered() const { return pos<size; }
+
+private:
+    bool fill()
+    {
+        for(;;)
+        {
+            ssize_t n=::read(fd,buffer,sizeof(buffer));
+            if(n<0 && errno==EINTR) continue;
+            if(n<0) throw runtime_error("Connection to remote target lost");
+            pos=0;
+            size=n;
+            return n>0;
+        }
+    }
+
+    int fd;
+    size_t pos=0, size=0;
+    char buffer[64*1024];
+};
+
+/**
+ * Buffered writes to a file descriptor
+ */
+class Writer
+{
+public:
+    explicit Writer(int fd) : fd(fd) {}
+
+    void write(const char *data, size_t size)
+    {
+        buffer.append(data,size);
+        if(buffer.size()>=chunkSize) flush();
+    }
+
+    void write(const string& s) { write(s.data(),s.size()); }
+
+    /// Write a data chunk
+    void data(const char *data, size_t size)
+    {
+        write("data "+to_string(size)+"\n");
+        write(data,size);
+    }
+
+    void flush()
+    {
+        for(size_t written=0;written<buffer.size();)
+        {
+            ssize_t n=::write(fd,buffer.data()+written,buffer.size()-written);
+            if(n<0 && errno==EINTR) continue;
+            if(n<0)
+            {
+                buffer.clear();
+                throw runtime_error("Connection to remote target lost");
+            }
+            written+=n;
+        }
+        buffer.clear();
+    }
+
+private:
+    int fd;
+    string buffer;
+};
+
+/**
+ * An ostream that writes data chunks, so that directory trees are sent while
+ * they are written
+ */
+class DataStreambuf : public streambuf
+{
+public:
+    explicit DataStreambuf(Writer& w) : w(w), buffer(chunkSize)
+    {
+        setp(buffer.data(),buffer.data()+buffer.size());
+    }
+
+    int overflow(int c) override
+    {
+        sync();
+        if(c!=traits_type::eof())
+        {
+            *pptr()=traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override
+    {
+        if(pptr()>pbase()) w.data(pbase(),pptr()-pbase());
+        setp(buffer.data(),buffer.data()+buffer.size());
+        return 0;
+    }
+
+private:
+    Writer& w;
+    vector<char> buffer;
+};
+
+/**
+ * The body of a request, read by the remote process
+ */
+class Body
+{
+public:
+    explicit Body(Reader& r) : r(r) {}
+
+    /**
+     * \return the number of bytes read, 0 at the end of the body
+     * \throws runtime_error if the client aborted sending the body
+     */
+    size_t read(void *data, size_t size)
+    {
+        while(left==0)
+        {
+            if(done) return 0;
+            string line;
+            if(r.line(line)==false) throw runtime_error("Connection closed");
+            if(line=="end") done=true;
+            else if(line=="abort") {
+                done=true;
+                throw runtime_error("Request aborted by the client");
+            } else if(line.compare(0,5,"data ")==0) left=stoull(line.substr(5));
+            else throw runtime_error("Malformed remote request");
+        }
+        size_t n=min(size,left);
+        r.read(data,n);
+        left-=n;
+        return n;
+    }
+
+    /// \return the rest of the body
+    string readAll()
+    {
+        string result;
+        char buffer[64*1024];
+        while(size_t n=read(buffer,sizeof(buffer))) result.append(buffer,n);
+        return result;
+    }
+
+    /// Skip the rest of the body, if any
+    void skip()
+    {
+        try {
+            readAll();
+        } catch(exception&) {
+            if(done==false) throw;
+        }
+    }
+
+private:
+    Reader& r;
+    size_t left=0;
+    bool done=false;
+};
+
+//
+// serveRemoteTarget
+//
+
+/**
+ * Serve a single request
+ * \param op request name
+ * \param args request arguments
+ * \param body request body
+ * \param w writer where to send the data of the reply
+ * \throws exception if the request failed
+ */
+static void serveRequest(const string& op, istream& args, Body& body, Writer& w,
+                         function<void (const string&)> warningCallback)
+{
+    path p=readPath(args);
+    if(op=="alg")
+    {
+        string s=hashAlgorithmName(DirectoryTree::readHashAlgorithm(p));
+        w.data(s.data(),s.size());
+    } else if(op=="exists") {
+        error_code ec;
+        auto s=symlink_status(p,ec);
+        if(status_known(s)==false) throw filesystem_error("could not stat",p,ec);
+        char c=std::filesystem::exists(s) ? '1' : '0';
+        w.data(&c,1);
+    } else if(op=="read") {
+        ifstream in(p,ios::binary);
+        if(!in) throw runtime_error(string("could not open for reading: ")+p.string());
+        vector<char> buffer(chunkSize);
+        while(in)
+        {
+            in.read(buffer.data(),buffer.size());
+            if(in.gcount()>0) w.data(buffer.data(),in.gcount());
+        }
+        if(in.bad()) throw runtime_error(string("Error reading ")+p.string());
+    } else if(op=="write") {
+        string content=body.readAll();
+        ofstream out(p,ios::binary);
+        if(!out) throw runtime_error(string("could not open for writing: ")+p.string());
+        out<<content;
+        out.close();
+        if(!out) throw runtime_error(string("Error writing ")+p.string());
+    } else if(op=="scan") {
+        int hash;
+        string alg;
+        unsigned jobs;
+        if(!(args>>hash>>alg>>jobs)) throw runtime_error("Malformed remote request");
+        DirectoryTree tree;
+        tree.setWarningCallback(warningCallback);
+        tree.setHashAlgorithm(hashAlgorithmFromName(alg));
+        tree.setJobs(jobs);
+        DataStreambuf buf(w);
+        ostream os(&buf);
+        tree.scanDirectoryTo(p,os,hash ? ScanOpt::ComputeHash : ScanOpt::OmitHash);
+        os.flush();
+    } else if(op=="hashes") {
+        uint64_t maxBytesPerSecond;
+        unsigned jobs;
+        if(!(args>>maxBytesPerSecond>>jobs)) throw runtime_error("Malformed remote request");
+        DirectoryTree tree;
+        tree.setWarningCallback(warningCallback);
+        tree.setJobs(jobs);
+        {
+            istringstream is(body.readAll());
+            tree.readFrom(is);
+        }
+        tree.bindToTopPath(p);
+        tree.computeMissingHashes(maxBytesPerSecond,[&w](const HashProgress& h){
+            w.write("progress "+to_string(h.files)+' '+to_string(h.totalFiles)+' '
+                +to_string(h.bytes)+' '+to_string(h.totalBytes)+' '
+                +to_string(h.seconds)+'\n');
+            w.flush();
+        });
+        DataStreambuf buf(w);
+        ostream os(&buf);
+        tree.writeTo(os);
+        os.flush();
+    } else if(op=="copy") {
+        unsigned perm;
+        string user, group;
+        time_t mtime;
+        if(!(args>>perm>>quoted(user)>>quoted(group)>>mtime))
+            throw runtime_error("Malformed remote request");
+        //The file is removed in case of errors only if it was created
+        bool created=false;
+        try {
+            if(ext_write_file(p,static_cast<perms>(perm),user,group,mtime,
+                [&](unsigned char *data, size_t size){
+                    created=true;
+                    return body.read(data,size);
+                })==false)
+                warningCallback(string("Warning: could not change ownership of ")
+                    +p.string()+": maybe retry with sudo?");
+        } catch(exception&) {
+            error_code ec;
+            if(created) std::filesystem::remove(p,ec);
+            throw;
+        }
+    } else if(op=="mkdir") {
+        if(create_directory(p)==false)
+            throw runtime_error(string("Error creating directory ")+p.string());
+    } else if(op=="symlink") {
+        path link=readPath(args);
+        create_symlink(p,link);
+    } else if(op=="remove") {
+        remove_all(p);
+    } else if(op=="rename") {
+        std::filesystem::rename(p,readPath(args));
+    } else if(op=="chmod") {
+        unsigned perm;
+        if(!(args>>perm)) throw runtime_error("Malformed remote request");
+        permissions(p,static_cast<perms>(perm));
+    } else if(op=="chown") {
+        string user, group;
+        if(!(args>>quoted(user)>>quoted(group)))
+            throw runtime_error("Malformed remote request");
+        try {
+            ext_symlink_change_ownership(p,user,group);
+        } catch(exception&) {
+            warningCallback(string("Warning: could not change ownership of ")
+                +p.string()+": maybe retry with sudo?");
+        }
+    } else if(op=="mtime") {
+        time_t mtime;
+        if(!(args>>mtime)) throw runtime_error("Malformed remote request");
+        ext_symlink_last_write_time(p,mtime);
+    } else throw runtime_error(string("Unknown remote request ")+op);
+}
+
+void serveRemoteTarget(int in, int out,
+                       function<void (const string&)> warningCallback)
+{
+    Reader r(in);
+    Writer w(out);
+    w.write(string(greeting)+'\n');
+    w.flush();
+    string line;
+    while(r.line(line))
+    {
+        istringstream args(line);
+        string op;
+        args>>op;
+        Body body(r);
+        bool hasBody=op=="write" || op=="hashes" || op=="copy";
+        try {
+            serveRequest(op,args,body,w,warningCallback);
+            if(hasBody) body.skip();
+            w.write("ok\n");
+        } catch(exception& e) {
+            if(hasBody) body.skip();
+            w.write("error "+quote(string(e.what()))+'\n');
+        }
+        //Replies to pipelined requests are sent together
+        if(r.buffered()==false) w.flush();
+    }
+    w.flush();
+}
+
+//
+// class RemoteTarget
+//
+
+/**
+ * The reply to a request the client waits for
+ */
+struct Reply
+{
+    string data;
+    string error;
+    bool done=false;
+    function<void (const HashProgress&)> progress;
+};
+
+class RemoteTarget::Connection
+{
+public:
+    explicit Connection(const string& command);
+
+    Connection(const Connection&)=delete;
+    Connection& operator=(const Connection&)=delete;
+
+    /**
+     * Send a request
+     * \param request writes the request
+     * \param reply if not nullptr, the reply is stored here, otherwise an
+     * error in the reply is reported by sync()
+     */
+    void send(function<void (Writer&)> request, Reply *reply=nullptr);
+
+    /**
+     * Send a request and wait for its reply
+     * \return the data of the reply
+     * \throws runtime_error if the request failed
+     */
+    string call(function<void (Writer&)> request,
+                function<void (const HashProgress&)> progress={});
+
+    void sync();
+
+    ~Connection();
+
+private:
+    void readReplies();
+
+    const string command;
+    pid_t pid=-1;
+    int in=-1, out=-1;
+    mutex sendMutex;             ///< Held while sending a request
+    unique_ptr<Writer> w;
+    mutex m;                     ///< Protects the members below
+    condition_variable cv;
+    uint64_t sent=0, received=0; ///< Number of requests sent and replied
+    map<uint64_t,Reply*> waiting;
+    vector<string> errors;
+    bool broken=false;
+    thread reader;
+};
+
+RemoteTarget::Connection::Connection(const string& command) : command(command)
+{
+    //Writing to the remote process once it exited must be an error
+    signal(SIGPIPE,SIG_IGN);
+    int toRemote[2], fromRemote[2];
+    if(pipe2(toRemote,O_CLOEXEC)!=0)
+        throw runtime_error("Can't start remote command");
+    if(pipe2(fromRemote,O_CLOEXEC)!=0)
+    {
+        close(toRemote[0]);
+        close(toRemote[1]);
+        throw runtime_error("Can't start remote command");
+    }
+    pid=fork();
+    if(pid==0)
+    {
+        dup2(toRemote[0],STDIN_FILENO);
+        dup2(fromRemote[1],STDOUT_FILENO);
+        execl("/bin/sh","sh","-c",command.c_str(),nullptr);
+        _exit(127);
+    }
+    close(toRemote[0]);
+    close(fromRemote[1]);
+    out=toRemote[1];
+    in=fromRemote[0];
+    if(pid<0)
+    {
+        close(in);
+        close(out);
+        throw runtime_error("Can't start remote command");
+    }
+    w=make_unique<Writer>(out);
+    //Shared with the thread reading the replies, that is started once the
+    //greeting is read
+    auto r=make_shared<Reader>(in);
+    string line;
+    bool ok=false;
+    try {
+        ok=r->line(line) && line==greeting;
+    } catch(exception&) {}
+    if(ok==false)
+    {
+        close(out);
+        close(in);
+        waitpid(pid,nullptr,0);
+        throw runtime_error(string("The remote command '")+command
+            +"' did not start 'ddm serve'");
+    }
+    reader=thread([this,r]{
+        try {
+            string line;
+            while(r->line(line))
+            {
+                unique_lock<mutex> l(m);
+                auto it=waiting.find(received);
+                Reply *reply=it==waiting.end() ? nullptr : it->second;
+                l.unlock();
+                if(line.compare(0,5,"data ")==0)
+                {
+                    string data(stoull(line.substr(5)),'\0');
+                    r->read(data.data(),data.size());
+                    if(reply) reply->data+=data;
+                } else if(line.compare(0,9,"progress ")==0) {
+                    HashProgress p;
+                    istringstream ss(line.substr(9));
+                    ss>>p.files>>p.totalFiles>>p.bytes>>p.totalBytes>>p.seconds;
+                    if(reply && reply->progress) reply->progress(p);
+                } else {
+                    string error;
+                    if(line.compare(0,6,"error ")==0)
+                    {
+                        istringstream ss(line.substr(6));
+                        ss>>quoted(error);
+                        if(error.empty()) error="Remote request failed";
+                    } else if(line!="ok") throw runtime_error("Malformed remote reply");
+                    l.lock();
+                    if(reply)
+                    {
+                        reply->error=error;
+                        reply->done=true;
+                        waiting.erase(received);
+                    } else if(error.empty()==false) errors.push_back(error);
+                    received++;
+                    cv.notify_all();
+                }
+            }
+        } catch(exception&) {}
+        unique_lock<mutex> l(m);
+        broken=true;
+        for(auto& it : waiting)
+        {
+            it.second->error="Connection to remote target lost";
+            it.second->done=true;
+        }
+        waiting.clear();
+        cv.notify_all();
+    });
+}
+
+void RemoteTarget::Connection::send(function<void (Writer&)> request, Reply *reply)
+{
+    unique_lock<mutex> s(sendMutex);
+    {
+        unique_lock<mutex> l(m);
+        if(broken) throw runtime_error("Connection to remote target lost");
+        if(reply) waiting[sent]=reply;
+        sent++;
+    }
+    request(*w);
+    if(reply) w->flush();
+}
+
+string RemoteTarget::Connection::call(function<void (Writer&)> request,
+                                      function<void (const HashProgress&)> progress)
+{
+    Reply reply;
+    reply.progress=progress;
+    send(request,&reply);
+    unique_lock<mutex> l(m);
+    cv.wait(l,[&reply]{ return reply.done; });
+    if(reply.error.empty()==false) throw runtime_error(reply.error);
+    return std::move(reply.data);
+}
+
+void RemoteTarget::Connection::sync()
+{
+    uint64_t last;
+    {
+        unique_lock<mutex> s(sendMutex);
+        w->flush();
+        last=sent;
+    }
+    unique_lock<mutex> l(m);
+    cv.wait(l,[this,last]{ return received>=last || broken; });
+    string message;
+    for(auto& e : errors)
+    {
+        if(message.empty()==false) message+=' ';
+        message+=e;
+    }
+    errors.clear();
+    if(broken && received<last)
+        message+=(message.empty() ? "" : " ")+string("Connection to remote target lost");
+    if(message.empty()==false) throw runtime_error(message);
+}
+
+RemoteTarget::Connection::~Connection()
+{
+    try {
+        unique_lock<mutex> s(sendMutex);
+        w->flush();
+    } catch(exception&) {}
+    //The remote process exits when its input is closed
+    close(out);
+    reader.join();
+    close(in);
+    waitpid(pid,nullptr,0);
+}
+
+RemoteTarget::RemoteTarget(const string& command) : c(make_unique<Connection>(command)) {}
+
+HashAlgorithm RemoteTarget::readHashAlgorithm(const path& metadataFile)
+{
+    return hashAlgorithmFromName(c->call([&](Writer& w){
+        w.write("alg "+quote(metadataFile)+'\n');
+    }));
+}
+
+bool RemoteTarget::exists(const path& p)
+{
+    return c->call([&](Writer& w){ w.write("exists "+quote(p)+'\n'); })=="1";
+}
+
+string RemoteTarget::readFile(const path& p)
+{
+    return c->call([&](Writer& w){ w.write("read "+quote(p)+'\n'); });
+}
+
+/**
+ * Write a body
+ */
+static void writeBody(Writer& w, const string& content)
+{
+    for(size_t i=0;i<content.size();i+=chunkSize)
+        w.data(content.data()+i,min(chunkSize,content.size()-i));
+    w.write("end\n");
+}
+
+void RemoteTarget::writeFile(const path& p, const string& content)
+{
+    c->call([&](Writer& w){
+        w.write("write "+quote(p)+'\n');
+        writeBody(w,content);
+    });
+}
+
+void RemoteTarget::scanDirectory(const path& topPath, ScanOpt opt, unsigned jobs,
+                                 DirectoryTree& tree)
+{
+    istringstream is(c->call([&](Writer& w){
+        w.write("scan "+quote(topPath)+' '+(opt==ScanOpt::ComputeHash ? "1 " : "0 ")
+            +hashAlgorithmName(tree.hashAlgorithm())+' '+to_string(jobs)+'\n');
+    }));
+    tree.readFrom(is,topPath.string());
+    tree.bindToRemoteTarget(*this,topPath);
+}
+
+void RemoteTarget::computeMissingHashes(DirectoryTree& tree, unsigned jobs,
+    uint64_t maxBytesPerSecond, function<void (const HashProgress&)> progress)
+{
+    path topPath=tree.getTopPath().value();
+    auto format=tree.metadataFormat();
+    ostringstream os;
+    tree.setMetadataFormat(MetadataFormat::Text);
+    tree.writeTo(os);
+    tree.setMetadataFormat(format);
+    istringstream is(c->call([&](Writer& w){
+        w.write("hashes "+quote(topPath)+' '+to_string(maxBytesPerSecond)+' '
+            +to_string(jobs)+'\n');
+        writeBody(w,os.str());
+    },progress));
+    tree.readFrom(is,topPath.string());
+    tree.setMetadataFormat(format);
+    tree.bindToRemoteTarget(*this,topPath);
+}
+
+FileHash RemoteTarget::copyFile(const path& from, const path& to, perms perm,
+    const string& user, const string& group, time_t mtime, HashAlgorithm alg,
+    bool hash)
+{
+    optional<Hasher> hasher;
+    if(hash) hasher.emplace(alg);
+    bool failed=false;
+    c->send([&](Writer& w){
+        w.write("copy "+quote(to)+' '+to_string(static_cast<unsigned>(perm))+' '
+            +quote(user)+' '+quote(group)+' '+to_string(mtime)+'\n');
+        int fd=open(from.c_str(),O_RDONLY | O_CLOEXEC);
+        if(fd<0)
+        {
+            failed=true;
+            w.write("abort\n");
+            return;
+        }
+        posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+        static thread_local unique_ptr<char[]> buffer;
+        if(!buffer) buffer.reset(new char[chunkSize]);
+        for(;;)
+        {
+            ssize_t n=read(fd,buffer.get(),chunkSize);
+            if(n<0 && errno==EINTR) continue;
+            if(n<0) failed=true;
+            if(n<=0) break;
+            if(hasher) hasher->update(reinterpret_cast<unsigned char*>(buffer.get()),n);
+            w.data(buffer.get(),n);
+        }
+        close(fd);
+        w.write(failed ? "abort\n" : "end\n");
+    });
+    if(failed)
+        throw runtime_error(string("Error copying ")+from.string()+" to "+to.string());
+    if(!hasher) return FileHash();
+    unsigned char digest[maxHashSize];
+    hasher->final(digest);
+    return FileHash(digest,hashSize(alg));
+}
+
+void RemoteTarget::createDirectory(const path& p)
+{
+    c->send([&](Writer& w){ w.write("mkdir "+quote(p)+'\n'); });
+}
+
+void RemoteTarget::createSymlink(const string& target, const path& p)
+{
+    c->send([&](Writer& w){ w.write("symlink "+quote(target)+' '+quote(p)+'\n'); });
+}
+
+void RemoteTarget::remove(const path& p)
+{
+    c->send([&](Writer& w){ w.write("remove "+quote(p)+'\n'); });
+}
+
+void RemoteTarget::rename(const path& from, const path& to)
+{
+    c->send([&](Writer& w){ w.write("rename "+quote(from)+' '+quote(to)+'\n'); });
+}
+
+void RemoteTarget::setPermissions(const path& p, perms perm)
+{
+    c->send([&](Writer& w){
+        w.write("chmod "+quote(p)+' '+to_string(static_cast<unsigned>(perm))+'\n');
+    });
+}
+
+void RemoteTarget::setOwner(const path& p, const string& user, const string& group)
+{
+    c->send([&](Writer& w){
+        w.write("chown "+quote(p)+' '+quote(user)+' '+quote(group)+'\n');
+    });
+}
+
+void RemoteTarget::setMtime(const path& p, time_t mtime)
+{
+    c->send([&](Writer& w){ w.write("mtime "+quote(p)+' '+to_string(mtime)+'\n'); });
+}
+
+void RemoteTarget::sync() { c->sync(); }
+
+RemoteTarget::~RemoteTarget() {}
@@ -0,0 +1,172 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <memory>
+#include "core.h"
+
+/**
+ * A connection to a 'ddm serve' process running on the machine where the
+ * backup directory is, for example through ssh. Directory trees and the
+ * content of metadata files are transferred as a whole, and the changes to
+ * the filesystem are sent without waiting for each of them to complete, so
+ * that the latency of the connection is paid once per operation and not once
+ * per file. Files in the backup directory are hashed by the remote process,
+ * so their content is never transferred to check them.
+ * All paths are paths of the remote machine. Member functions can be called
+ * from multiple threads.
+ */
+class RemoteTarget
+{
+public:
+    /**
+     * Start the remote process
+     * \param command shell command that runs 'ddm serve', such as
+     * "ssh nas ddm serve"
+     * \throws runtime_error if the command can't be started or does not
+     * answer as 'ddm serve' does
+     */
+    explicit RemoteTarget(const std::string& command);
+
+    RemoteTarget(const RemoteTarget&)=delete;
+    RemoteTarget& operator=(const RemoteTarget&)=delete;
+
+    /**
+     * \param metadataFile path of a metadata file
+     * \return the hash algorithm of the metadata file,
+     * see DirectoryTree::readHashAlgorithm()
+     * \throws runtime_error in case of errors
+     */
+    HashAlgorithm readHashAlgorithm(const std::filesystem::path& metadataFile);
+
+    /**
+     * \param p path
+     * \return true if an entry exists at the path, symlinks are not followed
+     * \throws runtime_error in case of errors
+     */
+    bool exists(const std::filesystem::path& p);
+
+    /**
+     * \param p path of a file
+     * \return the content of the file
+     * \throws runtime_error in case of errors
+     */
+    std::string readFile(const std::filesystem::path& p);
+
+    /**
+     * Write a file, replacing it if it exists
+     * \param p path of the file
+     * \param content content of the file
+     * \throws runtime_error in case of errors
+     */
+    void writeFile(const std::filesystem::path& p, const std::string& content);
+
+    /**
+     * Scan a directory, and bind the tree to it, see
+     * DirectoryTree::bindToRemoteTarget()
+     * \param topPath directory to scan
+     * \param opt scan options
+     * \param jobs number of threads used by the remote process to scan
+     * \param tree the tree is replaced with the scanned directory, using its
+     * hash algorithm
+     * \throws runtime_error in case of errors
+     */
+    void scanDirectory(const std::filesystem::path& topPath, ScanOpt opt,
+                       unsigned jobs, DirectoryTree& tree);
+
+    /**
+     * Compute the missing hashes of a tree bound to this target, called by
+     * DirectoryTree::computeMissingHashes(). The tree is sent to the remote
+     * process, that hashes the files and sends it back
+     * \param tree directory tree
+     * \param jobs number of threads used by the remote process to hash
+     * \param maxBytesPerSecond if not 0, limit the rate files are read at
+     * \param progress if set, called about once a second while hashing
+     * \throws runtime_error in case of errors
+     */
+    void computeMissingHashes(DirectoryTree& tree, unsigned jobs,
+                              uint64_t maxBytesPerSecond,
+                              std::function<void (const HashProgress&)> progress);
+
+    /**
+     * Copy a local regular file to the remote machine, see ext_copy_file()
+     * \param from local path of the file
+     * \param to remote path of the copy, must not exist
+     * \param alg hash algorithm
+     * \param hash if true, hash the file while copying it
+     * \return the hash of the file, computed on the data that was sent, or
+     * an empty hash if hash is false
+     * \throws runtime_error if the local file can't be read, errors writing
+     * the copy are reported by sync()
+     */
+    FileHash copyFile(const std::filesystem::path& from,
+                      const std::filesystem::path& to, std::filesystem::perms perm,
+                      const std::string& user, const std::string& group,
+                      time_t mtime, HashAlgorithm alg, bool hash);
+
+    //The following member functions change the filesystem of the remote
+    //machine as their namesakes of std::filesystem and extfs.h, but return
+    //without waiting for the change to be made. Changes are made in the order
+    //they are requested, and errors are reported by sync(). Failing to change
+    //the owner is only a warning, printed by the remote process
+
+    void createDirectory(const std::filesystem::path& p);
+
+    void createSymlink(const std::string& target, const std::filesystem::path& p);
+
+    void remove(const std::filesystem::path& p);
+
+    void rename(const std::filesystem::path& from, const std::filesystem::path& to);
+
+    void setPermissions(const std::filesystem::path& p, std::filesystem::perms perm);
+
+    void setOwner(const std::filesystem::path& p, const std::string& user,
+                  const std::string& group);
+
+    void setMtime(const std::filesystem::path& p, time_t mtime);
+
+    /**
+     * Wait for the changes requested so far to be made
+     * \throws runtime_error with the errors of the changes that failed since
+     * the last call
+     */
+    void sync();
+
+    /**
+     * Close the connection, waiting for the remote process to exit
+     */
+    ~RemoteTarget();
+
+private:
+    class Connection;
+    std::unique_ptr<Connection> c;
+};
+
+/**
+ * Serve the requests of a RemoteTarget till the connection is closed, this is
+ * the 'ddm serve' command
+ * \param in file descriptor requests are read from
+ * \param out file descriptor replies are written to
+ * \param warningCallback warning callback
+ * \throws runtime_error if the connection breaks or the requests are malformed
+ */
+void serveRemoteTarget(int in, int out,
+                       std::function<void (const std::string&)> warningCallback);
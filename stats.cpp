@@ -0,0 +1,420 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "stats.h"
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <iomanip>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+/**
+ * Resource usage counters of a thread
+ */
+struct Usage
+{
+    uint64_t cpuNs=0;       ///< User and system CPU time
+    uint64_t readCalls=0;   ///< Read syscalls (syscr)
+    uint64_t writeCalls=0;  ///< Write syscalls (syscw)
+    uint64_t readBytes=0;   ///< Bytes read by syscalls (rchar)
+    uint64_t writeBytes=0;  ///< Bytes written by syscalls (wchar)
+    uint64_t diskRead=0;    ///< Bytes read from storage (read_bytes)
+    uint64_t diskWrite=0;   ///< Bytes written to storage (write_bytes)
+};
+
+/**
+ * Statistics of a phase. Counters are updated by many threads, the members
+ * guarded by the mutex only when a thread or timer enters or leaves the phase
+ */
+struct PhaseStats
+{
+    atomic<uint64_t> cpuNs{0}, readCalls{0}, writeCalls{0}, readBytes{0},
+                     writeBytes{0}, diskRead{0}, diskWrite{0};
+    atomic<uint64_t> entries{0}, bytes{0}, hashedFiles{0}, hashedBytes{0};
+
+    mutex m;
+    bool used=false;
+    unsigned threads=0;         ///< Threads in the phase right now
+    unsigned maxThreads=0;
+    chrono::steady_clock::time_point since; ///< When threads became nonzero
+    uint64_t wallNs=0;          ///< Time at least a thread was in the phase
+    uint64_t peakRssKiB=0;
+};
+
+static const char *phaseNames[]=
+{
+    "none", "metadata_load", "src_scan", "dst_scan", "scrub", "diff", "copy",
+    "metadata_update", "missing_hashes", "metadata_write"
+};
+static_assert(sizeof(phaseNames)/sizeof(phaseNames[0])==
+              static_cast<int>(Phase::NumPhases),"Phase names");
+
+static atomic<bool> enabled(false);
+static PhaseStats phases[static_cast<int>(Phase::NumPhases)];
+static atomic<unsigned> activeTimers(0); ///< Timers in any phase right now
+static chrono::steady_clock::time_point startTime;
+
+/**
+ * \param p phase
+ * \return the statistics of the phase
+ */
+static PhaseStats& stats(Phase p) { return phases[static_cast<int>(p)]; }
+
+/**
+ * Read a counter from the content of a /proc/<pid>/io file
+ */
+static uint64_t ioField(const char *content, const char *name)
+{
+    const char *p=strstr(content,name);
+    return p ? strtoull(p+strlen(name),nullptr,10) : 0;
+}
+
+/**
+ * \return the resource usage of the calling thread so far. The I/O counters
+ * are zero if the kernel does not provide them
+ */
+static Usage threadUsage()
+{
+    Usage result;
+    int fd=open("/proc/thread-self/io",O_RDONLY | O_CLOEXEC);
+    if(fd>=0)
+    {
+        char content[512];
+        ssize_t n=read(fd,content,sizeof(content)-1);
+        close(fd);
+        if(n>0)
+        {
+            content[n]='\0';
+            result.readBytes=ioField(content,"rchar:");
+            result.writeBytes=ioField(content,"wchar:");
+            result.readCalls=ioField(content,"syscr:");
+            result.writeCalls=ioField(content,"syscw:");
+            result.diskRead=ioField(content,"\nread_bytes:");
+            result.diskWrite=ioField(content,"\nwrite_bytes:");
+        }
+    }
+    //Read last, so that reading the I/O counters is not counted in the phase
+    struct timespec ts;
+    if(clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts)==0)
+        result.cpuNs=ts.tv_sec*1000000000ull+ts.tv_nsec;
+    return result;
+}
+
+/**
+ * \return the peak resident memory of the process in KiB since the last
+ * resetPeakRss()
+ */
+static uint64_t peakRssKiB()
+{
+    int fd=open("/proc/self/status",O_RDONLY | O_CLOEXEC);
+    if(fd<0) return 0;
+    char content[4096];
+    ssize_t n=read(fd,content,sizeof(content)-1);
+    close(fd);
+    if(n<=0) return 0;
+    content[n]='\0';
+    return ioField(content,"VmHWM:");
+}
+
+/**
+ * Reset the peak resident memory of the process, ignored by kernels that
+ * don't support it, in this case the peak since the process started is
+ * reported
+ */
+static void resetPeakRss()
+{
+    int fd=open("/proc/self/clear_refs",O_WRONLY | O_CLOEXEC);
+    if(fd<0) return;
+    if(write(fd,"5",1)!=1) {}
+    close(fd);
+}
+
+/**
+ * The phase a thread is in, and its resource usage when it entered it. When
+ * the thread exits its usage is attributed to its last phase
+ */
+class ThreadAccount
+{
+public:
+    void change(Phase p)
+    {
+        if(p==phase) return;
+        Usage now=threadUsage();
+        auto t=chrono::steady_clock::now();
+        if(phase!=Phase::None)
+        {
+            auto& s=stats(phase);
+            s.cpuNs+=now.cpuNs-since.cpuNs;
+            s.readCalls+=now.readCalls-since.readCalls;
+            s.writeCalls+=now.writeCalls-since.writeCalls;
+            s.readBytes+=now.readBytes-since.readBytes;
+            s.writeBytes+=now.writeBytes-since.writeBytes;
+            s.diskRead+=now.diskRead-since.diskRead;
+            s.diskWrite+=now.diskWrite-since.diskWrite;
+            lock_guard<mutex> l(s.m);
+            if(--s.threads==0)
+                s.wallNs+=chrono::duration_cast<chrono::nanoseconds>(t-s.since).count();
+        }
+        if(p!=Phase::None)
+        {
+            auto& s=stats(p);
+            lock_guard<mutex> l(s.m);
+            s.used=true;
+            if(s.threads++==0) s.since=t;
+            s.maxThreads=max(s.maxThreads,s.threads);
+        }
+        phase=p;
+        since=now;
+    }
+
+    Phase current() const { return phase; }
+
+    ~ThreadAccount() { change(Phase::None); }
+
+private:
+    Phase phase=Phase::None;
+    Usage since;
+};
+
+static thread_local ThreadAccount account;
+
+void enableStats()
+{
+    startTime=chrono::steady_clock::now();
+    enabled=true;
+}
+
+bool statsEnabled()
+{
+    return enabled.load(memory_order_relaxed);
+}
+
+void switchPhase(Phase phase)
+{
+    if(statsEnabled()) account.change(phase);
+}
+
+Phase currentPhase()
+{
+    return statsEnabled() ? account.current() : Phase::None;
+}
+
+void countEntries(uint64_t entries, uint64_t bytes)
+{
+    if(statsEnabled()==false || account.current()==Phase::None) return;
+    auto& s=stats(account.current());
+    s.entries.fetch_add(entries,memory_order_relaxed);
+    s.bytes.fetch_add(bytes,memory_order_relaxed);
+}
+
+void countHashed(uint64_t bytes)
+{
+    if(statsEnabled()==false || account.current()==Phase::None) return;
+    auto& s=stats(account.current());
+    s.hashedFiles.fetch_add(1,memory_order_relaxed);
+    s.hashedBytes.fetch_add(bytes,memory_order_relaxed);
+}
+
+PhaseTimer::PhaseTimer(Phase phase) : phase(phase), previous(currentPhase())
+{
+    if(statsEnabled()==false) return;
+    //The peak memory of phases run at the same time can't be told apart
+    if(activeTimers++==0) resetPeakRss();
+    visited=1<<static_cast<int>(phase);
+    account.change(phase);
+}
+
+void PhaseTimer::change(Phase phase)
+{
+    if(statsEnabled()==false || phase==this->phase) return;
+    account.change(phase);
+    visited|=1<<static_cast<int>(phase);
+    this->phase=phase;
+}
+
+PhaseTimer::~PhaseTimer()
+{
+    if(statsEnabled()==false) return;
+    account.change(previous);
+    auto peak=peakRssKiB();
+    for(int i=0;i<static_cast<int>(Phase::NumPhases);i++)
+    {
+        if((visited & 1<<i)==0) continue;
+        lock_guard<mutex> l(phases[i].m);
+        phases[i].peakRssKiB=max(phases[i].peakRssKiB,peak);
+    }
+    activeTimers--;
+}
+
+/**
+ * Snapshot of the statistics of a phase, for writing them
+ */
+struct PhaseReport
+{
+    const char *name;
+    double wall, cpu, utilization;
+    unsigned threads;
+    uint64_t entries, bytes, hashedFiles, hashedBytes, readCalls, writeCalls,
+             readBytes, writeBytes, diskRead, diskWrite, peakRssKiB;
+};
+
+/**
+ * \return the phases that were entered, in the order they are declared
+ */
+static vector<PhaseReport> report()
+{
+    vector<PhaseReport> result;
+    for(int i=1;i<static_cast<int>(Phase::NumPhases);i++)
+    {
+        auto& s=phases[i];
+        lock_guard<mutex> l(s.m);
+        if(s.used==false) continue;
+        PhaseReport r;
+        r.name=phaseNames[i];
+        uint64_t wallNs=s.wallNs;
+        if(s.threads>0)
+            wallNs+=chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now()-s.since).count();
+        r.wall=wallNs/1e9;
+        r.cpu=s.cpuNs/1e9;
+        r.threads=s.maxThreads;
+        //Fraction of the time the threads of the phase were running, the two
+        //clocks are not read at the same time so it can be a bit above 1 for
+        //very short phases
+        r.utilization=r.wall>0 && r.threads>0 ? min(1.0,r.cpu/(r.wall*r.threads)) : 0;
+        r.entries=s.entries;
+        r.bytes=s.bytes;
+        r.hashedFiles=s.hashedFiles;
+        r.hashedBytes=s.hashedBytes;
+        r.readCalls=s.readCalls;
+        r.writeCalls=s.writeCalls;
+        r.readBytes=s.readBytes;
+        r.writeBytes=s.writeBytes;
+        r.diskRead=s.diskRead;
+        r.diskWrite=s.diskWrite;
+        r.peakRssKiB=s.peakRssKiB;
+        result.push_back(r);
+    }
+    return result;
+}
+
+void writeStats(ostream& os, StatsFormat format)
+{
+    //The resource usage of the calling thread is counted up to now
+    auto phase=account.current();
+    switchPhase(Phase::None);
+    auto phases=report();
+    switchPhase(phase);
+    double total=chrono::duration<double>(chrono::steady_clock::now()-startTime).count();
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+    uint64_t maxRssKiB=ru.ru_maxrss;
+    auto flags=os.flags();
+    auto precision=os.precision();
+    os<<fixed<<setprecision(3);
+    switch(format)
+    {
+        case StatsFormat::Text:
+            os<<"Statistics (total "<<total<<" s, peak memory "<<maxRssKiB/1024
+              <<" MiB):\n"
+              <<left<<setw(16)<<"phase"<<right<<setw(10)<<"wall s"<<setw(10)
+              <<"cpu s"<<setw(8)<<"threads"<<setw(7)<<"util"<<setw(11)<<"entries"
+              <<setw(11)<<"MiB"<<setw(11)<<"hash MiB"<<setw(11)<<"read ops"
+              <<setw(11)<<"write ops"<<setw(11)<<"disk r MiB"<<setw(11)
+              <<"disk w MiB"<<setw(10)<<"peak MiB"<<"\n";
+            for(auto& r : phases)
+            {
+                os<<left<<setw(16)<<r.name<<right<<setw(10)<<r.wall<<setw(10)
+                  <<r.cpu<<setw(8)<<r.threads<<setw(6)<<setprecision(0)
+                  <<r.utilization*100<<"%"<<setw(11)<<r.entries<<setprecision(1)
+                  <<setw(11)<<r.bytes/1048576.0<<setw(11)<<r.hashedBytes/1048576.0
+                  <<setw(11)<<r.readCalls<<setw(11)<<r.writeCalls
+                  <<setw(11)<<r.diskRead/1048576.0<<setw(11)<<r.diskWrite/1048576.0
+                  <<setw(10)<<r.peakRssKiB/1024.0<<setprecision(3)<<"\n";
+            }
+            break;
+        case StatsFormat::Json:
+            os<<"{\n  \"total_seconds\": "<<total<<",\n  \"peak_rss_kib\": "
+              <<maxRssKiB<<",\n  \"phases\": [\n";
+            for(size_t i=0;i<phases.size();i++)
+            {
+                auto& r=phases[i];
+                os<<"    {\"phase\": \""<<r.name<<"\", \"wall_seconds\": "<<r.wall
+                  <<", \"cpu_seconds\": "<<r.cpu<<", \"threads\": "<<r.threads
+                  <<", \"utilization\": "<<r.utilization
+                  <<", \"entries\": "<<r.entries<<", \"bytes\": "<<r.bytes
+                  <<", \"hashed_files\": "<<r.hashedFiles
+                  <<", \"hashed_bytes\": "<<r.hashedBytes
+                  <<", \"read_syscalls\": "<<r.readCalls
+                  <<", \"write_syscalls\": "<<r.writeCalls
+                  <<", \"read_bytes\": "<<r.readBytes
+                  <<", \"write_bytes\": "<<r.writeBytes
+                  <<", \"storage_read_bytes\": "<<r.diskRead
+                  <<", \"storage_write_bytes\": "<<r.diskWrite
+                  <<", \"peak_rss_kib\": "<<r.peakRssKiB<<"}"
+                  <<(i+1<phases.size() ? ",\n" : "\n");
+            }
+            os<<"  ]\n}\n";
+            break;
+        case StatsFormat::Prometheus:
+        {
+            os<<"# HELP ddm_seconds Wall clock time of the last run.\n"
+              <<"# TYPE ddm_seconds gauge\nddm_seconds "<<total<<"\n"
+              <<"# HELP ddm_peak_rss_bytes Peak resident memory of the last run.\n"
+              <<"# TYPE ddm_peak_rss_bytes gauge\nddm_peak_rss_bytes "
+              <<maxRssKiB*1024<<"\n";
+            auto metric=[&](const char *name, const char *help, auto field){
+                os<<"# HELP ddm_phase_"<<name<<" "<<help<<"\n"
+                  <<"# TYPE ddm_phase_"<<name<<" gauge\n";
+                for(auto& r : phases)
+                    os<<"ddm_phase_"<<name<<"{phase=\""<<r.name<<"\"} "<<field(r)<<"\n";
+            };
+            typedef const PhaseReport& R;
+            metric("wall_seconds","Wall clock time of the phase.",[](R r){ return r.wall; });
+            metric("cpu_seconds","CPU time of the phase.",[](R r){ return r.cpu; });
+            metric("threads","Threads running the phase at the same time.",
+                   [](R r){ return r.threads; });
+            metric("utilization","Fraction of the time the threads were running.",
+                   [](R r){ return r.utilization; });
+            metric("entries","Entries processed by the phase.",[](R r){ return r.entries; });
+            metric("bytes","Bytes processed by the phase.",[](R r){ return r.bytes; });
+            metric("hashed_files","Files hashed.",[](R r){ return r.hashedFiles; });
+            metric("hashed_bytes","Bytes hashed.",[](R r){ return r.hashedBytes; });
+            metric("read_syscalls","Read syscalls.",[](R r){ return r.readCalls; });
+            metric("write_syscalls","Write syscalls.",[](R r){ return r.writeCalls; });
+            metric("read_bytes","Bytes read by syscalls.",[](R r){ return r.readBytes; });
+            metric("write_bytes","Bytes written by syscalls.",[](R r){ return r.writeBytes; });
+            metric("storage_read_bytes","Bytes read from storage.",
+                   [](R r){ return r.diskRead; });
+            metric("storage_write_bytes","Bytes written to storage.",
+                   [](R r){ return r.diskWrite; });
+            metric("peak_rss_bytes","Peak resident memory.",
+                   [](R r){ return r.peakRssKiB*1024; });
+            break;
+        }
+    }
+    os.flags(flags);
+    os.precision(precision);
+}
@@ -0,0 +1,137 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+/**
+ * Phases of scrub and backup, whose resource usage is reported with --stats.
+ * Entries and bytes counted by every phase are:
+ * - MetadataLoad: entries and bytes of the metadata files read
+ * - SourceScan, BackupScan: entries scanned, and size of the regular files
+ * - Scrub, Diff: differences found
+ * - Copy: files copied and their size, and entries removed
+ * - MetadataUpdate: entries whose metadata was changed
+ * - MetadataWrite: entries and bytes of the metadata files written
+ * Files hashed are counted separately in every phase, and are all that
+ * MissingHashes counts. Files hashed by a RemoteTarget are not counted
+ */
+enum class Phase
+{
+    None,           ///< Not in a phase, not reported
+    MetadataLoad,   ///< Loading the metadata files
+    SourceScan,     ///< Scanning the source directory
+    BackupScan,     ///< Scanning the backup directory
+    Scrub,          ///< Comparing the backup directory with metadata files, fixing it
+    Diff,           ///< Comparing the source directory with the backup directory
+    Copy,           ///< Copying, replacing and removing entries in the backup directory
+    MetadataUpdate, ///< Changing the metadata of entries in the backup directory
+    MissingHashes,  ///< Hashing the files without hash after a fast backup
+    MetadataWrite,  ///< Writing the metadata files
+    NumPhases
+};
+
+/**
+ * Output format of the statistics
+ */
+enum class StatsFormat
+{
+    Text,       ///< Table for humans
+    Json,       ///< JSON object
+    Prometheus  ///< Prometheus text exposition format, for the textfile collector
+};
+
+/**
+ * Start collecting statistics. Until called, all the functions of this file
+ * return without doing anything, so the instrumentation costs one branch
+ */
+void enableStats();
+
+/**
+ * \return true if statistics are being collected
+ */
+bool statsEnabled();
+
+/**
+ * The resource usage of a thread is attributed to the phase it is in, and the
+ * wall clock time of a phase is the time at least a thread is in it. The
+ * CPU time and I/O counters of the thread are read only when it changes phase,
+ * so phases should not be changed for every file.
+ * Tasks submitted to a ThreadPool run in the phase of the thread that
+ * submitted them, idle workers are in no phase.
+ * \param phase new phase of the calling thread
+ */
+void switchPhase(Phase phase);
+
+/**
+ * \return the phase of the calling thread
+ */
+Phase currentPhase();
+
+/**
+ * Count entries processed by the phase of the calling thread
+ * \param entries number of entries
+ * \param bytes number of bytes
+ */
+void countEntries(uint64_t entries, uint64_t bytes=0);
+
+/**
+ * Count a file hashed by the phase of the calling thread
+ * \param bytes file size
+ */
+void countHashed(uint64_t bytes);
+
+/**
+ * Puts the calling thread in a phase for its lifetime, and measures the peak
+ * memory of the phase
+ */
+class PhaseTimer
+{
+public:
+    /**
+     * Enter a phase
+     * \param phase phase
+     */
+    explicit PhaseTimer(Phase phase);
+
+    PhaseTimer(const PhaseTimer&)=delete;
+    PhaseTimer& operator=(const PhaseTimer&)=delete;
+
+    /**
+     * Move to another phase, does nothing if already in the given phase
+     * \param phase new phase
+     */
+    void change(Phase phase);
+
+    /**
+     * Leave the phase, going back to the phase the thread was in before
+     */
+    ~PhaseTimer();
+
+private:
+    Phase phase, previous;
+    unsigned visited=0; ///< Bitmask of the phases entered, for peak memory
+};
+
+/**
+ * Write the statistics collected so far
+ * \param os ostream where to write
+ * \param format output format
+ */
+void writeStats(std::ostream& os, StatsFormat format);
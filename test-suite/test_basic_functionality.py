@@ -1,6 +1,16 @@
 import pytest
 import os
-from subprocess import check_output, CalledProcessError
+import time
+import json
+from subprocess import check_output, run, Popen, PIPE, DEVNULL, CalledProcessError
+
+
+# Create the two metadata files of dst, and return their paths
+def make_metadata(dst, tmp_path, formats=('text', 'text'), prefix='m'):
+	meta = [tmp_path / '{}{}.ddm'.format(prefix, i + 1) for i in range(2)]
+	for m, f in zip(meta, formats):
+		check_output(['./build/ddm', 'ls', str(dst), '--format', f, '-o', str(m)])
+	return meta
 
 
 def test_app_exists():
@@ -13,3 +23,330 @@ def test_app_displays_help_and_exits():
 	with pytest.raises(CalledProcessError):  # ddm returns 100 on help message
 		output = check_output(['./build/ddm', '-h'])
 		assert 'diff'.encode() in output, 'diff command in help message'
+
+
+def test_ls_output_does_not_depend_on_jobs(tmp_path):
+	for i in range(20):
+		d = tmp_path / 'dir{}'.format(i % 3)
+		d.mkdir(exist_ok=True)
+		(d / 'file{}'.format(i)).write_bytes(os.urandom(i * 100))
+	single = check_output(['./build/ddm', 'ls', str(tmp_path)])
+	multi = check_output(['./build/ddm', 'ls', str(tmp_path), '-j', '4'])
+	assert single == multi
+
+
+def test_backup_with_rehash_hashes_all_files_over_the_period(tmp_path):
+	src = tmp_path / 'src'
+	dst = tmp_path / 'dst'
+	for d in (src, dst):
+		d.mkdir()
+		for i in range(20):
+			(d / 'file{}'.format(i)).write_bytes(bytes(1000 + i))
+	time.sleep(1.1)  # Unchanged files are those older than the metadata files
+	meta = make_metadata(dst, tmp_path)
+	stats = tmp_path / 'stats.json'
+	hashed = 0
+	# Runs hash consecutive slots, even when made on the same day
+	for run in range(3):
+		check_output(['./build/ddm', 'backup', '--rehash', '3', '--stats',
+			'--statsformat', 'json', '--statsfile', str(stats), '-s', str(src),
+			'-t', str(dst)] + [str(m) for m in meta], stdin=PIPE)
+		phases = json.loads(stats.read_text())['phases']
+		hashed += sum(p['hashed_bytes'] for p in phases if p['phase'] == 'src_scan')
+	assert hashed == sum(1000 + i for i in range(20))
+
+
+def test_blake3_hashes_match_test_vectors(tmp_path):
+	# From the test vectors of the BLAKE3 reference implementation
+	vectors = {
+		0: 'af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262',
+		1: '2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213',
+		1023: '10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11',
+		1024: '42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7',
+		1025: 'd00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444',
+		2048: 'e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a',
+		2049: '5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030',
+		3072: 'b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2',
+		4096: '015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969',
+		8193: 'bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b',
+		102400: 'bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085',
+	}
+	for n in vectors:
+		(tmp_path / 'f{}'.format(n)).write_bytes(bytes(i % 251 for i in range(n)))
+	output = check_output(['./build/ddm', 'ls', '--hash', 'blake3', str(tmp_path)])
+	hashes = {int(l.split()[-1].strip('"')[1:]): l.split()[-2].lower()
+		for l in output.decode().splitlines() if not l.startswith('#')}
+	assert hashes == vectors
+
+
+def test_diff_output_is_in_name_order(tmp_path):
+	a = tmp_path / 'a'
+	b = tmp_path / 'b'
+	for d in (a, b):
+		d.mkdir()
+	for i in range(10):
+		(a / 'file{}'.format(i)).write_text('a')
+		(b / 'file{}'.format(i)).write_text('b')
+	(a / 'x').write_text('file')
+	(b / 'x').mkdir()
+	output = run(['./build/ddm', 'diff', '-i', 'mtime', str(a), str(b)],
+		stdout=PIPE).stdout.decode()
+	names = [l.split()[-1].strip('"') for l in output.splitlines() if l.startswith('- ')]
+	assert names == ['file{}'.format(i) for i in range(10)] + ['x']
+
+
+def test_metadata_with_quoted_paths_reads_back(tmp_path):
+	d = tmp_path / 'dir'
+	(d / 'a"b\\c').mkdir(parents=True)
+	(d / 'a"b\\c' / 'f "1"').write_text('x')
+	os.symlink('t"\\', d / 'l')
+	meta = tmp_path / 'm.ddm'
+	check_output(['./build/ddm', 'ls', str(d), '-o', str(meta)])
+	assert b'"a\\"b\\\\c/f \\"1\\""' in meta.read_bytes()
+	assert check_output(['./build/ddm', 'diff', str(meta), str(d)]) == b''
+
+
+def test_binary_metadata_converts_to_same_text(tmp_path):
+	d = tmp_path / 'dir'
+	(d / 'sub').mkdir(parents=True)
+	(d / 'sub' / 'f').write_text('x')
+	os.symlink('sub/f', d / 'l')
+	text = check_output(['./build/ddm', 'ls', str(d)])
+	binary = tmp_path / 'm.ddmb'
+	check_output(['./build/ddm', 'ls', str(d), '--format', 'binary', '-o', str(binary)])
+	assert binary.read_bytes()[:4] == b'DDMB'
+	assert check_output(['./build/ddm', 'ls', str(binary)]) == text
+	assert check_output(['./build/ddm', 'diff', str(binary), str(d)]) == b''
+
+
+def test_backup_keeps_format_of_mixed_metadata_files(tmp_path):
+	src = tmp_path / 'src'
+	src.mkdir()
+	(src / 'f').write_bytes(os.urandom(1000))
+	for i, formats in enumerate([('binary', 'text'), ('text', 'binary')]):
+		dst = tmp_path / 'dst{}'.format(i)
+		dst.mkdir()
+		meta = make_metadata(dst, tmp_path, formats, 'm{}'.format(i))
+		check_output(['./build/ddm', 'backup', '-s', str(src), '-t', str(dst)] +
+			[str(m) for m in meta], stdin=PIPE)
+		for m, f in zip(meta, formats):
+			assert (m.read_bytes()[:4] == b'DDMB') == (f == 'binary')
+			assert check_output(['./build/ddm', 'diff', str(m), str(dst)]) == b''
+
+
+def test_binary_metadata_diff_with_ignore_options(tmp_path):
+	d = tmp_path / 'dir'
+	for i in range(3):
+		(d / 'sub{}'.format(i) / 'deep').mkdir(parents=True)
+		(d / 'sub{}'.format(i) / 'deep' / 'f').write_text('x')
+	binary = tmp_path / 'm.ddmb'
+	check_output(['./build/ddm', 'ls', str(d), '--format', 'binary', '-o', str(binary)])
+	os.utime(d / 'sub1' / 'deep' / 'f', (0, 0))
+	output = run(['./build/ddm', 'diff', str(binary), str(d)], stdout=PIPE).stdout.decode()
+	assert output.count('"sub1/deep/f"') == 2 and 'sub0' not in output
+	assert check_output(['./build/ddm', 'diff', '-i', 'mtime', str(binary), str(d)]) == b''
+
+
+def test_parallel_backup_copies_new_directories(tmp_path):
+	src = tmp_path / 'src'
+	dst = tmp_path / 'dst'
+	for d in (src, dst):
+		d.mkdir()
+	meta = make_metadata(dst, tmp_path)
+	for i in range(4):
+		d = src / 'new{}'.format(i) / 'sub'
+		d.mkdir(parents=True)
+		for j in range(10):
+			(d / 'file{}'.format(j)).write_bytes(os.urandom(i * j * 1000))
+	(src / 'new0' / 'sub').chmod(0o555)
+	check_output(['./build/ddm', 'backup', '-j', '4', '-s', str(src), '-t', str(dst)]
+		+ [str(m) for m in meta], stdin=PIPE)
+	assert check_output(['./build/ddm', 'diff', str(src), str(dst)]) == b''
+	assert check_output(['./build/ddm', 'diff', str(meta[0]), str(dst)]) == b''
+	for d in (src, dst):
+		(d / 'new0' / 'sub').chmod(0o755)
+
+
+def test_backup_with_journal_scans_changed_directories(tmp_path):
+	src = tmp_path / 'src'
+	dst = tmp_path / 'dst'
+	for d in (src / 'a' / 'b', src / 'c', dst):
+		d.mkdir(parents=True)
+	(src / 'a' / 'b' / 'f').write_bytes(b'old')
+	# Metadata files store mtimes in seconds, make the change visible
+	os.utime(src / 'a' / 'b' / 'f', (1000000000, 1000000000))
+	meta = make_metadata(dst, tmp_path)
+	journal = tmp_path / 'journal'
+	backup = ['./build/ddm', 'backup', '--nohash', '-s', str(src), '-t', str(dst),
+		'--journal', str(journal)] + [str(m) for m in meta]
+	watcher = Popen(['./build/ddm', 'watch', str(src), '--journal', str(journal)],
+		stdout=DEVNULL)
+	try:
+		while not journal.exists():
+			time.sleep(0.1)
+		# The journal starts incomplete, so the first backup scans everything
+		assert b'scanning the entire' in check_output(backup, stdin=PIPE)
+		(src / 'a' / 'b' / 'f').write_bytes(b'changed')
+		(src / 'c' / 'd').mkdir()
+		(src / 'c' / 'd' / 'g').write_bytes(b'g')
+		time.sleep(2)
+		assert b'Scanning 3 changed' in check_output(backup, stdin=PIPE)
+	finally:
+		watcher.kill()
+		watcher.wait()
+	assert check_output(['./build/ddm', 'diff', str(src), str(dst)]) == b''
+	assert check_output(['./build/ddm', 'diff', str(meta[0]), str(dst)]) == b''
+
+
+def test_backup_trusting_metadata_detects_changed_backup(tmp_path):
+	src = tmp_path / 'src'
+	dst = tmp_path / 'dst'
+	for d in (src / 'a', dst):
+		d.mkdir(parents=True)
+	meta = make_metadata(dst, tmp_path)
+	backup = ['./build/ddm', 'backup', '--nohash', '--trustmeta', '100',
+		'-s', str(src), '-t', str(dst)] + [str(m) for m in meta]
+	# Without a previous scrub the backup directory is always scrubbed
+	assert b'Scrubbing' in check_output(backup, stdin=PIPE)
+	(src / 'a' / 'f').write_bytes(b'f')
+	output = check_output(backup, stdin=PIPE)
+	assert b'Scrubbing' not in output
+	assert check_output(['./build/ddm', 'diff', str(src), str(dst)]) == b''
+	assert check_output(['./build/ddm', 'diff', str(meta[0]), str(dst)]) == b''
+	(dst / 'a' / 'g').write_bytes(b'g')
+	result = run(backup, stdin=PIPE, stdout=PIPE)
+	assert b'Scrubbing' in result.stdout
+	assert result.returncode != 0
+
+
+def test_scrub_with_budget_resumes_and_finds_bit_rot(tmp_path):
+	dst = tmp_path / 'dst'
+	for i in range(3):
+		(dst / 'd{}'.format(i)).mkdir(parents=True)
+		for j in range(2):
+			(dst / 'd{}'.format(i) / 'f{}'.format(j)).write_bytes(os.urandom(1000))
+	meta = make_metadata(dst, tmp_path)
+	scrub = ['./build/ddm', 'scrub', '--budget', '2K', str(dst)] + [str(m) for m in meta]
+	cursors = []
+	for i in range(3):
+		check_output(scrub)
+		cursors.append((tmp_path / 'm1.ddm.scrub').read_text())
+	assert cursors == ['"d0/f1"\n', '"d1/f1"\n', '"d2/f1"\n']
+	# Change the content of a file keeping its metadata, as bit rot does
+	f = dst / 'd1' / 'f0'
+	st = f.stat()
+	f.write_bytes(os.urandom(1000))
+	os.utime(f, ns=(st.st_atime_ns, st.st_mtime_ns))
+	# The next sample starts over from d0, the rotten file is in the one after
+	assert run(scrub, stdout=PIPE).returncode == 0
+	assert run(scrub, stdout=PIPE).returncode != 0
+
+
+def test_scrub_with_budget_resumes_after_removed_file(tmp_path):
+	dst = tmp_path / 'dst'
+	for d in ('a', 'b', 'c'):
+		(dst / d).mkdir(parents=True)
+		for f in ('d', 'f'):
+			(dst / d / f).write_bytes(os.urandom(1000))
+	meta = make_metadata(dst, tmp_path)
+	cursor = tmp_path / 'm1.ddm.scrub'
+	scrub = ['./build/ddm', 'scrub', '--budget', '1K', str(dst)] + [str(m) for m in meta]
+	# The next file after the removed one, not the first of its directory
+	for last, following in [('b/e', 'b/f'), ('bb/x', 'c/d'), ('c/z', 'a/d')]:
+		cursor.write_text('"{}"\n'.format(last))
+		check_output(scrub)
+		assert cursor.read_text() == '"{}"\n'.format(following)
+
+
+def test_backup_with_dedup_moves_renamed_entries(tmp_path):
+	src = tmp_path / 'src'
+	dst = tmp_path / 'dst'
+	(src / 'a').mkdir(parents=True)
+	(src / 'a' / 'f').write_bytes(os.urandom(1000))
+	(src / 'g').write_bytes(os.urandom(100000))
+	dst.mkdir()
+	meta = make_metadata(dst, tmp_path)
+	backup = ['./build/ddm', 'backup', '--dedup', '-s', str(src), '-t', str(dst)] + \
+		[str(m) for m in meta]
+	check_output(backup, stdin=PIPE)
+	(src / 'a').rename(src / 'b')
+	(src / 'h').write_bytes((src / 'g').read_bytes())
+	output = check_output(backup, stdin=PIPE)
+	assert b'Moving directory "a" to "b"' in output
+	assert b'1 files were copied' in output
+	assert check_output(['./build/ddm', 'diff', str(src), str(dst)]) == b''
+	assert check_output(['./build/ddm', 'diff', str(meta[0]), str(dst)]) == b''
+
+
+def test_backup_and_scrub_with_remote_target(tmp_path):
+	src = tmp_path / 'src'
+	dst = tmp_path / 'dst'
+	(src / 'd').mkdir(parents=True)
+	(src / 'd' / 'f').write_bytes(os.urandom(3000000))
+	(src / 'l').symlink_to('d/f')
+	dst.mkdir()
+	meta = make_metadata(dst, tmp_path)
+	remote = ['--remote', os.path.abspath('./build/ddm') + ' serve']
+	check_output(['./build/ddm', 'backup', '--nohash', '-s', str(src), '-t', str(dst)] +
+		[str(m) for m in meta] + remote, stdin=PIPE)
+	assert check_output(['./build/ddm', 'diff', str(src), str(dst)]) == b''
+	assert check_output(['./build/ddm', 'diff', str(meta[0]), str(dst)]) == b''
+	output = check_output(['./build/ddm', 'scrub', str(dst)] + [str(m) for m in meta] +
+		remote, stdin=PIPE)
+	assert b'No differences found' in output
+
+
+def test_backup_writes_stats_file(tmp_path):
+	src = tmp_path / 'src'
+	dst = tmp_path / 'dst'
+	src.mkdir()
+	(src / 'f').write_bytes(os.urandom(1000))
+	dst.mkdir()
+	meta = make_metadata(dst, tmp_path)
+	stats = tmp_path / 'stats.json'
+	check_output(['./build/ddm', 'backup', '--statsformat', 'json', '--statsfile', str(stats),
+		'-s', str(src), '-t', str(dst)] + [str(m) for m in meta], stdin=PIPE)
+	phases = {p['phase']: p for p in json.loads(stats.read_text())['phases']}
+	assert phases['copy']['entries'] == 1 and phases['copy']['bytes'] == 1000
+	assert phases['src_scan']['hashed_bytes'] == 1000
+	assert 'metadata_write' in phases
+
+
+def test_backup_appends_changes_to_metadata_log(tmp_path):
+	src = tmp_path / 'src'
+	dst = tmp_path / 'dst'
+	for i in range(100):
+		d = src / 'dir{}'.format(i % 10)
+		d.mkdir(parents=True, exist_ok=True)
+		(d / 'file{}'.format(i)).write_bytes(os.urandom(100))
+	dst.mkdir()
+	meta = make_metadata(dst, tmp_path)
+	backup = ['./build/ddm', 'backup', '-s', str(src), '-t', str(dst)] + \
+		[str(m) for m in meta]
+	check_output(backup, stdin=PIPE)
+	base = meta[0].read_bytes()
+	(src / 'dir3' / 'new').write_bytes(os.urandom(100))
+	(src / 'dir5' / 'file5').unlink()
+	check_output(backup, stdin=PIPE)
+	# Only the log is written, and it records the changed directories
+	assert meta[0].read_bytes() == base
+	log = (tmp_path / 'm1.ddm.log').read_text()
+	assert '> "dir3"' in log and '> "dir5"' in log and '> "dir1"' not in log
+	assert (tmp_path / 'm2.ddm.log').read_text() == log
+	for m in meta:
+		assert check_output(['./build/ddm', 'diff', str(m), str(dst)]) == b''
+	output = check_output(['./build/ddm', 'scrub', str(dst)] + [str(m) for m in meta],
+		stdin=PIPE)
+	assert b'No differences found' in output
+	# A log without records left by a crash while rewriting the metadata file
+	# is only found to be stale once the backup changes the tree
+	for m in meta:
+		m.unlink()
+	make_metadata(dst, tmp_path)
+	for m in meta:
+		(tmp_path / (m.name + '.log')).write_text('# log 0123456789abcdef\n')
+	(src / 'dir7' / 'new').write_bytes(os.urandom(100))
+	check_output(backup, stdin=PIPE)
+	for m in meta:
+		assert not (tmp_path / (m.name + '.log')).read_text().endswith('abcdef\n')
+		assert check_output(['./build/ddm', 'diff', str(m), str(dst)]) == b''
@@ -0,0 +1,148 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "threadpool.h"
+#include "stats.h"
+#include <stdexcept>
+
+using namespace std;
+
+//
+// class ThreadPool
+//
+
+/// Pool and worker index, only set in the worker threads
+static thread_local ThreadPool *currentPool=nullptr;
+static thread_local unsigned currentWorker=0;
+
+ThreadPool::ThreadPool(unsigned threads, size_t maxQueued) : maxQueued(maxQueued)
+{
+    if(threads==0) threads=max(1u,thread::hardware_concurrency());
+    for(unsigned i=0;i<threads;i++) workers.push_back(make_unique<Worker>());
+    for(unsigned i=0;i<threads;i++) workers[i]->t=thread([this,i]{ run(i); });
+}
+
+void ThreadPool::submit(function<void ()> task)
+{
+    //Tasks are run in the phase they are submitted from
+    if(statsEnabled())
+        task=[phase=currentPhase(),task=std::move(task)]{
+            switchPhase(phase);
+            task();
+        };
+    bool inside=currentPool==this;
+    unique_lock<mutex> l(m);
+    if(maxQueued>0 && inside==false)
+        while(queued>=maxQueued) spaceCv.wait(l);
+    auto& w=*workers[inside ? currentWorker : next++ % workers.size()];
+    {
+        //NOTE: lock order is always m then w.m, pop() never holds both
+        unique_lock<mutex> wl(w.m);
+        w.tasks.push_back(std::move(task));
+    }
+    queued++;
+    pending++;
+    taskCv.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    unique_lock<mutex> l(m);
+    while(pending>0) idleCv.wait(l);
+    if(errors.empty()) return;
+    string e;
+    swap(e,errors);
+    throw runtime_error(e);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        unique_lock<mutex> l(m);
+        while(pending>0) idleCv.wait(l);
+        quit=true;
+        taskCv.notify_all();
+    }
+    for(auto& w : workers) w->t.join();
+}
+
+bool ThreadPool::pop(unsigned self, function<void ()>& task)
+{
+    //Own queue first, newest task first
+    {
+        auto& w=*workers[self];
+        unique_lock<mutex> l(w.m);
+        if(w.tasks.empty()==false)
+        {
+            task=std::move(w.tasks.back());
+            w.tasks.pop_back();
+            return true;
+        }
+    }
+    //Steal the oldest task of another worker
+    for(unsigned i=1;i<workers.size();i++)
+    {
+        auto& w=*workers[(self+i) % workers.size()];
+        unique_lock<mutex> l(w.m);
+        if(w.tasks.empty()==false)
+        {
+            task=std::move(w.tasks.front());
+            w.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(unsigned self)
+{
+    currentPool=this;
+    currentWorker=self;
+    function<void ()> task;
+    for(;;)
+    {
+        if(pop(self,task)==false)
+        {
+            switchPhase(Phase::None);
+            //NOTE: queued may be nonzero if another worker popped a task but
+            //did not yet update the count, in this case just retry
+            unique_lock<mutex> l(m);
+            while(queued==0 && quit==false) taskCv.wait(l);
+            if(queued==0) return;
+            continue;
+        }
+        {
+            unique_lock<mutex> l(m);
+            queued--;
+            if(maxQueued>0) spaceCv.notify_one();
+        }
+        string error;
+        try {
+            task();
+        } catch(exception& e) {
+            error=e.what();
+        }
+        task=nullptr; //Destroy captures outside the lock
+        unique_lock<mutex> l(m);
+        if(error.empty()==false)
+        {
+            if(errors.empty()==false) errors+=' ';
+            errors+=error;
+        }
+        if(--pending==0) idleCv.notify_all();
+    }
+}
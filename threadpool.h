@@ -0,0 +1,100 @@
+/***************************************************************************
+ *   Copyright (C) 2022 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#pragma once
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+
+/**
+ * A pool of worker threads with work stealing. Each worker has its own task
+ * queue. Tasks submitted from within a task go to the queue of the worker that
+ * submits them and are run last in first out, which keeps recursive work such
+ * as directory walks depth first and cache friendly, while idle workers steal
+ * the oldest tasks from the queues of the other workers.
+ * Exceptions thrown by tasks are not lost, they are collected and rethrown
+ * by wait() as a single runtime_error containing all the error messages, in
+ * the same way scanSourceTargetDir reports errors of its two threads.
+ */
+class ThreadPool
+{
+public:
+    /**
+     * Constructor
+     * \param threads number of worker threads, if 0 use as many threads as
+     * the hardware concurrency
+     * \param maxQueued if not 0, submit() blocks while this many tasks are
+     * waiting to be run. Bounds memory use when producing tasks much faster
+     * than they are consumed
+     */
+    explicit ThreadPool(unsigned threads, size_t maxQueued=0);
+
+    ThreadPool(const ThreadPool&)=delete;
+    ThreadPool& operator=(const ThreadPool&)=delete;
+
+    /**
+     * Add a task to the queue. Can be called also from within a task, in this
+     * case it never blocks even if the queue is full
+     * \param task task to run in one of the worker threads
+     */
+    void submit(std::function<void ()> task);
+
+    /**
+     * Wait until all submitted tasks, including those submitted by tasks
+     * while waiting, have completed
+     * \throws runtime_error if at least one task threw an exception
+     */
+    void wait();
+
+    /**
+     * \return the number of worker threads
+     */
+    unsigned size() const { return workers.size(); }
+
+    /**
+     * Destructor, waits for all tasks to complete discarding errors, if any
+     */
+    ~ThreadPool();
+
+private:
+    struct Worker
+    {
+        std::mutex m;                             ///< Guards tasks
+        std::deque<std::function<void ()>> tasks; ///< Tasks of this worker
+        std::thread t;
+    };
+
+    bool pop(unsigned self, std::function<void ()>& task);
+
+    void run(unsigned self);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex m; ///< Guards all the following members
+    std::condition_variable taskCv, idleCv, spaceCv;
+    const size_t maxQueued;
+    size_t queued=0;  ///< Tasks in the queues and not yet started
+    size_t pending=0; ///< Tasks submitted but not yet completed
+    unsigned next=0;  ///< Round robin index for tasks submitted from outside
+    bool quit=false;
+    std::string errors;
+};